@@ -23,30 +23,94 @@
 //               Finally, there is a single "Concatenation" service which
 //               is really just a kind of "hello world" type of service.
 //               This is implemented directly in this class.
+//
+//               The server can run in one of two modes. The default mode
+//               registers ServerImpl as a synchronous service, leaving grpc
+//               to manage the threads. With --async, we instead register
+//               the AsyncService, drain requests from a configurable number
+//               of completion queues using a fixed-size pool of handler
+//               threads (optionally pinned to cores), and dispatch each
+//               request to the same ServerImpl methods. In that mode, the
+//               request and response messages of each call live on a
+//               protobuf Arena owned by the call, so building a response
+//               does not go through the heap for every field, and tearing
+//               it down is a single release.
+//
+//               With --wal, each change is appended to a WriteAheadLog
+//               before it is made, and the log is replayed at startup to
+//               rebuild the repositories. The catalog repositories are not
+//               transactional, so we log the requests themselves (with the
+//               time they were made, so that replay reproduces the same
+//               edit times) rather than the changes to each repository.
+//               Concurrent changes write their records to the log together,
+//               through a WriteCoalescer, and GetServerMetrics reports how
+//               well they are being grouped.
+//
+//               With --checkpoint, the repositories are also written to a
+//               checkpoint file periodically (see checkpoint.h), and
+//               --restore loads one before serving, so that only the part
+//               of the log written since needs replaying.
+//
+//               BulkImport streams in Namespaces, Repositories and Datasets
+//               and imports them a chunk at a time (see BulkImporter), with
+//               other changes held off for each chunk, and each chunk
+//               logged as a single record.
 //============================================================================
 
+#include <pthread.h>
+#include <sched.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
 #include <iostream>
 #include <fstream>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
 using namespace std;
 
+#include <google/protobuf/arena.h>
 #include <grpc++/grpc++.h>
 
 #include <boost/program_options.hpp>
 
 #include "DatasetService.h"
+#include "checkpoint.h"
 #include "NamespaceService.h"
 #include "RepositoryService.h"
 #include "UserService.h"
+#include "bulk_importer.h"
 #include "dataset_repository.h"
 #include "encrypter.h"
 #include "namespace_repository.h"
 #include "referential_service.h"
 #include "repository_repository.h"
 #include "server.grpc.pb.h"
+#include "shared_mutex.h"
+#include "test_hooks.h"
+#include "time_util.h"
+#include "transaction.h"
+#include "write_ahead_log.h"
+#include "write_coalescer.h"
 
+using grpc::ServerAsyncReader;
+using grpc::ServerAsyncResponseWriter;
+using grpc::ServerCompletionQueue;
 using grpc::ServerContext;
 using grpc::ServerCredentials;
+using grpc::ServerReader;
 using grpc::Status;
+using acumio::CheckpointCatalog;
+using acumio::CheckpointView;
+using acumio::transaction::ExclusiveLock;
+using acumio::transaction::SharedLock;
+using acumio::transaction::SharedMutex;
+using acumio::transaction::Transaction;
+using acumio::transaction::TransactionManager;
+using acumio::transaction::WriteAheadLog;
+using acumio::transaction::WriteCoalescer;
+using acumio::transaction::WriteTransaction;
 
 namespace po = boost::program_options;
 
@@ -58,11 +122,176 @@ class ServerImpl final : public Server::Service {
   ServerImpl(acumio::DatasetService* dataset_service,
              acumio::NamespaceService* namespace_service,
              acumio::RepositoryService* repository_service,
-             acumio::UserService* user_service) :
+             acumio::UserService* user_service,
+             acumio::BulkImporter* bulk_importer) :
      dataset_service_(dataset_service),
      namespace_service_(namespace_service),
      repository_service_(repository_service),
-     user_service_(user_service) {}
+     user_service_(user_service),
+     bulk_importer_(bulk_importer),
+     bulk_import_chunk_size_(DEFAULT_BULK_IMPORT_CHUNK_SIZE),
+     write_ahead_log_(nullptr), write_coalescer_(nullptr) {}
+
+  // Identifies the call a logged record replays. These values are written
+  // to the log, so they must never be renumbered or reused.
+  enum LoggedCall {
+    CREATE_DATASET = 1,
+    REMOVE_DATASET = 2,
+    UPDATE_DATASET = 3,
+    UPDATE_DATASET_WITH_DESCRIPTION = 4,
+    UPDATE_DATASET_DESCRIPTION = 5,
+    CREATE_NAMESPACE = 6,
+    REMOVE_NAMESPACE = 7,
+    UPDATE_NAMESPACE = 8,
+    UPDATE_NAMESPACE_WITH_DESCRIPTION = 9,
+    UPSERT_NAMESPACE_DESCRIPTION = 10,
+    CREATE_REPOSITORY = 11,
+    REMOVE_REPOSITORY = 12,
+    UPDATE_REPOSITORY = 13,
+    UPDATE_REPOSITORY_WITH_DESCRIPTION = 14,
+    UPSERT_REPOSITORY_DESCRIPTION = 15,
+    // Only written by older servers: the record is the CreateUserRequest,
+    // with the password in the clear. See CREATE_FULL_USER.
+    CREATE_USER = 16,
+    REMOVE_USER = 17,
+    UPDATE_USER = 18,
+    BULK_IMPORT = 19,
+    CREATE_FULL_USER = 20
+  };
+
+  // Once set, every mutating call is logged to write_ahead_log before it
+  // is applied. Must be set before serving starts.
+  void set_write_ahead_log(WriteAheadLog* write_ahead_log) {
+    write_ahead_log_ = write_ahead_log;
+  }
+
+  // If set, logged calls hand their records to write_coalescer rather than
+  // writing them to the log themselves, so that the records of concurrent
+  // calls are written, and flushed, together. The coalescer's
+  // TransactionManager must log to the same WriteAheadLog. Must be set
+  // before serving starts.
+  void set_write_coalescer(WriteCoalescer* write_coalescer) {
+    write_coalescer_ = write_coalescer;
+  }
+
+  // The number of items BulkImport imports at a time. Must be set before
+  // serving starts.
+  void set_bulk_import_chunk_size(int chunk_size) {
+    bulk_import_chunk_size_ = std::max(1, chunk_size);
+  }
+
+  // Writes a checkpoint of catalog to path. Mutating calls are only held
+  // off while the checkpoint's view is captured, not while it is written.
+  Status WriteCheckpoint(const CheckpointCatalog& catalog,
+                         const std::string& path) {
+    std::unique_ptr<CheckpointView> view;
+    {
+      ExclusiveLock gate(mutation_gate_);
+      uint64_t log_position = write_ahead_log_ == nullptr ?
+          UINT64_C(0) : write_ahead_log_->end_position();
+      view.reset(new CheckpointView(catalog, log_position));
+    }
+    return view->Write(path);
+  }
+
+  // Re-applies a record written by Logged, setting *call_result to the
+  // result of the call. Should be called, in log order, before serving
+  // starts and before set_write_ahead_log. Calls are logged before they
+  // are applied, so some records are of calls that failed; since calls
+  // that could affect each other are applied in log order, those fail
+  // again here. Only a record that cannot be read is an error.
+  Status ReplayLogRecord(const std::string& record, Status* call_result) {
+    if (record.size() < LOG_RECORD_HEADER_SIZE) {
+      return Status(grpc::StatusCode::DATA_LOSS,
+                    "Write-ahead log record is too short.");
+    }
+    uint64_t wall_nanos = 0;
+    for (int i = 0; i < 8; i++) {
+      wall_nanos |= static_cast<uint64_t>(
+          static_cast<uint8_t>(record[1 + i])) << (8 * i);
+    }
+    // Replay with the edit times of the original call.
+    acumio::time::ScopedWallTime pinned(wall_nanos);
+    const char* payload = record.data() + LOG_RECORD_HEADER_SIZE;
+    int size = static_cast<int>(record.size() - LOG_RECORD_HEADER_SIZE);
+    switch (static_cast<LoggedCall>(record[0])) {
+      case CREATE_DATASET:
+        return Reapply(payload, size, call_result,
+                       &ServerImpl::CreateDataset);
+      case REMOVE_DATASET:
+        return Reapply(payload, size, call_result,
+                       &ServerImpl::RemoveDataset);
+      case UPDATE_DATASET:
+        return Reapply(payload, size, call_result,
+                       &ServerImpl::UpdateDataset);
+      case UPDATE_DATASET_WITH_DESCRIPTION:
+        return Reapply(payload, size, call_result,
+                       &ServerImpl::UpdateDatasetWithDescription);
+      case UPDATE_DATASET_DESCRIPTION:
+        return Reapply(payload, size, call_result,
+                       &ServerImpl::UpdateDatasetDescription);
+      case CREATE_NAMESPACE:
+        return Reapply(payload, size, call_result,
+                       &ServerImpl::CreateNamespace);
+      case REMOVE_NAMESPACE:
+        return Reapply(payload, size, call_result,
+                       &ServerImpl::RemoveNamespace);
+      case UPDATE_NAMESPACE:
+        return Reapply(payload, size, call_result,
+                       &ServerImpl::UpdateNamespace);
+      case UPDATE_NAMESPACE_WITH_DESCRIPTION:
+        return Reapply(payload, size, call_result,
+                       &ServerImpl::UpdateNamespaceWithDescription);
+      case UPSERT_NAMESPACE_DESCRIPTION:
+        return Reapply(payload, size, call_result,
+                       &ServerImpl::UpsertNamespaceDescription);
+      case CREATE_REPOSITORY:
+        return Reapply(payload, size, call_result,
+                       &ServerImpl::CreateRepository);
+      case REMOVE_REPOSITORY:
+        return Reapply(payload, size, call_result,
+                       &ServerImpl::RemoveRepository);
+      case UPDATE_REPOSITORY:
+        return Reapply(payload, size, call_result,
+                       &ServerImpl::UpdateRepository);
+      case UPDATE_REPOSITORY_WITH_DESCRIPTION:
+        return Reapply(payload, size, call_result,
+                       &ServerImpl::UpdateRepositoryWithDescription);
+      case UPSERT_REPOSITORY_DESCRIPTION:
+        return Reapply(payload, size, call_result,
+                       &ServerImpl::UpsertRepositoryDescription);
+      case CREATE_USER:
+        return Reapply(payload, size, call_result,
+                       &ServerImpl::CreateUser);
+      case REMOVE_USER:
+        return Reapply(payload, size, call_result,
+                       &ServerImpl::RemoveUser);
+      case UPDATE_USER:
+        return Reapply(payload, size, call_result,
+                       &ServerImpl::UpdateUser);
+      case CREATE_FULL_USER: {
+        FullUser full_user;
+        if (!full_user.ParseFromArray(payload, size)) {
+          return Status(grpc::StatusCode::DATA_LOSS,
+                        "Unable to parse write-ahead log record.");
+        }
+        *call_result = user_service_->AddUser(full_user);
+        return Status::OK;
+      }
+      case BULK_IMPORT: {
+        BulkImportRequest chunk;
+        if (!chunk.ParseFromArray(payload, size)) {
+          return Status(grpc::StatusCode::DATA_LOSS,
+                        "Unable to parse write-ahead log record.");
+        }
+        int failed_item = 0;
+        *call_result = bulk_importer_->Import(chunk, &failed_item);
+        return Status::OK;
+      }
+    }
+    return Status(grpc::StatusCode::DATA_LOSS,
+                  "Write-ahead log record names an unknown call.");
+  }
 
   Status ConcatInputs(ServerContext* context, const ConcatInputRequest* request,
                       ConcatInputResponse* response) override {
@@ -82,8 +311,12 @@ class ServerImpl final : public Server::Service {
   Status CreateDataset(ServerContext* context,
                        const CreateDatasetRequest* request,
                        CreateDatasetResponse* response) override {
-    return dataset_service_->CreateDataset(request->dataset(),
-                                           request->description());
+    return Logged(CREATE_DATASET, *request,
+        {DatasetKey(request->dataset().physical_name())},
+        [this, request]() {
+          return dataset_service_->CreateDataset(request->dataset(),
+                                                 request->description());
+        });
   }
 
   Status GetDataset(ServerContext* context, const GetDatasetRequest* request,
@@ -100,7 +333,10 @@ class ServerImpl final : public Server::Service {
   Status RemoveDataset(ServerContext* context,
                        const RemoveDatasetRequest* request,
                        RemoveDatasetResponse* response) override {
-    return dataset_service_->RemoveDataset(request->name());
+    return Logged(REMOVE_DATASET, *request, {DatasetKey(request->name())},
+        [this, request]() {
+          return dataset_service_->RemoveDataset(request->name());
+        });
   }
 
   Status SearchDatasets(ServerContext* context,
@@ -112,31 +348,50 @@ class ServerImpl final : public Server::Service {
   Status UpdateDataset(ServerContext* context,
                        const UpdateDatasetRequest* request,
                        UpdateDatasetResponse* response) override {
-    return dataset_service_->UpdateDataset(request->name(), request->dataset());
+    return Logged(UPDATE_DATASET, *request,
+        {DatasetKey(request->name()),
+         DatasetKey(request->dataset().physical_name())},
+        [this, request]() {
+          return dataset_service_->UpdateDataset(request->name(),
+                                                 request->dataset());
+        });
   }
 
   Status UpdateDatasetWithDescription(
       ServerContext* context,
       const UpdateDatasetWithDescriptionRequest* request,
       UpdateDatasetWithDescriptionResponse* response) override {
-    return dataset_service_->UpdateDatasetWithDescription(
-        request->name(),  request->update(), request->description_update());
+    return Logged(UPDATE_DATASET_WITH_DESCRIPTION, *request,
+        {DatasetKey(request->name()),
+         DatasetKey(request->update().physical_name())},
+        [this, request]() {
+          return dataset_service_->UpdateDatasetWithDescription(
+              request->name(), request->update(),
+              request->description_update());
+        });
   }
 
   Status UpdateDatasetDescription(
       ServerContext* context,
       const UpdateDatasetDescriptionRequest* request,
       UpdateDatasetDescriptionResponse* response) override {
-    return dataset_service_->UpdateDatasetDescription(
-        request->name(), request->description_update());
+    return Logged(UPDATE_DATASET_DESCRIPTION, *request,
+        {DatasetKey(request->name())},
+        [this, request]() {
+          return dataset_service_->UpdateDatasetDescription(
+              request->name(), request->description_update());
+        });
   }
 
   // Namespace Services
   Status CreateNamespace(ServerContext* context,
                          const CreateNamespaceRequest* request,
                          CreateNamespaceResponse* response) override {
-    return namespace_service_->CreateNamespace(request->name_space(),
-                                               request->description());
+    return Logged<ExclusiveLock>(CREATE_NAMESPACE, *request, {},
+        [this, request]() {
+          return namespace_service_->CreateNamespace(request->name_space(),
+                                                     request->description());
+        });
   }
 
   Status GetNamespace(ServerContext* context,
@@ -150,39 +405,56 @@ class ServerImpl final : public Server::Service {
   Status RemoveNamespace(ServerContext* context,
                          const RemoveNamespaceRequest* request,
                          RemoveNamespaceResponse* response) override {
-    return namespace_service_->RemoveNamespace(request->namespace_name());
+    return Logged<ExclusiveLock>(REMOVE_NAMESPACE, *request, {},
+        [this, request]() {
+          return namespace_service_->RemoveNamespace(request->namespace_name());
+        });
   }
 
   Status UpdateNamespace(ServerContext* context,
                          const UpdateNamespaceRequest* request,
                          UpdateNamespaceResponse* response) override {
-    return namespace_service_->UpdateNamespace(request->namespace_name(),
-                                               request->update());
+    return Logged<ExclusiveLock>(UPDATE_NAMESPACE, *request, {},
+        [this, request]() {
+          return namespace_service_->UpdateNamespace(request->namespace_name(),
+                                                     request->update());
+        });
   }
 
   Status UpdateNamespaceWithDescription(
       ServerContext* context,
       const UpdateNamespaceWithDescriptionRequest* request,
       UpdateNamespaceWithDescriptionResponse* repsonse) override {
-    return namespace_service_->UpdateNamespaceWithDescription(
-        request->namespace_name(), request->update(),
-        request->updated_description(), request->clear_description());
+    return Logged<ExclusiveLock>(UPDATE_NAMESPACE_WITH_DESCRIPTION, *request,
+        {},
+        [this, request]() {
+          return namespace_service_->UpdateNamespaceWithDescription(
+              request->namespace_name(), request->update(),
+              request->updated_description(), request->clear_description());
+        });
   }
 
   Status UpsertNamespaceDescription(
       ServerContext* context, const UpsertNamespaceDescriptionRequest* request,
       UpsertNamespaceDescriptionResponse* response) override {
-    return namespace_service_->UpsertNamespaceDescription(request->described(),
-        request->update(), request->clear_description());
+    return Logged<ExclusiveLock>(UPSERT_NAMESPACE_DESCRIPTION, *request, {},
+        [this, request]() {
+          return namespace_service_->UpsertNamespaceDescription(
+              request->described(), request->update(),
+              request->clear_description());
+        });
   }
 
   // Repository Services
   Status CreateRepository(ServerContext* context,
                           const CreateRepositoryRequest* request,
                           CreateRepositoryResponse* response) override {
-    return repository_service_->CreateRepository(request->repository(),
-        request->description(), request->create_or_associate_namespace(),
-        request->namespace_separator());
+    return Logged<ExclusiveLock>(CREATE_REPOSITORY, *request, {},
+        [this, request]() {
+          return repository_service_->CreateRepository(request->repository(),
+              request->description(), request->create_or_associate_namespace(),
+              request->namespace_separator());
+        });
   }
 
   Status GetRepository(ServerContext* context,
@@ -204,33 +476,49 @@ class ServerImpl final : public Server::Service {
   Status RemoveRepository(ServerContext* context,
                           const RemoveRepositoryRequest* request,
                           RemoveRepositoryResponse* response) override {
-    return repository_service_->RemoveRepository(request->repository_name(),
-        request->force(), request->remove_or_disassociate_namespace());
+    return Logged<ExclusiveLock>(REMOVE_REPOSITORY, *request, {},
+        [this, request]() {
+          return repository_service_->RemoveRepository(
+              request->repository_name(), request->force(),
+              request->remove_or_disassociate_namespace());
+        });
   }
 
   Status UpdateRepository(ServerContext* context,
                           const UpdateRepositoryRequest* request,
                           UpdateRepositoryResponse* response) override {
-    return repository_service_->UpdateRepository(request->repository_name(),
-        request->repository(), request->force());
+    return Logged<ExclusiveLock>(UPDATE_REPOSITORY, *request, {},
+        [this, request]() {
+          return repository_service_->UpdateRepository(
+              request->repository_name(), request->repository(),
+              request->force());
+        });
   }
 
   Status UpdateRepositoryWithDescription(
       ServerContext* context,
       const UpdateRepositoryWithDescriptionRequest* request,
       UpdateRepositoryWithDescriptionResponse* repsonse) override {
-    return repository_service_->UpdateRepositoryWithDescription(
-        request->repository_name(), request->update(),
-        request->updated_description(), request->clear_description(),
-        request->force());
+    return Logged<ExclusiveLock>(UPDATE_REPOSITORY_WITH_DESCRIPTION, *request,
+        {},
+        [this, request]() {
+          return repository_service_->UpdateRepositoryWithDescription(
+              request->repository_name(), request->update(),
+              request->updated_description(), request->clear_description(),
+              request->force());
+        });
   }
 
   Status UpsertRepositoryDescription(
       ServerContext* context,
       const UpsertRepositoryDescriptionRequest* request,
       UpsertRepositoryDescriptionResponse* response) override {
-    return repository_service_->UpsertRepositoryDescription(
-        request->described(), request->update(), request->clear_description());
+    return Logged<ExclusiveLock>(UPSERT_REPOSITORY_DESCRIPTION, *request, {},
+        [this, request]() {
+          return repository_service_->UpsertRepositoryDescription(
+              request->described(), request->update(),
+              request->clear_description());
+        });
   }
 
   // User Services.
@@ -238,8 +526,16 @@ class ServerImpl final : public Server::Service {
                     CreateUserResponse* response) override {
     // TODO: Authenticate User. Standard permissions would have this apply
     // to Admin role.
-    return user_service_->CreateUser(request->user(),
-                                     request->acumio_password());
+    // The password is encrypted before the call is logged, so that the
+    // log, like the repository, never holds it in the clear.
+    FullUser full_user;
+    user_service_->MakeFullUser(request->user(), request->acumio_password(),
+                                &full_user);
+    return Logged(CREATE_FULL_USER, full_user,
+        {UserKey(request->user().name())},
+        [this, &full_user]() {
+          return user_service_->AddUser(full_user);
+        });
   }
 
   Status GetSelfUser(ServerContext* context, const GetSelfUserRequest* request,
@@ -255,7 +551,10 @@ class ServerImpl final : public Server::Service {
                     RemoveUserResponse* response) override {
     // TODO: Authenticate User. Standard permissions would have this apply
     // to Admin role.
-    return user_service_->RemoveUser(request->user_name());
+    return Logged(REMOVE_USER, *request, {UserKey(request->user_name())},
+        [this, request]() {
+          return user_service_->RemoveUser(request->user_name());
+        });
   }
 
   Status UpdateUser(ServerContext* context, const UpdateUserRequest* request,
@@ -263,8 +562,18 @@ class ServerImpl final : public Server::Service {
     // TODO: Authenticate User. Standard permissions would have this apply
     // to Admin role *unless* the user being updated matched the user being
     // authenticated.
-    return user_service_->UpdateUser(request->user_name_to_modify(),
-                                     request->updated_user());
+    // UpdateUser does not change the password, so the record leaves it
+    // out rather than logging it in the clear.
+    UpdateUserRequest record(*request);
+    record.clear_also_update_password();
+    record.clear_updated_acumio_password();
+    return Logged(UPDATE_USER, record,
+        {UserKey(request->user_name_to_modify()),
+         UserKey(request->updated_user().name())},
+        [this, request]() {
+          return user_service_->UpdateUser(request->user_name_to_modify(),
+                                           request->updated_user());
+        });
   }
 
   Status UserSearch(ServerContext* context, const UserSearchRequest* request,
@@ -274,11 +583,221 @@ class ServerImpl final : public Server::Service {
     return user_service_->UserSearch(request, response);
   }
 
+  // Bulk Services.
+  Status BulkImport(ServerContext* context,
+                    ServerReader<BulkImportRequest>* reader,
+                    BulkImportResponse* response) override {
+    BulkImportRequest request;
+    BulkImportRequest chunk;
+    while (reader->Read(&request)) {
+      Status result = ContinueBulkImport(&request, &chunk, response);
+      if (!result.ok()) {
+        return result;
+      }
+    }
+    return FinishBulkImport(&chunk, response);
+  }
+
+  // Moves the items of request onto the end of chunk, importing chunk
+  // whenever it fills. The async BulkImport call drives the import
+  // through this and FinishBulkImport.
+  Status ContinueBulkImport(BulkImportRequest* request,
+                            BulkImportRequest* chunk,
+                            BulkImportResponse* response) {
+    for (int i = 0; i < request->item_size(); i++) {
+      chunk->add_item()->Swap(request->mutable_item(i));
+      if (chunk->item_size() >= bulk_import_chunk_size_) {
+        Status result = ImportChunk(chunk, response);
+        if (!result.ok()) {
+          return result;
+        }
+      }
+    }
+    request->Clear();
+    return Status::OK;
+  }
+
+  // Imports whatever is left in chunk once the stream ends.
+  Status FinishBulkImport(BulkImportRequest* chunk,
+                          BulkImportResponse* response) {
+    if (chunk->item_size() == 0) {
+      return Status::OK;
+    }
+    return ImportChunk(chunk, response);
+  }
+
+  // Monitoring Services.
+  Status GetServerMetrics(ServerContext* context,
+                          const GetServerMetricsRequest* request,
+                          GetServerMetricsResponse* response) override {
+    if (write_coalescer_ != nullptr) {
+      WriteCoalescer::Metrics metrics;
+      write_coalescer_->GetMetrics(&metrics);
+      WriteCoalescerMetrics* coalescer = response->mutable_write_coalescer();
+      coalescer->set_requests(metrics.requests);
+      coalescer->set_batches(metrics.batches);
+      coalescer->set_coalesced_requests(metrics.coalesced_requests);
+      coalescer->set_fallback_batches(metrics.fallback_batches);
+      coalescer->set_largest_batch(metrics.largest_batch);
+      coalescer->set_window_micros(metrics.window_micros);
+      coalescer->set_max_batch_size(metrics.max_batch_size);
+    }
+    return Status::OK;
+  }
+
  private:
   acumio::DatasetService* dataset_service_;
   acumio::NamespaceService* namespace_service_;
   acumio::RepositoryService* repository_service_;
   acumio::UserService* user_service_;
+  acumio::BulkImporter* bulk_importer_;
+  int bulk_import_chunk_size_;
+
+  static const int DEFAULT_BULK_IMPORT_CHUNK_SIZE = 1000;
+
+  // Each record is the LoggedCall (1 byte), the wall time of the call
+  // (8 bytes, little-endian nanos since the epoch), and the request, or
+  // for CREATE_FULL_USER, the FullUser to add.
+  static const size_t LOG_RECORD_HEADER_SIZE = 9;
+
+  // The number of mutexes that order logged calls by key; see Logged.
+  static const size_t LOG_ORDER_STRIPES = 64;
+
+  // Holds the log order stripes for a set of keys, taken in stripe order so
+  // that two calls with keys in common cannot deadlock.
+  class LogOrderLock {
+   public:
+    LogOrderLock(std::mutex* stripes, const std::vector<std::string>& keys) {
+      std::vector<size_t> indices;
+      for (const std::string& key : keys) {
+        indices.push_back(std::hash<std::string>()(key) % LOG_ORDER_STRIPES);
+      }
+      std::sort(indices.begin(), indices.end());
+      indices.erase(std::unique(indices.begin(), indices.end()),
+                    indices.end());
+      for (size_t index : indices) {
+        locks_.emplace_back(stripes[index]);
+      }
+    }
+
+   private:
+    std::vector<std::unique_lock<std::mutex>> locks_;
+  };
+
+  static std::string DatasetKey(const acumio::model::QualifiedName& name) {
+    std::string key("D");
+    key.append(name.name_space()).push_back('\0');
+    return key.append(name.name());
+  }
+
+  static std::string UserKey(const std::string& user_name) {
+    return "U" + user_name;
+  }
+
+  // Logs a mutating call, waits for the record to be durable, and only then
+  // applies the call. If the record cannot be logged, the call is not made,
+  // so the repositories never hold a change the log does not. Calls that
+  // fail are logged as well (we cannot tell in advance), and fail again
+  // when replayed.
+  //
+  // For replay to reproduce what happened, calls that could affect each
+  // other must take effect in the order they are logged. Rather than
+  // ordering every call, each call names the keys it writes, and holds the
+  // log order stripes for those keys from before its record is written
+  // until it has been applied; calls with no key in common go ahead
+  // concurrently, and share flushes of the log. Calls that change the
+  // Namespace tree (Namespaces and Repositories) could affect any other
+  // call, through the parent checks, so they pass ExclusiveLock as GateLock
+  // instead of naming keys.
+  //
+  // Every mutating call holds mutation_gate_ until it has been applied, so
+  // that a checkpoint sees each call either entirely or not at all, and
+  // records a log position consistent with what it saw. Calls hold the gate
+  // shared, unless they need to keep all other changes out while they run,
+  // in which case GateLock is ExclusiveLock.
+  //
+  // Record is the request, or some other object that can be appended to a
+  // string in the manner of a protobuf message.
+  template <class GateLock = SharedLock, class Record>
+  Status Logged(LoggedCall call, const Record& request,
+                const std::vector<std::string>& keys,
+                const std::function<Status()>& apply) {
+    GateLock gate(mutation_gate_);
+    if (write_ahead_log_ == nullptr) {
+      return apply();
+    }
+    LogOrderLock order(log_order_stripes_, keys);
+    uint64_t wall_nanos = acumio::time::WallNanosSinceEpoch();
+    std::string record;
+    record.push_back(static_cast<char>(call));
+    for (int i = 0; i < 8; i++) {
+      record.push_back(static_cast<char>((wall_nanos >> (8 * i)) & 0xFF));
+    }
+    request.AppendToString(&record);
+    Status log_result;
+    if (write_coalescer_ != nullptr) {
+      // A WriteTransaction with no operations: committing it just writes
+      // and flushes the records of its batch.
+      log_result = write_coalescer_->Commit([&record](WriteTransaction* tx) {
+        tx->AddLogRecord(record);
+      });
+    } else {
+      uint64_t position = 0;
+      log_result = write_ahead_log_->Write({record}, &position);
+      if (log_result.ok()) {
+        log_result = write_ahead_log_->WaitDurable(position);
+      }
+    }
+    if (!log_result.ok()) {
+      return Status(grpc::StatusCode::DATA_LOSS,
+          "The change was not made, since it could not be logged: " +
+          log_result.error_message());
+    }
+    acumio::time::ScopedWallTime pinned(wall_nanos);
+    return apply();
+  }
+
+  template <class Request, class Response>
+  Status Reapply(const char* payload, int size, Status* call_result,
+                 Status (ServerImpl::*handler)(ServerContext*, const Request*,
+                                               Response*)) {
+    Request request;
+    if (!request.ParseFromArray(payload, size)) {
+      return Status(grpc::StatusCode::DATA_LOSS,
+                    "Unable to parse write-ahead log record.");
+    }
+    Response response;
+    *call_result = (this->*handler)(nullptr, &request, &response);
+    return Status::OK;
+  }
+
+  // Imports chunk, and clears it for reuse. BulkImporter checks the parents
+  // of the whole chunk before applying any of it, so every other change is
+  // held off until the chunk is done.
+  Status ImportChunk(BulkImportRequest* chunk, BulkImportResponse* response) {
+    int failed_item = 0;
+    Status result = Logged<ExclusiveLock>(BULK_IMPORT, *chunk, {},
+        [this, chunk, &failed_item]() {
+          return bulk_importer_->Import(*chunk, &failed_item);
+        });
+    if (!result.ok()) {
+      uint64_t imported = response->items_imported();
+      return Status(result.error_code(),
+          "Bulk import stopped at item " +
+          std::to_string(imported + failed_item) + ", after importing " +
+          std::to_string(imported) + " items: " + result.error_message());
+    }
+    response->set_items_imported(response->items_imported() +
+                                 chunk->item_size());
+    response->set_chunks_committed(response->chunks_committed() + 1);
+    chunk->Clear();
+    return Status::OK;
+  }
+
+  WriteAheadLog* write_ahead_log_;
+  WriteCoalescer* write_coalescer_;
+  std::mutex log_order_stripes_[LOG_ORDER_STRIPES];
+  SharedMutex mutation_gate_;
 };
 /*
   Bring this back when we are ready to work with ssl communication.
@@ -302,7 +821,412 @@ void readFileToString(std::string fileName, std::string* results) {
 } // end anonymous namespace.
 */
 
-void RunServer(std::string address) {
+// Options controlling how requests are served. With async set to false,
+// the remaining fields are ignored.
+struct ServingOptions {
+  bool async;
+  // Number of completion queues. Each queue is drained by its own share of
+  // the handler threads.
+  int completion_queues;
+  // Total number of handler threads, spread evenly across the queues. Each
+  // queue gets at least one thread.
+  int handler_threads;
+  // If true, handler thread i is pinned to core (i % number of cores).
+  bool pin_threads;
+  // If not empty, the write-ahead log to replay at startup and then append
+  // each change to.
+  std::string wal_path;
+  WriteAheadLog::SyncPolicy wal_sync;
+  uint64_t wal_group_micros;
+  // How long, and for how many calls, a write to the log waits for others
+  // to share it; see WriteCoalescer.
+  uint64_t coalesce_window_micros;
+  uint32_t coalesce_max_batch;
+  // If not empty, the checkpoint to load before serving.
+  std::string restore_path;
+  // If not empty, where to write a checkpoint every
+  // checkpoint_interval_seconds.
+  std::string checkpoint_path;
+  int checkpoint_interval_seconds;
+  // Number of items BulkImport imports at a time.
+  int bulk_import_chunk_size;
+};
+
+namespace {
+// The Transactions that WriteCoalescer commits log records with. The pool
+// grows past its initial size if need be. They run no operations, so the
+// timeout only matters if a Transaction is somehow abandoned.
+const uint16_t LOG_TRANSACTION_POOL_SIZE = 64;
+const uint64_t LOG_TRANSACTION_TIMEOUT_NANOS =
+    10 * acumio::time::NANOS_PER_SECOND;
+// How often the TransactionManager's version collector runs, and for how
+// long at most; see TransactionManager::StartVersionCollector.
+const uint64_t VERSION_COLLECT_INTERVAL_NANOS =
+    acumio::time::NANOS_PER_SECOND;
+const uint64_t VERSION_COLLECT_BUDGET_NANOS =
+    10 * acumio::time::NANOS_PER_MILLI;
+
+// Writes a checkpoint every interval until destroyed.
+class PeriodicCheckpointer {
+ public:
+  PeriodicCheckpointer(ServerImpl* service, const CheckpointCatalog& catalog,
+                       const std::string& path, int interval_seconds) :
+      service_(service), catalog_(catalog), path_(path),
+      interval_(interval_seconds), guard_(), stop_requested_(),
+      stopping_(false), thread_(&PeriodicCheckpointer::Run, this) {}
+
+  ~PeriodicCheckpointer() {
+    {
+      std::lock_guard<std::mutex> lock(guard_);
+      stopping_ = true;
+    }
+    stop_requested_.notify_all();
+    thread_.join();
+  }
+
+ private:
+  void Run() {
+    std::unique_lock<std::mutex> lock(guard_);
+    while (!stop_requested_.wait_for(lock, interval_,
+                                     [this]() { return stopping_; })) {
+      lock.unlock();
+      Status result = service_->WriteCheckpoint(catalog_, path_);
+      if (!result.ok()) {
+        std::cerr << result.error_message() << std::endl;
+      }
+      lock.lock();
+    }
+  }
+
+  ServerImpl* service_;
+  CheckpointCatalog catalog_;
+  std::string path_;
+  std::chrono::seconds interval_;
+  std::mutex guard_;
+  std::condition_variable stop_requested_;
+  bool stopping_;
+  std::thread thread_;
+};
+
+// Base class for the per-call state objects used in async mode. Each
+// instance is its own completion-queue tag. The handler threads only know
+// about this interface.
+class AsyncCallInterface {
+ public:
+  AsyncCallInterface() {}
+  virtual ~AsyncCallInterface() {}
+  // Invoked when the tag for this call comes off of the completion queue.
+  // The ok parameter is the value reported by CompletionQueue::Next.
+  virtual void Proceed(bool ok) = 0;
+};
+
+// State machine for a single unary call. On construction, the call asks
+// the service for the next incoming request of its type. Once that request
+// arrives, it creates a replacement instance so that another request of
+// the same type can be accepted, runs the synchronous ServerImpl handler
+// on the current thread, and finishes the call. The instance deletes
+// itself once the Finish completes (or once the queue shuts down).
+//
+// The request and response are allocated on the call's arena, whose first
+// block is part of the call itself; typical calls need no further blocks.
+template <class Request, class Response>
+class AsyncUnaryCall : public AsyncCallInterface {
+ public:
+  typedef void (Server::AsyncService::*RequestMethod)(
+      ServerContext*, Request*, ServerAsyncResponseWriter<Response>*,
+      grpc::CompletionQueue*, ServerCompletionQueue*, void*);
+  typedef Status (ServerImpl::*HandlerMethod)(
+      ServerContext*, const Request*, Response*);
+
+  AsyncUnaryCall(Server::AsyncService* service, ServerImpl* impl,
+                 ServerCompletionQueue* cq, RequestMethod request_method,
+                 HandlerMethod handler_method) :
+      AsyncCallInterface(), service_(service), impl_(impl), cq_(cq),
+      request_method_(request_method), handler_method_(handler_method),
+      arena_(InitialBlockOptions(initial_block_, sizeof(initial_block_))),
+      request_(google::protobuf::Arena::CreateMessage<Request>(&arena_)),
+      response_(google::protobuf::Arena::CreateMessage<Response>(&arena_)),
+      responder_(&context_), finishing_(false) {
+    (service_->*request_method_)(&context_, request_, &responder_, cq_, cq_,
+                                 this);
+  }
+  ~AsyncUnaryCall() {}
+
+  void Proceed(bool ok) override {
+    if (finishing_ || !ok) {
+      // Either the response has been sent, or the queue is shutting down
+      // and this call never received a request.
+      delete this;
+      return;
+    }
+
+    new AsyncUnaryCall<Request, Response>(service_, impl_, cq_,
+                                          request_method_, handler_method_);
+    Status status = (impl_->*handler_method_)(&context_, request_,
+                                               response_);
+    finishing_ = true;
+    responder_.Finish(*response_, status, this);
+  }
+
+ private:
+  static const size_t INITIAL_ARENA_BLOCK_BYTES = 4096;
+
+  static google::protobuf::ArenaOptions InitialBlockOptions(char* block,
+                                                            size_t size) {
+    google::protobuf::ArenaOptions options;
+    options.initial_block = block;
+    options.initial_block_size = size;
+    return options;
+  }
+
+  Server::AsyncService* service_;
+  ServerImpl* impl_;
+  ServerCompletionQueue* cq_;
+  RequestMethod request_method_;
+  HandlerMethod handler_method_;
+  ServerContext context_;
+  alignas(8) char initial_block_[INITIAL_ARENA_BLOCK_BYTES];
+  google::protobuf::Arena arena_;
+  // Owned by arena_.
+  Request* request_;
+  Response* response_;
+  ServerAsyncResponseWriter<Response> responder_;
+  bool finishing_;
+};
+
+template <class Request, class Response>
+inline void StartAsyncCall(
+    Server::AsyncService* service, ServerImpl* impl, ServerCompletionQueue* cq,
+    typename AsyncUnaryCall<Request, Response>::RequestMethod request_method,
+    typename AsyncUnaryCall<Request, Response>::HandlerMethod handler_method) {
+  new AsyncUnaryCall<Request, Response>(service, impl, cq, request_method,
+                                        handler_method);
+}
+
+// State machine for a single BulkImport call. As with AsyncUnaryCall, the
+// call asks for the next incoming call on construction, and creates its
+// replacement once that call arrives. It then reads the request stream a
+// message at a time, importing each chunk as it fills on whichever handler
+// thread delivered the message, and finishes once the client closes the
+// stream or an import fails.
+class AsyncBulkImportCall : public AsyncCallInterface {
+ public:
+  AsyncBulkImportCall(Server::AsyncService* service, ServerImpl* impl,
+                      ServerCompletionQueue* cq) :
+      AsyncCallInterface(), service_(service), impl_(impl), cq_(cq),
+      reader_(&context_), state_(WAITING_FOR_CALL) {
+    service_->RequestBulkImport(&context_, &reader_, cq_, cq_, this);
+  }
+  ~AsyncBulkImportCall() {}
+
+  void Proceed(bool ok) override {
+    switch (state_) {
+      case WAITING_FOR_CALL:
+        if (!ok) {
+          // The queue is shutting down.
+          delete this;
+          return;
+        }
+        new AsyncBulkImportCall(service_, impl_, cq_);
+        state_ = READING;
+        reader_.Read(&request_, this);
+        return;
+      case READING: {
+        Status status;
+        if (ok) {
+          status = impl_->ContinueBulkImport(&request_, &chunk_, &response_);
+          if (status.ok()) {
+            reader_.Read(&request_, this);
+            return;
+          }
+        } else {
+          // The client has closed the stream.
+          status = impl_->FinishBulkImport(&chunk_, &response_);
+        }
+        state_ = FINISHING;
+        if (status.ok()) {
+          reader_.Finish(response_, status, this);
+        } else {
+          reader_.FinishWithError(status, this);
+        }
+        return;
+      }
+      case FINISHING:
+        delete this;
+        return;
+    }
+  }
+
+ private:
+  enum State {
+    WAITING_FOR_CALL,
+    READING,
+    FINISHING
+  };
+
+  Server::AsyncService* service_;
+  ServerImpl* impl_;
+  ServerCompletionQueue* cq_;
+  ServerContext context_;
+  BulkImportRequest request_;
+  BulkImportRequest chunk_;
+  BulkImportResponse response_;
+  ServerAsyncReader<BulkImportResponse, BulkImportRequest> reader_;
+  State state_;
+};
+
+// Posts one outstanding request for every method in the Server service to
+// the given completion queue.
+void StartAllAsyncCalls(Server::AsyncService* service, ServerImpl* impl,
+                        ServerCompletionQueue* cq) {
+  typedef Server::AsyncService S;
+  StartAsyncCall<ConcatInputRequest, ConcatInputResponse>(
+      service, impl, cq, &S::RequestConcatInputs, &ServerImpl::ConcatInputs);
+  StartAsyncCall<CreateDatasetRequest, CreateDatasetResponse>(
+      service, impl, cq, &S::RequestCreateDataset, &ServerImpl::CreateDataset);
+  StartAsyncCall<GetDatasetRequest, GetDatasetResponse>(
+      service, impl, cq, &S::RequestGetDataset, &ServerImpl::GetDataset);
+  StartAsyncCall<RemoveDatasetRequest, RemoveDatasetResponse>(
+      service, impl, cq, &S::RequestRemoveDataset, &ServerImpl::RemoveDataset);
+  StartAsyncCall<SearchDatasetsRequest, SearchDatasetsResponse>(
+      service, impl, cq, &S::RequestSearchDatasets,
+      &ServerImpl::SearchDatasets);
+  StartAsyncCall<UpdateDatasetRequest, UpdateDatasetResponse>(
+      service, impl, cq, &S::RequestUpdateDataset, &ServerImpl::UpdateDataset);
+  StartAsyncCall<UpdateDatasetWithDescriptionRequest,
+                 UpdateDatasetWithDescriptionResponse>(
+      service, impl, cq, &S::RequestUpdateDatasetWithDescription,
+      &ServerImpl::UpdateDatasetWithDescription);
+  StartAsyncCall<UpdateDatasetDescriptionRequest,
+                 UpdateDatasetDescriptionResponse>(
+      service, impl, cq, &S::RequestUpdateDatasetDescription,
+      &ServerImpl::UpdateDatasetDescription);
+  StartAsyncCall<CreateNamespaceRequest, CreateNamespaceResponse>(
+      service, impl, cq, &S::RequestCreateNamespace,
+      &ServerImpl::CreateNamespace);
+  StartAsyncCall<GetNamespaceRequest, GetNamespaceResponse>(
+      service, impl, cq, &S::RequestGetNamespace, &ServerImpl::GetNamespace);
+  StartAsyncCall<RemoveNamespaceRequest, RemoveNamespaceResponse>(
+      service, impl, cq, &S::RequestRemoveNamespace,
+      &ServerImpl::RemoveNamespace);
+  StartAsyncCall<UpdateNamespaceRequest, UpdateNamespaceResponse>(
+      service, impl, cq, &S::RequestUpdateNamespace,
+      &ServerImpl::UpdateNamespace);
+  StartAsyncCall<UpdateNamespaceWithDescriptionRequest,
+                 UpdateNamespaceWithDescriptionResponse>(
+      service, impl, cq, &S::RequestUpdateNamespaceWithDescription,
+      &ServerImpl::UpdateNamespaceWithDescription);
+  StartAsyncCall<UpsertNamespaceDescriptionRequest,
+                 UpsertNamespaceDescriptionResponse>(
+      service, impl, cq, &S::RequestUpsertNamespaceDescription,
+      &ServerImpl::UpsertNamespaceDescription);
+  StartAsyncCall<CreateRepositoryRequest, CreateRepositoryResponse>(
+      service, impl, cq, &S::RequestCreateRepository,
+      &ServerImpl::CreateRepository);
+  StartAsyncCall<GetRepositoryRequest, GetRepositoryResponse>(
+      service, impl, cq, &S::RequestGetRepository, &ServerImpl::GetRepository);
+  StartAsyncCall<ListRepositoriesRequest, ListRepositoriesResponse>(
+      service, impl, cq, &S::RequestListRepositories,
+      &ServerImpl::ListRepositories);
+  StartAsyncCall<RemoveRepositoryRequest, RemoveRepositoryResponse>(
+      service, impl, cq, &S::RequestRemoveRepository,
+      &ServerImpl::RemoveRepository);
+  StartAsyncCall<UpdateRepositoryRequest, UpdateRepositoryResponse>(
+      service, impl, cq, &S::RequestUpdateRepository,
+      &ServerImpl::UpdateRepository);
+  StartAsyncCall<UpdateRepositoryWithDescriptionRequest,
+                 UpdateRepositoryWithDescriptionResponse>(
+      service, impl, cq, &S::RequestUpdateRepositoryWithDescription,
+      &ServerImpl::UpdateRepositoryWithDescription);
+  StartAsyncCall<UpsertRepositoryDescriptionRequest,
+                 UpsertRepositoryDescriptionResponse>(
+      service, impl, cq, &S::RequestUpsertRepositoryDescription,
+      &ServerImpl::UpsertRepositoryDescription);
+  StartAsyncCall<CreateUserRequest, CreateUserResponse>(
+      service, impl, cq, &S::RequestCreateUser, &ServerImpl::CreateUser);
+  StartAsyncCall<GetSelfUserRequest, GetSelfUserResponse>(
+      service, impl, cq, &S::RequestGetSelfUser, &ServerImpl::GetSelfUser);
+  StartAsyncCall<RemoveUserRequest, RemoveUserResponse>(
+      service, impl, cq, &S::RequestRemoveUser, &ServerImpl::RemoveUser);
+  StartAsyncCall<UpdateUserRequest, UpdateUserResponse>(
+      service, impl, cq, &S::RequestUpdateUser, &ServerImpl::UpdateUser);
+  StartAsyncCall<UserSearchRequest, UserSearchResponse>(
+      service, impl, cq, &S::RequestUserSearch, &ServerImpl::UserSearch);
+  StartAsyncCall<GetServerMetricsRequest, GetServerMetricsResponse>(
+      service, impl, cq, &S::RequestGetServerMetrics,
+      &ServerImpl::GetServerMetrics);
+  new AsyncBulkImportCall(service, impl, cq);
+}
+
+void PinThreadToCore(std::thread* thread, int thread_number) {
+  unsigned int num_cores = std::thread::hardware_concurrency();
+  if (num_cores == 0) {
+    return;
+  }
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  CPU_SET(thread_number % num_cores, &cpu_set);
+  int result = pthread_setaffinity_np(thread->native_handle(),
+                                      sizeof(cpu_set_t), &cpu_set);
+  if (result != 0) {
+    // TODO: Log Warning. Not fatal; the thread simply stays unpinned.
+  }
+}
+
+void HandleAsyncCalls(ServerCompletionQueue* cq) {
+  void* tag = nullptr;
+  bool ok = false;
+  while (cq->Next(&tag, &ok)) {
+    static_cast<AsyncCallInterface*>(tag)->Proceed(ok);
+  }
+}
+
+void ServeAsync(grpc::ServerBuilder* builder, ServerImpl* impl,
+                const std::string& address, const ServingOptions& options) {
+  Server::AsyncService async_service;
+  builder->RegisterService(&async_service);
+  int num_queues = options.completion_queues < 1 ? 1 :
+                   options.completion_queues;
+  std::vector<std::unique_ptr<ServerCompletionQueue>> queues;
+  for (int i = 0; i < num_queues; i++) {
+    queues.push_back(builder->AddCompletionQueue());
+  }
+
+  std::unique_ptr<grpc::Server> server(builder->BuildAndStart());
+  // The first extra_threads queues take one more thread than the rest, so
+  // that every one of the handler_threads is used.
+  int threads_per_queue = options.handler_threads / num_queues;
+  int extra_threads = options.handler_threads % num_queues;
+  if (threads_per_queue < 1) {
+    threads_per_queue = 1;
+    extra_threads = 0;
+  }
+  std::cout << "Server listening on " << address << " (async: "
+            << num_queues << " completion queues, "
+            << num_queues * threads_per_queue + extra_threads
+            << " handler threads)" << std::endl;
+
+  std::vector<std::thread> handlers;
+  for (int i = 0; i < num_queues; i++) {
+    StartAllAsyncCalls(&async_service, impl, queues[i].get());
+    int queue_threads = threads_per_queue + (i < extra_threads ? 1 : 0);
+    for (int j = 0; j < queue_threads; j++) {
+      handlers.emplace_back(HandleAsyncCalls, queues[i].get());
+      if (options.pin_threads) {
+        PinThreadToCore(&handlers.back(), handlers.size() - 1);
+      }
+    }
+  }
+
+  // As with the synchronous mode, we run until the process is terminated.
+  // The handler threads only exit once the server and queues are shut down.
+  for (uint32_t i = 0; i < handlers.size(); i++) {
+    handlers[i].join();
+  }
+}
+} // anonymous namespace
+
+void RunServer(std::string address, const ServingOptions& options) {
   std::unique_ptr<acumio::crypto::EncrypterInterface> encrypter(
     new acumio::crypto::NoOpEncrypter());
   uint64_t salt_seed = 1;
@@ -320,8 +1244,78 @@ void RunServer(std::string address) {
   RepositoryService repository_service(&repository_repository,
                                        &referential_service);
   DatasetService dataset_service(&dataset_repository, &referential_service);
+  BulkImporter bulk_importer(&referential_service, &namespace_service,
+                             &repository_service, &dataset_service);
   ServerImpl service(&dataset_service, &namespace_service,
-                     &repository_service, &user_service);
+                     &repository_service, &user_service, &bulk_importer);
+  service.set_bulk_import_chunk_size(options.bulk_import_chunk_size);
+  CheckpointCatalog catalog = {&namespace_repository, &repository_repository,
+                               &dataset_repository, user_service.repository()};
+  uint64_t log_position = 0;
+  if (!options.restore_path.empty()) {
+    Status restore_result = acumio::RestoreCheckpoint(options.restore_path,
+                                                      catalog, &log_position);
+    if (!restore_result.ok()) {
+      std::cerr << "Unable to restore checkpoint: "
+                << restore_result.error_message() << std::endl;
+      return;
+    }
+    std::cout << "Restored " << options.restore_path << std::endl;
+  }
+  std::unique_ptr<WriteAheadLog> write_ahead_log;
+  acumio::test::TestHook<Transaction*> transaction_hook;
+  std::unique_ptr<TransactionManager> transaction_manager;
+  std::unique_ptr<WriteCoalescer> write_coalescer;
+  if (!options.wal_path.empty()) {
+    uint64_t replayed = 0;
+    uint64_t failed = 0;
+    Status replay_result = WriteAheadLog::Replay(options.wal_path,
+        log_position, [&service, &failed](const std::string& record) {
+          Status call_result;
+          Status result = service.ReplayLogRecord(record, &call_result);
+          if (!call_result.ok()) {
+            failed++;
+          }
+          return result;
+        }, &replayed);
+    if (!replay_result.ok()) {
+      std::cerr << "Unable to replay write-ahead log: "
+                << replay_result.error_message() << std::endl;
+      return;
+    }
+    std::cout << "Replayed " << replayed << " changes from "
+              << options.wal_path << " (" << failed
+              << " of them failed, as they did when first made)" << std::endl;
+    write_ahead_log.reset(new WriteAheadLog(options.wal_path, options.wal_sync,
+                                            options.wal_group_micros));
+    Status open_result = write_ahead_log->Open();
+    if (!open_result.ok()) {
+      std::cerr << open_result.error_message() << std::endl;
+      return;
+    }
+    service.set_write_ahead_log(write_ahead_log.get());
+    transaction_manager.reset(new TransactionManager(
+        LOG_TRANSACTION_POOL_SIZE, LOG_TRANSACTION_TIMEOUT_NANOS,
+        2 * LOG_TRANSACTION_TIMEOUT_NANOS, &transaction_hook));
+    transaction_manager->set_write_ahead_log(write_ahead_log.get());
+    // The catalog repositories are not transactional, so there are no
+    // versions to register cleaners for; the collector's passes still reap
+    // abandoned Transactions. Transactional repositories should register
+    // with transaction_manager here (see
+    // TxMemRepository::CleanVersionsWithin).
+    transaction_manager->StartVersionCollector(VERSION_COLLECT_INTERVAL_NANOS,
+                                               VERSION_COLLECT_BUDGET_NANOS);
+    write_coalescer.reset(new WriteCoalescer(*transaction_manager,
+                                             options.coalesce_window_micros,
+                                             options.coalesce_max_batch));
+    service.set_write_coalescer(write_coalescer.get());
+  }
+  std::unique_ptr<PeriodicCheckpointer> checkpointer;
+  if (!options.checkpoint_path.empty()) {
+    checkpointer.reset(new PeriodicCheckpointer(
+        &service, catalog, options.checkpoint_path,
+        std::max(1, options.checkpoint_interval_seconds)));
+  }
   grpc::ServerBuilder builder;
   /**
    This code assumes ssl connection.
@@ -340,6 +1334,11 @@ void RunServer(std::string address) {
   builder.AddListeningPort(address, credentials);
   **/
   builder.AddListeningPort(address, grpc::InsecureServerCredentials());
+  if (options.async) {
+    ServeAsync(&builder, &service, address, options);
+    return;
+  }
+
   // Register "service" as the instance through which we commmunicate with
   // clients.
   builder.RegisterService(&service);
@@ -362,7 +1361,46 @@ int main(int argc, char** argv) {
       ("help,h", "product help message")
       ("address,a", po::value<string>(),
        "Host + port address of server. Example: mydomain.com:1782. Required. "
-       "May also be specified without '-a' flag as positional argument.");
+       "May also be specified without '-a' flag as positional argument.")
+      ("async", "Serve requests from completion queues using a fixed pool of "
+       "handler threads instead of grpc's synchronous thread management.")
+      ("completion_queues,q", po::value<int>()->default_value(1),
+       "Number of completion queues to use with --async.")
+      ("handler_threads,t",
+       po::value<int>()->default_value(
+           std::max(1U, std::thread::hardware_concurrency())),
+       "Total number of handler threads to use with --async. The threads "
+       "are divided evenly among the completion queues.")
+      ("pin_threads", "With --async, pin each handler thread to a core.")
+      ("wal", po::value<string>(),
+       "Path of a write-ahead log. Changes recorded there are replayed at "
+       "startup, and each change is logged before it is acknowledged.")
+      ("wal_sync", po::value<string>()->default_value("commit"),
+       "When --wal is flushed to disk: 'commit' flushes before acknowledging "
+       "each change (sharing flushes among concurrent changes), 'group' "
+       "flushes every --wal_group_micros and acknowledges changes once "
+       "flushed, and 'async' flushes every --wal_group_micros without "
+       "waiting, so a crash may lose the most recent changes.")
+      ("wal_group_micros", po::value<int>()->default_value(1000),
+       "Flush interval for --wal_sync group and async.")
+      ("coalesce_window_micros", po::value<int>()->default_value(0),
+       "How long a change waits for others to write to --wal along with it. "
+       "With 0, a change only shares a write with those already waiting.")
+      ("coalesce_max_batch", po::value<int>()->default_value(64),
+       "Most changes written to --wal together.")
+      ("restore", po::value<string>(),
+       "Path of a checkpoint to load before serving. With --wal, only the "
+       "changes logged after the checkpoint was taken are replayed.")
+      ("checkpoint", po::value<string>(),
+       "Path to write a checkpoint of all repositories to, periodically. "
+       "The file is replaced atomically, so it may be copied off as a "
+       "backup at any time.")
+      ("checkpoint_interval", po::value<int>()->default_value(300),
+       "Seconds between checkpoints with --checkpoint.")
+      ("bulk_import_chunk",
+       po::value<int>()->default_value(1000),
+       "Number of items BulkImport imports at a time. Other changes wait "
+       "while a chunk is imported.");
       //("sslKeyFile,k", po::value<string>(), "Name of ssl key file")
       //("certificate", po::value<string>(), "Name of file holding certificate")
 
@@ -395,6 +1433,39 @@ int main(int argc, char** argv) {
   std::string ssl_key_file = "/home/bill/acumio/ssl/private/acumioserver.key";
   std::string certificate = "/home/bill/acumio/ssl/certs/Flying-Ubuntu-Dragon.crt";
 */
-  acumio::model::server::RunServer(address);
+  acumio::model::server::ServingOptions options;
+  options.async = var_map.count("async") > 0;
+  options.completion_queues = var_map["completion_queues"].as<int>();
+  options.handler_threads = var_map["handler_threads"].as<int>();
+  options.pin_threads = var_map.count("pin_threads") > 0;
+  if (var_map.count("wal") > 0) {
+    options.wal_path = var_map["wal"].as<string>();
+  }
+  std::string wal_sync = var_map["wal_sync"].as<string>();
+  if (wal_sync == "commit") {
+    options.wal_sync = WriteAheadLog::SYNC_EACH_COMMIT;
+  } else if (wal_sync == "group") {
+    options.wal_sync = WriteAheadLog::SYNC_GROUP_COMMIT;
+  } else if (wal_sync == "async") {
+    options.wal_sync = WriteAheadLog::SYNC_ASYNC;
+  } else {
+    cout << "Unknown --wal_sync value: " << wal_sync << "\n";
+    return 1;
+  }
+  options.wal_group_micros = std::max(1, var_map["wal_group_micros"].as<int>());
+  options.coalesce_window_micros =
+      std::max(0, var_map["coalesce_window_micros"].as<int>());
+  options.coalesce_max_batch =
+      std::max(1, var_map["coalesce_max_batch"].as<int>());
+  if (var_map.count("restore") > 0) {
+    options.restore_path = var_map["restore"].as<string>();
+  }
+  if (var_map.count("checkpoint") > 0) {
+    options.checkpoint_path = var_map["checkpoint"].as<string>();
+  }
+  options.checkpoint_interval_seconds =
+      var_map["checkpoint_interval"].as<int>();
+  options.bulk_import_chunk_size = var_map["bulk_import_chunk"].as<int>();
+  acumio::model::server::RunServer(address, options);
   return 0;
 }
@@ -12,6 +12,7 @@
 #include "description.pb.h"
 #include "protobuf_iterator.h"
 #include "referential_service.h"
+#include "shared_response.h"
 
 namespace acumio {
 DatasetService::DatasetService(
@@ -24,7 +25,7 @@ DatasetService::~DatasetService() {}
 grpc::Status DatasetService::CreateDataset(
     const model::Dataset& dataset,
     const model::MultiDescription& description) {
-  model::Namespace parent;
+  NamespaceRepository::Snapshot parent;
   grpc::Status check = referential_service_->GetParentNamespace(
       dataset.physical_name(), model::DATASET, &parent);
   if (!check.ok()) {
@@ -53,18 +54,20 @@ grpc::Status DatasetService::GetDataset(
       history_tags.begin());
   proto::ConstProtoIterator<std::string> history_end(
       history_tags.end());
-  model::Dataset* current_dataset = nullptr;
-  model::MultiDescription* current_description = nullptr;
-  model::MultiDescriptionHistory* current_history = nullptr;
-
+  // The response shares the stored Datasets where it can; see
+  // shared_response.h. The descriptions are picked out by tag, so they are
+  // built for the response.
+  DatasetRepository::Snapshot snapshot;
   grpc::Status check;
   for (int i = 0; i < num_requests && check.ok(); i++) {
-    current_dataset = dataset->Add();
-    current_description = description->Add();
-    current_history = description_history->Add();
-    check = repository_->GetDatasetAndDescription(
-        physical_name.Get(i), description_begin, description_end, history_begin,
-        history_end, current_dataset, current_description, current_history);
+    check = repository_->GetDatasetSnapshot(physical_name.Get(i), &snapshot);
+    if (!check.ok()) {
+      break;
+    }
+    AddSharedOrCopy(snapshot, snapshot->entity, dataset);
+    check = repository_->GetSnapshotDescription(
+        snapshot, description_begin, description_end, history_begin,
+        history_end, description->Add(), description_history->Add());
   }
 
   return check;
@@ -79,7 +82,7 @@ grpc::Status DatasetService::UpdateDataset(const model::QualifiedName& name,
   // Validate that if the parent namespace for the dataset is changing,
   // then the new parent namespace exists.
   if (name.name_space() != dataset.physical_name().name_space()) {
-    model::Namespace parent;
+    NamespaceRepository::Snapshot parent;
     grpc::Status check = referential_service_->GetParentNamespace(
         name, model::DATASET, &parent);
     if (!check.ok()) {
@@ -96,7 +99,7 @@ grpc::Status DatasetService::UpdateDatasetWithDescription(
   // Validate that if the parent namespace for the dataset is changing,
   // then the new parent namespace exists.
   if (name.name_space() != dataset.physical_name().name_space()) {
-    model::Namespace parent;
+    NamespaceRepository::Snapshot parent;
     grpc::Status check = referential_service_->GetParentNamespace(
         name, model::DATASET, &parent);
     if (!check.ok()) {
@@ -9,6 +9,8 @@
 #include "NamespaceService.h"
 
 #include <sstream>
+#include "description_deltas.h"
+#include "shared_response.h"
 
 namespace acumio {
 
@@ -81,46 +83,36 @@ grpc::Status NamespaceService::CreateNamespace(
   return repository_->AddWithDescription(name_space, description);
 }
 
-grpc::Status NamespaceService::GetJustNamespace(
-    const std::string& name_space,
-    model::server::GetNamespaceResponse* response) {
-  return repository_->GetNamespace(name_space,
-                                   response->mutable_name_space());
-}
-
 grpc::Status NamespaceService::GetNamespace(
     const std::string& name_space,
     bool include_description,
     bool include_description_history,
     model::server::GetNamespaceResponse* response) {
-  if (!include_description && !include_description_history) {
-    return GetJustNamespace(name_space, response);
+  // The response shares the stored Namespace and description where it can;
+  // see shared_response.h.
+  typedef model::server::GetNamespaceResponse Response;
+  NamespaceRepository::Snapshot snapshot;
+  grpc::Status result = repository_->GetNamespaceSnapshot(name_space,
+                                                          &snapshot);
+  if (!result.ok()) {
+    return result;
+  }
+  ShareOrCopy(snapshot, snapshot->entity, response,
+              &Response::unsafe_arena_set_allocated_name_space,
+              &Response::mutable_name_space);
+
+  // The newest version of a stored history is always kept in full.
+  const model::DescriptionHistory& history = snapshot->description_history;
+  int num_versions = history.version_size();
+  if (include_description && num_versions > 0) {
+    ShareOrCopy(snapshot, history.version(num_versions - 1), response,
+                &Response::unsafe_arena_set_allocated_description,
+                &Response::mutable_description);
   }
-
   if (include_description_history) {
-    grpc::Status result = repository_->GetNamespaceAndDescriptionHistory(
-        name_space,
-        response->mutable_name_space(),
-        response->mutable_description_history());
-    if (!result.ok()) {
-      return result;
-    }
-
-    if (include_description) {
-      uint32_t num_versions = response->description_history().version_size();
-      if (num_versions > 0) {
-        response->mutable_description()->CopyFrom(
-          response->description_history().version(num_versions - 1));
-      }
-    }
-    return grpc::Status::OK;
+    ExpandHistory(history, response->mutable_description_history());
   }
-
-  // assert: include_description is true.
-  return repository_->GetNamespaceAndDescription(
-      name_space,
-      response->mutable_name_space(),
-      response->mutable_description());
+  return grpc::Status::OK;
 }
 
 grpc::Status NamespaceService::RemoveNamespace(
@@ -195,12 +187,13 @@ grpc::Status NamespaceService::ValidateNewNamespace(
   }
 
   if (!ValidTopLevelNamespace(name_space)) {
-    model::Namespace parent;
-    grpc::Status parent_search_result =
-        repository_->GetNamespace(name_space.name().name_space(), &parent);
+    NamespaceRepository::Snapshot parent_snapshot;
+    grpc::Status parent_search_result = repository_->GetNamespaceSnapshot(
+        name_space.name().name_space(), &parent_snapshot);
     if (!parent_search_result.ok()) {
       return parent_search_result;
     }
+    const model::Namespace& parent = parent_snapshot->entity;
 
     if (!NamespaceFormatConsistent(name_space.full_name(),
                                    name_space.name(),
@@ -48,11 +48,6 @@ class NamespaceService {
       const model::Description& update, bool clear_description);
 
  private:
-  // Used internally when we have a GetNamespace with the request to just
-  // get the Namespace without the Descriptions.
-  grpc::Status GetJustNamespace(const std::string& full_namespace,
-                                model::server::GetNamespaceResponse* response);
-
   // Used to verify that a new Namespace does not violate any rules.
   // The rules-checking includes only those rules that are not already
   // enforced by the Repository layer - hence, it does not include primary
@@ -9,6 +9,8 @@
 #include "RepositoryService.h"
 #include "referential_service.h"
 #include "repository_repository.h"
+#include "description_deltas.h"
+#include "shared_response.h"
 
 namespace acumio {
 
@@ -30,12 +32,13 @@ grpc::Status RepositoryService::CreateRepository(
     const model::Description& description,
     bool create_or_associate_namespace,
     const std::string& namespace_separator) {
-  model::Namespace parent_namespace;
+  NamespaceRepository::Snapshot parent_snapshot;
   grpc::Status check = referential_service_->GetParentNamespace(
-      repository.name(), model::REPOSITORY, &parent_namespace);
+      repository.name(), model::REPOSITORY, &parent_snapshot);
   if (!check.ok()) {
     return check;
   }
+  const model::Namespace& parent_namespace = parent_snapshot->entity;
 
   check = ValidateWellFormedRepository(repository);
   if (!check.ok()) {
@@ -64,36 +67,31 @@ grpc::Status RepositoryService::GetRepository(
     bool include_description,
     bool include_description_history,
     model::server::GetRepositoryResponse* response) {
-  if (!include_description && !include_description_history) {
-    return GetJustRepository(repository_name, response);
+  // The response shares the stored Repository and description where it
+  // can; see shared_response.h.
+  typedef model::server::GetRepositoryResponse Response;
+  RepositoryRepository::Snapshot snapshot;
+  grpc::Status result = repository_->GetRepositorySnapshot(repository_name,
+                                                           &snapshot);
+  if (!result.ok()) {
+    return result;
+  }
+  ShareOrCopy(snapshot, snapshot->entity, response,
+              &Response::unsafe_arena_set_allocated_repository,
+              &Response::mutable_repository);
+
+  // The newest version of a stored history is always kept in full.
+  const model::DescriptionHistory& history = snapshot->description_history;
+  int num_versions = history.version_size();
+  if (include_description && num_versions > 0) {
+    ShareOrCopy(snapshot, history.version(num_versions - 1), response,
+                &Response::unsafe_arena_set_allocated_description,
+                &Response::mutable_description);
   }
-
   if (include_description_history) {
-    grpc::Status result = repository_->GetRepositoryAndDescriptionHistory(
-        repository_name,
-        response->mutable_repository(),
-        response->mutable_description_history());
-    if (!result.ok()) {
-      return result;
-    }
-
-    // If we want descriptions and description history, we will just get
-    // the descriptions from the description history.
-    if (include_description) {
-      uint32_t num_versions = response->description_history().version_size();
-      if (num_versions > 0) {
-        response->mutable_description()->CopyFrom(
-          response->description_history().version(num_versions - 1));
-      }
-    }
-    return grpc::Status::OK;
+    ExpandHistory(history, response->mutable_description_history());
   }
-
-  // assert: include_description && !include_description_history
-  return repository_->GetRepositoryAndDescription(
-      repository_name,
-      response->mutable_repository(),
-      response->mutable_description());
+  return grpc::Status::OK;
 }
 
 grpc::Status RepositoryService::ListRepositories(
@@ -119,12 +117,13 @@ grpc::Status RepositoryService::RemoveRepository(
     const model::QualifiedName& repository_name,
     bool force,
     bool remove_or_disassociate_namespace) {
-  model::Namespace parent_namespace;
+  NamespaceRepository::Snapshot parent_snapshot;
   grpc::Status check = referential_service_->GetParentNamespace(
-      repository_name, model::REPOSITORY, &parent_namespace);
+      repository_name, model::REPOSITORY, &parent_snapshot);
   if (!check.ok()) {
     return check;
   }
+  const model::Namespace& parent_namespace = parent_snapshot->entity;
   std::stringstream namespace_fullname;
   namespace_fullname << parent_namespace.full_name()
                      << parent_namespace.separator()
@@ -184,12 +183,14 @@ grpc::Status RepositoryService::UpdateRepository(
   // If we reach here, we are fundamentally changing the name of the
   // repository, hence the namespace. We need to first check if we can
   // find if the current namespace has children.
-  model::Namespace current_namespace_parent;
+  NamespaceRepository::Snapshot current_parent_snapshot;
   check = referential_service_->GetParentNamespace(
-      name, model::REPOSITORY, &current_namespace_parent);
+      name, model::REPOSITORY, &current_parent_snapshot);
   if (!check.ok()) {
     return check;
   }
+  const model::Namespace& current_namespace_parent =
+      current_parent_snapshot->entity;
   model::Namespace current_namespace;
   std::stringstream current_fullname;
   current_fullname << current_namespace_parent.full_name()
@@ -213,12 +214,13 @@ grpc::Status RepositoryService::UpdateRepository(
   // We now know the disposition of the old namespace: either we are 
   // disassociating it or we are not. However, we need to associate or
   // create the new namespace before we proceed.
-  model::Namespace new_namespace_parent;
+  NamespaceRepository::Snapshot new_parent_snapshot;
   check = referential_service_->GetParentNamespace(
-      update.name(), model::REPOSITORY, &new_namespace_parent);
+      update.name(), model::REPOSITORY, &new_parent_snapshot);
   if (!check.ok()) {
     return check;
   }
+  const model::Namespace& new_namespace_parent = new_parent_snapshot->entity;
   model::Namespace new_namespace;
   std::stringstream new_fullname;
   new_fullname << new_namespace_parent.full_name()
@@ -241,9 +243,9 @@ grpc::Status RepositoryService::UpdateRepository(
     // Let's check if there is already a Repository with the given name.
     // We basically need to validate everything before we execute in order
     // to avoid getting into a bad state.
-    model::Repository pre_existing_repository;
-    check = repository_->GetRepository(new_namespace.name(), 
-                                       &pre_existing_repository);
+    RepositoryRepository::Snapshot pre_existing_repository;
+    check = repository_->GetRepositorySnapshot(new_namespace.name(),
+                                               &pre_existing_repository);
     if (check.ok()) {
       // If results were "ok", it means there is already a Repository with
       // the new name. Following through would imply a collision.
@@ -301,12 +303,14 @@ grpc::Status RepositoryService::UpdateRepositoryWithDescription(
   // If we reach here, we are fundamentally changing the name of the
   // repository, hence the namespace. We need to first check if we can
   // find if the current namespace has children.
-  model::Namespace current_namespace_parent;
+  NamespaceRepository::Snapshot current_parent_snapshot;
   check = referential_service_->GetParentNamespace(
-      name, model::REPOSITORY, &current_namespace_parent);
+      name, model::REPOSITORY, &current_parent_snapshot);
   if (!check.ok()) {
     return check;
   }
+  const model::Namespace& current_namespace_parent =
+      current_parent_snapshot->entity;
   model::Namespace current_namespace;
   check = referential_service_->GetNamespaceUsingParent(
       current_namespace_parent, name.name(), &current_namespace);
@@ -326,12 +330,13 @@ grpc::Status RepositoryService::UpdateRepositoryWithDescription(
   // We now know the disposition of the old namespace: either we are 
   // disassociating it or we are not. However, we need to associate or
   // create the new namespace before we proceed.
-  model::Namespace new_namespace_parent;
+  NamespaceRepository::Snapshot new_parent_snapshot;
   check = referential_service_->GetParentNamespace(update.name(),
-      model::REPOSITORY, &new_namespace_parent);
+      model::REPOSITORY, &new_parent_snapshot);
   if (!check.ok()) {
     return check;
   }
+  const model::Namespace& new_namespace_parent = new_parent_snapshot->entity;
   model::Namespace new_namespace;
   check = referential_service_->GetNamespaceUsingParent(
       new_namespace_parent, update.name().name(), &new_namespace);
@@ -350,9 +355,9 @@ grpc::Status RepositoryService::UpdateRepositoryWithDescription(
     // Let's check if there is already a Repository with the given name.
     // We basically need to validate everything before we execute in order
     // to avoid getting into a bad state.
-    model::Repository pre_existing_repository;
-    check = repository_->GetRepository(new_namespace.name(), 
-                                       &pre_existing_repository);
+    RepositoryRepository::Snapshot pre_existing_repository;
+    check = repository_->GetRepositorySnapshot(new_namespace.name(),
+                                               &pre_existing_repository);
     if (check.ok()) {
       // If results were "ok", it means there is already a Repository with
       // the new name. Following through would imply a collision.
@@ -406,13 +411,6 @@ grpc::Status RepositoryService::UpsertRepositoryDescription(
 }
 
 // PRIVATE METHODS
-grpc::Status RepositoryService::GetJustRepository(
-    const model::QualifiedName& repository_name,
-    model::server::GetRepositoryResponse* response) {
-  return repository_->GetRepository(repository_name,
-                                    response->mutable_repository());
-}
-
 RepositoryRepository::PrimaryIterator RepositoryService::IteratorStart(
     const model::QualifiedName& start_after_name) const {
   RepositoryRepository::PrimaryIterator start = repository_->primary_begin();
@@ -60,12 +60,6 @@ class RepositoryService {
       bool clear_description);
 
  private:
-  // Used internally when we have a GetRepository with the request to just
-  // get the Repository without the Descriptions.
-  grpc::Status GetJustRepository(
-      const model::QualifiedName& repository_name,
-      model::server::GetRepositoryResponse* response);
-
   // Returned Iterator guaranteed to be first Repository r such that
   // start_after_name < r.name(). Similar to the idea of LowerBound,
   // but LowerBound returns first element r such that after_name <= r.name().
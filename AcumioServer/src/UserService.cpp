@@ -50,14 +50,24 @@ grpc::Status UserService::UserSearch(
 grpc::Status UserService::CreateUser(const model::User& user,
                                      const std::string& password) {
   FullUser full_user;
-  full_user.mutable_user()->CopyFrom(user);
+  MakeFullUser(user, password, &full_user);
+  return AddUser(full_user);
+}
+
+void UserService::MakeFullUser(const model::User& user,
+                               const std::string& password,
+                               FullUser* full_user) {
+  full_user->mutable_user()->CopyFrom(user);
   // If password is empty, we leave it intentionally empty on full_user.
   if (!password.empty()) {
     std::string salt = (*salt_generator_)();
     std::string encrypted = (*encrypter_)(password, salt);
-    full_user.mutable_salt()->assign(salt);
-    full_user.mutable_password()->assign(password);
+    full_user->mutable_salt()->assign(salt);
+    full_user->mutable_password()->assign(encrypted);
   }
+}
+
+grpc::Status UserService::AddUser(const FullUser& full_user) {
   return repository_.Add(full_user);
 }
 
@@ -88,7 +98,7 @@ grpc::Status UserService::UpdatePassword(const std::string& user_name,
     std::string salt = (*salt_generator_)();
     std::string encrypted = (*encrypter_)(password, salt);
     existing_user.mutable_salt()->assign(salt);
-    existing_user.mutable_password()->assign(password);
+    existing_user.mutable_password()->assign(encrypted);
   } else {
     existing_user.mutable_salt()->clear();
     existing_user.mutable_password()->clear();
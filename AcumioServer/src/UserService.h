@@ -31,12 +31,20 @@ class UserService {
                           model::server::UserSearchResponse* response);
   grpc::Status CreateUser(const model::User& user,
                           const std::string& password);
+  // CreateUser in two steps: MakeFullUser encrypts the password, so that
+  // the resulting FullUser can be logged before AddUser stores it.
+  void MakeFullUser(const model::User& user, const std::string& password,
+                    FullUser* full_user);
+  grpc::Status AddUser(const FullUser& full_user);
   grpc::Status RemoveUser(const std::string& user_name);
   grpc::Status UpdateUser(const std::string& user_name,
                           const model::User& user);
   grpc::Status UpdatePassword(const std::string& user_name,
                               const std::string& password);
 
+  // The underlying storage, for checkpoints.
+  inline UserRepository* repository() { return &repository_; }
+
  private:
   // The encrypter_ will be invoked as:
   // std::string salt = salt_generator_();
@@ -0,0 +1,81 @@
+//============================================================================
+// Name        : rz_string_hash_benchmark.cpp
+// Author      : Bill Province (bill@acumio.com)
+// Version     :
+// Copyright   : Copyright (C) 2016 Acumio
+// Description : A microbenchmark for RZStringHash::HashBatch. It reports
+//               the time per key of HashBatch against hashing the keys one
+//               at a time. The comparison depends on the machine, so this
+//               is not part of the unit tests; build it with
+//               "make benchmarks".
+//============================================================================
+#include "rz_string_hash.h"
+
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace acumio {
+namespace util {
+namespace {
+
+std::vector<std::string> RandomKeys(size_t count, size_t min_length,
+                                    size_t max_length) {
+  std::mt19937 generator(17);
+  std::uniform_int_distribution<size_t> length(min_length, max_length);
+  std::uniform_int_distribution<int> byte(0, 255);
+  std::vector<std::string> ret_val;
+  for (size_t i = 0; i < count; i++) {
+    std::string key(length(generator), '\0');
+    for (size_t j = 0; j < key.size(); j++) {
+      key[j] = static_cast<char>(byte(generator));
+    }
+    ret_val.push_back(key);
+  }
+  return ret_val;
+}
+
+// Returns false if the batch and single hashes disagree.
+bool RunBenchmark(size_t key_count, size_t min_length, size_t max_length) {
+  typedef std::chrono::steady_clock Clock;
+  RZStringHash hash(0x5bd1e995, 5, 2);
+  std::vector<std::string> keys =
+      RandomKeys(key_count, min_length, max_length);
+  std::vector<uint32_t> single(key_count);
+  std::vector<uint32_t> batch(key_count);
+
+  Clock::time_point start = Clock::now();
+  for (size_t i = 0; i < key_count; i++) {
+    single[i] = hash(keys[i]);
+  }
+  Clock::time_point middle = Clock::now();
+  hash.HashBatch(keys.data(), key_count, batch.data());
+  Clock::time_point end = Clock::now();
+
+  double single_nanos =
+      std::chrono::duration<double, std::nano>(middle - start).count();
+  double batch_nanos =
+      std::chrono::duration<double, std::nano>(end - middle).count();
+  std::cout << key_count << " keys of " << min_length << " to "
+            << max_length << " bytes; ns/key: single: "
+            << single_nanos / key_count << " batch: "
+            << batch_nanos / key_count << std::endl;
+  return single == batch;
+}
+
+} // anonymous namespace
+} // namespace util
+} // namespace acumio
+
+int main(int argc, char** argv) {
+  bool ok = acumio::util::RunBenchmark(2000, 16, 48) &&
+      acumio::util::RunBenchmark(200000, 16, 48) &&
+      acumio::util::RunBenchmark(200000, 0, 200);
+  if (!ok) {
+    std::cerr << "HashBatch disagrees with operator()" << std::endl;
+    return 1;
+  }
+  return 0;
+}
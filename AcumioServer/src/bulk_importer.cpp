@@ -0,0 +1,238 @@
+//============================================================================
+// Name        : bulk_importer.cpp
+// Author      : Bill Province (bill@acumio.com)
+// Version     :
+// Copyright   : Copyright (C) 2016 Acumio
+// Description : Implementation of BulkImporter.
+//============================================================================
+
+#include "bulk_importer.h"
+
+#include <sstream>
+#include "model_constants.h"
+
+namespace acumio {
+
+BulkImporter::BulkImporter(ReferentialService* referential_service,
+                           NamespaceService* namespace_service,
+                           RepositoryService* repository_service,
+                           DatasetService* dataset_service) :
+    referential_service_(referential_service),
+    namespace_service_(namespace_service),
+    repository_service_(repository_service),
+    dataset_service_(dataset_service) {}
+
+BulkImporter::~BulkImporter() {}
+
+grpc::Status BulkImporter::Import(
+    const model::server::BulkImportRequest& chunk, int* failed_item) {
+  NamespaceMap known;
+  for (int i = 0; i < chunk.item_size(); i++) {
+    grpc::Status result = Check(chunk.item(i), &known);
+    if (!result.ok()) {
+      *failed_item = i;
+      return result;
+    }
+  }
+
+  std::vector<AssociatedNamespace> associated(chunk.item_size());
+  for (int i = 0; i < chunk.item_size(); i++) {
+    grpc::Status result = Apply(chunk.item(i), &associated[i]);
+    if (!result.ok()) {
+      *failed_item = i;
+      for (int j = i - 1; j >= 0; j--) {
+        // TODO: Log Error. There is nothing more we can do if an item we
+        // just added cannot be removed again.
+        Undo(chunk.item(j), associated[j]);
+      }
+      return result;
+    }
+  }
+  return grpc::Status::OK;
+}
+
+grpc::Status BulkImporter::Check(const model::server::BulkImportItem& item,
+                                 NamespaceMap* known) const {
+  const model::Namespace* parent = nullptr;
+  grpc::Status result;
+  switch (item.item_case()) {
+    case model::server::BulkImportItem::kNameSpace: {
+      const model::Namespace& name_space = item.name_space().name_space();
+      // Top-level Namespaces have no parent to check.
+      if (!name_space.name().name_space().empty()) {
+        result = FindParent(name_space.name(), model::NAMESPACE, known,
+                            &parent);
+        if (!result.ok()) {
+          return result;
+        }
+      }
+      if (!known->insert(std::make_pair(name_space.full_name(),
+                                        name_space)).second) {
+        std::stringstream error;
+        error << "Cannot add duplicate Namespace with name: (\""
+              << name_space.full_name()
+              << "\")";
+        return grpc::Status(grpc::StatusCode::ALREADY_EXISTS, error.str());
+      }
+      return grpc::Status::OK;
+    }
+    case model::server::BulkImportItem::kRepository: {
+      const model::server::CreateRepositoryRequest& request =
+          item.repository();
+      result = FindParent(request.repository().name(), model::REPOSITORY,
+                          known, &parent);
+      if (!result.ok() || !request.create_or_associate_namespace()) {
+        return result;
+      }
+      // Later items may be created in the Namespace that goes with the
+      // Repository. See ReferentialService::CreateOrAssociateNamespace.
+      model::Namespace associated;
+      associated.set_full_name(parent->full_name() + parent->separator() +
+                               request.repository().name().name());
+      associated.mutable_name()->set_name_space(parent->full_name());
+      associated.mutable_name()->set_name(request.repository().name().name());
+      associated.set_separator(request.namespace_separator());
+      associated.set_is_repository_name(true);
+      (*known)[associated.full_name()] = associated;
+      return grpc::Status::OK;
+    }
+    case model::server::BulkImportItem::kDataset:
+      return FindParent(item.dataset().dataset().physical_name(),
+                        model::DATASET, known, &parent);
+    case model::server::BulkImportItem::ITEM_NOT_SET:
+      break;
+  }
+  return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                      "A bulk import item must hold a Namespace, a "
+                      "Repository or a Dataset.");
+}
+
+grpc::Status BulkImporter::FindParent(const model::QualifiedName& child_name,
+                                      const char* child_type,
+                                      NamespaceMap* known,
+                                      const model::Namespace** parent) const {
+  NamespaceMap::const_iterator found = known->find(child_name.name_space());
+  if (found != known->end()) {
+    *parent = &(found->second);
+    return grpc::Status::OK;
+  }
+  NamespaceRepository::Snapshot snapshot;
+  grpc::Status result = referential_service_->GetParentNamespace(
+      child_name, child_type, &snapshot);
+  if (result.ok()) {
+    model::Namespace& known_parent = (*known)[snapshot->entity.full_name()];
+    known_parent.CopyFrom(snapshot->entity);
+    *parent = &known_parent;
+  }
+  return result;
+}
+
+grpc::Status BulkImporter::Apply(const model::server::BulkImportItem& item,
+                                 AssociatedNamespace* associated) {
+  switch (item.item_case()) {
+    case model::server::BulkImportItem::kNameSpace:
+      return namespace_service_->CreateNamespace(
+          item.name_space().name_space(), item.name_space().description());
+    case model::server::BulkImportItem::kRepository: {
+      const model::server::CreateRepositoryRequest& request =
+          item.repository();
+      if (request.create_or_associate_namespace()) {
+        NamespaceRepository::Snapshot parent;
+        grpc::Status result = referential_service_->GetParentNamespace(
+            request.repository().name(), model::REPOSITORY, &parent);
+        if (!result.ok()) {
+          return result;
+        }
+        associated->full_name = parent->entity.full_name() +
+            parent->entity.separator() +
+            request.repository().name().name();
+        result = referential_service_->GetNamespaceAndDescription(
+            associated->full_name, &(associated->existing),
+            &(associated->existing_description));
+        if (result.error_code() == grpc::StatusCode::NOT_FOUND) {
+          associated->created = true;
+        } else if (!result.ok()) {
+          return result;
+        }
+      }
+      grpc::Status result = repository_service_->CreateRepository(
+          request.repository(), request.description(),
+          request.create_or_associate_namespace(),
+          request.namespace_separator());
+      if (!result.ok() && request.create_or_associate_namespace()) {
+        // The Namespace is associated before the Repository is added, so
+        // it may need putting back even though the item failed.
+        // TODO: Log Error if this fails.
+        RestoreNamespace(*associated);
+      }
+      return result;
+    }
+    case model::server::BulkImportItem::kDataset:
+      return dataset_service_->CreateDataset(item.dataset().dataset(),
+                                             item.dataset().description());
+    case model::server::BulkImportItem::ITEM_NOT_SET:
+      break;
+  }
+  return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                      "A bulk import item must hold a Namespace, a "
+                      "Repository or a Dataset.");
+}
+
+grpc::Status BulkImporter::Undo(const model::server::BulkImportItem& item,
+                                const AssociatedNamespace& associated) {
+  switch (item.item_case()) {
+    case model::server::BulkImportItem::kNameSpace:
+      return referential_service_->RemoveNamespace(
+          item.name_space().name_space().full_name());
+    case model::server::BulkImportItem::kRepository: {
+      // The associated Namespace may hold elements from before the import,
+      // so the Repository is removed with force, leaving the Namespace to
+      // RestoreNamespace.
+      const model::server::CreateRepositoryRequest& request =
+          item.repository();
+      grpc::Status result = repository_service_->RemoveRepository(
+          request.repository().name(), true, false);
+      if (!result.ok() || !request.create_or_associate_namespace()) {
+        return result;
+      }
+      return RestoreNamespace(associated);
+    }
+    case model::server::BulkImportItem::kDataset:
+      return dataset_service_->RemoveDataset(
+          item.dataset().dataset().physical_name());
+    case model::server::BulkImportItem::ITEM_NOT_SET:
+      break;
+  }
+  return grpc::Status::OK;
+}
+
+grpc::Status BulkImporter::RestoreNamespace(
+    const AssociatedNamespace& associated) {
+  if (associated.created) {
+    return referential_service_->RemoveNamespace(associated.full_name);
+  }
+  model::Namespace current;
+  model::Description current_description;
+  grpc::Status result = referential_service_->GetNamespaceAndDescription(
+      associated.full_name, &current, &current_description);
+  if (!result.ok()) {
+    return result;
+  }
+  // ReferentialService::AssociateNamespace only changes these.
+  if (current.is_repository_name() !=
+          associated.existing.is_repository_name() ||
+      current.separator() != associated.existing.separator()) {
+    result = referential_service_->RestoreNamespace(associated.existing);
+    if (!result.ok()) {
+      return result;
+    }
+  }
+  const model::Description& existing = associated.existing_description;
+  if (current_description.contents() != existing.contents()) {
+    return namespace_service_->UpsertNamespaceDescription(
+        associated.full_name, existing, existing.contents().empty());
+  }
+  return grpc::Status::OK;
+}
+
+} // namespace acumio
@@ -0,0 +1,103 @@
+#ifndef AcumioServer_bulk_importer_h
+#define AcumioServer_bulk_importer_h
+//============================================================================
+// Name        : bulk_importer.h
+// Author      : Bill Province (bill@acumio.com)
+// Version     :
+// Copyright   : Copyright (C) 2016 Acumio
+// Description : Imports chunks of Namespaces, Repositories and Datasets
+//               for the BulkImport API.
+//
+//               A chunk is checked before any of it is applied: every
+//               item's parent Namespace must either exist already or be
+//               created by an earlier item of the chunk. Each parent is
+//               looked up at most once per chunk, so a chunk of Datasets
+//               spread over a few Namespaces costs a few lookups rather
+//               than one per Dataset. The items are then applied in order.
+//               If one fails anyway (most often because it already
+//               exists), the items of the chunk that were applied are
+//               undone again, newest first, so that a chunk is imported
+//               either entirely or not at all. Undo only reverses what
+//               Apply did: a Namespace that existed before and was only
+//               associated with a new Repository is restored, not removed.
+//
+//               The repositories are not transactional, so the caller must
+//               keep other writers out while a chunk is imported.
+//============================================================================
+
+#include <grpc++/grpc++.h>
+#include <string>
+#include <unordered_map>
+#include "server.pb.h"
+#include <vector>
+#include "DatasetService.h"
+#include "NamespaceService.h"
+#include "RepositoryService.h"
+#include "referential_service.h"
+
+namespace acumio {
+
+class BulkImporter {
+ public:
+  // client retains ownership of pointers.
+  BulkImporter(ReferentialService* referential_service,
+               NamespaceService* namespace_service,
+               RepositoryService* repository_service,
+               DatasetService* dataset_service);
+  ~BulkImporter();
+
+  // Imports the items of chunk as a unit. On failure, nothing from chunk
+  // remains, and *failed_item is set to the index within chunk of the item
+  // responsible.
+  grpc::Status Import(const model::server::BulkImportRequest& chunk,
+                      int* failed_item);
+
+ private:
+  // The Namespaces known to the chunk being checked, by full name: those
+  // looked up as parents, and those the chunk creates.
+  typedef std::unordered_map<std::string, model::Namespace> NamespaceMap;
+
+  // What Apply did to the Namespace associated with a Repository item, so
+  // that Undo can put it back.
+  struct AssociatedNamespace {
+    AssociatedNamespace() : full_name(), created(false), existing(),
+                            existing_description() {}
+    std::string full_name;
+    // True if Apply created the Namespace; otherwise existing and
+    // existing_description hold it as it was before Apply.
+    bool created;
+    model::Namespace existing;
+    model::Description existing_description;
+  };
+
+  grpc::Status Check(const model::server::BulkImportItem& item,
+                     NamespaceMap* known) const;
+
+  // Finds the parent Namespace of child_name, preferring known to a lookup,
+  // and adding what it looks up to known. *parent is set to point into
+  // known, so each parent is copied once per chunk rather than per item.
+  grpc::Status FindParent(const model::QualifiedName& child_name,
+                          const char* child_type, NamespaceMap* known,
+                          const model::Namespace** parent) const;
+
+  // For Repository items with create_or_associate_namespace set, records
+  // the state of the associated Namespace in *associated first.
+  grpc::Status Apply(const model::server::BulkImportItem& item,
+                     AssociatedNamespace* associated);
+
+  // Reverses what Apply did for item.
+  grpc::Status Undo(const model::server::BulkImportItem& item,
+                    const AssociatedNamespace& associated);
+
+  // Puts back the Namespace that a Repository was associated with.
+  grpc::Status RestoreNamespace(const AssociatedNamespace& associated);
+
+  ReferentialService* referential_service_;
+  NamespaceService* namespace_service_;
+  RepositoryService* repository_service_;
+  DatasetService* dataset_service_;
+};
+
+} // namespace acumio
+
+#endif // AcumioServer_bulk_importer_h
@@ -0,0 +1,580 @@
+//============================================================================
+// Name        : checkpoint.cpp
+// Author      : Bill Province (bill@acumio.com)
+// Version     :
+// Copyright   : Copyright (C) 2016 Acumio
+// Description : Implementation of checkpoints.
+//============================================================================
+#include "checkpoint.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <sstream>
+
+#include "crc32c.h"
+#include "time_util.h"
+
+namespace acumio {
+
+const uint32_t CHECKPOINT_BLOCK_ENTRIES = 1024;
+
+namespace {
+const char CHECKPOINT_HEADER[] = "ACUMCKP1";
+const char CHECKPOINT_TRAILER_MAGIC[] = "ACUMCKPT";
+const size_t MAGIC_SIZE = 8;
+// Footer offset, log position, wall time, footer CRC, reserved, magic.
+const size_t TRAILER_SIZE = 8 + 8 + 8 + 4 + 4 + MAGIC_SIZE;
+
+// These values are written to the file; never renumber them.
+enum SectionKind {
+  NAMESPACES = 1,
+  REPOSITORIES = 2,
+  DATASETS = 3,
+  USERS = 4
+};
+
+void AppendFixed32(uint32_t value, std::string* out) {
+  for (int i = 0; i < 4; i++) {
+    out->push_back(static_cast<char>((value >> (8 * i)) & 0xFF));
+  }
+}
+
+void AppendFixed64(uint64_t value, std::string* out) {
+  for (int i = 0; i < 8; i++) {
+    out->push_back(static_cast<char>((value >> (8 * i)) & 0xFF));
+  }
+}
+
+void SetFixed32(uint32_t value, size_t position, std::string* out) {
+  for (int i = 0; i < 4; i++) {
+    (*out)[position + i] = static_cast<char>((value >> (8 * i)) & 0xFF);
+  }
+}
+
+uint64_t ReadFixed(const char* in, int bytes) {
+  uint64_t ret_val = 0;
+  for (int i = 0; i < bytes; i++) {
+    ret_val |= static_cast<uint64_t>(static_cast<uint8_t>(in[i])) << (8 * i);
+  }
+  return ret_val;
+}
+
+// Appends a length-prefixed message without computing its size up front.
+void AppendMessage(const google::protobuf::Message& message,
+                   std::string* out) {
+  size_t start = out->size();
+  AppendFixed32(0, out);
+  message.AppendToString(out);
+  SetFixed32(out->size() - start - 4, start, out);
+}
+
+void AppendString(const std::string& value, std::string* out) {
+  AppendFixed32(value.size(), out);
+  out->append(value);
+}
+
+template <class Entity>
+void AppendPayload(const model::Described<Entity>& element, std::string* out) {
+  AppendMessage(element.entity, out);
+  AppendMessage(element.description_history, out);
+}
+
+void AppendPayload(const model::MultiDescribed<model::Dataset>& element,
+                   std::string* out) {
+  AppendMessage(element.entity, out);
+  AppendMessage(element.history, out);
+}
+
+void AppendPayload(const FullUser& element, std::string* out) {
+  AppendMessage(element.user(), out);
+  AppendString(element.password(), out);
+  AppendString(element.salt(), out);
+}
+
+// Reads length-prefixed fields from mapped memory, without copying them
+// until asked to.
+class Reader {
+ public:
+  Reader(const char* data, size_t size) : next_(data), end_(data + size) {}
+
+  inline bool done() const { return next_ == end_; }
+
+  bool ReadFixed32(uint32_t* value) {
+    if (end_ - next_ < 4) {
+      return false;
+    }
+    *value = static_cast<uint32_t>(ReadFixed(next_, 4));
+    next_ += 4;
+    return true;
+  }
+
+  bool ReadBytes(uint32_t size, const char** bytes) {
+    if (static_cast<size_t>(end_ - next_) < size) {
+      return false;
+    }
+    *bytes = next_;
+    next_ += size;
+    return true;
+  }
+
+  bool ReadMessage(google::protobuf::Message* message) {
+    uint32_t size;
+    const char* bytes;
+    return ReadFixed32(&size) && ReadBytes(size, &bytes) &&
+           message->ParseFromArray(bytes, size);
+  }
+
+  bool ReadString(std::string* value) {
+    uint32_t size;
+    const char* bytes;
+    if (!ReadFixed32(&size) || !ReadBytes(size, &bytes)) {
+      return false;
+    }
+    value->assign(bytes, size);
+    return true;
+  }
+
+ private:
+  const char* next_;
+  const char* end_;
+};
+
+template <class Entity>
+bool ReadPayload(Reader* reader, model::Described<Entity>* element) {
+  return reader->ReadMessage(&(element->entity)) &&
+         reader->ReadMessage(&(element->description_history));
+}
+
+bool ReadPayload(Reader* reader,
+                 model::MultiDescribed<model::Dataset>* element) {
+  return reader->ReadMessage(&(element->entity)) &&
+         reader->ReadMessage(&(element->history));
+}
+
+bool ReadPayload(Reader* reader, FullUser* element) {
+  return reader->ReadMessage(element->mutable_user()) &&
+         reader->ReadString(element->mutable_password()) &&
+         reader->ReadString(element->mutable_salt());
+}
+
+inline grpc::Status LoadElements(
+    std::vector<model::DescribedNamespace>* elements,
+    const CheckpointCatalog& catalog) {
+  return catalog.namespaces->BulkLoad(elements);
+}
+
+inline grpc::Status LoadElements(
+    std::vector<model::DescribedRepository>* elements,
+    const CheckpointCatalog& catalog) {
+  return catalog.repositories->BulkLoad(elements);
+}
+
+inline grpc::Status LoadElements(
+    std::vector<model::MultiDescribed<model::Dataset>>* elements,
+    const CheckpointCatalog& catalog) {
+  return catalog.datasets->BulkLoad(elements);
+}
+
+inline grpc::Status LoadElements(std::vector<FullUser>* elements,
+                                 const CheckpointCatalog& catalog) {
+  return catalog.users->BulkLoad(elements);
+}
+
+grpc::Status IoError(const std::string& what, const std::string& path,
+                     int error_number) {
+  std::stringstream error;
+  error << "Unable to " << what << " checkpoint (\"" << path << "\"): "
+        << strerror(error_number);
+  return grpc::Status(grpc::StatusCode::INTERNAL, error.str());
+}
+
+grpc::Status Corrupt(const std::string& path, const std::string& what) {
+  std::stringstream error;
+  error << "The checkpoint (\"" << path << "\") is corrupt: " << what;
+  return grpc::Status(grpc::StatusCode::DATA_LOSS, error.str());
+}
+
+// Flushes the directory holding path, so that a rename into it survives a
+// crash.
+grpc::Status SyncDirectoryOf(const std::string& path) {
+  size_t slash = path.find_last_of('/');
+  std::string directory = slash == std::string::npos ? "." :
+      (slash == 0 ? "/" : path.substr(0, slash));
+  int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+  if (fd < 0) {
+    return IoError("open the directory of", path, errno);
+  }
+  int error_number = ::fsync(fd) == 0 ? 0 : errno;
+  ::close(fd);
+  if (error_number != 0) {
+    return IoError("flush the directory of", path, error_number);
+  }
+  return grpc::Status::OK;
+}
+
+// Writes to a file descriptor, keeping track of the offset. After the first
+// failure, further writes are ignored and error_number() reports why.
+class FileWriter {
+ public:
+  FileWriter(int fd) : fd_(fd), offset_(0), error_number_(0) {}
+
+  void Write(const std::string& data) {
+    size_t done = 0;
+    while (error_number_ == 0 && done < data.size()) {
+      ssize_t result = ::write(fd_, data.data() + done, data.size() - done);
+      if (result < 0) {
+        if (errno != EINTR) {
+          error_number_ = errno;
+        }
+        continue;
+      }
+      done += result;
+    }
+    offset_ += data.size();
+  }
+
+  inline uint64_t offset() const { return offset_; }
+  inline int error_number() const { return error_number_; }
+
+ private:
+  int fd_;
+  uint64_t offset_;
+  int error_number_;
+};
+
+template <class KeyedSnapshot>
+void WriteSection(SectionKind kind, const std::vector<KeyedSnapshot>& elements,
+                  FileWriter* writer, std::string* footer) {
+  uint32_t block_count = (elements.size() + CHECKPOINT_BLOCK_ENTRIES - 1) /
+                         CHECKPOINT_BLOCK_ENTRIES;
+  AppendFixed32(kind, footer);
+  AppendFixed32(block_count, footer);
+  AppendFixed64(elements.size(), footer);
+
+  const size_t block_entries = CHECKPOINT_BLOCK_ENTRIES;
+  std::string block;
+  for (size_t start = 0; start < elements.size(); start += block_entries) {
+    size_t end = std::min(elements.size(), start + block_entries);
+    block.clear();
+    for (size_t i = start; i < end; i++) {
+      const EncodedKey& key = elements[i].first;
+      size_t entry_start = block.size();
+      AppendFixed32(key.size(), &block);
+      AppendFixed32(0, &block);
+      block.append(key.data(), key.size());
+      size_t payload_start = block.size();
+      AppendPayload(*(elements[i].second), &block);
+      SetFixed32(block.size() - payload_start, entry_start + 4, &block);
+    }
+
+    const EncodedKey& first_key = elements[start].first;
+    AppendFixed64(writer->offset(), footer);
+    AppendFixed32(block.size(), footer);
+    AppendFixed32(end - start, footer);
+    AppendFixed32(Crc32c(block), footer);
+    AppendFixed32(first_key.size(), footer);
+    footer->append(first_key.data(), first_key.size());
+    writer->Write(block);
+  }
+}
+
+struct BlockIndex {
+  uint64_t offset;
+  uint32_t size;
+  uint32_t entry_count;
+  uint32_t crc;
+  const char* first_key;
+  uint32_t first_key_size;
+};
+
+// Parses and checks the elements of a section into *elements.
+template <class EltType>
+grpc::Status ParseSection(const std::string& path, const char* file,
+                          const std::vector<BlockIndex>& blocks,
+                          std::vector<EltType>* elements) {
+  std::string prior_key;
+  bool first = true;
+  for (const BlockIndex& block : blocks) {
+    const char* data = file + block.offset;
+    if (Crc32c(data, block.size) != block.crc) {
+      return Corrupt(path, "a block failed its checksum.");
+    }
+    Reader reader(data, block.size);
+    for (uint32_t i = 0; i < block.entry_count; i++) {
+      uint32_t key_size;
+      uint32_t payload_size;
+      const char* key;
+      const char* payload;
+      if (!reader.ReadFixed32(&key_size) ||
+          !reader.ReadFixed32(&payload_size) ||
+          !reader.ReadBytes(key_size, &key) ||
+          !reader.ReadBytes(payload_size, &payload)) {
+        return Corrupt(path, "an element runs past the end of its block.");
+      }
+      std::string current_key(key, key_size);
+      if (i == 0 && (key_size != block.first_key_size ||
+                     memcmp(key, block.first_key, key_size) != 0)) {
+        return Corrupt(path, "a block does not match its index entry.");
+      }
+      if (!first && !(prior_key < current_key)) {
+        return Corrupt(path, "the elements are out of order.");
+      }
+      first = false;
+      prior_key.swap(current_key);
+
+      elements->emplace_back();
+      Reader payload_reader(payload, payload_size);
+      if (!ReadPayload(&payload_reader, &(elements->back())) ||
+          !payload_reader.done()) {
+        return Corrupt(path, "unable to parse an element.");
+      }
+    }
+    if (!reader.done()) {
+      return Corrupt(path, "a block has more elements than its index says.");
+    }
+  }
+  return grpc::Status::OK;
+}
+
+// Unmaps and closes the file on the way out of RestoreCheckpoint.
+class MappedFile {
+ public:
+  MappedFile() : fd_(-1), data_(nullptr), size_(0) {}
+  ~MappedFile() {
+    if (data_ != nullptr) {
+      ::munmap(const_cast<char*>(data_), size_);
+    }
+    if (fd_ >= 0) {
+      ::close(fd_);
+    }
+  }
+
+  grpc::Status Map(const std::string& path) {
+    fd_ = ::open(path.c_str(), O_RDONLY);
+    if (fd_ < 0) {
+      return IoError("open", path, errno);
+    }
+    struct stat file_stat;
+    if (::fstat(fd_, &file_stat) != 0) {
+      return IoError("stat", path, errno);
+    }
+    size_ = file_stat.st_size;
+    if (size_ == 0) {
+      return grpc::Status::OK;
+    }
+    void* mapped = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+    if (mapped == MAP_FAILED) {
+      return IoError("map", path, errno);
+    }
+    data_ = static_cast<const char*>(mapped);
+    // We read each block once, front to back.
+    ::madvise(mapped, size_, MADV_SEQUENTIAL);
+    return grpc::Status::OK;
+  }
+
+  inline const char* data() const { return data_; }
+  inline size_t size() const { return size_; }
+
+ private:
+  int fd_;
+  const char* data_;
+  size_t size_;
+};
+} // anonymous namespace
+
+CheckpointView::CheckpointView(const CheckpointCatalog& catalog,
+                               uint64_t log_position) :
+    namespaces_(), repositories_(), datasets_(), users_(), catalog_(catalog),
+    sorted_(false), log_position_(log_position),
+    wall_nanos_(acumio::time::WallNanosSinceEpoch()) {
+  catalog.namespaces->GetSnapshots(&namespaces_);
+  catalog.repositories->GetSnapshots(&repositories_);
+  catalog.datasets->GetSnapshots(&datasets_);
+  catalog.users->GetSnapshots(&users_);
+}
+
+CheckpointView::~CheckpointView() {}
+
+grpc::Status CheckpointView::Write(const std::string& path) {
+  if (!sorted_) {
+    catalog_.namespaces->SortSnapshots(&namespaces_);
+    catalog_.repositories->SortSnapshots(&repositories_);
+    catalog_.datasets->SortSnapshots(&datasets_);
+    catalog_.users->SortSnapshots(&users_);
+    sorted_ = true;
+  }
+
+  std::string temp_path = path + ".tmp";
+  // The checkpoint holds every user's encrypted password and salt, so as
+  // with the write-ahead log, only the owner may read it. A stale
+  // temporary file keeps its old mode through O_TRUNC, hence the fchmod.
+  int fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0) {
+    return IoError("create", temp_path, errno);
+  }
+  if (::fchmod(fd, 0600) != 0) {
+    int error_number = errno;
+    ::close(fd);
+    ::unlink(temp_path.c_str());
+    return IoError("restrict access to", temp_path, error_number);
+  }
+
+  FileWriter writer(fd);
+  writer.Write(std::string(CHECKPOINT_HEADER, MAGIC_SIZE));
+  std::string footer;
+  WriteSection(NAMESPACES, namespaces_, &writer, &footer);
+  WriteSection(REPOSITORIES, repositories_, &writer, &footer);
+  WriteSection(DATASETS, datasets_, &writer, &footer);
+  WriteSection(USERS, users_, &writer, &footer);
+
+  std::string trailer;
+  AppendFixed64(writer.offset(), &trailer);
+  AppendFixed64(log_position_, &trailer);
+  AppendFixed64(wall_nanos_, &trailer);
+  AppendFixed32(Crc32c(footer), &trailer);
+  AppendFixed32(0, &trailer);
+  trailer.append(CHECKPOINT_TRAILER_MAGIC, MAGIC_SIZE);
+  writer.Write(footer);
+  writer.Write(trailer);
+
+  int error_number = writer.error_number();
+  bool ok = error_number == 0;
+  if (ok && ::fsync(fd) != 0) {
+    error_number = errno;
+    ok = false;
+  }
+  ::close(fd);
+  if (ok && ::rename(temp_path.c_str(), path.c_str()) != 0) {
+    error_number = errno;
+    ok = false;
+  }
+  if (!ok) {
+    ::unlink(temp_path.c_str());
+    return IoError("write", path, error_number);
+  }
+  return SyncDirectoryOf(path);
+}
+
+grpc::Status RestoreCheckpoint(const std::string& path,
+                               const CheckpointCatalog& catalog,
+                               uint64_t* log_position) {
+  MappedFile file;
+  grpc::Status result = file.Map(path);
+  if (!result.ok()) {
+    return result;
+  }
+  const char* data = file.data();
+  size_t size = file.size();
+  if (size < MAGIC_SIZE + TRAILER_SIZE ||
+      memcmp(data, CHECKPOINT_HEADER, MAGIC_SIZE) != 0) {
+    std::stringstream error;
+    error << "The file (\"" << path
+          << "\") is not a checkpoint, or has an unsupported version.";
+    return grpc::Status(grpc::StatusCode::FAILED_PRECONDITION, error.str());
+  }
+
+  const char* trailer = data + size - TRAILER_SIZE;
+  if (memcmp(trailer + TRAILER_SIZE - MAGIC_SIZE, CHECKPOINT_TRAILER_MAGIC,
+             MAGIC_SIZE) != 0) {
+    return Corrupt(path, "the file is incomplete.");
+  }
+  uint64_t footer_offset = ReadFixed(trailer, 8);
+  if (footer_offset < MAGIC_SIZE || footer_offset > size - TRAILER_SIZE) {
+    return Corrupt(path, "the footer offset is out of range.");
+  }
+  size_t footer_size = size - TRAILER_SIZE - footer_offset;
+  const char* footer = data + footer_offset;
+  if (Crc32c(footer, footer_size) !=
+      static_cast<uint32_t>(ReadFixed(trailer + 24, 4))) {
+    return Corrupt(path, "the footer failed its checksum.");
+  }
+
+  // Read the whole index before loading anything.
+  std::map<uint32_t, std::vector<BlockIndex>> sections;
+  Reader reader(footer, footer_size);
+  while (!reader.done()) {
+    uint32_t kind;
+    uint32_t block_count;
+    const char* entry_count;
+    if (!reader.ReadFixed32(&kind) || !reader.ReadFixed32(&block_count) ||
+        !reader.ReadBytes(8, &entry_count)) {
+      return Corrupt(path, "the footer is truncated.");
+    }
+    std::vector<BlockIndex>& blocks = sections[kind];
+    for (uint32_t i = 0; i < block_count; i++) {
+      BlockIndex block;
+      const char* offset;
+      if (!reader.ReadBytes(8, &offset) || !reader.ReadFixed32(&block.size) ||
+          !reader.ReadFixed32(&block.entry_count) ||
+          !reader.ReadFixed32(&block.crc) ||
+          !reader.ReadFixed32(&block.first_key_size) ||
+          !reader.ReadBytes(block.first_key_size, &block.first_key)) {
+        return Corrupt(path, "the footer is truncated.");
+      }
+      block.offset = ReadFixed(offset, 8);
+      if (block.offset < MAGIC_SIZE || block.offset > footer_offset ||
+          block.size > footer_offset - block.offset) {
+        return Corrupt(path, "a block is out of range.");
+      }
+      blocks.push_back(block);
+    }
+  }
+
+  // Likewise, check every section before loading any of them.
+  std::vector<model::DescribedNamespace> namespaces;
+  std::vector<model::DescribedRepository> repositories;
+  std::vector<model::MultiDescribed<model::Dataset>> datasets;
+  std::vector<FullUser> users;
+  result = ParseSection(path, data, sections[NAMESPACES], &namespaces);
+  if (result.ok()) {
+    result = ParseSection(path, data, sections[REPOSITORIES], &repositories);
+  }
+  if (result.ok()) {
+    result = ParseSection(path, data, sections[DATASETS], &datasets);
+  }
+  if (result.ok()) {
+    result = ParseSection(path, data, sections[USERS], &users);
+  }
+
+  if (!result.ok()) {
+    return result;
+  }
+
+  // The elements are in main key order, so the main indexes are built
+  // without sorting. A section can still fail to load (say, on a duplicate
+  // key), and a failed BulkLoad loads nothing, so on failure only the
+  // repositories loaded before it need to be emptied again.
+  result = LoadElements(&namespaces, catalog);
+  if (!result.ok()) {
+    return result;
+  }
+  result = LoadElements(&repositories, catalog);
+  if (!result.ok()) {
+    catalog.namespaces->Clear();
+    return result;
+  }
+  result = LoadElements(&datasets, catalog);
+  if (!result.ok()) {
+    catalog.repositories->Clear();
+    catalog.namespaces->Clear();
+    return result;
+  }
+  result = LoadElements(&users, catalog);
+  if (!result.ok()) {
+    catalog.datasets->Clear();
+    catalog.repositories->Clear();
+    catalog.namespaces->Clear();
+    return result;
+  }
+  *log_position = ReadFixed(trailer + 8, 8);
+  return grpc::Status::OK;
+}
+
+} // namespace acumio
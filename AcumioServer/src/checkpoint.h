@@ -0,0 +1,111 @@
+#ifndef AcumioServer_checkpoint_h
+#define AcumioServer_checkpoint_h
+//============================================================================
+// Name        : checkpoint.h
+// Author      : Bill Province (bill@acumio.com)
+// Version     :
+// Copyright   : Copyright (C) 2016 Acumio
+// Description : Checkpoints of the catalog repositories, so that a server
+//               can be restarted from a file rather than by having every
+//               client register everything again.
+//
+//               A checkpoint is taken in two steps. Constructing a
+//               CheckpointView copies out the snapshot pointers of every
+//               element (see MemRepository::GetSnapshots), which is quick,
+//               and is the only part that needs writers kept out to get a
+//               consistent view across the repositories. Writing the view
+//               to a file - keying and sorting the elements, then writing
+//               them - works from those immutable snapshots while writers
+//               carry on.
+//
+//               The file is laid out so that it can be mapped into memory
+//               and read in place:
+//                   header:  "ACUMCKP1"; the digit is the format version.
+//                   sections: one per repository, each a run of blocks of
+//                       up to CHECKPOINT_BLOCK_ENTRIES elements, in main key
+//                       order. Each element is:
+//                           4 bytes: key size
+//                           4 bytes: payload size
+//                           the EncodedKey of the element
+//                           the payload: the serialized element
+//                   footer:  for each section, its kind, its element count,
+//                       and for each of its blocks: the offset, size,
+//                       element count, CRC-32C and first key of the block.
+//                   trailer: the footer offset, the write-ahead log position
+//                       and wall time the view was taken at, the CRC-32C of
+//                       the footer, and "ACUMCKPT".
+//               All integers are little-endian.
+//
+//               A view is written to a temporary file that is only renamed
+//               into place once it is complete and flushed, and the
+//               directory is flushed after the rename, so the checkpoint
+//               file can be copied off as a backup at any time.
+//============================================================================
+
+#include <grpc++/support/status.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "dataset_repository.h"
+#include "namespace_repository.h"
+#include "repository_repository.h"
+#include "user_repository.h"
+
+namespace acumio {
+
+extern const uint32_t CHECKPOINT_BLOCK_ENTRIES;
+
+// The repositories a checkpoint covers.
+struct CheckpointCatalog {
+  NamespaceRepository* namespaces;
+  RepositoryRepository* repositories;
+  DatasetRepository* datasets;
+  UserRepository* users;
+};
+
+class CheckpointView {
+ public:
+  // Captures the current contents of the catalog. log_position is recorded
+  // in the checkpoint, so that a restore knows where in the write-ahead log
+  // to resume replay (see WriteAheadLog::end_position); pass 0 if there is
+  // no log.
+  CheckpointView(const CheckpointCatalog& catalog, uint64_t log_position);
+  ~CheckpointView();
+
+  // Sorts the captured elements by main key, if that has not been done
+  // already, and writes them to path.
+  grpc::Status Write(const std::string& path);
+
+  inline uint64_t log_position() const { return log_position_; }
+  inline size_t element_count() const {
+    return namespaces_.size() + repositories_.size() + datasets_.size() +
+           users_.size();
+  }
+
+ private:
+  std::vector<NamespaceRepository::KeyedSnapshot> namespaces_;
+  std::vector<RepositoryRepository::KeyedSnapshot> repositories_;
+  std::vector<DatasetRepository::KeyedSnapshot> datasets_;
+  std::vector<UserRepository::KeyedSnapshot> users_;
+  CheckpointCatalog catalog_;
+  bool sorted_;
+  uint64_t log_position_;
+  uint64_t wall_nanos_;
+};
+
+// Loads the checkpoint at path into the repositories of catalog, which
+// must be empty, and sets *log_position to the write-ahead log position
+// recorded with it. The file is mapped rather than read, and each block is
+// checked against its checksum before its elements are parsed. Every
+// section is parsed and checked before any repository is filled with
+// MemRepository::BulkLoad, and if a repository then fails to load, those
+// already loaded are cleared, so a corrupt checkpoint leaves them all
+// empty.
+grpc::Status RestoreCheckpoint(const std::string& path,
+                               const CheckpointCatalog& catalog,
+                               uint64_t* log_position);
+
+} // namespace acumio
+
+#endif // AcumioServer_checkpoint_h
@@ -26,9 +26,17 @@
 //               a.compare_string().compare(b.compare_string()) < 0.
 //               While this may limit our notion of "Comparable" the advantage
 //               is that we can put our Comparables into a Trie data structure.
+//
+//               Each Comparable can also append itself to an EncodedKey,
+//               whose memcmp order agrees with compare_to. The
+//               MemRepository orders its indexes by the encoded keys, so
+//               that lookups may be made with an EncodedKey built on the
+//               stack rather than with a heap-allocated Comparable.
 //============================================================================
 
+#include <stdint.h>
 #include <string>
+#include "encoded_key.h"
 
 namespace acumio {
 class Comparable {
@@ -38,6 +46,12 @@ class Comparable {
   virtual int compare_to(const Comparable& c) const = 0;
   virtual std::string to_string() const = 0;
   virtual const std::string& compare_string() const = 0;
+  virtual void append_encoded_key(EncodedKey* key) const = 0;
+  inline EncodedKey encoded_key() const {
+    EncodedKey ret_val;
+    append_encoded_key(&ret_val);
+    return ret_val;
+  }
   inline bool operator==(const Comparable& c) const {
     return compare_to(c) == 0;
   }
@@ -70,6 +84,9 @@ class StringComparable : public Comparable {
   inline std::string to_string() const { return value_; }
   inline const std::string& compare_string() const { return value_; }
   inline const std::string& value() const { return value_; }
+  inline void append_encoded_key(EncodedKey* key) const {
+    key->AppendString(value_);
+  }
  private:
   std::string value_;
 };
@@ -86,6 +103,9 @@ class StringPairComparable : public Comparable {
   }
   inline std::string to_string() const { return prefix_ + " " + suffix_; }
   inline const std::string& compare_string() const { return compare_string_; }
+  inline void append_encoded_key(EncodedKey* key) const {
+    key->AppendString(prefix_).AppendString(suffix_);
+  }
 
  private:
   std::string prefix_;
@@ -106,6 +126,9 @@ class Int32Comparable : public Comparable {
   }
   inline std::string to_string() const { return compare_string_; }
   inline const std::string& compare_string() const { return compare_string_; }
+  inline void append_encoded_key(EncodedKey* key) const {
+    key->AppendInt32(value_);
+  }
  private:
   int32_t value_;
   std::string compare_string_;
@@ -124,6 +147,9 @@ class Int64Comparable : public Comparable {
   }
   inline std::string to_string() const { return compare_string_; }
   inline const std::string& compare_string() const { return compare_string_; }
+  inline void append_encoded_key(EncodedKey* key) const {
+    key->AppendInt64(value_);
+  }
  private:
   int64_t value_;
   std::string compare_string_;
@@ -0,0 +1,44 @@
+//============================================================================
+// Name        : crc32c.cpp
+// Author      : Bill Province (bill@acumio.com)
+// Version     :
+// Copyright   : Copyright (C) 2016 Acumio
+// Description : Implementation of Crc32c.
+//============================================================================
+#include "crc32c.h"
+
+namespace acumio {
+
+namespace {
+// Reflected, one table lookup per byte.
+class Crc32cTable {
+ public:
+  Crc32cTable() {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t crc = i;
+      for (int bit = 0; bit < 8; bit++) {
+        crc = (crc & 1) ? (crc >> 1) ^ UINT32_C(0x82F63B78) : crc >> 1;
+      }
+      table_[i] = crc;
+    }
+  }
+
+  uint32_t Compute(const char* data, size_t size) const {
+    uint32_t crc = UINT32_C(0xFFFFFFFF);
+    for (size_t i = 0; i < size; i++) {
+      crc = table_[(crc ^ static_cast<uint8_t>(data[i])) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ UINT32_C(0xFFFFFFFF);
+  }
+
+ private:
+  uint32_t table_[256];
+};
+} // anonymous namespace
+
+uint32_t Crc32c(const char* data, size_t size) {
+  static const Crc32cTable table;
+  return table.Compute(data, size);
+}
+
+} // namespace acumio
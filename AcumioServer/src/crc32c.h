@@ -0,0 +1,26 @@
+#ifndef AcumioServer_crc32c_h
+#define AcumioServer_crc32c_h
+//============================================================================
+// Name        : crc32c.h
+// Author      : Bill Province (bill@acumio.com)
+// Version     :
+// Copyright   : Copyright (C) 2016 Acumio
+// Description : CRC-32C (Castagnoli) checksums, for detecting torn or
+//               corrupted data in the files we write.
+//============================================================================
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+namespace acumio {
+
+uint32_t Crc32c(const char* data, size_t size);
+
+inline uint32_t Crc32c(const std::string& data) {
+  return Crc32c(data.data(), data.size());
+}
+
+} // namespace acumio
+
+#endif // AcumioServer_crc32c_h
@@ -50,21 +50,28 @@ DatasetRepository::DatasetRepository() : repository_(nullptr) {
   std::vector<std::unique_ptr<_DatasetExtractor>> additional_extractors;
   additional_extractors.push_back(std::move(namespace_extractor));
   repository_.reset(new _Repository(std::move(main_extractor),
-                                    &additional_extractors));
+                                    &additional_extractors,
+                                    true));
 }
 
 DatasetRepository::~DatasetRepository() {}
 
 grpc::Status DatasetRepository::GetDataset(const model::QualifiedName& name,
                                            model::Dataset* elt) const {
-  std::unique_ptr<Comparable> key(
-      new StringPairComparable(name.name_space(), name.name()));
+  EncodedKey key = EncodedKey::ForStringPair(name.name_space(), name.name());
 
   // TODO: Translate NOT_FOUND results to present better error message.
   // See similar comment in NamespaceRepository::GetDescription.
   return repository_->GetEntity(key, elt);
 }
 
+grpc::Status DatasetRepository::GetDatasetSnapshot(
+    const model::QualifiedName& name,
+    Snapshot* snapshot) const {
+  EncodedKey key = EncodedKey::ForStringPair(name.name_space(), name.name());
+  return repository_->GetSnapshot(key, snapshot);
+}
+
 grpc::Status DatasetRepository::GetDescription(
     const model::QualifiedName& name,
     proto::ConstProtoIterator<std::string>& description_tags_begin,
@@ -73,8 +80,7 @@ grpc::Status DatasetRepository::GetDescription(
     proto::ConstProtoIterator<std::string>& history_tags_end,
     model::MultiDescription* description,
     model::MultiDescriptionHistory* history) const {
-  std::unique_ptr<Comparable> key(
-      new StringPairComparable(name.name_space(), name.name()));
+  EncodedKey key = EncodedKey::ForStringPair(name.name_space(), name.name());
   return repository_->GetDescription(
       key, description_tags_begin, description_tags_end, history_tags_begin,
       history_tags_end, description, history);
@@ -89,8 +95,7 @@ grpc::Status DatasetRepository::GetDatasetAndDescription(
     model::Dataset* elt,
     model::MultiDescription* description,
     model::MultiDescriptionHistory* history) const {
-  std::unique_ptr<Comparable> key(
-      new StringPairComparable(name.name_space(), name.name()));
+  EncodedKey key = EncodedKey::ForStringPair(name.name_space(), name.name());
 
   return repository_->GetEntityAndDescription(
       key, description_tags_begin, description_tags_end, history_tags_begin,
@@ -99,15 +104,13 @@ grpc::Status DatasetRepository::GetDatasetAndDescription(
 
 grpc::Status DatasetRepository::RemoveDataset(
     const model::QualifiedName& name) {
-  std::unique_ptr<Comparable> key(
-      new StringPairComparable(name.name_space(), name.name()));
+  EncodedKey key = EncodedKey::ForStringPair(name.name_space(), name.name());
   return repository_->Remove(key);
 }
 
 grpc::Status DatasetRepository::UpdateDataset(const model::QualifiedName& name,
                                               const model::Dataset& dataset) {
-  std::unique_ptr<Comparable> key(
-      new StringPairComparable(name.name_space(), name.name()));
+  EncodedKey key = EncodedKey::ForStringPair(name.name_space(), name.name());
   return repository_->Update(key, dataset);
 }
 
@@ -115,30 +118,27 @@ grpc::Status DatasetRepository::UpdateDatasetWithDescription(
     const model::QualifiedName& name,
     const model::Dataset& dataset,
     const MultiMutationInterface* description_update) {
-  std::unique_ptr<Comparable> key(
-      new StringPairComparable(name.name_space(), name.name()));
+  EncodedKey key = EncodedKey::ForStringPair(name.name_space(), name.name());
   return repository_->UpdateWithDescription(key, dataset, description_update);
 }
 
 grpc::Status DatasetRepository::UpdateDescription(
     const model::QualifiedName& name,
     const MultiMutationInterface* description_update) {
-  std::unique_ptr<Comparable> key(
-      new StringPairComparable(name.name_space(), name.name()));
+  EncodedKey key = EncodedKey::ForStringPair(name.name_space(), name.name());
   return repository_->UpdateDescription(key, description_update);
 }
 
 
 DatasetRepository::PrimaryIterator DatasetRepository::LowerBoundByFullName(
     const model::QualifiedName& name) const {
-  std::unique_ptr<Comparable> key(
-      new StringPairComparable(name.name_space(), name.name()));
+  EncodedKey key = EncodedKey::ForStringPair(name.name_space(), name.name());
   return repository_->LowerBound(key);
 }
 
 DatasetRepository::SecondaryIterator DatasetRepository::LowerBoundByNamespace(
     const std::string& name_space) const {
-  std::unique_ptr<Comparable> key(new StringComparable(name_space));
+  EncodedKey key = EncodedKey::ForString(name_space);
   return repository_->LowerBoundByIndex(key, 0);
 }
 
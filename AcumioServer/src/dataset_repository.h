@@ -24,18 +24,66 @@ class DatasetRepository {
   typedef mem_repository::MultiDescribedRepository<model::Dataset> _Repository;
   typedef _Repository::PrimaryIterator PrimaryIterator;
   typedef _Repository::SecondaryIterator SecondaryIterator;
+  typedef _Repository::KeyedSnapshot KeyedSnapshot;
+  typedef _Repository::Snapshot Snapshot;
 
   DatasetRepository();
   ~DatasetRepository();
 
+  inline uint32_t size() const { return repository_->size(); }
+
   inline grpc::Status Add(const model::Dataset& dataset,
                           const model::MultiDescription& description) {
     return repository_->Add(dataset, description);
   }
 
+  // See MemRepository::BulkLoad.
+  inline grpc::Status BulkLoad(
+      std::vector<model::MultiDescribed<model::Dataset>>* elts) {
+    return repository_->BulkLoad(elts);
+  }
+
+  // See MemRepository::Clear.
+  inline void Clear() {
+    repository_->Clear();
+  }
+
+  // See MemRepository::GetSortedSnapshots.
+  inline void GetSortedSnapshots(std::vector<KeyedSnapshot>* snapshots) const {
+    repository_->GetSortedSnapshots(snapshots);
+  }
+
+  // See MemRepository::GetSnapshots.
+  inline void GetSnapshots(std::vector<KeyedSnapshot>* snapshots) const {
+    repository_->GetSnapshots(snapshots);
+  }
+
+  // See MemRepository::SortSnapshots.
+  inline void SortSnapshots(std::vector<KeyedSnapshot>* snapshots) const {
+    repository_->SortSnapshots(snapshots);
+  }
+
   grpc::Status GetDataset(const model::QualifiedName& name,
                           model::Dataset* elt) const;
 
+  // See MultiDescribedRepository::GetSnapshot.
+  grpc::Status GetDatasetSnapshot(const model::QualifiedName& name,
+                                  Snapshot* snapshot) const;
+
+  // See MultiDescribedRepository::GetSnapshotDescription.
+  inline grpc::Status GetSnapshotDescription(
+      const Snapshot& snapshot,
+      proto::ConstProtoIterator<std::string>& description_tags_begin,
+      proto::ConstProtoIterator<std::string>& description_tags_end,
+      proto::ConstProtoIterator<std::string>& history_tags_begin,
+      proto::ConstProtoIterator<std::string>& history_tags_end,
+      model::MultiDescription* description,
+      model::MultiDescriptionHistory* history) const {
+    return repository_->GetSnapshotDescription(
+        snapshot, description_tags_begin, description_tags_end,
+        history_tags_begin, history_tags_end, description, history);
+  }
+
   grpc::Status GetDescription(
       const model::QualifiedName& name,
       proto::ConstProtoIterator<std::string>& description_tags_begin,
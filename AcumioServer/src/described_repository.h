@@ -7,11 +7,15 @@
 // Copyright   : Copyright (C) 2016 Acumio
 // Description : Provides templated multi-threaded access to an in-memory
 //               repository for an entity that is paired with a
-//               DescriptionHistory.
+//               DescriptionHistory. The history is stored compressed
+//               (see description_deltas.h), and only expanded when asked
+//               for.
 //============================================================================
 
 #include "comparable.h"
+#include "encoded_key.h"
 #include "description.pb.h"
+#include "description_deltas.h"
 #include "mem_repository.h"
 #include "time_util.h"
 
@@ -57,9 +61,13 @@ class DescribedRepository {
   typedef MemRepository<acumio::model::Described<Entity>> _Repository;
   typedef typename _Repository::PrimaryIterator PrimaryIterator;
   typedef typename _Repository::SecondaryIterator SecondaryIterator;
+  typedef typename _Repository::EltConstPtr Snapshot;
+  typedef typename _Repository::KeyedSnapshot KeyedSnapshot;
 
+  // See MemRepository for hash_point_lookups.
   DescribedRepository(std::unique_ptr<Delegate> main_extractor,
-                      std::vector<std::unique_ptr<Delegate>>* extractors) {
+                      std::vector<std::unique_ptr<Delegate>>* extractors,
+                      bool hash_point_lookups = false) {
     std::unique_ptr<Extractor> described_main_extractor(
         new Extractor(std::move(main_extractor)));
     std::vector<std::unique_ptr<_BaseExtractor>> described_extractors;
@@ -70,7 +78,8 @@ class DescribedRepository {
       described_extractors.push_back(std::move(current));
     }
     repository_.reset(new _Repository(std::move(described_main_extractor),
-                                      &described_extractors));
+                                      &described_extractors,
+                                      hash_point_lookups));
   }
 
   ~DescribedRepository() {}
@@ -89,11 +98,55 @@ class DescribedRepository {
 
   inline uint32_t size() const { return repository_->size(); }
 
-  inline grpc::Status Add(const acumio::model::Described<Entity>& e) {
-    return repository_->Add(e);
+  grpc::Status Add(const acumio::model::Described<Entity>& e) {
+    if (e.description_history.version_size() < 2) {
+      return repository_->Add(e);
+    }
+    acumio::model::Described<Entity> compressed(e);
+    CompressHistory(&(compressed.description_history));
+    return repository_->Add(compressed);
+  }
+
+  // See MemRepository::BulkLoad.
+  grpc::Status BulkLoad(std::vector<acumio::model::Described<Entity>>* elts) {
+    for (acumio::model::Described<Entity>& elt : *elts) {
+      CompressHistory(&(elt.description_history));
+    }
+    return repository_->BulkLoad(elts);
+  }
+
+  // See MemRepository::Clear.
+  void Clear() {
+    repository_->Clear();
+  }
+
+  // See MemRepository::GetSortedSnapshots.
+  inline void GetSortedSnapshots(std::vector<KeyedSnapshot>* snapshots) const {
+    repository_->GetSortedSnapshots(snapshots);
+  }
+
+  // See MemRepository::GetSnapshots.
+  inline void GetSnapshots(std::vector<KeyedSnapshot>* snapshots) const {
+    repository_->GetSnapshots(snapshots);
+  }
+
+  // See MemRepository::SortSnapshots.
+  inline void SortSnapshots(std::vector<KeyedSnapshot>* snapshots) const {
+    repository_->SortSnapshots(snapshots);
+  }
+
+  // Shares the stored entity and its descriptions rather than copying
+  // them out; the snapshot does not change if the entity is updated.
+  // Note that the snapshot's history is compressed; use ExpandHistory
+  // to read its older versions.
+  grpc::Status GetSnapshot(const EncodedKey& key, Snapshot* snapshot) const {
+    typename _Repository::StatusEltConstPtrPair getResult =
+        repository_->NonMutableGet(key);
+    snapshot->swap(getResult.second);
+    return getResult.first;
   }
 
-  grpc::Status GetEntity(const std::unique_ptr<Comparable>& key,
+  grpc::Status GetEntity(const EncodedKey& key,
                          Entity* entity) const {
     typename _Repository::StatusEltConstPtrPair getResult =
         repository_->NonMutableGet(key);
@@ -105,7 +158,7 @@ class DescribedRepository {
     return grpc::Status::OK;
   }
 
-  grpc::Status GetDescription(const std::unique_ptr<Comparable>& key,
+  grpc::Status GetDescription(const EncodedKey& key,
                               acumio::model::Description* description) const {
     typename _Repository::StatusEltConstPtrPair getResult =
         repository_->NonMutableGet(key);
@@ -127,7 +180,7 @@ class DescribedRepository {
   }
 
   grpc::Status GetDescriptionHistory(
-      const std::unique_ptr<Comparable>& key,
+      const EncodedKey& key,
       acumio::model::DescriptionHistory* history ) const {
     typename _Repository::StatusEltConstPtrPair getResult =
         repository_->NonMutableGet(key);
@@ -135,12 +188,12 @@ class DescribedRepository {
       return getResult.first;
     }
 
-    history->CopyFrom(getResult.second->description_history);
+    ExpandHistory(getResult.second->description_history, history);
     return grpc::Status::OK;
   }
 
   grpc::Status GetEntityAndDescription(
-      const std::unique_ptr<Comparable>& key,
+      const EncodedKey& key,
       Entity* entity,
       acumio::model::Description* description) const {
     typename _Repository::StatusEltConstPtrPair getResult =
@@ -164,7 +217,7 @@ class DescribedRepository {
   }
 
   grpc::Status GetEntityAndDescriptionHistory(
-      const std::unique_ptr<Comparable>& key,
+      const EncodedKey& key,
       Entity* entity,
       acumio::model::DescriptionHistory* history) const {
     typename _Repository::StatusEltConstPtrPair getResult =
@@ -174,7 +227,7 @@ class DescribedRepository {
     }
 
     entity->CopyFrom(getResult.second->entity);
-    history->CopyFrom(getResult.second->description_history);
+    ExpandHistory(getResult.second->description_history, history);
     return grpc::Status::OK;
   }
 
@@ -185,6 +238,7 @@ class DescribedRepository {
     acumio::model::Description* new_desc =
        elt.description_history.add_version();
     new_desc->CopyFrom(desc);
+    new_desc->clear_contents_delta();
     if (!new_desc->has_edit_time() || new_desc->edit_time().seconds() == 0) {
       acumio::time::SetTimestampToNow(new_desc->mutable_edit_time());
     }
@@ -202,16 +256,16 @@ class DescribedRepository {
   // main_extractor used in the interface. In other words, given
   // an Entity e, and the main_extractor then main_extractor.GetKey(e)
   // could feasibly match the parameter key in this method
-  inline grpc::Status Remove(const std::unique_ptr<Comparable>& key) {
+  inline grpc::Status Remove(const EncodedKey& key) {
     return repository_->Remove(key);
   }
 
   grpc::Status UpdateNoDescription(
-      const std::unique_ptr<Comparable>& key, const Entity& new_value) {
+      const EncodedKey& key, const Entity& new_value) {
     EntityMutator mutator(new_value);
     
-    std::unique_ptr<Comparable> updated_key =
-        main_extractor().delegate().GetKey(new_value);
+    EncodedKey updated_key =
+        main_extractor().delegate().GetKey(new_value)->encoded_key();
     return repository_->ApplyMutation(
         key,
         updated_key,
@@ -219,38 +273,38 @@ class DescribedRepository {
                      acumio::model::Described<Entity>>*>(&mutator));
   }
 
-  grpc::Status ClearDescription(const std::unique_ptr<Comparable>& key) {
+  grpc::Status ClearDescription(const EncodedKey& key) {
     ClearDescriptionMutator mutator;
     return repository_->ApplyMutation(key, key, &mutator);
   }
 
   grpc::Status UpdateDescriptionOnly(
-      const std::unique_ptr<Comparable>& key,
+      const EncodedKey& key,
       const acumio::model::Description& description) {
     DescriptionMutator mutator(description);
     return repository_->ApplyMutation(key, key, &mutator);
   }
 
   grpc::Status UpdateAndClearDescription(
-      const std::unique_ptr<Comparable>& key, const Entity& new_value) {
+      const EncodedKey& key, const Entity& new_value) {
     UpdaterWithClearDescription mutator(new_value);
-    std::unique_ptr<Comparable> updated_key =
-        main_extractor().delegate().GetKey(new_value);
+    EncodedKey updated_key =
+        main_extractor().delegate().GetKey(new_value)->encoded_key();
     return repository_->ApplyMutation(key, updated_key, &mutator);
   }
 
   grpc::Status UpdateWithDescription(
-      const std::unique_ptr<Comparable>& key,
+      const EncodedKey& key,
       const Entity& new_value,
       const acumio::model::Description& description) {
     EntityAndDescriptionMutator mutator(new_value, description);
-    std::unique_ptr<Comparable> updated_key =
-        main_extractor().delegate().GetKey(new_value);
+    EncodedKey updated_key =
+        main_extractor().delegate().GetKey(new_value)->encoded_key();
     return repository_->ApplyMutation(key, updated_key, &mutator);
   }
 
   inline PrimaryIterator LowerBound(
-      const std::unique_ptr<Comparable>& key) const {
+      const EncodedKey& key) const {
     return repository_->LowerBound(key);
   }
 
@@ -263,7 +317,7 @@ class DescribedRepository {
   }
 
   inline SecondaryIterator LowerBoundByIndex(
-      const std::unique_ptr<Comparable>& key, int index_number) const {
+      const EncodedKey& key, int index_number) const {
     return repository_->LowerBoundByIndex(key, index_number);
   }
 
@@ -310,9 +364,11 @@ class DescribedRepository {
 
       acumio::model::Description* update = history->add_version();
       update->CopyFrom(new_description_);
+      update->clear_contents_delta();
       if (!update->has_edit_time() || update->edit_time().seconds() == 0) {
         acumio::time::SetTimestampToNow(update->mutable_edit_time());
       }
+      CompressHistory(history);
       // TODO: edit user information. Need to wait until we are properly
       // getting a user identity. User information would need to come
       // with the constructor to this mutator, hence a parameter of
@@ -344,6 +400,7 @@ class DescribedRepository {
 
       acumio::model::Description* update = history->add_version();
       acumio::time::SetTimestampToNow(update->mutable_edit_time());
+      CompressHistory(history);
       // TODO: edit user information. Need to wait until we are properly
       // getting a user identity. User information would need to come
       // with the constructor to this mutator, hence a parameter of
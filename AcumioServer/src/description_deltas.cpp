@@ -0,0 +1,144 @@
+//============================================================================
+// Name        : description_deltas.cpp
+// Author      : Bill Province (bill@acumio.com)
+// Version     :
+// Copyright   : Copyright (C) 2016 Acumio
+// Description : Compact storage for description histories.
+//============================================================================
+
+#include "description_deltas.h"
+
+#include <algorithm>
+#include <stdint.h>
+
+namespace acumio {
+
+const int DESCRIPTION_KEYFRAME_INTERVAL = 16;
+
+namespace {
+
+void AppendVarint(size_t value, std::string* out) {
+  while (value >= 0x80) {
+    out->push_back(static_cast<char>((value & 0x7F) | 0x80));
+    value >>= 7;
+  }
+  out->push_back(static_cast<char>(value));
+}
+
+size_t ReadVarint(const std::string& in, size_t* position) {
+  size_t ret_val = 0;
+  int shift = 0;
+  while (*position < in.size()) {
+    uint8_t byte = static_cast<uint8_t>(in[(*position)++]);
+    ret_val |= static_cast<size_t>(byte & 0x7F) << shift;
+    if ((byte & 0x80) == 0) {
+      break;
+    }
+    shift += 7;
+  }
+  return ret_val;
+}
+
+// The delta is never empty, which is how we tell an encoded version from
+// one kept in full.
+std::string EncodeDelta(const std::string& older, const std::string& newer) {
+  size_t shared_limit = std::min(older.size(), newer.size());
+  size_t prefix = 0;
+  while (prefix < shared_limit && older[prefix] == newer[prefix]) {
+    prefix++;
+  }
+  size_t suffix = 0;
+  while (suffix < shared_limit - prefix &&
+         older[older.size() - 1 - suffix] == newer[newer.size() - 1 - suffix]) {
+    suffix++;
+  }
+  std::string ret_val;
+  AppendVarint(prefix, &ret_val);
+  AppendVarint(suffix, &ret_val);
+  ret_val.append(older, prefix, older.size() - prefix - suffix);
+  return ret_val;
+}
+
+void ApplyDelta(const std::string& newer, const std::string& delta,
+                std::string* older) {
+  size_t position = 0;
+  size_t prefix = ReadVarint(delta, &position);
+  size_t suffix = ReadVarint(delta, &position);
+  older->assign(newer, 0, prefix);
+  older->append(delta, position, std::string::npos);
+  older->append(newer, newer.size() - suffix, suffix);
+}
+
+inline bool IsEncoded(const model::Description& version) {
+  return !version.contents_delta().empty();
+}
+
+inline bool IsKeyframe(int version) {
+  return version % DESCRIPTION_KEYFRAME_INTERVAL == 0;
+}
+
+} // anonymous namespace
+
+void CompressHistory(model::DescriptionHistory* history) {
+  int newest = history->version_size() - 1;
+  if (newest < 1) {
+    return;
+  }
+
+  std::string newer = history->version(newest).contents();
+  std::string contents;
+  for (int i = newest - 1; i >= 0; i--) {
+    model::Description* version = history->mutable_version(i);
+    if (IsEncoded(*version)) {
+      break;
+    }
+    contents = version->contents();
+    if (!IsKeyframe(i)) {
+      version->set_contents_delta(EncodeDelta(contents, newer));
+      version->clear_contents();
+    }
+    newer.swap(contents);
+  }
+}
+
+void CompressHistory(model::MultiDescriptionHistory* history) {
+  auto history_map = history->mutable_history();
+  for (auto it = history_map->begin(); it != history_map->end(); it++) {
+    CompressHistory(&(it->second));
+  }
+}
+
+void ExpandHistory(const model::DescriptionHistory& stored,
+                   model::DescriptionHistory* target) {
+  target->CopyFrom(stored);
+  std::string newer;
+  std::string older;
+  for (int i = target->version_size() - 1; i >= 0; i--) {
+    model::Description* version = target->mutable_version(i);
+    if (IsEncoded(*version)) {
+      ApplyDelta(newer, version->contents_delta(), &older);
+      version->clear_contents_delta();
+      version->set_contents(older);
+      newer.swap(older);
+    } else {
+      newer = version->contents();
+    }
+  }
+}
+
+void ExpandContents(const model::DescriptionHistory& stored, int version,
+                    std::string* contents) {
+  int start = version;
+  while (start < stored.version_size() - 1 &&
+         IsEncoded(stored.version(start))) {
+    start++;
+  }
+  *contents = stored.version(start).contents();
+  std::string older;
+  for (int i = start - 1; i >= version; i--) {
+    ApplyDelta(*contents, stored.version(i).contents_delta(), &older);
+    contents->swap(older);
+  }
+}
+
+} // namespace acumio
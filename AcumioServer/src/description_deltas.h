@@ -0,0 +1,56 @@
+#ifndef AcumioServer_description_deltas_h
+#define AcumioServer_description_deltas_h
+//============================================================================
+// Name        : description_deltas.h
+// Author      : Bill Province (bill@acumio.com)
+// Version     :
+// Copyright   : Copyright (C) 2016 Acumio
+// Description : Compact storage for description histories. A wiki-style
+//               description is typically edited many times, each edit
+//               changing a small part of a long text, so keeping every
+//               version in full grows quadratically with the number of
+//               edits.
+//
+//               In a compressed history, the newest version is kept in
+//               full, and each older version keeps its contents as a delta
+//               against the version after it: the length of the prefix and
+//               suffix the two share, followed by the text between them.
+//               Every DESCRIPTION_KEYFRAME_INTERVAL versions, a version is
+//               kept in full as a keyframe, which bounds the deltas needed
+//               to rebuild any single version. Only the contents are
+//               delta-encoded; the other fields of each version are small.
+//
+//               Since the newest version is always whole, reading the
+//               current description needs no decoding at all; a history is
+//               only expanded when it is actually asked for.
+//============================================================================
+
+#include <string>
+#include "description.pb.h"
+
+namespace acumio {
+
+extern const int DESCRIPTION_KEYFRAME_INTERVAL;
+
+// Delta-encodes the versions of history that are not yet encoded. Versions
+// are only ever appended to a history, so this just walks back from the
+// newest version to the first one that is already encoded; calling it after
+// each change keeps the cost proportional to the versions added.
+void CompressHistory(model::DescriptionHistory* history);
+
+// As above, for each of the tagged histories.
+void CompressHistory(model::MultiDescriptionHistory* history);
+
+// Sets *target to the given compressed history with all of its versions
+// in full.
+void ExpandHistory(const model::DescriptionHistory& stored,
+                   model::DescriptionHistory* target);
+
+// Sets *contents to the full contents of the given version of a compressed
+// history.
+void ExpandContents(const model::DescriptionHistory& stored, int version,
+                    std::string* contents);
+
+} // namespace acumio
+
+#endif // AcumioServer_description_deltas_h
@@ -0,0 +1,202 @@
+//============================================================================
+// Name        : encoded_key.cpp
+// Author      : Bill Province (bill@acumio.com)
+// Version     :
+// Copyright   : Copyright (C) 2016 Acumio
+// Description : Implementation of EncodedKey.
+//============================================================================
+#include "encoded_key.h"
+
+namespace acumio {
+
+const uint32_t EncodedKey::INLINE_CAPACITY;
+const char EncodedKey::ESCAPE;
+const char EncodedKey::ESCAPED_NUL;
+const char EncodedKey::TERMINATOR;
+
+EncodedKey::EncodedKey(const EncodedKey& other) : data_(inline_), size_(0),
+    capacity_(INLINE_CAPACITY) {
+  Reserve(other.size_);
+  memcpy(data_, other.data_, other.size_);
+  size_ = other.size_;
+}
+
+EncodedKey::EncodedKey(EncodedKey&& other) : data_(inline_),
+    size_(other.size_), capacity_(INLINE_CAPACITY) {
+  if (other.data_ == other.inline_) {
+    memcpy(inline_, other.inline_, other.size_);
+  } else {
+    // Take over the heap buffer.
+    data_ = other.data_;
+    capacity_ = other.capacity_;
+    other.data_ = other.inline_;
+    other.capacity_ = INLINE_CAPACITY;
+  }
+  other.size_ = 0;
+}
+
+EncodedKey::~EncodedKey() {
+  if (data_ != inline_) {
+    delete[] data_;
+  }
+}
+
+EncodedKey& EncodedKey::operator=(const EncodedKey& other) {
+  if (this != &other) {
+    size_ = 0;
+    Reserve(other.size_);
+    memcpy(data_, other.data_, other.size_);
+    size_ = other.size_;
+  }
+  return *this;
+}
+
+EncodedKey& EncodedKey::operator=(EncodedKey&& other) {
+  if (this == &other) {
+    return *this;
+  }
+  if (other.data_ == other.inline_) {
+    // Nothing to steal; an ordinary copy keeps whatever buffer we have.
+    return *this = static_cast<const EncodedKey&>(other);
+  }
+  if (data_ != inline_) {
+    delete[] data_;
+  }
+  data_ = other.data_;
+  size_ = other.size_;
+  capacity_ = other.capacity_;
+  other.data_ = other.inline_;
+  other.size_ = 0;
+  other.capacity_ = INLINE_CAPACITY;
+  return *this;
+}
+
+EncodedKey EncodedKey::ForString(const std::string& value) {
+  EncodedKey ret_val;
+  ret_val.AppendString(value);
+  return ret_val;
+}
+
+EncodedKey EncodedKey::ForStringPair(const std::string& prefix,
+                                     const std::string& suffix) {
+  EncodedKey ret_val;
+  ret_val.AppendString(prefix).AppendString(suffix);
+  return ret_val;
+}
+
+EncodedKey& EncodedKey::AppendString(const char* value, size_t length) {
+  // In the worst case, every byte is escaped.
+  Reserve(1 + 2 * length + 2);
+  data_[size_++] = STRING_TAG;
+  const char* end = value + length;
+  while (value < end) {
+    const char* nul = static_cast<const char*>(memchr(value, '\0',
+                                                      end - value));
+    size_t run = (nul == nullptr ? end : nul) - value;
+    memcpy(data_ + size_, value, run);
+    size_ += run;
+    value += run;
+    if (nul != nullptr) {
+      data_[size_++] = ESCAPE;
+      data_[size_++] = ESCAPED_NUL;
+      value++;
+    }
+  }
+  data_[size_++] = ESCAPE;
+  data_[size_++] = TERMINATOR;
+  return *this;
+}
+
+EncodedKey& EncodedKey::AppendInt32(int32_t value) {
+  Reserve(1 + sizeof(value));
+  data_[size_++] = INT32_TAG;
+  AppendBigEndian(static_cast<uint32_t>(value) ^ UINT32_C(0x80000000), 4);
+  return *this;
+}
+
+EncodedKey& EncodedKey::AppendInt64(int64_t value) {
+  Reserve(1 + sizeof(value));
+  data_[size_++] = INT64_TAG;
+  AppendBigEndian(static_cast<uint64_t>(value) ^
+                  UINT64_C(0x8000000000000000), 8);
+  return *this;
+}
+
+EncodedKey& EncodedKey::AppendUint64(uint64_t value) {
+  Reserve(1 + sizeof(value));
+  data_[size_++] = UINT64_TAG;
+  AppendBigEndian(value, 8);
+  return *this;
+}
+
+std::string EncodedKey::to_string() const {
+  std::string ret_val;
+  uint32_t position = 0;
+  while (position < size_) {
+    if (position > 0) {
+      ret_val.push_back(' ');
+    }
+    uint8_t tag = static_cast<uint8_t>(data_[position++]);
+    switch (tag) {
+      case STRING_TAG:
+        while (position + 1 < size_ &&
+               !(data_[position] == ESCAPE &&
+                 data_[position + 1] == TERMINATOR)) {
+          if (data_[position] == ESCAPE) {
+            ret_val.push_back('\0');
+            position += 2;
+          } else {
+            ret_val.push_back(data_[position++]);
+          }
+        }
+        position += 2;
+        break;
+      case INT32_TAG:
+        ret_val.append(std::to_string(static_cast<int32_t>(
+            ReadBigEndian(&position, 4) ^ UINT32_C(0x80000000))));
+        break;
+      case INT64_TAG:
+        ret_val.append(std::to_string(static_cast<int64_t>(
+            ReadBigEndian(&position, 8) ^ UINT64_C(0x8000000000000000))));
+        break;
+      case UINT64_TAG:
+        ret_val.append(std::to_string(ReadBigEndian(&position, 8)));
+        break;
+      default:
+        // Not one of our encodings; stop rather than misread it.
+        ret_val.append("<malformed>");
+        return ret_val;
+    }
+  }
+  return ret_val;
+}
+
+void EncodedKey::Grow(uint32_t needed) {
+  uint32_t new_capacity = 2 * capacity_;
+  if (new_capacity < needed) {
+    new_capacity = needed;
+  }
+  char* new_data = new char[new_capacity];
+  memcpy(new_data, data_, size_);
+  if (data_ != inline_) {
+    delete[] data_;
+  }
+  data_ = new_data;
+  capacity_ = new_capacity;
+}
+
+void EncodedKey::AppendBigEndian(uint64_t value, int bytes) {
+  for (int shift = 8 * (bytes - 1); shift >= 0; shift -= 8) {
+    data_[size_++] = static_cast<char>((value >> shift) & 0xFF);
+  }
+}
+
+uint64_t EncodedKey::ReadBigEndian(uint32_t* position, int bytes) const {
+  uint64_t ret_val = 0;
+  for (int i = 0; i < bytes && *position < size_; i++) {
+    ret_val = (ret_val << 8) | static_cast<uint8_t>(data_[(*position)++]);
+  }
+  return ret_val;
+}
+
+} // namespace acumio
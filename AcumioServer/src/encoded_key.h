@@ -0,0 +1,136 @@
+#ifndef AcumioServer_encoded_key_h
+#define AcumioServer_encoded_key_h
+//============================================================================
+// Name        : encoded_key.h
+// Author      : Bill Province (bill@acumio.com)
+// Version     :
+// Copyright   : Copyright (C) 2016 Acumio
+// Description : An order-preserving binary key encoding. An EncodedKey is
+//               a tuple of components (strings and integers) encoded so
+//               that comparing two keys with a single memcmp gives the
+//               same answer as comparing their tuples component by
+//               component. Unlike a Comparable, an EncodedKey is a plain
+//               value type: it has no virtual methods, and keys of up to
+//               INLINE_CAPACITY bytes live entirely on the stack, so that
+//               building a key for a lookup needs no heap allocation.
+//
+//               Each component begins with a one-byte tag naming its type
+//               (so that to_string() can decode it), followed by:
+//                 strings:  the bytes of the string, with each 0x00 byte
+//                           escaped as 0x00 0xFF, terminated by 0x00 0x01.
+//                           The terminator sorts before any escaped or
+//                           ordinary byte, so a string sorts before every
+//                           string it is a proper prefix of.
+//                 integers: big-endian, with the sign bit flipped for
+//                           signed types, so that negative values sort
+//                           before positive ones.
+//
+//               Usage:
+//                 EncodedKey key;
+//                 key.AppendString(name.name_space()).AppendString(
+//                     name.name());
+//                 repository->Get(key, &elt);
+//============================================================================
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+namespace acumio {
+
+class EncodedKey {
+ public:
+  static const uint32_t INLINE_CAPACITY = 56;
+
+  EncodedKey() : data_(inline_), size_(0), capacity_(INLINE_CAPACITY) {}
+  EncodedKey(const EncodedKey& other);
+  EncodedKey(EncodedKey&& other);
+  ~EncodedKey();
+
+  EncodedKey& operator=(const EncodedKey& other);
+  EncodedKey& operator=(EncodedKey&& other);
+
+  // Convenience constructors for our most common keys.
+  static EncodedKey ForString(const std::string& value);
+  static EncodedKey ForStringPair(const std::string& prefix,
+                                  const std::string& suffix);
+
+  // Each Append adds one component to the end of the tuple.
+  EncodedKey& AppendString(const char* value, size_t length);
+  inline EncodedKey& AppendString(const std::string& value) {
+    return AppendString(value.data(), value.size());
+  }
+  EncodedKey& AppendInt32(int32_t value);
+  EncodedKey& AppendInt64(int64_t value);
+  EncodedKey& AppendUint64(uint64_t value);
+
+  inline const char* data() const { return data_; }
+  inline uint32_t size() const { return size_; }
+  inline bool empty() const { return size_ == 0; }
+  inline void clear() { size_ = 0; }
+
+  inline int compare(const EncodedKey& other) const {
+    uint32_t common = size_ < other.size_ ? size_ : other.size_;
+    int ret_val = memcmp(data_, other.data_, common);
+    if (ret_val != 0) {
+      return ret_val;
+    }
+    return size_ < other.size_ ? -1 : (size_ > other.size_ ? 1 : 0);
+  }
+
+  inline bool operator==(const EncodedKey& other) const {
+    return size_ == other.size_ && memcmp(data_, other.data_, size_) == 0;
+  }
+  inline bool operator!=(const EncodedKey& other) const {
+    return !(*this == other);
+  }
+  inline bool operator<(const EncodedKey& other) const {
+    return compare(other) < 0;
+  }
+  inline bool operator>(const EncodedKey& other) const {
+    return compare(other) > 0;
+  }
+  inline bool operator<=(const EncodedKey& other) const {
+    return compare(other) <= 0;
+  }
+  inline bool operator>=(const EncodedKey& other) const {
+    return compare(other) >= 0;
+  }
+
+  // Decodes the key for display: strings as they are, integers in
+  // decimal, with the components separated by spaces. This matches
+  // Comparable::to_string() for the Comparables we encode.
+  std::string to_string() const;
+
+ private:
+  enum ComponentTag : uint8_t {
+    STRING_TAG = 0x10,
+    INT32_TAG = 0x20,
+    INT64_TAG = 0x21,
+    UINT64_TAG = 0x22
+  };
+  static const char ESCAPE = '\x00';
+  static const char ESCAPED_NUL = '\xFF';
+  static const char TERMINATOR = '\x01';
+
+  // Ensures room for additional more bytes.
+  inline void Reserve(uint32_t additional) {
+    if (size_ + additional > capacity_) {
+      Grow(size_ + additional);
+    }
+  }
+  void Grow(uint32_t needed);
+  void AppendBigEndian(uint64_t value, int bytes);
+  // Reads the big-endian value of the given width at *position, advancing
+  // *position past it.
+  uint64_t ReadBigEndian(uint32_t* position, int bytes) const;
+
+  // Points either to inline_ or to a heap buffer of capacity_ bytes.
+  char* data_;
+  uint32_t size_;
+  uint32_t capacity_;
+  char inline_[INLINE_CAPACITY];
+};
+
+} // namespace acumio
+#endif // AcumioServer_encoded_key_h
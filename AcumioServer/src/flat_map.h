@@ -20,6 +20,9 @@
 //
 //               The strings are tracked via a StringAllocator, and thus
 //               the keys are actually integer offsets into a string array.
+//               If the allocator is front-coded, the stored strings are not
+//               the keys themselves, so we go through its Compare and Decode
+//               methods rather than reading them directly.
 //               The values are typed as uint32_t, but are tracked with an
 //               ObjectAllocator.
 //============================================================================
@@ -27,7 +30,9 @@
 #include <memory>
 #include <stack>
 #include <string.h>
+#include <vector>
 #include "iterators.h"
+#include "key_prefix.h"
 #include "tx_managed_map.h"
 #include "object_allocator.h"
 #include "string_allocator.h"
@@ -105,8 +110,9 @@ class FlatMap {
       const char* key = nullptr;
       uint32_t value = 0;
       if (node_id_ < container_->size()) {
-        key = container_->GetKey(node_id_);
-        value = container_->GetValue(node_id_);
+        saved_key_ = container_->GetKey(node_id_);
+        key = saved_key_.c_str();
+        value = container_->values_[node_id_];
       }
       saved_val_.reset(new MapIterElement(key, value));
       return *saved_val_;
@@ -116,8 +122,9 @@ class FlatMap {
       const char* key = nullptr;
       uint32_t value = 0;
       if (node_id_ < container_->size()) {
-        key = container_->GetKey(node_id_);
-        value = container_->GetValue(node_id_);
+        saved_key_ = container_->GetKey(node_id_);
+        key = saved_key_.c_str();
+        value = container_->values_[node_id_];
       }
       saved_val_.reset(new MapIterElement(key, value));
       return saved_val_.get();
@@ -127,6 +134,8 @@ class FlatMap {
     const FlatMap* container_;
     uint8_t node_id_;
     std::unique_ptr<Iterator> saved_tmp_;
+    // Backs the key of saved_val_.
+    mutable std::string saved_key_;
     mutable std::unique_ptr<MapIterElement> saved_val_;
   };
 
@@ -141,9 +150,10 @@ class FlatMap {
           uint8_t max_size, bool allow_duplicates) :
       key_allocator_(key_allocator), object_allocator_(object_allocator),
       max_size_(max_size), size_(0), allow_duplicates_(allow_duplicates),
-      keys_(nullptr), values_(nullptr) {
+      keys_(nullptr), prefixes_(nullptr), values_(nullptr) {
     if (max_size_ > 0) {
       keys_ = new uint16_t[max_size_];
+      prefixes_ = new uint64_t[max_size_];
       values_ = new uint32_t[max_size_];
     }
   }
@@ -154,16 +164,19 @@ class FlatMap {
       object_allocator_(other.object_allocator_),
       max_size_(other.max_size_), size_(other.size_),
       allow_duplicates_(other.allow_duplicates_), keys_(nullptr),
-      values_(nullptr) {
+      prefixes_(nullptr), values_(nullptr) {
     if (max_size_ > 0) {
       keys_ = new uint16_t[max_size_];
+      prefixes_ = new uint64_t[max_size_];
       values_ = new uint32_t[max_size_];
       if (size_ > 0) {
         for (uint8_t i = size_ - 1; i > 0; i--) {
           key_allocator_->AddReference(keys_[i] = other.keys_[i]);
+          prefixes_[i] = other.prefixes_[i];
           object_allocator_->AddReference(values_[i] = other.values_[i]);
         }
         key_allocator_->AddReference(keys_[0] = other.keys_[0]);
+        prefixes_[0] = other.prefixes_[0];
         object_allocator_->AddReference(values_[0] = other.values_[0]);
       }
     }
@@ -194,17 +207,22 @@ class FlatMap {
       object_allocator_(other.object_allocator_),
       max_size_(other.max_size_), size_(other.size_ + 1),
       allow_duplicates_(other.allow_duplicates_), keys_(nullptr),
-      values_(nullptr) {
+      prefixes_(nullptr), values_(nullptr) {
     keys_ = new uint16_t[max_size_];
+    prefixes_ = new uint64_t[max_size_];
     values_ = new uint32_t[max_size_];
-    for (uint8_t i = new_elt_pos - 1; i > 0; i--) {
+    for (uint8_t i = 0; i < new_elt_pos; i++) {
       key_allocator_->AddReference(keys_[i] = other.keys_[i]);
+      prefixes_[i] = other.prefixes_[i];
       object_allocator_->AddReference(values_[i] = other.values_[i]);
     }
     key_allocator_->AddReference(keys_[new_elt_pos] = key_pos);
+    prefixes_[new_elt_pos] = KeyPrefix(
+        key_allocator_->Decode(key_pos).c_str());
     object_allocator_->AddReference(values_[new_elt_pos] = value_pos);
     for (uint8_t i = new_elt_pos + 1; i < size_; i++) {
       key_allocator_->AddReference(keys_[i] = other.keys_[i-1]);
+      prefixes_[i] = other.prefixes_[i-1];
       object_allocator_->AddReference(values_[i] = other.values_[i-1]);
     }
   }
@@ -214,39 +232,71 @@ class FlatMap {
     object_allocator_(other.object_allocator_),
     max_size_(other.max_size_), size_(other.size_),
     allow_duplicates_(other.allow_duplicates_), keys_(nullptr),
-    values_(nullptr) {
+    prefixes_(nullptr), values_(nullptr) {
     if (size_ > removed_pos) {
       size_--;
     }
     keys_ = new uint16_t[max_size_];
+    prefixes_ = new uint64_t[max_size_];
     values_ = new uint32_t[max_size_];
-    for (uint8_t i = removed_pos - 1; i > 0; i--) {
+    for (uint8_t i = 0; i < removed_pos && i < size_; i++) {
       key_allocator_->AddReference(keys_[i] = other.keys_[i]);
+      prefixes_[i] = other.prefixes_[i];
       object_allocator_->AddReference(values_[i] = other.values_[i]);
     }
     for (uint8_t i = removed_pos; i < size_; i++) {
       key_allocator_->AddReference(keys_[i] = other.keys_[i+1]);
+      prefixes_[i] = other.prefixes_[i+1];
       object_allocator_->AddReference(values_[i] = other.values_[i+1]);
     }
   }
 
   ~FlatMap() {
-    if (size_ > 0) {
-      for (uint8_t i = size_ - 1; i > 0; i--) {
-        key_allocator_->DropReference(keys_[i]);
-        object_allocator_->DropReference(values_[i]);
+    DropAll();
+    delete [] keys_;
+    delete [] prefixes_;
+    delete [] values_;
+  }
+
+  // TxAware assigns versions into one another, so this must take and drop
+  // references just as the copy constructor and destructor do.
+  FlatMap& operator=(const FlatMap& other) {
+    if (this == &other) {
+      return *this;
+    }
+    DropAll();
+    if (max_size_ != other.max_size_) {
+      delete [] keys_;
+      delete [] prefixes_;
+      delete [] values_;
+      keys_ = nullptr;
+      prefixes_ = nullptr;
+      values_ = nullptr;
+      if (other.max_size_ > 0) {
+        keys_ = new uint16_t[other.max_size_];
+        prefixes_ = new uint64_t[other.max_size_];
+        values_ = new uint32_t[other.max_size_];
       }
-      key_allocator_->DropReference(keys_[0]);
-      object_allocator_->DropReference(values_[0]);
     }
+    key_allocator_ = other.key_allocator_;
+    object_allocator_ = other.object_allocator_;
+    max_size_ = other.max_size_;
+    size_ = other.size_;
+    allow_duplicates_ = other.allow_duplicates_;
+    for (uint8_t i = 0; i < size_; i++) {
+      key_allocator_->AddReference(keys_[i] = other.keys_[i]);
+      prefixes_[i] = other.prefixes_[i];
+      object_allocator_->AddReference(values_[i] = other.values_[i]);
+    }
+    return *this;
   }
 
   inline uint16_t GetIntKey(uint8_t position) const {
     return keys_[position];
   }
 
-  inline const char* GetKey(uint8_t position) const {
-    return key_allocator_->StringAt(keys_[position]);
+  inline std::string GetKey(uint8_t position) const {
+    return key_allocator_->Decode(keys_[position]);
   }
 
   inline const EltType& GetValue(uint32_t allocated_position) const {
@@ -261,57 +311,37 @@ class FlatMap {
     return object_allocator_->ObjectAt(values_[position]);
   }
 
+  inline uint32_t GetValuePositionByInternalPosition(uint8_t position) const {
+    return values_[position];
+  }
+
   inline EltType& GetModifiableValueByInternalPosition(uint8_t position) {
     return object_allocator_->ModifiableObjectAt(values_[position]);
   }
 
+  // Returns the position of an entry matching key, with *matches_key set
+  // to true, or if there is none, the position at which key would be
+  // inserted. The key prefixes narrow the search to the entries sharing
+  // key's prefix, so that we only visit the key strings to break ties.
   uint8_t GetInternalPosition(const char* key, bool* matches_key) const {
-    if (size_ == 0) {
-      return 0;
-    }
-    // first, look at final position:
-    uint8_t upper_bound = size_ - 1;
-    int cmp = strcmp(key, key_allocator_->StringAt(keys_[upper_bound]));
-    if (cmp == 0) {
-      *matches_key = true;
-      return upper_bound;
-    } else if (cmp > 0) {
-      *matches_key = false;
-      return size_;
-    }
-    // We now know that the key is less than the max value in the list.
-    // Time to consider lower-bound.
-    cmp = strcmp(key, key_allocator_->StringAt(keys_[0]));
-    if (cmp == 0) {
-      *matches_key = true;
-      return 0;
-    } else if (cmp < 0) {
-      *matches_key = false;
-      return 0;
-    }
-    // At this point, we know that the key is less than the key at the
-    // upper bound (the last element in the list) and greater than the
-    // key at the lower bound (0).
-    uint8_t lower_bound = 0;
-    uint8_t mid = (upper_bound >> 1);
-    while (mid != lower_bound) {
-      cmp = strcmp(key, key_allocator_->StringAt(keys_[mid]));
+    uint8_t lower_bound;
+    uint8_t upper_bound;
+    bool short_key = PrefixRange(key, &lower_bound, &upper_bound);
+    size_t base_match = key_allocator_->BaseMatch(key);
+    while (lower_bound < upper_bound) {
+      uint8_t mid = ((lower_bound + upper_bound) >> 1);
+      int cmp = CompareWithinPrefix(key, short_key, base_match, mid);
       if (cmp == 0) {
-        *matches_key  = true;
+        *matches_key = true;
         return mid;
       } else if (cmp < 0) {
         upper_bound = mid;
       } else {
-        lower_bound = mid;
+        lower_bound = mid + 1;
       }
-      mid = ((lower_bound + upper_bound) >> 1);
     }
-
     *matches_key = false;
-    // If we were to insert the key, it would go after all values earlier
-    // that are less than the current key, and it would push up all
-    // values later - including what is at the upper bound.
-    return upper_bound;
+    return lower_bound;
   }
 
   // This should be invoked when allow_duplicates_ is true. In this case, we
@@ -319,79 +349,31 @@ class FlatMap {
   // with respect to the combination of key and value_pos.
   uint8_t GetInternalPosition(const char* key, uint32_t value_pos,
                               bool* matches_key) const {
-    if (size_ == 0) {
-      return 0;
-    }
-    // first, look at final position:
-    uint8_t upper_bound = size_ - 1;
-    int cmp = strcmp(key, key_allocator_->StringAt(keys_[upper_bound]));
-    if (cmp == 0) {
-      if (value_pos < values_[upper_bound]) {
-        cmp = -1;
-      } else if (value_pos == values_[upper_bound]) {
-        cmp = 0;
-      } else {
-        cmp = 1;
-      }
-    }
-    if (cmp == 0) {
-      *matches_key = true;
-      return upper_bound;
-    } else if (cmp > 0) {
-      *matches_key = false;
-      return size_;
-    }
-    // We now know that the key is less than the max value in the list.
-    // Time to consider lower-bound.
-    cmp = strcmp(key, key_allocator_->StringAt(keys_[0]));
-    if (cmp == 0) {
-      if (value_pos < values_[0]) {
-        cmp = -1;
-      } else if (value_pos == values_[0]) {
-        cmp = 0;
-      } else {
-        cmp = 1;
-      }
-    }
-    if (cmp == 0) {
-      *matches_key = true;
-      return 0;
-    } else if (cmp < 0) {
-      *matches_key = false;
-      return 0;
-    }
-    // At this point, we know that the key is less than the key at the
-    // upper bound (the last element in the list) and greater than the
-    // key at the lower bound (0).
-    uint8_t lower_bound = 0;
-    uint8_t mid = (upper_bound >> 1);
-    while (mid != lower_bound) {
-      cmp = strcmp(key, key_allocator_->StringAt(keys_[mid]));
+    uint8_t lower_bound;
+    uint8_t upper_bound;
+    bool short_key = PrefixRange(key, &lower_bound, &upper_bound);
+    size_t base_match = key_allocator_->BaseMatch(key);
+    while (lower_bound < upper_bound) {
+      uint8_t mid = ((lower_bound + upper_bound) >> 1);
+      int cmp = CompareWithinPrefix(key, short_key, base_match, mid);
       if (cmp == 0) {
         if (value_pos < values_[mid]) {
           cmp = -1;
-        } else if (value_pos == values_[mid]) {
-          cmp = 0;
-        } else {
+        } else if (value_pos > values_[mid]) {
           cmp = 1;
         }
       }
       if (cmp == 0) {
-        *matches_key  = true;
+        *matches_key = true;
         return mid;
       } else if (cmp < 0) {
         upper_bound = mid;
       } else {
-        lower_bound = mid;
+        lower_bound = mid + 1;
       }
-      mid = ((lower_bound + upper_bound) >> 1);
     }
-
     *matches_key = false;
-    // If we were to insert the key, it would go after all values earlier
-    // that are less than the current key, and it would push up all
-    // values later - including what is at the upper bound.
-    return upper_bound;
+    return lower_bound;
   }
 
   // Returns nullptr if key does not match an existing entry.
@@ -420,7 +402,7 @@ class FlatMap {
 
   uint16_t GetKeyPosition(const char* key, bool* exists) const {
     uint8_t pos = GetInternalPosition(key, exists);
-    if (!exists) {
+    if (!*exists) {
       return key_allocator_->max_size();
     }
     return keys_[pos];
@@ -428,7 +410,7 @@ class FlatMap {
 
   uint32_t GetValuePosition(const char* key, bool* exists) const {
     uint8_t pos = GetInternalPosition(key, exists);
-    if (!exists) {
+    if (!*exists) {
       return object_allocator_->ImpossiblePosition();
     }
     return values_[pos];
@@ -448,7 +430,7 @@ class FlatMap {
     uint8_t pos = (allow_duplicates_ ?
                    GetInternalPosition(key, value_position, &exists) :
                    GetInternalPosition(key, &exists));
-    if (!exists) {
+    if (exists) {
       return max_size_;
     }
     uint16_t key_position = key_allocator_->Add(key);
@@ -457,9 +439,11 @@ class FlatMap {
     }
     for (uint8_t i = size_; i > pos; i--) {
       keys_[i] = keys_[i-1];
+      prefixes_[i] = prefixes_[i-1];
       values_[i] = values_[i-1];
     }
     keys_[pos] = key_position;
+    prefixes_[pos] = KeyPrefix(key);
     values_[pos] = value_position;
     // We return a reference for the value, but not the keys. The reason
     // to not add the reference for the keys is because it was already
@@ -492,18 +476,21 @@ class FlatMap {
     }
 
     bool exists = false;
-    const char* key = key_allocator_->StringAt(key_position);
+    std::string decoded_key = key_allocator_->Decode(key_position);
+    const char* key = decoded_key.c_str();
     uint8_t pos = (allow_duplicates_ ?
                    GetInternalPosition(key, value_position, &exists) :
                    GetInternalPosition(key, &exists));
-    if (!exists) {
+    if (exists) {
       return max_size_;
     }
     for (uint8_t i = size_; i > pos; i--) {
       keys_[i] = keys_[i-1];
+      prefixes_[i] = prefixes_[i-1];
       values_[i] = values_[i-1];
     }
     keys_[pos] = key_position;
+    prefixes_[pos] = KeyPrefix(key);
     values_[pos] = value_position;
     key_allocator_->AddReference(key_position);
     object_allocator_->AddReference(value_position);
@@ -547,9 +534,11 @@ class FlatMap {
 
     for (uint8_t i = size_; i > pos; i--) {
       keys_[i] = keys_[i-1];
+      prefixes_[i] = prefixes_[i-1];
       values_[i] = values_[i-1];
     }
     keys_[pos] = key_position;
+    prefixes_[pos] = KeyPrefix(key_allocator_->Decode(key_position).c_str());
     values_[pos] = allocated_position;
     // We return a reference for the value, but not the keys. The reason
     // to not add the reference for the keys is because it was already
@@ -572,13 +561,23 @@ class FlatMap {
     object_allocator_->DropReference(value_pos);
     for (uint8_t i = pos + 1; i < size_; i++) {
       keys_[i-1] = keys_[i];
+      prefixes_[i-1] = prefixes_[i];
       values_[i-1] = values_[i];
     }
+    size_--;
     return true;
   }
 
   inline bool Remove(uint16_t key_position) {
-    return Remove(key_allocator_->StringAt(key_position));
+    return Remove(key_allocator_->Decode(key_position).c_str());
+  }
+
+  // Updates our key positions after key_allocator_->Compact, given the
+  // relocation it reported.
+  void RelocateKeys(const std::vector<uint16_t>& relocation) {
+    for (uint8_t i = 0; i < size_; i++) {
+      keys_[i] = relocation[keys_[i]];
+    }
   }
 
   inline uint8_t size() const { return size_; }
@@ -586,12 +585,49 @@ class FlatMap {
   inline bool allow_duplicates() const { return allow_duplicates_; }
 
  private:
+  // Sets [*lower, *upper) to the positions whose key prefix matches key's.
+  // Returns true if key fits within its prefix.
+  inline bool PrefixRange(const char* key, uint8_t* lower,
+                          uint8_t* upper) const {
+    uint64_t prefix;
+    bool short_key = KeyPrefix(key, &prefix);
+    acumio::collection::PrefixRange(prefixes_, size_, prefix, lower, upper);
+    return short_key;
+  }
+
+  // Compares key with the key at position, given that their prefixes
+  // match. base_match must be key_allocator_->BaseMatch(key).
+  inline int CompareWithinPrefix(const char* key, bool short_key,
+                                 size_t base_match, uint8_t position) const {
+    if (short_key) {
+      return 0;
+    }
+    if (key_allocator_->front_coded()) {
+      return key_allocator_->Compare(key, base_match, keys_[position]);
+    }
+    return strcmp(key + KEY_PREFIX_BYTES,
+                  key_allocator_->StringAt(keys_[position]) +
+                  KEY_PREFIX_BYTES);
+  }
+
+  void DropAll() {
+    for (uint8_t i = 0; i < size_; i++) {
+      key_allocator_->DropReference(keys_[i]);
+      object_allocator_->DropReference(values_[i]);
+    }
+    size_ = 0;
+  }
+
   StringAllocator* key_allocator_;
   ObjectAllocator<EltType>* object_allocator_;
   uint8_t max_size_;
   uint8_t size_;
   bool allow_duplicates_;
   uint16_t* keys_;
+  // prefixes_[i] is the KeyPrefix of the key at keys_[i], kept side by
+  // side so that a search can narrow its range without visiting the
+  // strings in key_allocator_.
+  uint64_t* prefixes_;
   uint32_t* values_;
 };
 
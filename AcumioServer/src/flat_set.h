@@ -66,14 +66,14 @@ class FlatSet {
     }
 
     inline T& operator*() { return container_[location_]; }
-    inline T* operator->() { return &(container_[location]); }
+    inline T* operator->() { return &(container_[location_]); }
 
     inline bool operator==(const iterator& other) const {
-      return container_ == other.container_ && location_ == other.location_;
+      return &container_ == &other.container_ && location_ == other.location_;
     }
 
     inline bool operator!=(const iterator& other) const {
-      return container_ != other.container_ || location_ != other.location_;
+      return &container_ != &other.container_ || location_ != other.location_;
     }
 
     inline size_t location() const { return location_; }
@@ -125,14 +125,14 @@ class FlatSet {
     }
 
     inline const T& operator*() { return container_[location_]; }
-    inline const T* operator->() { return &(container_[location]); }
+    inline const T* operator->() { return &(container_[location_]); }
 
     inline bool operator==(const const_iterator& other) const {
-      return container_ == other.container_ && location_ == other.location_;
+      return &container_ == &other.container_ && location_ == other.location_;
     }
 
     inline bool operator!=(const const_iterator& other) const {
-      return container_ != other.container_ || location_ != other.location_;
+      return &container_ != &other.container_ || location_ != other.location_;
     }
 
     inline size_t location() const { return location_; }
@@ -280,7 +280,8 @@ class FlatSet {
       return std::pair<iterator,bool>(iter, false);
     }
     size_t location = iter.location();
-    for (size_t index = elements_.size(); index > location; index--) {
+    elements_.push_back(val);
+    for (size_t index = elements_.size() - 1; index > location; index--) {
       elements_[index] = elements_[index - 1]; 
     }
     elements_[location] = val;
@@ -292,7 +293,7 @@ class FlatSet {
   }
 
   size_t count(const T& val) const {
-    iterator location = lower_bound(val);
+    const_iterator location = lower_bound(val);
     return (location == end() || (*location != val)) ? 0 : 1;
   }
 
@@ -0,0 +1,257 @@
+#ifndef AcumioServer_hash_index_h
+#define AcumioServer_hash_index_h
+//============================================================================
+// Name        : hash_index.h
+// Author      : Bill Province (bill@acumio.com)
+// Version     :
+// Copyright   : Copyright (C) 2016 Acumio
+// Description : An open-addressing hash table from EncodedKey to Value,
+//               for exact-key lookups. Unlike an ordered index, it cannot
+//               answer range or prefix queries, but a lookup is a hash of
+//               the key bytes followed by (usually) a single probe.
+//
+//               Slots hold the full hash, the value, and the key itself, so
+//               that a probe only compares keys whose hashes match, and
+//               keys that fit in an EncodedKey's inline buffer need no
+//               further memory access. Collisions are resolved by linear
+//               probing; removed entries leave a tombstone behind, and
+//               tombstones are dropped when the table is next resized.
+//
+//               The table is split into SHARD_COUNT shards, chosen by the
+//               top bits of the hash, each with its own lock and resized on
+//               its own. Readers share a shard's lock and writers hold it
+//               exclusively, so writers only contend with each other, or
+//               with readers, when their keys land in the same shard.
+//============================================================================
+
+#include <stdint.h>
+#include <vector>
+#include "encoded_key.h"
+#include "rz_string_hash.h"
+#include "shared_mutex.h"
+
+namespace acumio {
+namespace collection {
+
+template <typename Value>
+class HashIndex {
+ public:
+  static const uint32_t SHARD_COUNT = 16;
+
+  // The capacity is spread over the shards, and rounded up to a power of
+  // two in each.
+  explicit HashIndex(uint32_t initial_capacity = 64) :
+      hash_(SEED, LEFT_SHIFT, RIGHT_SHIFT) {
+    for (uint32_t i = 0; i < SHARD_COUNT; i++) {
+      shards_[i].slots.resize(
+          RoundUpCapacity((initial_capacity + SHARD_COUNT - 1) / SHARD_COUNT));
+    }
+  }
+
+  ~HashIndex() {}
+
+  bool Get(const EncodedKey& key, Value* value) const {
+    uint32_t hash = Hash(key);
+    const Shard& shard = ShardFor(hash);
+    acumio::transaction::SharedLock lock(shard.guard);
+    const Slot* slot = Find(shard, key, hash);
+    if (slot == nullptr) {
+      return false;
+    }
+    *value = slot->value;
+    return true;
+  }
+
+  // Returns false, changing nothing, if the key is already present.
+  bool Insert(const EncodedKey& key, const Value& value) {
+    return InsertHashed(key, Hash(key), value);
+  }
+
+  // Inserts values[i] under *(keys[i]) for 0 <= i < n, as Insert would,
+  // but hashes all the keys together first, which is faster for large
+  // batches; see RZStringHash::HashBatch. Returns the number of keys that
+  // were not already present.
+  size_t InsertBatch(const EncodedKey* const* keys, const Value* values,
+                     size_t n) {
+    std::vector<const char*> data(n);
+    std::vector<size_t> lengths(n);
+    for (size_t i = 0; i < n; i++) {
+      data[i] = keys[i]->data();
+      lengths[i] = keys[i]->size();
+    }
+    std::vector<uint32_t> hashes(n);
+    hash_.HashBatch(data.data(), lengths.data(), n, hashes.data());
+    size_t ret_val = 0;
+    for (size_t i = 0; i < n; i++) {
+      if (InsertHashed(*(keys[i]), hashes[i], values[i])) {
+        ret_val++;
+      }
+    }
+    return ret_val;
+  }
+
+  // Returns false if the key was not present.
+  bool Erase(const EncodedKey& key) {
+    uint32_t hash = Hash(key);
+    Shard& shard = ShardFor(hash);
+    acumio::transaction::ExclusiveLock lock(shard.guard);
+    Slot* slot = const_cast<Slot*>(Find(shard, key, hash));
+    if (slot == nullptr) {
+      return false;
+    }
+    slot->state = DELETED;
+    slot->key.clear();
+    shard.size--;
+    return true;
+  }
+
+  // Not a snapshot: concurrent writers may change the count while we sum
+  // the shards.
+  size_t size() const {
+    size_t ret_val = 0;
+    for (const Shard& shard : shards_) {
+      acumio::transaction::SharedLock lock(shard.guard);
+      ret_val += shard.size;
+    }
+    return ret_val;
+  }
+
+  size_t capacity() const {
+    size_t ret_val = 0;
+    for (const Shard& shard : shards_) {
+      acumio::transaction::SharedLock lock(shard.guard);
+      ret_val += shard.slots.size();
+    }
+    return ret_val;
+  }
+
+ private:
+  // Shift values as recommended by Ramakrishna and Zobel.
+  static const uint32_t SEED = 0x5bd1e995;
+  static const uint8_t LEFT_SHIFT = 5;
+  static const uint8_t RIGHT_SHIFT = 2;
+  static const uint32_t MIN_CAPACITY = 16;
+  // The top SHARD_BITS of the hash pick the shard; the low bits pick the
+  // slot within it.
+  static const uint32_t SHARD_BITS = 4;
+  static_assert((1u << SHARD_BITS) == SHARD_COUNT,
+                "SHARD_COUNT must be 2 to the power SHARD_BITS.");
+
+  enum SlotState : uint8_t { EMPTY = 0, FULL = 1, DELETED = 2 };
+
+  struct Slot {
+    Slot() : hash(0), state(EMPTY), value(), key() {}
+    uint32_t hash;
+    SlotState state;
+    Value value;
+    EncodedKey key;
+  };
+
+  struct Shard {
+    Shard() : slots(), size(0), used(0), guard() {}
+    std::vector<Slot> slots;
+    // The number of live entries.
+    size_t size;
+    // The number of non-empty slots: live entries plus tombstones.
+    size_t used;
+    mutable acumio::transaction::SharedMutex guard;
+  };
+
+  static size_t RoundUpCapacity(size_t wanted) {
+    size_t ret_val = MIN_CAPACITY;
+    while (ret_val < wanted) {
+      ret_val <<= 1;
+    }
+    return ret_val;
+  }
+
+  inline uint32_t Hash(const EncodedKey& key) const {
+    return hash_(key.data(), key.size());
+  }
+
+  inline Shard& ShardFor(uint32_t hash) {
+    return shards_[hash >> (32 - SHARD_BITS)];
+  }
+
+  inline const Shard& ShardFor(uint32_t hash) const {
+    return shards_[hash >> (32 - SHARD_BITS)];
+  }
+
+  // Insert, given the hash of key.
+  bool InsertHashed(const EncodedKey& key, uint32_t hash,
+                    const Value& value) {
+    Shard& shard = ShardFor(hash);
+    acumio::transaction::ExclusiveLock lock(shard.guard);
+    if (Find(shard, key, hash) != nullptr) {
+      return false;
+    }
+    // Keep the shard at most 3/4 full, counting tombstones.
+    if (4 * (shard.used + 1) > 3 * shard.slots.size()) {
+      Resize(RoundUpCapacity(2 * (shard.size + 1)), &shard);
+    }
+    if (Place(key, hash, value, &shard)) {
+      shard.used++;
+    }
+    shard.size++;
+    return true;
+  }
+
+  // Requires the shard's guard be held.
+  static const Slot* Find(const Shard& shard, const EncodedKey& key,
+                          uint32_t hash) {
+    size_t mask = shard.slots.size() - 1;
+    for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+      const Slot& slot = shard.slots[i];
+      if (slot.state == EMPTY) {
+        return nullptr;
+      }
+      if (slot.state == FULL && slot.hash == hash && slot.key == key) {
+        return &slot;
+      }
+    }
+  }
+
+  // Places the entry in the first free slot of its probe sequence.
+  // Returns true if that slot was empty rather than a tombstone. Requires
+  // that the shard's guard be held exclusively, and that the key be absent.
+  static bool Place(const EncodedKey& key, uint32_t hash, const Value& value,
+                    Shard* shard) {
+    size_t mask = shard->slots.size() - 1;
+    size_t i = hash & mask;
+    while (shard->slots[i].state == FULL) {
+      i = (i + 1) & mask;
+    }
+    Slot& slot = shard->slots[i];
+    bool was_empty = slot.state == EMPTY;
+    slot.hash = hash;
+    slot.state = FULL;
+    slot.value = value;
+    slot.key = key;
+    return was_empty;
+  }
+
+  static void Resize(size_t capacity, Shard* shard) {
+    std::vector<Slot> old_slots(capacity);
+    old_slots.swap(shard->slots);
+    for (const Slot& slot : old_slots) {
+      if (slot.state == FULL) {
+        Place(slot.key, slot.hash, slot.value, shard);
+      }
+    }
+    shard->used = shard->size;
+  }
+
+  Shard shards_[SHARD_COUNT];
+  acumio::util::RZStringHash hash_;
+};
+
+template <typename Value> const uint32_t HashIndex<Value>::SEED;
+template <typename Value> const uint8_t HashIndex<Value>::LEFT_SHIFT;
+template <typename Value> const uint8_t HashIndex<Value>::RIGHT_SHIFT;
+template <typename Value> const uint32_t HashIndex<Value>::MIN_CAPACITY;
+template <typename Value> const uint32_t HashIndex<Value>::SHARD_COUNT;
+template <typename Value> const uint32_t HashIndex<Value>::SHARD_BITS;
+
+} // namespace collection
+} // namespace acumio
+#endif // AcumioServer_hash_index_h
@@ -28,6 +28,7 @@
 //============================================================================
 
 #include <iterator>
+#include <memory>
 #include "shared_mutex.h"
 
 namespace acumio {
@@ -39,19 +40,23 @@ using acumio::transaction::SharedMutex;
 template <typename EltType> class BasicIterator :
     public std::iterator<std::bidirectional_iterator_tag, EltType> {
  public:
-  BasicIterator() : lock_(nullptr) {}
-  BasicIterator(SharedMutex* guard) : lock_(nullptr) {
-    lock_ = new SharedLock(*guard);
-  }
-  BasicIterator(const BasicIterator& other) : lock_(nullptr) {
-    if (other.lock_ != nullptr) {
-      lock_ = new SharedLock(other.lock_->GetMutex());
+  BasicIterator() : lock_() {}
+  // A null guard yields an iterator that holds no lock.
+  BasicIterator(SharedMutex* guard) : lock_() {
+    if (guard != nullptr) {
+      lock_.reset(new SharedLock(*guard));
     }
   }
+  // Takes ownership of a lock the caller already holds. Containers use this
+  // to hand the lock they positioned the iterator under to the iterator
+  // itself, rather than acquiring the guard a second time on the same
+  // thread (which can deadlock against a waiting writer).
+  explicit BasicIterator(SharedLock* held_lock) : lock_(held_lock) {}
+  // For the same reason, a copy shares the lock of the original rather
+  // than acquiring its own; the lock is released with the last of them.
+  BasicIterator(const BasicIterator& other) : lock_(other.lock_) {}
 
-  virtual ~BasicIterator() {
-    delete lock_;
-  }
+  virtual ~BasicIterator() {}
 
   // We need to have a type of "virtual copy constructor." You cannot do
   // that directly in the language, but we can build in the idea here.
@@ -76,11 +81,11 @@ template <typename EltType> class BasicIterator :
 
   // Guard access
   inline SharedMutex* guard() const {
-    return lock_ == nullptr ? nullptr : &(lock_->GetMutex());
+    return lock_.get() == nullptr ? nullptr : &(lock_->GetMutex());
   }
 
  private:
-  mutable SharedLock* lock_;
+  std::shared_ptr<SharedLock> lock_;
 };
 
 template <typename EltType>
@@ -93,9 +98,16 @@ class DelegatingIterator : public BasicIterator<EltType> {
                      SharedMutex* guard) :
       BasicIterator<EltType>(guard), delegate_(delegate) {}
 
+  // Takes ownership of held_lock; see BasicIterator(SharedLock*).
+  DelegatingIterator(std::shared_ptr<BasicIterator<EltType>> delegate,
+                     SharedLock* held_lock) :
+      BasicIterator<EltType>(held_lock), delegate_(delegate) {}
+
+  // The copy gets its own delegate, so that moving one iterator does not
+  // move the other.
   DelegatingIterator(const DelegatingIterator& other) :
       BasicIterator<EltType>(static_cast<const BasicIterator<EltType>&>(other)),
-      delegate_(other.delegate_) {}
+      delegate_(other.delegate_->Clone()) {}
 
   ~DelegatingIterator() {}
 
@@ -106,25 +118,25 @@ class DelegatingIterator : public BasicIterator<EltType> {
   // Here, we diverge a bit from the standard templates, because our return
   // type is a BasicIterator& instead of a DelegatingIterator&.
   inline BasicIterator<EltType>& operator++() {
-    (*delegate_)++;
+    ++(*delegate_);
     return *this;
   }
 
   inline BasicIterator<EltType>& operator--() {
-    (*delegate_)--;
+    --(*delegate_);
     return *this;
   }
 
   // post-increment/decrement
   BasicIterator<EltType>& operator++(int) {
     saved_tmp_.reset(new DelegatingIterator(*this));
-    (*delegate_)++;
+    ++(*delegate_);
     return *saved_tmp_;
   }
 
   BasicIterator<EltType>& operator--(int) {
     saved_tmp_.reset(new DelegatingIterator(*this));
-    (*delegate_)--;
+    --(*delegate_);
     return *saved_tmp_;
   }
 
@@ -0,0 +1,86 @@
+//============================================================================
+// Name        : key_prefix.cpp
+// Author      : Bill Province (bill@acumio.com)
+// Version     :
+// Copyright   : Copyright (C) 2016 Acumio
+// Description : Implementation of PrefixRange.
+//============================================================================
+#include "key_prefix.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ACUMIO_KEY_PREFIX_AVX2
+#include <immintrin.h>
+#endif
+
+namespace acumio {
+namespace collection {
+
+namespace {
+// Counts rather than searches: for the handful of entries in a FlatMap,
+// comparing against all of them without branches beats a binary search.
+void PrefixRangeScalar(const uint64_t* prefixes, uint8_t size,
+                       uint64_t prefix, uint8_t* lower, uint8_t* upper) {
+  uint8_t less = 0;
+  uint8_t less_or_equal = 0;
+  for (uint8_t i = 0; i < size; i++) {
+    less += prefixes[i] < prefix;
+    less_or_equal += prefixes[i] <= prefix;
+  }
+  *lower = less;
+  *upper = less_or_equal;
+}
+
+#ifdef ACUMIO_KEY_PREFIX_AVX2
+const uint8_t AVX2_LANES = 4;
+
+__attribute__((target("avx2,popcnt")))
+void PrefixRangeAvx2(const uint64_t* prefixes, uint8_t size,
+                     uint64_t prefix, uint8_t* lower, uint8_t* upper) {
+  // AVX2 only compares signed 64-bit values, so flip the sign bits to
+  // compare unsigned ones.
+  const __m256i sign = _mm256_set1_epi64x(INT64_MIN);
+  const __m256i target =
+      _mm256_xor_si256(_mm256_set1_epi64x(static_cast<int64_t>(prefix)),
+                       sign);
+  uint32_t less = 0;
+  uint32_t greater = 0;
+  uint8_t i = 0;
+  for (; i + AVX2_LANES <= size; i += AVX2_LANES) {
+    __m256i values = _mm256_xor_si256(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(prefixes + i)),
+        sign);
+    less += _mm_popcnt_u32(_mm256_movemask_pd(_mm256_castsi256_pd(
+        _mm256_cmpgt_epi64(target, values))));
+    greater += _mm_popcnt_u32(_mm256_movemask_pd(_mm256_castsi256_pd(
+        _mm256_cmpgt_epi64(values, target))));
+  }
+  for (; i < size; i++) {
+    less += prefixes[i] < prefix;
+    greater += prefixes[i] > prefix;
+  }
+  *lower = static_cast<uint8_t>(less);
+  *upper = static_cast<uint8_t>(size - greater);
+}
+#endif
+
+typedef void (*PrefixRangeFunction)(const uint64_t*, uint8_t, uint64_t,
+                                    uint8_t*, uint8_t*);
+
+PrefixRangeFunction SelectPrefixRange() {
+#ifdef ACUMIO_KEY_PREFIX_AVX2
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+    return &PrefixRangeAvx2;
+  }
+#endif
+  return &PrefixRangeScalar;
+}
+} // anonymous namespace
+
+void PrefixRange(const uint64_t* prefixes, uint8_t size, uint64_t prefix,
+                 uint8_t* lower, uint8_t* upper) {
+  static const PrefixRangeFunction prefix_range = SelectPrefixRange();
+  prefix_range(prefixes, size, prefix, lower, upper);
+}
+
+} // namespace collection
+} // namespace acumio
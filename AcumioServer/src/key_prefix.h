@@ -0,0 +1,61 @@
+#ifndef AcumioServer_key_prefix_h
+#define AcumioServer_key_prefix_h
+//============================================================================
+// Name        : key_prefix.h
+// Author      : Bill Province (bill@acumio.com)
+// Version     :
+// Copyright   : Copyright (C) 2016 Acumio
+// Description : Fixed-width key prefixes, for narrowing a search over a
+//               small sorted array of C-string keys without touching the
+//               strings themselves.
+//
+//               The prefix of a key is its first KEY_PREFIX_BYTES bytes,
+//               zero-padded and read big-endian into a uint64_t. Comparing
+//               two prefixes as integers agrees with strcmp on the keys up
+//               to that length, so in a sorted array of keys the prefixes
+//               are sorted as well, and the only keys that can equal a
+//               given key are those in the run sharing its prefix.
+//============================================================================
+
+#include <stdint.h>
+
+namespace acumio {
+namespace collection {
+
+const uint8_t KEY_PREFIX_BYTES = 8;
+
+// Sets *prefix to the prefix of key. Returns true if the key is shorter
+// than KEY_PREFIX_BYTES, in which case the prefix holds the entire key,
+// and keys with equal prefixes are equal.
+inline bool KeyPrefix(const char* key, uint64_t* prefix) {
+  uint64_t value = 0;
+  uint8_t length = 0;
+  for (; length < KEY_PREFIX_BYTES && key[length] != '\0'; length++) {
+    value = (value << 8) | static_cast<uint8_t>(key[length]);
+  }
+  if (length < KEY_PREFIX_BYTES) {
+    // Pad on the right, done in two steps so as never to shift by 64.
+    value = (value << (4 * (KEY_PREFIX_BYTES - length))) <<
+        (4 * (KEY_PREFIX_BYTES - length));
+  }
+  *prefix = value;
+  return length < KEY_PREFIX_BYTES;
+}
+
+inline uint64_t KeyPrefix(const char* key) {
+  uint64_t prefix;
+  KeyPrefix(key, &prefix);
+  return prefix;
+}
+
+// Given the sorted array prefixes[0..size), sets [*lower, *upper) to the
+// range of positions whose prefix equals prefix. If there are none, then
+// *lower == *upper is the position at which prefix would be inserted.
+// Uses AVX2 compares across the whole array where the processor supports
+// them.
+void PrefixRange(const uint64_t* prefixes, uint8_t size, uint64_t prefix,
+                 uint8_t* lower, uint8_t* upper);
+
+} // namespace collection
+} // namespace acumio
+#endif // AcumioServer_key_prefix_h
@@ -6,23 +6,45 @@
 // Version     :
 // Copyright   : Copyright (C) 2016 Acumio
 // Description : Provides templated multi-threaded access to an in-memory
-//               repository. (Not yet threadsafe).
+//               repository. Each index is range-partitioned (see
+//               PartitionedMap), so that concurrent writers only contend
+//               where they touch the same key range.
+//
+//               Stored elements are immutable, reference-counted snapshots.
+//               An update builds a new snapshot and swaps it in, so readers
+//               can share the stored element rather than copying it, and
+//               what they hold is never changed underneath them.
 //============================================================================
 
 #include <iostream> // Remove me. Needed for std::cout.
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <iterator>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <sstream>
 #include <stack>
 #include <stdint.h>
+#include <thread>
 #include <vector>
 #include <grpc++/support/status.h>
 #include "comparable.h"
+#include "encoded_key.h"
+#include "hash_index.h"
+#include "partitioned_map.h"
 #include "pointer_less.h"
+#include "shared_mutex.h"
 
 namespace acumio {
 
 namespace mem_repository {
 
+using acumio::transaction::ExclusiveLock;
+using acumio::transaction::SharedLock;
+using acumio::transaction::SharedMutex;
+
 template <class EltType>
 class KeyExtractorInterface {
  public:
@@ -71,19 +93,16 @@ class MemRepository {
   // Second:
   // We need thread-safe access to this content, particularly in the case
   // of a multiply-indexed dataset. However, locking the entire structure
-  // is cost-prohibitive. An alternative is to partition the maps into
-  // chunks such that, if a map contains n elements, each chunk will
-  // contain O(sqrt(n)) elements, and then there is a map that selects
-  // which of the chunks you need to go in. The super-map is of course,
-  // of size O(sqrt(n)). Now, when a mutation occurs, you only need to
-  // lock the specific chunk(s) involved rather than the entire
-  // structure. A caveat is that occasionally, the chunk boundaries need
-  // to be adjusted. This can be detected and performed by a background
-  // process.
+  // is cost-prohibitive. So each index is a PartitionedMap: the index is
+  // split into key-range chunks, and a mutation only locks the chunk it
+  // touches. The chunk boundaries are adjusted (split and merged) as the
+  // chunks drift from their target size.
   // Third:
-  // Having a direct hash-map access might also be helpful based on
-  // primary-key lookup. However, if we have a well-written
-  // patricia-trie, this will not really be required.
+  // Point lookups by primary key do not need the ordering, so a repository
+  // may also keep a hash index on the main key (a HashIndex; see
+  // hash_point_lookups). Get and NonMutableGet then take O(m) to hash the
+  // key rather than O(log(n) * m) to search the main index, at the cost of
+  // maintaining one more index on every write.
   // Fourth:
   // Some indexes, such as indexes based on keyword search, will be
   // expensive to perform up-front. For those indices, it is better
@@ -95,82 +114,146 @@ class MemRepository {
                         acumio::functional::pointer_less<Comparable>>
       RepositoryMultiMap;
 
-  typedef std::pair<const std::unique_ptr<Comparable>&, const EltType>
+  // The key of an index entry: the EncodedKey, which orders the index
+  // with a single memcmp, plus the Comparable it was encoded from, which
+  // our iterators hand back. Lookup keys carry just the EncodedKey.
+  struct IndexKey {
+    explicit IndexKey(const EncodedKey& key) : encoded(key), comparable() {}
+    explicit IndexKey(std::unique_ptr<Comparable> key) :
+        encoded(key->encoded_key()), comparable(std::move(key)) {}
+    IndexKey(IndexKey&& other) : encoded(std::move(other.encoded)),
+        comparable(std::move(other.comparable)) {}
+    IndexKey& operator=(IndexKey&& other) {
+      encoded = std::move(other.encoded);
+      comparable = std::move(other.comparable);
+      return *this;
+    }
+
+    EncodedKey encoded;
+    std::unique_ptr<Comparable> comparable;
+  };
+
+  struct IndexKeyLess {
+    inline bool operator()(const IndexKey& left,
+                           const IndexKey& right) const {
+      return left.encoded < right.encoded;
+    }
+  };
+
+  // The index type used for both the main index (which does not allow
+  // duplicates) and the added indices (which do).
+  typedef acumio::collection::PartitionedMap<IndexKey, int32_t, IndexKeyLess>
+      RepositoryIndex;
+
+  typedef std::shared_ptr<const EltType> EltConstPtr;
+  // The element refers to a snapshot held by the iterator, and remains
+  // valid until the iterator is next moved or destroyed.
+  typedef std::pair<const std::unique_ptr<Comparable>&, const EltType&>
       IteratorElement;
   typedef std::pair<grpc::Status, EltType*> StatusEltPtrPair;
-  typedef std::pair<grpc::Status, const EltType*> StatusEltConstPtrPair;
+  typedef std::pair<grpc::Status, EltConstPtr> StatusEltConstPtrPair;
+  typedef std::pair<EncodedKey, EltConstPtr> KeyedSnapshot;
 
   template <typename IterType>
   class Iterator :
       public std::iterator<std::bidirectional_iterator_tag, IteratorElement> {
    public:
-    Iterator<IterType>() {}
+    Iterator<IterType>() : wrapped_iterator_(), repository_(nullptr),
+        snapshot_(), saved_elt_(nullptr) {}
+    // Requires repository->elements_guard_ be held, in at least shared
+    // mode, since wrapped_iterator was positioned.
     Iterator<IterType>(IterType wrapped_iterator,
-                       const std::vector<EltType>* elements) :
-        wrapped_iterator_(wrapped_iterator), elements_(elements),
-        saved_elt_(nullptr) {}
+                       const MemRepository<EltType>* repository) :
+        wrapped_iterator_(wrapped_iterator), repository_(repository),
+        snapshot_(), saved_elt_(nullptr) {
+      LoadSnapshot();
+    }
     Iterator<IterType>(const Iterator<IterType>& copy) :
-        wrapped_iterator_(copy.wrapped_iterator_), elements_(copy.elements_) {}
+        wrapped_iterator_(copy.wrapped_iterator_),
+        repository_(copy.repository_), snapshot_(copy.snapshot_),
+        saved_elt_(nullptr) {}
     ~Iterator<IterType>() {}
     // pre-increment/decrement.
     inline Iterator<IterType>& operator++() {
-      wrapped_iterator_++;
+      SharedLock elements_lock(repository_->elements_guard_);
+      ++wrapped_iterator_;
+      LoadSnapshot();
       return *this;
     }
     inline Iterator<IterType>& operator--() {
-      wrapped_iterator_--;
+      SharedLock elements_lock(repository_->elements_guard_);
+      --wrapped_iterator_;
+      LoadSnapshot();
       return *this;
     }
     // post-increment/decrement.
     inline Iterator<IterType> operator++(int) {
       Iterator<IterType> tmp(*this);
-      wrapped_iterator_++;
+      ++(*this);
       return tmp;
     }
     inline Iterator<IterType> operator--(int) {
       Iterator<IterType> tmp(*this);
-      wrapped_iterator_--;
+      --(*this);
       return tmp;
     }
     inline bool operator==(const Iterator<IterType>& other) const {
       return wrapped_iterator_ == other.wrapped_iterator_ &&
-             elements_ == other.elements_;
+             repository_ == other.repository_;
     }
     inline bool operator!=(const Iterator<IterType>& other) const {
       return wrapped_iterator_ != other.wrapped_iterator_ ||
-             elements_ != other.elements_;
+             repository_ != other.repository_;
     }
     IteratorElement operator*() {
-      IteratorElement ret_val(wrapped_iterator_->first,
-                              elements_->at(wrapped_iterator_->second));
-      return ret_val;
+      return IteratorElement(wrapped_iterator_->first.comparable, *snapshot_);
     }
     IteratorElement* operator->() {
-      saved_elt_.reset(
-          new IteratorElement(wrapped_iterator_->first,
-                              elements_->at(wrapped_iterator_->second)));
+      saved_elt_.reset(new IteratorElement(**this));
       return saved_elt_.get();
     }
 
    private:
+    // Takes the snapshot of the element that wrapped_iterator_ now points
+    // to. The index entry was live when wrapped_iterator_ reached it, and
+    // elements are only freed after their index entries are erased, so
+    // with elements_guard_ held since then, the slot still holds the
+    // element of that entry. Requires elements_guard_ be held.
+    void LoadSnapshot() {
+      if (wrapped_iterator_ == IterType()) {
+        snapshot_.reset();
+      } else {
+        snapshot_ = repository_->elements_[wrapped_iterator_->second];
+      }
+    }
+
     IterType wrapped_iterator_;
-    const std::vector<EltType>* elements_;
+    const MemRepository<EltType>* repository_;
+    // The snapshot of the element at wrapped_iterator_, or null at the end.
+    EltConstPtr snapshot_;
     std::unique_ptr<IteratorElement> saved_elt_;
   };
 
-  typedef Iterator<RepositoryMap::const_iterator> PrimaryIterator;
-  typedef Iterator<RepositoryMultiMap::const_iterator> SecondaryIterator; 
+  typedef Iterator<typename RepositoryIndex::Iterator> PrimaryIterator;
+  typedef Iterator<typename RepositoryIndex::Iterator> SecondaryIterator;
 
   // The extractors vector is *not* made const, because we perform a move
   // operation on the contents of the vector, thereby passing ownership
   // to the repository.
+  //
+  // If hash_point_lookups is set, the repository also keeps a hash index
+  // on the main key, and answers Get and NonMutableGet from it instead of
+  // from the ordered main index. Range queries still use the main index.
   MemRepository(std::unique_ptr<Extractor> main_extractor,
-                std::vector<std::unique_ptr<Extractor>>* extractors) :
-      main_extractor_(std::move(main_extractor)) {
+                std::vector<std::unique_ptr<Extractor>>* extractors,
+                bool hash_point_lookups = false) :
+      main_extractor_(std::move(main_extractor)), main_index_(false),
+      point_index_(hash_point_lookups ? new PointIndex() : nullptr) {
     for (uint16_t i = 0; i < extractors->size(); i++) {
       extractors_.push_back(std::move(extractors->at(i)));
+      indices_.push_back(
+          std::unique_ptr<RepositoryIndex>(new RepositoryIndex(true)));
     }
-    indices_.resize(extractors_.size());
     free_list_.push(0);
   }
 
@@ -185,190 +268,280 @@ class MemRepository {
 
   inline uint32_t size() const { return main_index_.size(); }
 
+  // Adds may run concurrently with each other, and with readers. They only
+  // serialize where they touch the same chunk of an index, or where their
+  // keys share a write stripe (see KeyLock).
   grpc::Status Add(const EltType& e) {
-    // TODO: Properly guard element to handle multi-threaded access.
-    //       This method is broken without these guards. However, below
-    //       is the main idea behind the logic of what has to happen.
-
-    // First, extract the primary key from the element. Before going
-    // too far, we will check for duplicates.
-    std::unique_ptr<Comparable> main_key(main_extractor_->GetKey(e));
-    RepositoryMap::iterator it = main_index_.lower_bound(main_key);
-    if (it != main_index_.end() && *(it->first) == *main_key) {
+    // First, extract all the key values to be updated.
+    IndexKey main_key(main_extractor_->GetKey(e));
+    std::vector<IndexKey> added_keys;
+    for (uint16_t i = 0; i < extractors_.size(); i++) {
+      added_keys.push_back(IndexKey(extractors_[i]->GetKey(e)));
+    }
+
+    KeyLock key_lock(this, main_key.encoded);
+    int32_t new_elt_pos = AllocateElement(e);
+    if (!InsertMainKey(&main_key, new_elt_pos)) {
+      FreeElement(new_elt_pos);
       // TODO: Log Error.
       std::stringstream error;
       error << "Cannot add duplicate element with key: (\""
-            << main_key->to_string()
+            << main_key.encoded.to_string()
             << "\")";
       return grpc::Status(grpc::StatusCode::ALREADY_EXISTS, error.str());
     }
 
-    // Next, extract all the key values to be updated.
-    std::vector<std::unique_ptr<Comparable>> added_keys;
-    for (uint16_t i = 0; i < extractors_.size(); i++) {
-      std::unique_ptr<Comparable> current_key = extractors_[i]->GetKey(e);
-      added_keys.push_back(std::move(current_key));
+    for (uint16_t i = 0; i < added_keys.size(); i++) {
+      indices_[i]->Insert(std::move(added_keys[i]), new_elt_pos);
     }
 
-    // Get the position in the elements_ array from the free_list_.
-    // Note that the bottom entry in the free_list_ stack is always
-    // the one equal to the total size of the elements_ array. 
-    int32_t new_elt_pos = free_list_.top();
-    free_list_.pop();
-    if (free_list_.empty()) {
-      // assert: new_elt_pos == elements_.size()
-      elements_.push_back(e);
-      free_list_.push(elements_.size());
+    return grpc::Status::OK;
+  }
+
+  // Loads elements into an empty repository, for seeding a server from a
+  // checkpoint or an export. Rather than Adding the elements one at a
+  // time, each index is built on its own thread: the thread extracts its
+  // keys, sorts them by key and then by position in elements, and builds
+  // the index from the sorted run (see PartitionedMap::BulkLoad). When the
+  // elements come in main key order, the main index needs no sort at all.
+  //
+  // Fails with FAILED_PRECONDITION if the repository is not empty, and
+  // with ALREADY_EXISTS, loading nothing, if two elements have the same
+  // main key. Other writers wait until BulkLoad returns. The elements are
+  // moved out of *elements.
+  grpc::Status BulkLoad(std::vector<EltType>* elements) {
+    KeyLock all_keys_lock(this);
+    if (main_index_.size() > 0) {
+      return grpc::Status(grpc::StatusCode::FAILED_PRECONDITION,
+                          "Cannot bulk load a repository that is not empty.");
     }
-    else {
-      elements_[new_elt_pos] = e;
+    std::vector<EltConstPtr> snapshots;
+    snapshots.reserve(elements->size());
+    for (EltType& element : *elements) {
+      snapshots.push_back(std::make_shared<const EltType>(std::move(element)));
+    }
+    elements->clear();
+
+    // The main index comes first, followed by the added indices.
+    std::vector<IndexEntries> entries(indices_.size() + 1);
+    std::vector<std::function<void()>> sorts;
+    sorts.push_back([this, &snapshots, &entries]() {
+      SortIndexEntries(*main_extractor_, snapshots, &(entries[0]));
+    });
+    for (uint16_t i = 0; i < indices_.size(); i++) {
+      sorts.push_back([this, &snapshots, &entries, i]() {
+        SortIndexEntries(*(extractors_[i]), snapshots, &(entries[i + 1]));
+      });
+    }
+    RunInParallel(sorts);
+
+    const IndexEntries& main_entries = entries[0];
+    for (size_t i = 1; i < main_entries.size(); i++) {
+      if (main_entries[i - 1].first.encoded == main_entries[i].first.encoded) {
+        std::stringstream error;
+        error << "Cannot add duplicate element with key: (\""
+              << main_entries[i].first.encoded.to_string()
+              << "\")";
+        return grpc::Status(grpc::StatusCode::ALREADY_EXISTS, error.str());
+      }
     }
 
-    main_index_.emplace_hint(it, std::move(main_key), new_elt_pos);
-    for (uint16_t i = 0; i < added_keys.size(); i++) {
-      indices_[i].emplace(std::move(added_keys[i]), new_elt_pos);
+    // The elements take the positions they had in *elements.
+    {
+      ExclusiveLock elements_lock(elements_guard_);
+      elements_.assign(std::make_move_iterator(snapshots.begin()),
+                       std::make_move_iterator(snapshots.end()));
+      free_list_ = std::stack<int32_t>();
+      free_list_.push(elements_.size());
     }
 
+    std::vector<std::function<void()>> builds;
+    builds.push_back([this, &entries]() {
+      if (point_index_) {
+        std::vector<const EncodedKey*> keys;
+        std::vector<int32_t> locations;
+        keys.reserve(entries[0].size());
+        locations.reserve(entries[0].size());
+        for (const std::pair<IndexKey, int32_t>& entry : entries[0]) {
+          keys.push_back(&(entry.first.encoded));
+          locations.push_back(entry.second);
+        }
+        point_index_->InsertBatch(keys.data(), locations.data(), keys.size());
+      }
+      main_index_.BulkLoad(&(entries[0]));
+    });
+    for (uint16_t i = 0; i < indices_.size(); i++) {
+      builds.push_back([this, &entries, i]() {
+        indices_[i]->BulkLoad(&(entries[i + 1]));
+      });
+    }
+    RunInParallel(builds);
     return grpc::Status::OK;
   }
 
-  grpc::Status Remove(const std::unique_ptr<Comparable>& key) {
-    if (main_index_.count(key) == 0) {
-      // TODO: Log Warning.
-      std::stringstream error;
-      error << "Unable to find element with key: (\""
-            << key->to_string()
-            << "\")";
-      return grpc::Status(grpc::StatusCode::NOT_FOUND, error.str());
+  // Removes every element, as if by Remove, for undoing a BulkLoad. An
+  // Add that is in progress may or may not be removed.
+  void Clear() {
+    std::vector<KeyedSnapshot> snapshots;
+    GetSnapshots(&snapshots);
+    SortSnapshots(&snapshots);
+    for (const KeyedSnapshot& snapshot : snapshots) {
+      Remove(snapshot.first);
+    }
+  }
+
+  inline grpc::Status Remove(const std::unique_ptr<Comparable>& key) {
+    return Remove(key->encoded_key());
+  }
+
+  // As with Add, the point index (where we have one) is updated first, so
+  // that a Get, an Add and a Remove of the same key all see the element
+  // leave at the same moment.
+  grpc::Status Remove(const EncodedKey& key) {
+    KeyLock key_lock(this, key);
+    if (point_index_ && !point_index_->Erase(key)) {
+      return NotFound(key);
+    }
+    int32_t elt_pos;
+    if (!main_index_.Take(IndexKey(key), &elt_pos)) {
+      // With the key's stripe held, this is a sign of data corruption.
+      // TODO: Log Error.
+      return NotFound(key);
+    }
+
+    std::vector<EncodedKey> index_keys;
+    EltConstPtr elt = SnapshotAt(elt_pos);
+    for (uint32_t i = 0; i < indices_.size(); i++) {
+      index_keys.push_back(extractors_[i]->GetKey(*elt)->encoded_key());
     }
-  
-    RepositoryMap::iterator it = main_index_.find(key);
-    int32_t elt_pos = it->second; 
-    const EltType& elt = elements_[elt_pos];
-    main_index_.erase(it);
     for (uint32_t i = 0; i < indices_.size(); i++) {
-      std::unique_ptr<Comparable> index_key = extractors_[i]->GetKey(elt);
       grpc::Status result =
-          DeleteFromSecondaryIndex(indices_[i], index_key, i, elt_pos);
+          DeleteFromSecondaryIndex(indices_[i].get(), index_keys[i], i,
+                                   elt_pos);
       if (!result.ok()) {
         return result;
       }
     }
-    free_list_.push(elt_pos);
+    FreeElement(elt_pos);
     return grpc::Status::OK;
   }
 
-  grpc::Status Update(const std::unique_ptr<Comparable>& key,
-                      const EltType& new_value) {
+  inline grpc::Status Update(const std::unique_ptr<Comparable>& key,
+                             const EltType& new_value) {
+    return Update(key->encoded_key(), new_value);
+  }
+
+  grpc::Status Update(const EncodedKey& key, const EltType& new_value) {
     ReplacementMutator<EltType> mutator(new_value);
-    std::unique_ptr<Comparable> update_key = main_extractor_->GetKey(new_value);
-    return ApplyMutation(key, update_key, &mutator);
+    return ApplyMutation(key, main_extractor_->GetKey(new_value)->encoded_key(),
+                         &mutator);
   }
 
-  grpc::Status Get(const std::unique_ptr<Comparable>& key, EltType* elt) const {
-    RepositoryMap::const_iterator it = main_index_.find(key);
-    if (it == main_index_.end()) {
-      std::stringstream error;
-      error << "Unable to find element with key: (\""
-            << key->to_string()
-            << "\")";
-      return grpc::Status(grpc::StatusCode::NOT_FOUND, error.str());
+  inline grpc::Status Get(const std::unique_ptr<Comparable>& key,
+                          EltType* elt) const {
+    return Get(key->encoded_key(), elt);
+  }
+
+  grpc::Status Get(const EncodedKey& key, EltType* elt) const {
+    EltConstPtr snapshot = LocateSnapshot(key);
+    if (!snapshot) {
+      return NotFound(key);
     }
-    int32_t location = it->second;
-    *elt = elements_[location];
+    *elt = *snapshot;
     return grpc::Status::OK;
   }
 
   // Warning: make sure that the updated_key would match the result of
-  // performing the mutation on the element. If this is incorrect, we
-  // could get a data corruption, as the mutation will occur - without
-  // a means of reverting back - but will not be completed.
-  grpc::Status ApplyMutation(const std::unique_ptr<Comparable>& key,
-                             const std::unique_ptr<Comparable>& updated_key,
+  // performing the mutation on the element. If this is incorrect, the
+  // mutation is rejected with an INTERNAL error.
+  //
+  // The mutation is applied to a copy of the element, which replaces the
+  // stored snapshot only once we know the new key is free; readers see
+  // either the old snapshot or the new one. Writers of the old or the new
+  // key wait for the mutation to finish; other writers do not.
+  inline grpc::Status ApplyMutation(
+      const std::unique_ptr<Comparable>& key,
+      const std::unique_ptr<Comparable>& updated_key,
+      ElementMutatorInterface<EltType>* mutator) {
+    return ApplyMutation(key->encoded_key(), updated_key->encoded_key(),
+                         mutator);
+  }
+
+  grpc::Status ApplyMutation(const EncodedKey& key,
+                             const EncodedKey& updated_key,
                              ElementMutatorInterface<EltType>* mutator) {
-    // TODO: Consider refactoring this method to make it simpler. Not
-    // immediately clear what we can do, but it seems we try the same
-    // or similar test comparisons a few times in this method.
-    RepositoryMap::iterator it = main_index_.find(key);
-    if (it == main_index_.end()) {
-      std::stringstream error;
-      error << "Unable to find element with key: (\""
-            << key->to_string()
-            << "\")";
-      return grpc::Status(grpc::StatusCode::NOT_FOUND, error.str());
+    KeyLock key_lock(this, key, updated_key);
+    int32_t location;
+    if (!Locate(key, &location)) {
+      return NotFound(key);
     }
 
-    int32_t location = it->second;
-    EltType* element = &(elements_[location]);
-
-    RepositoryMap::iterator new_location = main_index_.lower_bound(updated_key);
-    if (new_location != main_index_.end() &&
-        (*key != *updated_key) &&
-        *(new_location->first) == *updated_key) {
-      std::stringstream error;
-      error << "There is already an element with the key "
-            << updated_key->to_string() << ".";
-      return grpc::Status(grpc::StatusCode::ALREADY_EXISTS, error.str());
-    }
+    EltType element = *SnapshotAt(location);
 
     // Before applying the mutation, we want to capture the secondary
     // key information. That way, after making the change, we can
     // detect the difference.
-    std::vector<std::unique_ptr<Comparable>> prior_keys;
+    std::vector<EncodedKey> prior_keys;
     for (uint16_t i = 0; i < extractors_.size(); i++) {
-      prior_keys.push_back((extractors_[i])->GetKey(*element));
+      prior_keys.push_back((extractors_[i])->GetKey(element)->encoded_key());
     }
-    grpc::Status mutate_result = mutator->Mutate(element);
+    grpc::Status mutate_result = mutator->Mutate(&element);
 
     if (!mutate_result.ok()) {
       return mutate_result;
     }
 
-    std::unique_ptr<Comparable> new_key = main_extractor_->GetKey(*element);
+    IndexKey new_key(main_extractor_->GetKey(element));
 
-    if (*new_key != *updated_key) {
+    if (new_key.encoded != updated_key) {
       // This should *never* happen if we do things properly. Any time we
       // perform a Mutate operation, we should verify beforehand that the
       // mutation will not cause duplicate key violations.
       std::stringstream error;
       error << "Internal error: Applied mutation with wrong update key. "
             << "The expected update key was: (\""
-            << updated_key->to_string()
+            << updated_key.to_string()
             << "\"), but what was found was: (\""
-            << new_key->to_string()
-            << "\"). This mismatch will cause data corruption.";
+            << new_key.encoded.to_string()
+            << "\"). The mutation has not been applied.";
       return grpc::Status(grpc::StatusCode::INTERNAL, error.str());
     }
-    
-    if (*updated_key != *key) {
-      if (it == new_location) {
-        // While this is fairly rare, we do need to handle this case. The
-        // standard approach of erasing the old element than adding with
-        // a hint for the new element gets broken when the old and new
-        // reference locations are the same (such as what happens if we
-        // update a key without actually changing its over all sort location).
-        // The reason is because the delete will invalidate the new location
-        // iterator reference.
-        auto removed_location = main_index_.erase(it);
-        if (removed_location != main_index_.begin()) {
-          removed_location--;
-        }
-        main_index_.emplace_hint(removed_location, std::move(new_key),
-                                 location);
-      } else {
-        main_index_.erase(it);
-        if (new_location == main_index_.end()) {
-          new_location--;
+
+    std::vector<IndexKey> new_keys;
+    for (uint16_t i = 0; i < extractors_.size(); i++) {
+      new_keys.push_back(IndexKey(extractors_[i]->GetKey(element)));
+    }
+    EltConstPtr snapshot = std::make_shared<const EltType>(std::move(element));
+    bool key_changed = updated_key != key;
+    {
+      // Readers hold elements_guard_ from their index lookup until they
+      // have the snapshot, so changing the main key along with the
+      // snapshot under the lock means that a reader of either key finds
+      // the element only while it has that key. The new key goes in ahead
+      // of the old one coming out, point index first in both cases, as in
+      // Add and Remove.
+      ExclusiveLock elements_lock(elements_guard_);
+      if (key_changed && !InsertMainKey(&new_key, location)) {
+        std::stringstream error;
+        error << "There is already an element with the key "
+              << updated_key.to_string() << ".";
+        return grpc::Status(grpc::StatusCode::ALREADY_EXISTS, error.str());
+      }
+      elements_[location].swap(snapshot);
+      if (key_changed) {
+        if (point_index_) {
+          point_index_->Erase(key);
         }
-        main_index_.emplace_hint(new_location, std::move(new_key), location);
+        main_index_.EraseEntry(IndexKey(key), location);
       }
     }
+    // The prior snapshot is released here, outside the lock, unless a
+    // reader still holds it.
+    snapshot.reset();
 
     for (uint16_t i = 0; i < indices_.size(); i++) {
-      const std::unique_ptr<Extractor>& extractor = extractors_[i];
-      std::unique_ptr<Comparable> new_secondary = extractor->GetKey(*element);
-      grpc::Status result = UpdateSecondaryIndex(std::move(new_secondary),
-                                                 std::move(prior_keys[i]),
+      grpc::Status result = UpdateSecondaryIndex(std::move(new_keys[i]),
+                                                 prior_keys[i],
                                                  location,
                                                  i);
       if (! result.ok()) {
@@ -379,102 +552,340 @@ class MemRepository {
     return grpc::Status::OK;
   }
 
-  StatusEltConstPtrPair NonMutableGet(
+  // Returns the stored snapshot of the element, without copying it. The
+  // snapshot is unaffected by later updates or removal of the element.
+  inline StatusEltConstPtrPair NonMutableGet(
       const std::unique_ptr<Comparable>& key) const {
-    RepositoryMap::const_iterator it = main_index_.find(key);
-    if (it == main_index_.end()) {
-      std::stringstream error;
-      error << "Unable to find element with key: (\""
-            << key->to_string()
-            << "\")";
-      return StatusEltConstPtrPair(
-          grpc::Status(grpc::StatusCode::NOT_FOUND, error.str()),
-          nullptr);
+    return NonMutableGet(key->encoded_key());
+  }
+
+  StatusEltConstPtrPair NonMutableGet(const EncodedKey& key) const {
+    EltConstPtr snapshot = LocateSnapshot(key);
+    if (!snapshot) {
+      return StatusEltConstPtrPair(NotFound(key), nullptr);
     }
-    int32_t location = it->second;
-    return StatusEltConstPtrPair(grpc::Status::OK, &(elements_[location]));
+    return StatusEltConstPtrPair(grpc::Status::OK, std::move(snapshot));
   }
 
-  PrimaryIterator LowerBound(const std::unique_ptr<Comparable>& key) const {
-    PrimaryIterator ret_val(main_index_.lower_bound(key), &elements_);
-    return ret_val;
+  // Sets *snapshots to the current snapshot of every element, paired with
+  // its main key and sorted by it. See GetSnapshots and SortSnapshots.
+  void GetSortedSnapshots(std::vector<KeyedSnapshot>* snapshots) const {
+    GetSnapshots(snapshots);
+    SortSnapshots(snapshots);
   }
 
-  SecondaryIterator LowerBoundByIndex(const std::unique_ptr<Comparable>& key,
+  // Sets *snapshots to the current snapshot of every element, in no
+  // particular order and with empty keys; SortSnapshots fills those in.
+  // Writers are only held off while the snapshot pointers are copied. An
+  // Add or ApplyMutation that is in progress may or may not be seen, so a
+  // caller that needs a view consistent with other state must keep writers
+  // out for the duration of the call - but need not while sorting.
+  void GetSnapshots(std::vector<KeyedSnapshot>* snapshots) const {
+    snapshots->clear();
+    SharedLock elements_lock(elements_guard_);
+    snapshots->reserve(elements_.size());
+    for (const EltConstPtr& element : elements_) {
+      if (element) {
+        snapshots->push_back(KeyedSnapshot(EncodedKey(), element));
+      }
+    }
+  }
+
+  // Pairs each snapshot from GetSnapshots with its main key, and sorts them
+  // by it. Takes no locks: the snapshots are immutable.
+  void SortSnapshots(std::vector<KeyedSnapshot>* snapshots) const {
+    for (KeyedSnapshot& snapshot : *snapshots) {
+      snapshot.first =
+          main_extractor_->GetKey(*(snapshot.second))->encoded_key();
+    }
+    std::sort(snapshots->begin(), snapshots->end(),
+              [](const KeyedSnapshot& a, const KeyedSnapshot& b) {
+                return a.first < b.first;
+              });
+  }
+
+  // Iterators may be held while writing to the repository, but the chunk
+  // of an index that an iterator points into is only rebalanced once the
+  // iterator leaves it. See PartitionedMap.
+  inline PrimaryIterator LowerBound(
+      const std::unique_ptr<Comparable>& key) const {
+    return LowerBound(key->encoded_key());
+  }
+
+  PrimaryIterator LowerBound(const EncodedKey& key) const {
+    SharedLock elements_lock(elements_guard_);
+    return PrimaryIterator(main_index_.LowerBound(IndexKey(key)), this);
+  }
+
+  inline SecondaryIterator LowerBoundByIndex(
+      const std::unique_ptr<Comparable>& key, int index_number) const {
+    return LowerBoundByIndex(key->encoded_key(), index_number);
+  }
+
+  SecondaryIterator LowerBoundByIndex(const EncodedKey& key,
                                       int index_number) const {
-    return SecondaryIterator(indices_[index_number].lower_bound(key),
-                             &elements_);
+    SharedLock elements_lock(elements_guard_);
+    return SecondaryIterator(
+        indices_[index_number]->LowerBound(IndexKey(key)), this);
   }
 
   PrimaryIterator primary_begin() const {
-    return PrimaryIterator(main_index_.begin(), &elements_);
+    SharedLock elements_lock(elements_guard_);
+    return PrimaryIterator(main_index_.begin(), this);
   }
 
   const PrimaryIterator primary_end() const {
-    return PrimaryIterator(main_index_.end(), &elements_);
+    return PrimaryIterator(main_index_.end(), this);
   }
 
   const SecondaryIterator secondary_begin(int index_number) const {
-    return SecondaryIterator(indices_[index_number].begin(), &elements_);
+    SharedLock elements_lock(elements_guard_);
+    return SecondaryIterator(indices_[index_number]->begin(), this);
   }
 
   const SecondaryIterator secondary_end(int index_number) const {
-    return SecondaryIterator(indices_[index_number].end(), &elements_);
+    return SecondaryIterator(indices_[index_number]->end(), this);
+  }
+
+  // Starts a background thread for each index that rebalances its chunks
+  // every interval_nanos, rather than rebalancing inline on the writer
+  // that notices the drift. Useful during bulk registration, so that
+  // ingestion threads do not take turns rebalancing.
+  void StartBackgroundRebalancer(uint64_t interval_nanos) {
+    main_index_.StartBackgroundRebalancer(interval_nanos);
+    for (const std::unique_ptr<RepositoryIndex>& index : indices_) {
+      index->StartBackgroundRebalancer(interval_nanos);
+    }
+  }
+
+  void StopBackgroundRebalancer() {
+    main_index_.StopBackgroundRebalancer();
+    for (const std::unique_ptr<RepositoryIndex>& index : indices_) {
+      index->StopBackgroundRebalancer();
+    }
   }
  
  private:
+  typedef acumio::collection::HashIndex<int32_t> PointIndex;
+  typedef std::vector<std::pair<IndexKey, int32_t>> IndexEntries;
+
+  static const uint32_t WRITE_STRIPES = 64;
+
+  // Holds the write stripes for one or two main keys, or for all of them.
+  // Every writer holds the stripe of each main key it adds, removes or
+  // changes, so that the point index and the main index change together
+  // as far as other writers of the key can tell. Stripes are taken in
+  // index order, so two-key holders cannot deadlock.
+  class KeyLock {
+   public:
+    KeyLock(MemRepository* repository, const EncodedKey& key) {
+      Lock(repository, {Stripe(key)});
+    }
+
+    KeyLock(MemRepository* repository, const EncodedKey& key,
+            const EncodedKey& other_key) {
+      Lock(repository, {Stripe(key), Stripe(other_key)});
+    }
+
+    explicit KeyLock(MemRepository* repository) {
+      std::vector<uint32_t> stripes;
+      for (uint32_t i = 0; i < WRITE_STRIPES; i++) {
+        stripes.push_back(i);
+      }
+      Lock(repository, stripes);
+    }
+
+   private:
+    // FNV-1a.
+    static uint32_t Stripe(const EncodedKey& key) {
+      uint32_t hash = 2166136261u;
+      for (uint32_t i = 0; i < key.size(); i++) {
+        hash = (hash ^ static_cast<uint8_t>(key.data()[i])) * 16777619u;
+      }
+      return hash % WRITE_STRIPES;
+    }
+
+    void Lock(MemRepository* repository, std::vector<uint32_t> stripes) {
+      std::sort(stripes.begin(), stripes.end());
+      stripes.erase(std::unique(stripes.begin(), stripes.end()),
+                    stripes.end());
+      for (uint32_t stripe : stripes) {
+        locks_.push_back(std::unique_lock<std::mutex>(
+            repository->write_stripes_[stripe]));
+      }
+    }
+
+    std::vector<std::unique_lock<std::mutex>> locks_;
+  };
+
+  // Sets *entries to the key extractor gives each element, paired with the
+  // element's position, sorted by key and then by position.
+  static void SortIndexEntries(const Extractor& extractor,
+                               const std::vector<EltConstPtr>& elements,
+                               IndexEntries* entries) {
+    entries->reserve(elements.size());
+    for (size_t i = 0; i < elements.size(); i++) {
+      entries->push_back(std::pair<IndexKey, int32_t>(
+          IndexKey(extractor.GetKey(*(elements[i]))), i));
+    }
+    auto key_less = [](const std::pair<IndexKey, int32_t>& left,
+                       const std::pair<IndexKey, int32_t>& right) {
+      return left.first.encoded < right.first.encoded;
+    };
+    if (!std::is_sorted(entries->begin(), entries->end(), key_less)) {
+      std::stable_sort(entries->begin(), entries->end(), key_less);
+    }
+  }
+
+  // Runs the first task on the calling thread, and each of the others on
+  // a thread of its own, returning once all are done.
+  static void RunInParallel(const std::vector<std::function<void()>>& tasks) {
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < tasks.size(); i++) {
+      threads.push_back(std::thread(tasks[i]));
+    }
+    if (!tasks.empty()) {
+      tasks[0]();
+    }
+    for (std::thread& thread : threads) {
+      thread.join();
+    }
+  }
+
+  // Inserts the main key into the point index, where we have one, and then
+  // into the main index. Returns false, leaving *key in place and both
+  // indexes unchanged, if the key is already present. The caller must
+  // hold the key's stripe.
+  bool InsertMainKey(IndexKey* key, int32_t location) {
+    if (point_index_ && !point_index_->Insert(key->encoded, location)) {
+      return false;
+    }
+    EncodedKey encoded;
+    if (point_index_) {
+      encoded = key->encoded;
+    }
+    if (!main_index_.Insert(std::move(*key), location)) {
+      if (point_index_) {
+        point_index_->Erase(encoded);
+      }
+      return false;
+    }
+    return true;
+  }
+
+  // Finds the location of the element with the given main key, using the
+  // point index where we have one.
+  inline bool Locate(const EncodedKey& key, int32_t* location) const {
+    if (point_index_) {
+      return point_index_->Get(key, location);
+    }
+    return main_index_.Get(IndexKey(key), location);
+  }
+
+  // Returns the snapshot of the element with the given main key, or null
+  // if there is none. elements_guard_ is held from the lookup through to
+  // taking the snapshot: Remove erases the key from the indexes before
+  // FreeElement clears and recycles its slot, so the slot we find cannot
+  // be freed, or handed to another element, in between.
+  EltConstPtr LocateSnapshot(const EncodedKey& key) const {
+    SharedLock elements_lock(elements_guard_);
+    int32_t location;
+    if (!Locate(key, &location)) {
+      return nullptr;
+    }
+    return elements_[location];
+  }
+
+  static grpc::Status NotFound(const EncodedKey& key) {
+    std::stringstream error;
+    error << "Unable to find element with key: (\""
+          << key.to_string()
+          << "\")";
+    return grpc::Status(grpc::StatusCode::NOT_FOUND, error.str());
+  }
+
+  EltConstPtr SnapshotAt(int32_t location) const {
+    SharedLock elements_lock(elements_guard_);
+    return elements_[location];
+  }
+
+  // Get the position in the elements_ array from the free_list_.
+  // Note that the bottom entry in the free_list_ stack is always
+  // the one equal to the total size of the elements_ array.
+  int32_t AllocateElement(const EltType& e) {
+    EltConstPtr snapshot = std::make_shared<const EltType>(e);
+    ExclusiveLock elements_lock(elements_guard_);
+    int32_t new_elt_pos = free_list_.top();
+    free_list_.pop();
+    if (free_list_.empty()) {
+      // assert: new_elt_pos == elements_.size()
+      elements_.push_back(std::move(snapshot));
+      free_list_.push(elements_.size());
+    }
+    else {
+      elements_[new_elt_pos] = std::move(snapshot);
+    }
+    return new_elt_pos;
+  }
+
+  void FreeElement(int32_t elt_pos) {
+    EltConstPtr released;
+    ExclusiveLock elements_lock(elements_guard_);
+    elements_[elt_pos].swap(released);
+    free_list_.push(elt_pos);
+  }
+
   grpc::Status UpdateSecondaryIndex(
-      std::unique_ptr<Comparable> new_key,
-      const std::unique_ptr<Comparable>& prior_key,
+      IndexKey new_key,
+      const EncodedKey& prior_key,
       int32_t elt_pos,
       int32_t index_number) {
-    if (prior_key == new_key) {
+    if (prior_key == new_key.encoded) {
       return grpc::Status::OK;
     }
-    RepositoryMultiMap& index = indices_[index_number];
-    indices_[index_number].emplace(std::move(new_key), elt_pos);
+    RepositoryIndex* index = indices_[index_number].get();
+    index->Insert(std::move(new_key), elt_pos);
     return DeleteFromSecondaryIndex(index, prior_key, index_number, elt_pos);
   }
 
-  grpc::Status DeleteFromSecondaryIndex(RepositoryMultiMap& index,
-                                        const std::unique_ptr<Comparable>& key,
+  grpc::Status DeleteFromSecondaryIndex(RepositoryIndex* index,
+                                        const EncodedKey& key,
                                         int32_t index_number,
                                         int32_t elt_pos) {
-    std::pair<RepositoryMultiMap::iterator,
-              RepositoryMultiMap::iterator> range = index.equal_range(key);
-    RepositoryMultiMap::iterator lower = range.first;
-    RepositoryMultiMap::iterator upper = range.second;
-    while (lower != upper && lower->second != elt_pos) {
-      lower++;
-    }
-
-    if (lower->second != elt_pos) {
-      // TODO: Log Error. Error probably caused by multi-threaded access
-      // corruption. Since we are not really thread-safe here, we should
-      // expect this.
+    if (!index->EraseEntry(IndexKey(key), elt_pos)) {
+      // TODO: Log Error.
       std::stringstream error;
       error << "Index corruption detected when looking at index (\""
             << std::to_string(index_number)
             << "\") while removing key (\""
-            << key->to_string()
+            << key.to_string()
             << "\") and expecting element position (\""
             << std::to_string(elt_pos)
             << "\").";
       return grpc::Status(grpc::StatusCode::DATA_LOSS, error.str());
     }
-    index.erase(lower);
     return grpc::Status::OK;
   }
 
-
-  std::vector<EltType> elements_;
+  // The current snapshot of each element; a free slot holds nullptr.
+  // elements_guard_ protects elements_ and free_list_, but not the
+  // snapshots themselves, which never change once stored.
+  std::deque<EltConstPtr> elements_;
   std::unique_ptr<Extractor> main_extractor_;
-  RepositoryMap main_index_;
+  RepositoryIndex main_index_;
+  // Null unless hash_point_lookups was requested.
+  std::unique_ptr<PointIndex> point_index_;
   std::vector<std::unique_ptr<Extractor>> extractors_;
-  std::vector<RepositoryMultiMap> indices_;
+  std::vector<std::unique_ptr<RepositoryIndex>> indices_;
   std::stack<int32_t> free_list_;
+  mutable SharedMutex elements_guard_;
+  // Writers of main keys in the same stripe are serialized; see KeyLock.
+  std::mutex write_stripes_[WRITE_STRIPES];
 };
 
+template <class EltType>
+const uint32_t MemRepository<EltType>::WRITE_STRIPES;
+
 } // namespace mem_repository
 } // namespace acumio
 
@@ -7,11 +7,15 @@
 // Copyright   : Copyright (C) 2016 Acumio
 // Description : Provides templated multi-threaded access to an in-memory
 //               repository for an entity that is paired with a
-//               MultiDescriptionHistory.
+//               MultiDescriptionHistory. Each tagged history is stored
+//               compressed (see description_deltas.h), and only expanded
+//               when asked for.
 //============================================================================
 
 #include "comparable.h"
+#include "encoded_key.h"
 #include "description.pb.h"
+#include "description_deltas.h"
 #include "mem_repository.h"
 #include "model_constants.h"
 #include "multi_description_mutations.h"
@@ -61,11 +65,12 @@ grpc::Status PopulateMultiDescription(
     return PopulateMultiDescriptionAllTags(history, description);
   }
 
-  auto history_map = history.history();
+  const auto& history_map = history.history();
   auto description_map = description->mutable_description();
   for (auto it = tags_begin; it != tags_end; it++) {
-    if (history_map.count(*it) > 0) {
-      const model::DescriptionHistory& specific_history = history_map[*it];
+    auto found = history_map.find(*it);
+    if (found != history_map.end()) {
+      const model::DescriptionHistory& specific_history = found->second;
       int num_versions = specific_history.version_size();
       if  (num_versions > 0) {
         (*description_map)[*it] = specific_history.version(num_versions - 1);
@@ -84,19 +89,21 @@ grpc::Status PopulateMultiDescriptionHistory(
     return grpc::Status::OK;
   }
 
+  const auto& source_history_map = source.history();
+  auto target_history_map = target->mutable_history();
   if (*tags_begin == acumio::model::WILDCARD) {
-    target->CopyFrom(source);
+    for (auto it = source_history_map.begin(); it != source_history_map.end();
+         it++) {
+      ExpandHistory(it->second, &((*target_history_map)[it->first]));
+    }
     return grpc::Status::OK;
   }
 
-  auto source_history_map = source.history();
-  auto target_history_map = target->mutable_history();
   for (auto it = tags_begin; it != tags_end; it++) {
     const std::string& tag = *it;
-    if (source_history_map.count(tag) >  0) {
-      const acumio::model::DescriptionHistory& specific_source =
-          source_history_map[tag];
-      (*target_history_map)[tag] = specific_source;
+    auto found = source_history_map.find(tag);
+    if (found != source_history_map.end()) {
+      ExpandHistory(found->second, &((*target_history_map)[tag]));
     }
   }
   return grpc::Status::OK;
@@ -133,13 +140,17 @@ class MultiDescribedRepository {
   typedef MemRepository<acumio::model::MultiDescribed<Entity>> _Repository;
   typedef typename _Repository::PrimaryIterator PrimaryIterator;
   typedef typename _Repository::SecondaryIterator SecondaryIterator;
+  typedef typename _Repository::EltConstPtr Snapshot;
+  typedef typename _Repository::KeyedSnapshot KeyedSnapshot;
   typedef google::protobuf::Map<std::string, acumio::model::Description>
       DescriptionMap;
   typedef google::protobuf::Map<std::string, acumio::model::DescriptionHistory>
       DescriptionHistoryMap;
 
+  // See MemRepository for hash_point_lookups.
   MultiDescribedRepository(std::unique_ptr<Delegate> main_extractor,
-                           std::vector<std::unique_ptr<Delegate>>* extractors) {
+                           std::vector<std::unique_ptr<Delegate>>* extractors,
+                           bool hash_point_lookups = false) {
     std::unique_ptr<Extractor> described_main_extractor(
         new Extractor(std::move(main_extractor)));
     std::vector<std::unique_ptr<_BaseExtractor>> described_extractors;
@@ -150,7 +161,8 @@ class MultiDescribedRepository {
       described_extractors.push_back(std::move(current));
     }
     repository_.reset(new _Repository(std::move(described_main_extractor),
-                                      &described_extractors));
+                                      &described_extractors,
+                                      hash_point_lookups));
   }
 
   ~MultiDescribedRepository() {}
@@ -167,8 +179,12 @@ class MultiDescribedRepository {
     return dynamic_cast<const Extractor&>(repository_->ith_extractor(i));
   }
 
-  inline grpc::Status Add(const acumio::model::MultiDescribed<Entity>& e) {
-    return repository_->Add(e);
+  inline uint32_t size() const { return repository_->size(); }
+
+  grpc::Status Add(const acumio::model::MultiDescribed<Entity>& e) {
+    acumio::model::MultiDescribed<Entity> compressed(e);
+    CompressHistory(&(compressed.history));
+    return repository_->Add(compressed);
   }
 
   grpc::Status Add(const Entity& e,
@@ -183,16 +199,58 @@ class MultiDescribedRepository {
       model::DescriptionHistory specific_history;
       model::Description* new_desc = specific_history.add_version();
       new_desc->CopyFrom(it->second);
+      new_desc->clear_contents_delta();
       if (!new_desc->has_edit_time() || new_desc->edit_time().seconds() == 0) {
         acumio::time::SetTimestampToNow(new_desc->mutable_edit_time());
       }
       (*history_map)[it->first] = specific_history;
     }
 
-    return Add(elt); 
+    // Each history has a single version, so there is nothing to compress.
+    return repository_->Add(elt);
+  }
+
+  // See MemRepository::BulkLoad.
+  grpc::Status BulkLoad(
+      std::vector<acumio::model::MultiDescribed<Entity>>* elts) {
+    for (acumio::model::MultiDescribed<Entity>& elt : *elts) {
+      CompressHistory(&(elt.history));
+    }
+    return repository_->BulkLoad(elts);
+  }
+
+  // See MemRepository::Clear.
+  void Clear() {
+    repository_->Clear();
+  }
+
+  // See MemRepository::GetSortedSnapshots.
+  inline void GetSortedSnapshots(std::vector<KeyedSnapshot>* snapshots) const {
+    repository_->GetSortedSnapshots(snapshots);
+  }
+
+  // See MemRepository::GetSnapshots.
+  inline void GetSnapshots(std::vector<KeyedSnapshot>* snapshots) const {
+    repository_->GetSnapshots(snapshots);
+  }
+
+  // See MemRepository::SortSnapshots.
+  inline void SortSnapshots(std::vector<KeyedSnapshot>* snapshots) const {
+    repository_->SortSnapshots(snapshots);
   }
 
-  grpc::Status GetEntity(const std::unique_ptr<Comparable>& key,
+  // Shares the stored entity and its descriptions rather than copying
+  // them out; the snapshot does not change if the entity is updated.
+  // Note that the snapshot's histories are compressed; use ExpandHistory
+  // to read their older versions.
+  grpc::Status GetSnapshot(const EncodedKey& key, Snapshot* snapshot) const {
+    typename _Repository::StatusEltConstPtrPair getResult =
+        repository_->NonMutableGet(key);
+    snapshot->swap(getResult.second);
+    return getResult.first;
+  }
+
+  grpc::Status GetEntity(const EncodedKey& key,
                          Entity* entity) const {
     typename _Repository::StatusEltConstPtrPair getResult =
         repository_->NonMutableGet(key);
@@ -205,7 +263,7 @@ class MultiDescribedRepository {
   }
 
   grpc::Status GetDescription(
-      const std::unique_ptr<Comparable>& key,
+      const EncodedKey& key,
       acumio::proto::ConstProtoIterator<std::string>& description_tags_begin,
       acumio::proto::ConstProtoIterator<std::string>& description_tags_end,
       acumio::proto::ConstProtoIterator<std::string>& history_tags_begin,
@@ -233,7 +291,7 @@ class MultiDescribedRepository {
   }
 
   grpc::Status GetEntityAndDescription(
-      const std::unique_ptr<Comparable>& key,
+      const EncodedKey& key,
       acumio::proto::ConstProtoIterator<std::string>& description_tags_begin,
       acumio::proto::ConstProtoIterator<std::string>& description_tags_end,
       acumio::proto::ConstProtoIterator<std::string>& history_tags_begin,
@@ -248,34 +306,45 @@ class MultiDescribedRepository {
     }
 
     entity->CopyFrom(getResult.second->entity);
-    const acumio::model::MultiDescriptionHistory& source_history =
-        getResult.second->history;
+    return GetSnapshotDescription(
+        getResult.second, description_tags_begin, description_tags_end,
+        history_tags_begin, history_tags_end, description, history);
+  }
 
+  // As GetDescription, for a snapshot already in hand.
+  grpc::Status GetSnapshotDescription(
+      const Snapshot& snapshot,
+      acumio::proto::ConstProtoIterator<std::string>& description_tags_begin,
+      acumio::proto::ConstProtoIterator<std::string>& description_tags_end,
+      acumio::proto::ConstProtoIterator<std::string>& history_tags_begin,
+      acumio::proto::ConstProtoIterator<std::string>& history_tags_end,
+      acumio::model::MultiDescription* description,
+      acumio::model::MultiDescriptionHistory* history) const {
     grpc::Status check = PopulateMultiDescription(
-        source_history, description_tags_begin, description_tags_end,
+        snapshot->history, description_tags_begin, description_tags_end,
         description);
     if (!check.ok()) {
       return check;
     }
 
     return PopulateMultiDescriptionHistory(
-        source_history, history_tags_begin, history_tags_end, history);
+        snapshot->history, history_tags_begin, history_tags_end, history);
   }
 
   // The type for the key should match the type returned by the
   // main_extractor used in the interface. In other words, given
   // an Entity e, and the main_extractor then main_extractor.GetKey(e)
   // could feasibly match the parameter key in this method
-  inline grpc::Status Remove(const std::unique_ptr<Comparable>& key) {
+  inline grpc::Status Remove(const EncodedKey& key) {
     return repository_->Remove(key);
   }
 
   grpc::Status Update(
-      const std::unique_ptr<Comparable>& key, const Entity& new_value) {
+      const EncodedKey& key, const Entity& new_value) {
     EntityMutator mutator(new_value);
 
-    std::unique_ptr<Comparable> updated_key =
-        main_extractor().delegate().GetKey(new_value);
+    EncodedKey updated_key =
+        main_extractor().delegate().GetKey(new_value)->encoded_key();
     return repository_->ApplyMutation(
         key,
         updated_key,
@@ -284,13 +353,13 @@ class MultiDescribedRepository {
   }
 
   grpc::Status UpdateWithDescription(
-     const std::unique_ptr<Comparable>& key,
+     const EncodedKey& key,
      const Entity& new_value,
      const MultiMutationInterface* description_update) {
     EntityAndDescriptionMutator mutator(new_value, description_update);
  
-    std::unique_ptr<Comparable> updated_key =
-        main_extractor().delegate().GetKey(new_value);
+    EncodedKey updated_key =
+        main_extractor().delegate().GetKey(new_value)->encoded_key();
     return repository_->ApplyMutation(
         key,
         updated_key,
@@ -299,7 +368,7 @@ class MultiDescribedRepository {
   }
 
   grpc::Status UpdateDescription(
-      const std::unique_ptr<Comparable>& key,
+      const EncodedKey& key,
       const MultiMutationInterface* description_update) {
     DescriptionOnlyMutator mutator(description_update);
 
@@ -316,7 +385,7 @@ class MultiDescribedRepository {
   }
 
   inline PrimaryIterator LowerBound(
-      const std::unique_ptr<Comparable>& key) const {
+      const EncodedKey& key) const {
     return repository_->LowerBound(key);
   }
 
@@ -329,7 +398,7 @@ class MultiDescribedRepository {
   }
 
   inline SecondaryIterator LowerBoundByIndex(
-      const std::unique_ptr<Comparable>& key, int index_number) const {
+      const EncodedKey& key, int index_number) const {
     return repository_->LowerBoundByIndex(key, index_number);
   }
 
@@ -362,7 +431,9 @@ class MultiDescribedRepository {
         description_update_(description_update) {}
     ~DescriptionOnlyMutator() {}
     inline grpc::Status Mutate(acumio::model::MultiDescribed<Entity>* element) {
-      return description_update_->Mutate(&(element->history));
+      grpc::Status result = description_update_->Mutate(&(element->history));
+      CompressHistory(&(element->history));
+      return result;
     }
 
    private:
@@ -379,7 +450,9 @@ class MultiDescribedRepository {
     ~EntityAndDescriptionMutator() {}
     inline grpc::Status Mutate(acumio::model::MultiDescribed<Entity>* element) {
       element->entity = new_value_;
-      return description_update_->Mutate(&(element->history));
+      grpc::Status result = description_update_->Mutate(&(element->history));
+      CompressHistory(&(element->history));
+      return result;
     }
 
    private:
@@ -50,7 +50,8 @@ NamespaceRepository::NamespaceRepository() : repository_(nullptr) {
   std::vector<std::unique_ptr<_NamespaceExtractor>> additional_extractors;
   additional_extractors.push_back(std::move(short_name_extractor));
   repository_.reset(new _Repository(std::move(main_extractor),
-                                    &additional_extractors));
+                                    &additional_extractors,
+                                    true));
 }
 
 NamespaceRepository::~NamespaceRepository() {}
@@ -32,12 +32,39 @@ class NamespaceRepository {
   typedef mem_repository::DescribedRepository<model::Namespace> _Repository;
   typedef _Repository::PrimaryIterator PrimaryIterator;
   typedef _Repository::SecondaryIterator SecondaryIterator;
+  typedef _Repository::KeyedSnapshot KeyedSnapshot;
+  typedef _Repository::Snapshot Snapshot;
 
   NamespaceRepository();
   ~NamespaceRepository();
 
   inline uint32_t size() const { return repository_->size(); }
 
+  // See MemRepository::BulkLoad.
+  inline grpc::Status BulkLoad(std::vector<model::DescribedNamespace>* elts) {
+    return repository_->BulkLoad(elts);
+  }
+
+  // See MemRepository::Clear.
+  inline void Clear() {
+    repository_->Clear();
+  }
+
+  // See MemRepository::GetSortedSnapshots.
+  inline void GetSortedSnapshots(std::vector<KeyedSnapshot>* snapshots) const {
+    repository_->GetSortedSnapshots(snapshots);
+  }
+
+  // See MemRepository::GetSnapshots.
+  inline void GetSnapshots(std::vector<KeyedSnapshot>* snapshots) const {
+    repository_->GetSnapshots(snapshots);
+  }
+
+  // See MemRepository::SortSnapshots.
+  inline void SortSnapshots(std::vector<KeyedSnapshot>* snapshots) const {
+    repository_->SortSnapshots(snapshots);
+  }
+
   inline grpc::Status AddWithDescription(const model::Namespace& name_space,
                                          const model::Description& desc) {
     return repository_->AddWithDescription(name_space, desc);
@@ -49,13 +76,20 @@ class NamespaceRepository {
 
   inline grpc::Status GetNamespace(const std::string& full_name,
                              model::Namespace* elt) const {
-    std::unique_ptr<Comparable> key(new StringComparable(full_name));
+    EncodedKey key = EncodedKey::ForString(full_name);
     return repository_->GetEntity(key, elt);
   }
 
+  // See DescribedRepository::GetSnapshot.
+  inline grpc::Status GetNamespaceSnapshot(const std::string& full_name,
+                                           Snapshot* snapshot) const {
+    EncodedKey key = EncodedKey::ForString(full_name);
+    return repository_->GetSnapshot(key, snapshot);
+  }
+
   inline grpc::Status GetDescription(const std::string& full_name,
                                      model::Description* description) const {
-    std::unique_ptr<Comparable> key(new StringComparable(full_name));
+    EncodedKey key = EncodedKey::ForString(full_name);
     // TODO: Translate NOT_FOUND results to present better error message.
     //       Perhaps the best way is to push the information down to
     //       the constructor of the generic repository so that it can
@@ -65,7 +99,7 @@ class NamespaceRepository {
 
   inline grpc::Status GetDescriptionHistory(
       const std::string& full_name, model::DescriptionHistory* history) const {
-    std::unique_ptr<Comparable> key(new StringComparable(full_name));
+    EncodedKey key = EncodedKey::ForString(full_name);
     // TODO: Translate NOT_FOUND results to present better error message.
     //       Perhaps the best way is to push the information down to
     //       the constructor of the generic repository so that it can
@@ -77,7 +111,7 @@ class NamespaceRepository {
       const std::string& full_name,
       model::Namespace* name_space,
       model::Description* description) const {
-    std::unique_ptr<Comparable> key(new StringComparable(full_name));
+    EncodedKey key = EncodedKey::ForString(full_name);
     // TODO: Translate NOT_FOUND results to present better error message.
     //       Perhaps the best way is to push the information down to
     //       the constructor of the generic repository so that it can
@@ -89,7 +123,7 @@ class NamespaceRepository {
       const std::string& full_name,
       model::Namespace* name_space,
       model::DescriptionHistory* history) const {
-    std::unique_ptr<Comparable> key(new StringComparable(full_name));
+    EncodedKey key = EncodedKey::ForString(full_name);
     // TODO: Translate NOT_FOUND results to present better error message.
     //       Perhaps the best way is to push the information down to
     //       the constructor of the generic repository so that it can
@@ -100,32 +134,32 @@ class NamespaceRepository {
   }
 
   inline grpc::Status Remove(const std::string& full_name) {
-    std::unique_ptr<Comparable> key(new StringComparable(full_name));
+    EncodedKey key = EncodedKey::ForString(full_name);
     return repository_->Remove(key);
   }
 
   inline grpc::Status UpdateNoDescription(const std::string& full_name,
                                           const model::Namespace& name_space) {
-    std::unique_ptr<Comparable> key(new StringComparable(full_name));
+    EncodedKey key = EncodedKey::ForString(full_name);
     return repository_->UpdateNoDescription(key, name_space);
   }
 
   inline grpc::Status ClearDescription(const std::string& full_name) {
-    std::unique_ptr<Comparable> key(new StringComparable(full_name));
+    EncodedKey key = EncodedKey::ForString(full_name);
     return repository_->ClearDescription(key);
   }
 
   inline grpc::Status UpdateDescriptionOnly(
       const std::string& full_name,
       const model::Description& description) {
-    std::unique_ptr<Comparable> key(new StringComparable(full_name));
+    EncodedKey key = EncodedKey::ForString(full_name);
     return repository_->UpdateDescriptionOnly(key, description);
   }
 
   inline grpc::Status UpdateAndClearDescription(
       const std::string& full_name,
       const model::Namespace& name_space) {
-    std::unique_ptr<Comparable> key(new StringComparable(full_name));
+    EncodedKey key = EncodedKey::ForString(full_name);
     return repository_->UpdateAndClearDescription(key, name_space);
   }
 
@@ -133,12 +167,12 @@ class NamespaceRepository {
       const std::string& full_name,
       const model::Namespace& update,
       const model::Description& description) {
-    std::unique_ptr<Comparable> key(new StringComparable(full_name));
+    EncodedKey key = EncodedKey::ForString(full_name);
     return repository_->UpdateWithDescription(key, update, description);
   }
 
   PrimaryIterator LowerBoundByFullName(const std::string& full_name) {
-    std::unique_ptr<Comparable> key(new StringComparable(full_name));
+    EncodedKey key = EncodedKey::ForString(full_name);
     return repository_->LowerBound(key);
   }
 
@@ -151,8 +185,8 @@ class NamespaceRepository {
   }
 
   SecondaryIterator LowerBoundByShortName(const std::string& short_name) {
-    std::unique_ptr<Comparable> string_key(new StringComparable(short_name));
-    return repository_->LowerBoundByIndex(string_key, 0);
+    EncodedKey key = EncodedKey::ForString(short_name);
+    return repository_->LowerBoundByIndex(key, 0);
   }
 
   const SecondaryIterator short_name_begin() const {
@@ -10,25 +10,31 @@
 //               referenceable by a uint32_t - which will be small enough
 //               to make their use in an index cheap. In this way, an index
 //               can refer to the "values" portion as a uint32_t while
-//               we store the objects themselves as a massive pre-allocated
-//               array.
+//               we store the objects themselves in large pre-allocated
+//               arrays.
 //
-//               Use care when selecting an initial capacity. the intent here
-//               is for a somewhat large in-memory store. The initial capacity
-//               should be set to accomodate the expected size of the store.
-//               If the arrays have to grow, the re-allocation time might
-//               make the value of using this class questionable.
+//               The objects live in fixed-size chunks, and a position
+//               encodes the chunk in its upper bits and the offset within
+//               the chunk in its lower CHUNK_BITS bits. Chunks are never
+//               moved or released before the allocator is, so growing never
+//               copies existing objects, and a reference obtained from
+//               ObjectAt stays valid for as long as the object is
+//               referenced. The chunk directory is fixed at construction,
+//               which caps the allocator at MAX_CHUNKS * CHUNK_SIZE objects;
+//               beyond that, Add returns ImpossiblePosition().
 //
-//               TODO: Allocate chunks of capacity instead of having a single
-//               large capacity block. See the TODO comment in the private
-//               member variables section.
-//               possible allocation would then be 2048*2048 =~ 4 million.
+//               Add, AddReference and DropReference may be called from
+//               multiple threads, and none of them takes a lock: reference
+//               counts are atomic, freed positions go on a lock-free stack
+//               (tagged against the ABA problem), and fresh positions are
+//               handed out by an atomic counter. A new chunk is installed
+//               by whichever thread first needs it.
 //============================================================================
 
-#include <stack>
+#include <atomic>
+#include <memory>
 #include <stdint.h>
 #include <string>
-#include <vector>
 
 namespace acumio {
 namespace collection {
@@ -39,35 +45,56 @@ class ObjectAllocator {
  public:
   const uint16_t MAX_REFERENCE_COUNT = UINT16_C(65534);
 
+  static const uint32_t CHUNK_BITS = 12;
+  static const uint32_t CHUNK_SIZE = UINT32_C(1) << CHUNK_BITS;
+  static const uint32_t MAX_CHUNKS = UINT32_C(1) << 14;
+
+  // Chunks covering initial_capacity objects are allocated up front.
   ObjectAllocator(uint32_t initial_capacity = UINT32_C(16384)) :
-      elements_(), reference_counts_(), free_list_() {
-    elements_.reserve(initial_capacity);
-    reference_counts_.reserve(initial_capacity);
-    free_list_.push(UINT32_C(0));
+      chunks_(new std::atomic<Chunk*>[MAX_CHUNKS]), next_unused_(0),
+      free_head_(EMPTY_FREE_LIST), live_count_(0) {
+    for (uint32_t i = 0; i < MAX_CHUNKS; i++) {
+      chunks_[i].store(nullptr, std::memory_order_relaxed);
+    }
+    uint32_t initial_chunks = (initial_capacity + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    for (uint32_t i = 0; i < initial_chunks && i < MAX_CHUNKS; i++) {
+      chunks_[i].store(new Chunk(), std::memory_order_relaxed);
+    }
   }
 
-  ~ObjectAllocator() {}
+  ~ObjectAllocator() {
+    for (uint32_t i = 0; i < MAX_CHUNKS; i++) {
+      delete chunks_[i].load(std::memory_order_relaxed);
+    }
+  }
 
   inline const EltType& ObjectAt(uint32_t position) const {
-    return elements_[position];
+    return ChunkOf(position)->elements[position & OFFSET_MASK];
   }
 
   inline EltType& ModifiableObjectAt(uint32_t position) {
-    return elements_[position];
+    return ChunkOf(position)->elements[position & OFFSET_MASK];
+  }
+
+  // Kept for callers written against the earlier, re-allocating layout;
+  // since objects no longer move, this is just a copy of ObjectAt.
+  EltType CopyObjectAt(uint32_t position) const {
+    return ObjectAt(position);
   }
 
   uint32_t Add(const EltType& object) {
-    uint32_t ret_val = free_list_.top();
-    free_list_.pop();
-    if (free_list_.empty()) {
-      elements_.push_back(object);
-      reference_counts_.push_back(UINT16_C(1));
-      free_list_.push(elements_.size());
-    } else {
-      elements_[ret_val] = object;
-      reference_counts_[ret_val] = UINT16_C(1);
+    uint32_t ret_val = PopFree();
+    if (ret_val == ImpossiblePosition()) {
+      ret_val = TakeUnused();
+      if (ret_val == ImpossiblePosition()) {
+        return ret_val;
+      }
     }
-
+    Chunk* chunk = ChunkOf(ret_val);
+    chunk->elements[ret_val & OFFSET_MASK] = object;
+    chunk->reference_counts[ret_val & OFFSET_MASK].store(
+        UINT16_C(1), std::memory_order_release);
+    live_count_.fetch_add(1, std::memory_order_relaxed);
     return ret_val;
   }
 
@@ -81,56 +108,54 @@ class ObjectAllocator {
   // The operation is undefined if position does not refer to an actual
   // object.
   uint16_t AddReference(uint32_t position) {
-    if (position >= reference_counts_.size()) {
-      return 0;
-    }
-    int ret_val = ++(reference_counts_[position]);
-    if (ret_val == 1) {
-      reference_counts_[position] = 0;
-      return 0;
-    } else if (ret_val > MAX_REFERENCE_COUNT) {
-      reference_counts_[position] = MAX_REFERENCE_COUNT;
+    std::atomic<uint16_t>* count = ReferenceCountAt(position);
+    if (count == nullptr) {
       return 0;
     }
-
-    return ret_val;
+    uint16_t current = count->load(std::memory_order_relaxed);
+    do {
+      if (current == 0 || current >= MAX_REFERENCE_COUNT) {
+        return 0;
+      }
+    } while (!count->compare_exchange_weak(current, current + 1,
+                                           std::memory_order_acq_rel));
+    return current + 1;
   }
 
   // Returns the total number of references to the given position after
   // dropping one. If the total number of references at the position was
   // previously 0, this is a no-op, with 0 returned. If the total
   // reference count goes to 0, this is effectively removed.
-  uint16_t DropReference(uint16_t position) {
-    if (position >= reference_counts_.size()) {
+  uint16_t DropReference(uint32_t position) {
+    std::atomic<uint16_t>* count = ReferenceCountAt(position);
+    if (count == nullptr) {
       return 0;
     }
-    uint16_t* value = &(reference_counts_[position]);
-    switch (*value) {
-      case 0:
+    uint16_t current = count->load(std::memory_order_relaxed);
+    do {
+      if (current == 0) {
         return 0;
-      case 1: 
-        *value = 0;
-        if (position == elements_.size() - 1) {
-          if (free_list_.top() == elements_.size()) {
-            free_list_.pop();
-          }
-          elements_.pop_back();
-          reference_counts_.pop_back();
-          free_list_.push(elements_.size());
-          return 0;
-        }
-      default:
-        *value = *value - 1;
+      }
+    } while (!count->compare_exchange_weak(current, current - 1,
+                                           std::memory_order_acq_rel));
+    if (current > 1) {
+      return current - 1;
     }
-    return *value;
+    // The position becomes reusable. We let go of the object itself first,
+    // in case it holds resources of its own.
+    ModifiableObjectAt(position) = EltType();
+    live_count_.fetch_sub(1, std::memory_order_relaxed);
+    PushFree(position);
+    return 0;
   }
 
   inline uint16_t ReferenceCount(uint32_t position) const {
-    return reference_counts_[position];
+    return ChunkOf(position)->reference_counts[position & OFFSET_MASK].load(
+        std::memory_order_acquire);
   }
 
   inline uint32_t size() {
-    return elements_.size() + 1 - free_list_.size();
+    return live_count_.load(std::memory_order_relaxed);
   }
 
   inline uint32_t ImpossiblePosition() const {
@@ -138,27 +163,113 @@ class ObjectAllocator {
   }
 
  private:
-  // TODO: Modify elements_ and reference_counts_ to:
-  //  std::vector<std::vector<EltType>> elements_ and
-  //  std::vector<std::vector<uint16_t>> reference_counts_ respectively.
-  // Currently, we reserve an initial vector size, and rely on standard
-  // vector growth to handle capacity. The idea with the double vectoring
-  // is to have an initial capacity of V vectors, and each of the vectors
-  // could be allowed to reserve initially 1 element, but when growth is
-  // needed, it could reserve M elements. This will allow for V*M elements
-  // before needing to worry about re-allocation.
-  // M should be large enough to give efficiency but small enough that we
-  // won't get into trouble with memory fragmentation. Setting V and M
-  // to 2048 each allows for approx. 4 million elements total. The downside
-  // of this approach is that references to the elements will require
-  // an extra pointer hop.
-  std::vector<EltType> elements_;
-  std::vector<uint16_t> reference_counts_;
-  std::stack<uint32_t> free_list_;
+  static const uint32_t OFFSET_MASK = CHUNK_SIZE - 1;
+  // The low half of free_head_ holds the top position of the free stack,
+  // and the high half a tag, bumped on every change so that a stale
+  // compare-and-swap cannot succeed even if the same position is back on
+  // top.
+  static const uint64_t EMPTY_FREE_LIST = UINT32_MAX;
+
+  struct Chunk {
+    Chunk() {
+      for (uint32_t i = 0; i < CHUNK_SIZE; i++) {
+        reference_counts[i].store(0, std::memory_order_relaxed);
+        next_free[i].store(UINT32_MAX, std::memory_order_relaxed);
+      }
+    }
+    EltType elements[CHUNK_SIZE];
+    std::atomic<uint16_t> reference_counts[CHUNK_SIZE];
+    // For a position on the free stack, the position below it.
+    std::atomic<uint32_t> next_free[CHUNK_SIZE];
+  };
+
+  inline Chunk* ChunkOf(uint32_t position) const {
+    return chunks_[position >> CHUNK_BITS].load(std::memory_order_acquire);
+  }
+
+  // Returns nullptr if position does not lie in an allocated chunk.
+  inline std::atomic<uint16_t>* ReferenceCountAt(uint32_t position) const {
+    if ((position >> CHUNK_BITS) >= MAX_CHUNKS) {
+      return nullptr;
+    }
+    Chunk* chunk = ChunkOf(position);
+    if (chunk == nullptr) {
+      return nullptr;
+    }
+    return &(chunk->reference_counts[position & OFFSET_MASK]);
+  }
+
+  // Returns ImpossiblePosition() if the free stack is empty.
+  uint32_t PopFree() {
+    uint64_t head = free_head_.load(std::memory_order_acquire);
+    while (true) {
+      uint32_t top = static_cast<uint32_t>(head);
+      if (top == UINT32_MAX) {
+        return ImpossiblePosition();
+      }
+      // If another thread pops top first, this may read a stale link, but
+      // the tag will have changed, so the swap below fails and we retry.
+      uint32_t below = ChunkOf(top)->next_free[top & OFFSET_MASK].load(
+          std::memory_order_relaxed);
+      uint64_t new_head = (((head >> 32) + 1) << 32) | below;
+      if (free_head_.compare_exchange_weak(head, new_head,
+                                           std::memory_order_acq_rel)) {
+        return top;
+      }
+    }
+  }
+
+  void PushFree(uint32_t position) {
+    std::atomic<uint32_t>& link =
+        ChunkOf(position)->next_free[position & OFFSET_MASK];
+    uint64_t head = free_head_.load(std::memory_order_relaxed);
+    uint64_t new_head;
+    do {
+      link.store(static_cast<uint32_t>(head), std::memory_order_relaxed);
+      new_head = (((head >> 32) + 1) << 32) | position;
+    } while (!free_head_.compare_exchange_weak(head, new_head,
+                                               std::memory_order_acq_rel));
+  }
+
+  // Hands out the next never-used position, installing its chunk if this
+  // is the first position in it. Returns ImpossiblePosition() if the
+  // directory is full.
+  uint32_t TakeUnused() {
+    uint32_t ret_val = next_unused_.load(std::memory_order_relaxed);
+    do {
+      if (ret_val >= MAX_CHUNKS * CHUNK_SIZE) {
+        return ImpossiblePosition();
+      }
+    } while (!next_unused_.compare_exchange_weak(ret_val, ret_val + 1,
+                                                 std::memory_order_acq_rel));
+    std::atomic<Chunk*>& slot = chunks_[ret_val >> CHUNK_BITS];
+    if (slot.load(std::memory_order_acquire) == nullptr) {
+      Chunk* fresh = new Chunk();
+      Chunk* expected = nullptr;
+      if (!slot.compare_exchange_strong(expected, fresh,
+                                        std::memory_order_acq_rel)) {
+        // Another thread installed it first.
+        delete fresh;
+      }
+    }
+    return ret_val;
+  }
+
+  std::unique_ptr<std::atomic<Chunk*>[]> chunks_;
+  std::atomic<uint32_t> next_unused_;
+  std::atomic<uint64_t> free_head_;
+  std::atomic<uint32_t> live_count_;
 };
 
+template <typename EltType> const uint32_t ObjectAllocator<EltType>::CHUNK_BITS;
+template <typename EltType> const uint32_t ObjectAllocator<EltType>::CHUNK_SIZE;
+template <typename EltType> const uint32_t ObjectAllocator<EltType>::MAX_CHUNKS;
+template <typename EltType>
+const uint32_t ObjectAllocator<EltType>::OFFSET_MASK;
+template <typename EltType>
+const uint64_t ObjectAllocator<EltType>::EMPTY_FREE_LIST;
+
 } // namespace collection
 } // namespace acumio
 
 #endif // AcumioServer_object_allocator_h
-
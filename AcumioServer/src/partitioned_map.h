@@ -0,0 +1,888 @@
+#ifndef AcumioServer_partitioned_map_h
+#define AcumioServer_partitioned_map_h
+//============================================================================
+// Name        : partitioned_map.h
+// Author      : Bill Province (bill@acumio.com)
+// Version     :
+// Copyright   : Copyright (C) 2016 Acumio
+// Description : An ordered multimap split into key-range partitions, each
+//               with its own SharedMutex, so that writers touching
+//               different key ranges do not serialize on one structure.
+//
+//               The partitions are held in a directory ordered by key:
+//               every key in partition i precedes every key in partition
+//               i + 1, and equal keys never span two partitions. Every
+//               operation takes the directory guard shared and then locks
+//               just the partitions it works on, one at a time.
+//               Partitions drifting from the target size (more than twice
+//               the target, or below a quarter of it) are split or merged
+//               by Rebalance, which takes the directory guard exclusively.
+//               A partition that Rebalance cannot bring back within bounds
+//               (a run of equal keys, or a small partition between two
+//               full ones) is left alone until it drifts twice as far.
+//               Rebalance runs either inline, on the thread that detected
+//               the drift, or on a background rebalancer thread if one was
+//               started.
+//
+//               Iterators hold no locks while they sit between operations,
+//               so a thread may write to the map while holding one. They
+//               pin the partition they point into instead: Rebalance leaves
+//               a pinned partition exactly as it is, rebalancing the others
+//               around it, and erased entries of a pinned partition are
+//               only marked as tombstones, which every operation skips,
+//               rather than freed. An iterator thus stays valid through any
+//               insert, erase or Rebalance, from any thread, even of the
+//               entry it points to. Tombstones are reaped by the next
+//               Rebalance, or by the next erase from their partition, once
+//               no iterator pins it. Likewise, a pinned partition that
+//               drifts is rebalanced once the last iterator leaves it.
+//============================================================================
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+#include "shared_mutex.h"
+
+namespace acumio {
+namespace collection {
+
+using acumio::transaction::ExclusiveLock;
+using acumio::transaction::ReaderBiasedSharedMutex;
+using acumio::transaction::SharedLock;
+using acumio::transaction::SharedMutex;
+
+template <class Key, class Value, class Compare = std::less<Key>>
+class PartitionedMap {
+ private:
+  struct Partition;
+
+ public:
+  typedef std::multimap<Key, Value, Compare> Contents;
+  typedef typename Contents::value_type value_type;
+
+  static const uint32_t DEFAULT_TARGET_PARTITION_SIZE = 512;
+
+  class Iterator :
+      public std::iterator<std::bidirectional_iterator_tag, value_type> {
+   public:
+    // Produces an end iterator that is not attached to any map.
+    Iterator() : map_(nullptr), pinned_(nullptr), epoch_(0),
+        partition_(END_PARTITION), position_() {}
+
+    // Other's pin already keeps the partition in place, so no lock is
+    // needed to share it.
+    Iterator(const Iterator& other) : map_(other.map_),
+        pinned_(other.pinned_), epoch_(other.epoch_),
+        partition_(other.partition_), position_(other.position_) {
+      if (pinned_ != nullptr) {
+        pinned_->pins++;
+      }
+    }
+
+    Iterator& operator=(const Iterator& other) {
+      if (this != &other) {
+        if (other.pinned_ != nullptr) {
+          other.pinned_->pins++;
+        }
+        Unpin();
+        map_ = other.map_;
+        pinned_ = other.pinned_;
+        epoch_ = other.epoch_;
+        partition_ = other.partition_;
+        position_ = other.position_;
+      }
+      return *this;
+    }
+
+    ~Iterator() {
+      Unpin();
+    }
+
+    inline const value_type& operator*() const { return *position_; }
+    inline const value_type* operator->() const { return &(*position_); }
+
+    // pre-increment/decrement.
+    Iterator& operator++() {
+      SharedLock directory_lock(map_->directory_guard_);
+      FindPinnedPartition();
+      {
+        SharedLock partition_lock(pinned_->guard);
+        position_ = pinned_->SkipForward(++position_);
+        if (position_ != pinned_->contents.end()) {
+          return *this;
+        }
+      }
+      SettleForward(partition_ + 1);
+      return *this;
+    }
+
+    // Decrementing the end iterator moves to the last entry, as with the
+    // std containers. Decrementing the first entry is undefined.
+    Iterator& operator--() {
+      SharedLock directory_lock(map_->directory_guard_);
+      if (partition_ == END_PARTITION) {
+        SettleBackward(map_->partitions_.size());
+        return *this;
+      }
+      FindPinnedPartition();
+      {
+        SharedLock partition_lock(pinned_->guard);
+        if (pinned_->SkipBackward(&position_)) {
+          return *this;
+        }
+      }
+      SettleBackward(partition_);
+      return *this;
+    }
+
+    // post-increment/decrement.
+    inline Iterator operator++(int) {
+      Iterator tmp(*this);
+      ++(*this);
+      return tmp;
+    }
+
+    inline Iterator operator--(int) {
+      Iterator tmp(*this);
+      --(*this);
+      return tmp;
+    }
+
+    // The end iterator of a map equals every other end iterator of that
+    // map, including the unattached one produced by Iterator().
+    inline bool operator==(const Iterator& other) const {
+      if (partition_ == END_PARTITION || other.partition_ == END_PARTITION) {
+        return partition_ == other.partition_ &&
+               (map_ == other.map_ || map_ == nullptr ||
+                other.map_ == nullptr);
+      }
+      return map_ == other.map_ && position_ == other.position_;
+    }
+
+    inline bool operator!=(const Iterator& other) const {
+      return !(*this == other);
+    }
+
+   private:
+    friend class PartitionedMap;
+    typedef typename Contents::const_iterator Position;
+
+    explicit Iterator(const PartitionedMap* map) : map_(map),
+        pinned_(nullptr), epoch_(0), partition_(END_PARTITION),
+        position_() {}
+
+    // Points this iterator at position, in the partition at index. Caller
+    // must hold map_->directory_guard_ and partition->guard.
+    void MoveTo(const Partition* partition, size_t index, Position position) {
+      if (partition != pinned_) {
+        partition->pins++;
+        UnpinLocked();
+        pinned_ = partition;
+      }
+      epoch_ = map_->epoch_;
+      partition_ = index;
+      position_ = position;
+    }
+
+    inline void Unpin() {
+      if (pinned_ != nullptr) {
+        SharedLock directory_lock(map_->directory_guard_);
+        UnpinLocked();
+      }
+    }
+
+    // Caller must hold map_->directory_guard_, so that a Rebalance cannot
+    // free the partition once its count drops.
+    void UnpinLocked() {
+      if (pinned_ == nullptr) {
+        return;
+      }
+      if (pinned_->pins.fetch_sub(1) == 1 &&
+          pinned_->drift_deferred.exchange(false)) {
+        map_->deferred_drift_.store(true);
+      }
+      pinned_ = nullptr;
+    }
+
+    // Brings partition_ up to date with any Rebalance since this iterator
+    // last moved. Caller must hold map_->directory_guard_.
+    void FindPinnedPartition() {
+      if (epoch_ == map_->epoch_) {
+        return;
+      }
+      size_t index = 0;
+      while (map_->partitions_[index].get() != pinned_) {
+        index++;
+      }
+      partition_ = index;
+      epoch_ = map_->epoch_;
+    }
+
+    // Moves to the first live entry at or after partition first. Caller
+    // must hold map_->directory_guard_.
+    void SettleForward(size_t first) {
+      for (size_t i = first; i < map_->partitions_.size(); i++) {
+        const Partition& partition = *(map_->partitions_[i]);
+        SharedLock partition_lock(partition.guard);
+        Position position = partition.SkipForward(partition.contents.begin());
+        if (position != partition.contents.end()) {
+          MoveTo(&partition, i, position);
+          return;
+        }
+      }
+      MakeEnd();
+    }
+
+    // Moves to the last live entry before partition last. Caller must hold
+    // map_->directory_guard_.
+    void SettleBackward(size_t last) {
+      for (size_t i = last; i > 0; i--) {
+        const Partition& partition = *(map_->partitions_[i - 1]);
+        SharedLock partition_lock(partition.guard);
+        Position position = partition.contents.end();
+        if (partition.SkipBackward(&position)) {
+          MoveTo(&partition, i - 1, position);
+          return;
+        }
+      }
+      MakeEnd();
+    }
+
+    void MakeEnd() {
+      UnpinLocked();
+      partition_ = END_PARTITION;
+      position_ = Position();
+    }
+
+    const PartitionedMap* map_;
+    // The partition position_ points into, which counts this iterator in
+    // its pins; null for an end iterator.
+    const Partition* pinned_;
+    // The map's epoch_ when partition_ was last known to index pinned_.
+    uint64_t epoch_;
+    size_t partition_;
+    Position position_;
+  };
+
+  PartitionedMap(bool allow_duplicates,
+                 uint32_t target_partition_size =
+                     DEFAULT_TARGET_PARTITION_SIZE) :
+      allow_duplicates_(allow_duplicates),
+      target_partition_size_(target_partition_size < 2 ?
+                             2 : target_partition_size),
+      compare_(), directory_guard_(), partitions_(), epoch_(0), size_(0),
+      drifted_(false), deferred_drift_(false), rebalancer_guard_(),
+      rebalancer_wakeup_(), rebalancer_(), rebalancer_running_(false) {
+    partitions_.push_back(std::unique_ptr<Partition>(new Partition()));
+  }
+
+  // Same as PartitionedMap(false).
+  PartitionedMap() : PartitionedMap(false) {}
+
+  ~PartitionedMap() {
+    StopBackgroundRebalancer();
+  }
+
+  PartitionedMap(const PartitionedMap&) = delete;
+  PartitionedMap& operator=(const PartitionedMap&) = delete;
+
+  inline bool allow_duplicates() const { return allow_duplicates_; }
+  inline uint32_t target_partition_size() const {
+    return target_partition_size_;
+  }
+  inline size_t size() const { return size_.load(); }
+  inline bool empty() const { return size() == 0; }
+
+  size_t partition_count() const {
+    SharedLock directory_lock(directory_guard_);
+    return partitions_.size();
+  }
+
+  // Returns false, leaving key untouched, if duplicates are not allowed
+  // and key is already present.
+  bool Insert(Key&& key, const Value& value) {
+    return DoInsert(std::move(key), value);
+  }
+
+  bool Insert(const Key& key, const Value& value) {
+    return DoInsert(key, value);
+  }
+
+  // Copies the value of the first entry with the given key.
+  bool Get(const Key& key, Value* value) const {
+    SharedLock directory_lock(directory_guard_);
+    const Partition& partition = *(partitions_[Route(key)]);
+    SharedLock partition_lock(partition.guard);
+    std::pair<typename Contents::const_iterator,
+              typename Contents::const_iterator> range =
+        partition.contents.equal_range(key);
+    for (typename Contents::const_iterator it = range.first;
+         it != range.second; ++it) {
+      if (!partition.IsTombstone(it)) {
+        *value = it->second;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  size_t Count(const Key& key) const {
+    SharedLock directory_lock(directory_guard_);
+    const Partition& partition = *(partitions_[Route(key)]);
+    SharedLock partition_lock(partition.guard);
+    std::pair<typename Contents::const_iterator,
+              typename Contents::const_iterator> range =
+        partition.contents.equal_range(key);
+    size_t ret_val = 0;
+    for (typename Contents::const_iterator it = range.first;
+         it != range.second; ++it) {
+      if (!partition.IsTombstone(it)) {
+        ret_val++;
+      }
+    }
+    return ret_val;
+  }
+
+  // Erases every entry with the given key, returning the number erased.
+  size_t Erase(const Key& key) {
+    return DoErase(key, [](const Value&) { return true; }, true, nullptr);
+  }
+
+  // Erases the first entry with the given key, copying its value into
+  // *value.
+  bool Take(const Key& key, Value* value) {
+    return DoErase(key, [](const Value&) { return true; }, false,
+                   value) > 0;
+  }
+
+  // Erases just the first entry matching both key and value.
+  bool EraseEntry(const Key& key, const Value& value) {
+    return DoErase(key, [&value](const Value& candidate) {
+                     return candidate == value;
+                   }, false, nullptr) > 0;
+  }
+
+  // Fills an empty map from entries, which must be sorted by key (and,
+  // unless duplicates are allowed, hold no equal keys). The partitions are
+  // built directly at the target size, each by appending to its end, so
+  // this costs a fraction of inserting the entries one at a time. Equal
+  // keys keep their order in entries. The keys and values are moved out
+  // of entries. Returns false, doing nothing, if the map is not empty, or
+  // if any iterator on it is live.
+  bool BulkLoad(std::vector<std::pair<Key, Value>>* entries) {
+    ExclusiveLock directory_lock(directory_guard_);
+    if (size_.load() > 0) {
+      return false;
+    }
+    // An empty map can still hold tombstones that iterators point at.
+    for (const std::unique_ptr<Partition>& partition : partitions_) {
+      if (partition->pins.load() > 0) {
+        return false;
+      }
+    }
+    Directory loaded;
+    typename std::vector<std::pair<Key, Value>>::iterator it =
+        entries->begin();
+    while (it != entries->end()) {
+      std::unique_ptr<Partition> partition(new Partition());
+      Contents& contents = partition->contents;
+      // As in Split, equal keys are not separated.
+      while (it != entries->end() &&
+             (contents.size() < target_partition_size_ ||
+              !compare_(contents.rbegin()->first, it->first))) {
+        contents.emplace_hint(contents.end(), std::move(it->first),
+                              std::move(it->second));
+        ++it;
+      }
+      if (contents.size() > 2 * target_partition_size_) {
+        partition->unsplittable_size = contents.size();
+      }
+      loaded.push_back(std::move(partition));
+    }
+    if (loaded.empty()) {
+      loaded.push_back(std::unique_ptr<Partition>(new Partition()));
+    }
+    NoteUnmergeable(&loaded);
+    partitions_.swap(loaded);
+    epoch_++;
+    size_.store(entries->size());
+    drifted_.store(false);
+    entries->clear();
+    return true;
+  }
+
+  Iterator begin() const {
+    Iterator ret_val(this);
+    SharedLock directory_lock(directory_guard_);
+    ret_val.SettleForward(0);
+    return ret_val;
+  }
+
+  Iterator end() const {
+    return Iterator(this);
+  }
+
+  // The first entry whose key is not before key.
+  Iterator LowerBound(const Key& key) const {
+    Iterator ret_val(this);
+    SharedLock directory_lock(directory_guard_);
+    size_t index = Route(key);
+    {
+      const Partition& partition = *(partitions_[index]);
+      SharedLock partition_lock(partition.guard);
+      typename Contents::const_iterator it =
+          partition.SkipForward(partition.contents.lower_bound(key));
+      if (it != partition.contents.end()) {
+        ret_val.MoveTo(&partition, index, it);
+        return ret_val;
+      }
+    }
+    ret_val.SettleForward(index + 1);
+    return ret_val;
+  }
+
+  // Drops empty partitions, merges adjacent partitions whose combined size
+  // is within the target, and splits partitions holding more than twice
+  // the target into target-sized pieces. Blocks all other access to the
+  // map while it runs. Partitions pinned by an iterator are left as they
+  // are; those that have drifted are rebalanced once no iterator pins
+  // them.
+  void Rebalance() {
+    ExclusiveLock directory_lock(directory_guard_);
+    drifted_.store(false);
+    // Pins only change under directory_guard_, so they hold still here.
+    Directory merged;
+    for (std::unique_ptr<Partition>& partition : partitions_) {
+      if (partition->pins.load() > 0) {
+        merged.push_back(std::move(partition));
+        continue;
+      }
+      partition->ReapTombstones();
+      if (partition->contents.empty()) {
+        continue;
+      }
+      if (!merged.empty() && merged.back()->pins.load() == 0 &&
+          merged.back()->contents.size() + partition->contents.size() <=
+              target_partition_size_) {
+        MoveRange(&(partition->contents), partition->contents.begin(),
+                  partition->contents.end(), &(merged.back()->contents));
+      } else {
+        merged.push_back(std::move(partition));
+      }
+    }
+
+    Directory rebalanced;
+    for (std::unique_ptr<Partition>& partition : merged) {
+      if (partition->pins.load() > 0) {
+        rebalanced.push_back(std::move(partition));
+      } else {
+        Split(std::move(partition), &rebalanced);
+      }
+    }
+    if (rebalanced.empty()) {
+      rebalanced.push_back(std::unique_ptr<Partition>(new Partition()));
+    }
+    NoteUnmergeable(&rebalanced);
+    partitions_.swap(rebalanced);
+    epoch_++;
+    for (std::unique_ptr<Partition>& partition : partitions_) {
+      if (partition->pins.load() > 0 &&
+          (Oversized(*partition) || Undersized(*partition))) {
+        partition->drift_deferred.store(true);
+      }
+    }
+  }
+
+  // Starts a background thread that rebalances, every interval_nanos, if
+  // any partition has drifted from the target size. While it runs, writers
+  // no longer rebalance inline. Does nothing if the rebalancer is already
+  // running. The rebalancer is stopped by StopBackgroundRebalancer or by
+  // destruction of the map.
+  void StartBackgroundRebalancer(uint64_t interval_nanos) {
+    std::lock_guard<std::mutex> guard(rebalancer_guard_);
+    if (rebalancer_running_) {
+      return;
+    }
+    rebalancer_running_ = true;
+    rebalancer_ = std::thread([this, interval_nanos]() {
+      std::unique_lock<std::mutex> lock(rebalancer_guard_);
+      while (rebalancer_running_) {
+        rebalancer_wakeup_.wait_for(lock,
+                                    std::chrono::nanoseconds(interval_nanos));
+        if (!rebalancer_running_) {
+          break;
+        }
+        lock.unlock();
+        if (drifted_.load()) {
+          Rebalance();
+        }
+        lock.lock();
+      }
+    });
+  }
+
+  void StopBackgroundRebalancer() {
+    {
+      std::lock_guard<std::mutex> guard(rebalancer_guard_);
+      if (!rebalancer_running_) {
+        return;
+      }
+      rebalancer_running_ = false;
+    }
+    rebalancer_wakeup_.notify_all();
+    rebalancer_.join();
+  }
+
+ private:
+  typedef std::vector<std::unique_ptr<Partition>> Directory;
+  // partition_ value of an end iterator.
+  static const size_t END_PARTITION = SIZE_MAX;
+
+  struct Partition {
+    Partition() : guard(), contents(), tombstones(), unsplittable_size(0),
+                  unmergeable_size(0), pins(0), drift_deferred(false) {}
+
+    // The methods below require guard be held, exclusively for
+    // ReapTombstones.
+    inline bool IsTombstone(typename Contents::const_iterator it) const {
+      return !tombstones.empty() && tombstones.count(&(*it)) > 0;
+    }
+
+    // The first live entry at or after it.
+    typename Contents::const_iterator SkipForward(
+        typename Contents::const_iterator it) const {
+      while (it != contents.end() && IsTombstone(it)) {
+        ++it;
+      }
+      return it;
+    }
+
+    // Moves *it to the last live entry before it, returning false if
+    // there is none.
+    bool SkipBackward(typename Contents::const_iterator* it) const {
+      typename Contents::const_iterator position = *it;
+      while (position != contents.begin()) {
+        --position;
+        if (!IsTombstone(position)) {
+          *it = position;
+          return true;
+        }
+      }
+      return false;
+    }
+
+    inline size_t live_size() const {
+      return contents.size() - tombstones.size();
+    }
+
+    void ReapTombstones() {
+      typename Contents::iterator it = contents.begin();
+      while (!tombstones.empty() && it != contents.end()) {
+        if (tombstones.erase(&(*it)) > 0) {
+          it = contents.erase(it);
+        } else {
+          ++it;
+        }
+      }
+    }
+
+    mutable SharedMutex guard;
+    Contents contents;
+    // Entries erased while iterators were live. They stay in contents, in
+    // order, so that an iterator pointing at one can still move on from
+    // it, but are otherwise treated as absent.
+    std::set<const value_type*> tombstones;
+    // The size of contents when it was last split, if that left it over
+    // twice the target because it is a run of equal keys; otherwise 0.
+    // The partition only counts as oversized again once it has doubled,
+    // so that inserting into the run does not rebalance every time.
+    size_t unsplittable_size;
+    // Likewise, the size of contents after the last Rebalance, if it was
+    // left under a quarter of the target because no neighbour had room to
+    // take it; otherwise 0. It only counts as undersized again once it
+    // has halved, so that erasing from it does not rebalance every time.
+    size_t unmergeable_size;
+    // Number of iterators pointing into the partition. Only changed while
+    // holding the map's directory_guard_ shared, or by copying an iterator
+    // that already pins it, and only raised from 0 while also holding
+    // guard. So whether it is pinned holds still for Rebalance, and for an
+    // erase holding guard.
+    mutable std::atomic<uint32_t> pins;
+    // Set when the partition drifted while pinned, so that the last
+    // iterator to leave it can have it rebalanced.
+    mutable std::atomic<bool> drift_deferred;
+  };
+
+  // Whether partition should be split by the next Rebalance.
+  bool Oversized(const Partition& partition) const {
+    return partition.live_size() > 2 * target_partition_size_ &&
+        partition.live_size() > 2 * partition.unsplittable_size;
+  }
+
+  // Whether partition should be merged by the next Rebalance. Caller must
+  // hold directory_guard_.
+  bool Undersized(const Partition& partition) const {
+    return partitions_.size() > 1 &&
+        partition.live_size() < target_partition_size_ / 4 &&
+        (partition.unmergeable_size == 0 ||
+         2 * partition.live_size() < partition.unmergeable_size);
+  }
+
+  // Sets unmergeable_size on the partitions of directory, which Rebalance
+  // or BulkLoad has just built. Pinned partitions were not offered to
+  // their neighbours, so they do not count as unmergeable.
+  void NoteUnmergeable(Directory* directory) const {
+    for (std::unique_ptr<Partition>& partition : *directory) {
+      size_t size = partition->contents.size();
+      partition->unmergeable_size =
+          directory->size() > 1 && partition->pins.load() == 0 &&
+          size < target_partition_size_ / 4 ? size : 0;
+    }
+  }
+
+  // Whether a drift of partition, whose guard the caller holds, can be
+  // rebalanced now. If an iterator pins the partition, the drift is left
+  // for the last such iterator to report as it leaves.
+  bool CanRebalance(const Partition& partition) const {
+    if (partition.pins.load() == 0) {
+      return true;
+    }
+    partition.drift_deferred.store(true);
+    // The last iterator may have left before seeing drift_deferred.
+    return partition.pins.load() == 0;
+  }
+
+  // Whether the last iterator has left a partition whose drift was put
+  // off, since this was last asked.
+  inline bool TakeDeferredDrift() {
+    return deferred_drift_.load() && deferred_drift_.exchange(false);
+  }
+
+  // Returns the index of the partition that key belongs in: the last
+  // partition whose first key is not after key. Caller must hold
+  // directory_guard_. Partition 0 takes every key preceding the other
+  // partitions. An emptied partition keeps its place until the next
+  // Rebalance, and routes as though it began with the first key of the
+  // partition after it, so it is never refilled: the keys it held go to
+  // the partition before it instead.
+  //
+  // Between Rebalances, the first key of each partition only ever grows,
+  // so the answer stays correct for everything but inserts, which re-check
+  // it under the partition lock.
+  size_t Route(const Key& key) const {
+    size_t low = 0;
+    size_t high = partitions_.size();
+    // Invariant: the answer lies in [low, high).
+    while (high - low > 1) {
+      size_t middle = low + (high - low) / 2;
+      if (Precedes(key, middle)) {
+        high = middle;
+      } else {
+        low = middle;
+      }
+    }
+    return low;
+  }
+
+  // True if key precedes the first key at or after partition index.
+  bool Precedes(const Key& key, size_t index) const {
+    for (size_t i = index; i < partitions_.size(); i++) {
+      const Partition& partition = *(partitions_[i]);
+      SharedLock partition_lock(partition.guard);
+      if (!partition.contents.empty()) {
+        return compare_(key, partition.contents.begin()->first);
+      }
+    }
+    return true;
+  }
+
+  template <typename KeyRef>
+  bool DoInsert(KeyRef&& key, const Value& value) {
+    bool oversized = false;
+    {
+      SharedLock directory_lock(directory_guard_);
+      while (true) {
+        size_t index = Route(key);
+        Partition& partition = *(partitions_[index]);
+        ExclusiveLock partition_lock(partition.guard);
+        if (index > 0 && (partition.contents.empty() ||
+                          compare_(key, partition.contents.begin()->first))) {
+          // An erase moved this partition's first key past ours since we
+          // routed; route again.
+          continue;
+        }
+        if (allow_duplicates_) {
+          // Like std::multimap::insert, this goes after any equal keys.
+          partition.contents.emplace(std::forward<KeyRef>(key), value);
+        } else {
+          typename Contents::iterator hint =
+              partition.contents.lower_bound(key);
+          for (typename Contents::iterator it = hint;
+               it != partition.contents.end() && !compare_(key, it->first);
+               ++it) {
+            if (!partition.IsTombstone(it)) {
+              return false;
+            }
+          }
+          partition.contents.emplace_hint(hint, std::forward<KeyRef>(key),
+                                          value);
+        }
+        size_++;
+        oversized = Oversized(partition) && CanRebalance(partition);
+        break;
+      }
+    }
+    if (oversized || TakeDeferredDrift()) {
+      NoteDrift();
+    }
+    return true;
+  }
+
+  // Erases entries with the given key whose value satisfies matches: all
+  // of them if erase_all, otherwise just the first. If value is non-null,
+  // the erased value is copied into it. While any iterator pins the
+  // partition, the entries are only made tombstones.
+  size_t DoErase(const Key& key,
+                 const std::function<bool(const Value&)>& matches,
+                 bool erase_all, Value* value) {
+    size_t erased = 0;
+    bool undersized = false;
+    {
+      SharedLock directory_lock(directory_guard_);
+      Partition& partition = *(partitions_[Route(key)]);
+      ExclusiveLock partition_lock(partition.guard);
+      // Iterators only come to point into this partition while holding
+      // its guard, so none can while we hold it.
+      bool keep_tombstones = partition.pins.load() > 0;
+      if (!keep_tombstones) {
+        partition.ReapTombstones();
+      }
+      std::pair<typename Contents::iterator, typename Contents::iterator>
+          range = partition.contents.equal_range(key);
+      typename Contents::iterator it = range.first;
+      while (it != range.second) {
+        if (!matches(it->second) || partition.IsTombstone(it)) {
+          ++it;
+          continue;
+        }
+        if (value != nullptr) {
+          *value = it->second;
+        }
+        if (keep_tombstones) {
+          partition.tombstones.insert(&(*it));
+          ++it;
+        } else {
+          it = partition.contents.erase(it);
+        }
+        erased++;
+        if (!erase_all) {
+          break;
+        }
+      }
+      size_ -= erased;
+      undersized = erased > 0 && Undersized(partition) &&
+          CanRebalance(partition);
+    }
+    if (undersized || TakeDeferredDrift()) {
+      NoteDrift();
+    }
+    return erased;
+  }
+
+  void NoteDrift() {
+    drifted_.store(true);
+    bool background = false;
+    {
+      std::lock_guard<std::mutex> guard(rebalancer_guard_);
+      background = rebalancer_running_;
+    }
+    if (!background) {
+      Rebalance();
+    }
+  }
+
+  // Cuts target-sized pieces off the front of partition, without
+  // separating equal keys, until the rest is within twice the target or
+  // is a run of equal keys.
+  void Split(std::unique_ptr<Partition> partition, Directory* target) {
+    Contents& contents = partition->contents;
+    while (contents.size() > 2 * target_partition_size_) {
+      typename Contents::iterator cut = contents.begin();
+      std::advance(cut, target_partition_size_);
+      typename Contents::iterator previous = cut;
+      --previous;
+      while (cut != contents.end() && !compare_(previous->first, cut->first)) {
+        previous = cut;
+        ++cut;
+      }
+      if (cut == contents.end()) {
+        break;
+      }
+      std::unique_ptr<Partition> head(new Partition());
+      MoveRange(&contents, contents.begin(), cut, &(head->contents));
+      target->push_back(std::move(head));
+    }
+    partition->unsplittable_size =
+        contents.size() > 2 * target_partition_size_ ? contents.size() : 0;
+    target->push_back(std::move(partition));
+  }
+
+  // Appends [first, last) of source to the end of destination, whose keys
+  // must all precede those being moved. C++11 maps cannot release their
+  // nodes, so we move the keys out from under the map (they may be
+  // move-only, such as our unique_ptr<Comparable> keys) and then erase
+  // the emptied entries, which never compares them.
+  static void MoveRange(Contents* source, typename Contents::iterator first,
+                        typename Contents::iterator last,
+                        Contents* destination) {
+    for (typename Contents::iterator it = first; it != last; ++it) {
+      destination->emplace_hint(destination->end(),
+                                std::move(const_cast<Key&>(it->first)),
+                                std::move(it->second));
+    }
+    source->erase(first, last);
+  }
+
+  bool allow_duplicates_;
+  uint32_t target_partition_size_;
+  Compare compare_;
+  // Read on every operation and written only when rebalancing, so it is
+  // reader-biased.
+  mutable ReaderBiasedSharedMutex directory_guard_;
+  Directory partitions_;
+  // Counts the changes to partitions_, so that iterators can tell when the
+  // index of their partition may have moved.
+  uint64_t epoch_;
+  std::atomic<size_t> size_;
+  // Set when a partition has drifted from the target size.
+  std::atomic<bool> drifted_;
+  // Set when the last iterator leaves a partition whose drift was put off.
+  // The next insert or erase then notes the drift.
+  mutable std::atomic<bool> deferred_drift_;
+
+  std::mutex rebalancer_guard_;
+  std::condition_variable rebalancer_wakeup_;
+  std::thread rebalancer_;
+  bool rebalancer_running_;
+};
+
+template <class Key, class Value, class Compare>
+const uint32_t
+PartitionedMap<Key, Value, Compare>::DEFAULT_TARGET_PARTITION_SIZE;
+
+template <class Key, class Value, class Compare>
+const size_t PartitionedMap<Key, Value, Compare>::END_PARTITION;
+
+} // namespace collection
+} // namespace acumio
+
+#endif // AcumioServer_partitioned_map_h
@@ -52,8 +52,8 @@ grpc::Status ReferentialService::CreateOrAssociateNamespace(
 grpc::Status ReferentialService::GetParentNamespace(
     const model::QualifiedName& child_name,
     const char* child_type,
-    model::Namespace* parent) const {
-  grpc::Status result = namespace_repository_->GetNamespace(
+    NamespaceRepository::Snapshot* parent) const {
+  grpc::Status result = namespace_repository_->GetNamespaceSnapshot(
       child_name.name_space(), parent);
   if (!result.ok() && result.error_code() == grpc::StatusCode::NOT_FOUND) {
     std::stringstream error;
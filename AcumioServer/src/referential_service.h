@@ -45,13 +45,24 @@ class ReferentialService {
                                                       name_space);
   }
 
+  // Puts back a Namespace as it was before CreateOrAssociateNamespace
+  // associated it with a Repository, such as when that Repository is
+  // removed again by a failed bulk import. As with DisassociateNamespace,
+  // the context should identify that this is a "safe" operation.
+  inline grpc::Status RestoreNamespace(const model::Namespace& name_space) {
+    return namespace_repository_->UpdateNoDescription(name_space.full_name(),
+                                                      name_space);
+  }
+
   // Retrieves Namespace corresponding to child_name.name_space().
   // If unable to find the parent namespace, we generate an error message
   // using the child_type parameter. the child_type should be something
-  // like "repository" or "dataset" (see model_constants.h).
+  // like "repository" or "dataset" (see model_constants.h). The parent is
+  // shared with the repository rather than copied, since callers only
+  // check it or read its name.
   grpc::Status GetParentNamespace(const model::QualifiedName& child_name,
                                   const char* child_type,
-                                  model::Namespace* parent) const;
+                                  NamespaceRepository::Snapshot* parent) const;
 
   grpc::Status GetNamespace(const std::string& namespace_name,
                             model::Namespace* name_space) const;
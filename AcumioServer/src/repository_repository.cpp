@@ -54,7 +54,8 @@ RepositoryRepository::RepositoryRepository() : repository_(nullptr) {
   std::vector<std::unique_ptr<_RepositoryExtractor>> additional_extractors;
   additional_extractors.push_back(std::move(namespace_extractor));
   repository_.reset(new _Repository(std::move(main_extractor),
-                                    &additional_extractors));
+                                    &additional_extractors,
+                                    true));
 }
 
 RepositoryRepository::~RepositoryRepository() {}
@@ -62,18 +63,24 @@ RepositoryRepository::~RepositoryRepository() {}
 grpc::Status RepositoryRepository::GetRepository(
     const model::QualifiedName& full_name,
     model::Repository* elt) const {
-  std::unique_ptr<Comparable> key(
-      new StringPairComparable(full_name.name_space(),
-                               full_name.name()));
+  EncodedKey key = EncodedKey::ForStringPair(full_name.name_space(),
+                                             full_name.name());
   return repository_->GetEntity(key, elt);
 }
 
+grpc::Status RepositoryRepository::GetRepositorySnapshot(
+    const model::QualifiedName& full_name,
+    Snapshot* snapshot) const {
+  EncodedKey key = EncodedKey::ForStringPair(full_name.name_space(),
+                                             full_name.name());
+  return repository_->GetSnapshot(key, snapshot);
+}
+
 grpc::Status RepositoryRepository::GetDescription(
     const model::QualifiedName& full_name,
     model::Description* description) const {
-  std::unique_ptr<Comparable> key(
-      new StringPairComparable(full_name.name_space(),
-                               full_name.name()));
+  EncodedKey key = EncodedKey::ForStringPair(full_name.name_space(),
+                                             full_name.name());
   // TODO: Translate NOT_FOUND results to present better error message.
   // See similar comment in NamespaceRepository::GetDescription.
   return repository_->GetDescription(key, description);
@@ -82,8 +89,8 @@ grpc::Status RepositoryRepository::GetDescription(
 grpc::Status RepositoryRepository::GetDescriptionHistory(
     const model::QualifiedName& full_name,
     model::DescriptionHistory* history) const {
-  std::unique_ptr<Comparable> key(
-      new StringPairComparable(full_name.name_space(), full_name.name()));
+  EncodedKey key = EncodedKey::ForStringPair(full_name.name_space(),
+                                             full_name.name());
   // TODO: Translate NOT_FOUND results to present better error message.
   // See similar comment in NamespaceRepository::GetDescription.
   return repository_->GetDescriptionHistory(key, history);
@@ -93,8 +100,8 @@ grpc::Status RepositoryRepository::GetRepositoryAndDescription(
     const model::QualifiedName& full_name,
     model::Repository* repository,
     model::Description* description) const {
-  std::unique_ptr<Comparable> key(
-      new StringPairComparable(full_name.name_space(), full_name.name()));
+  EncodedKey key = EncodedKey::ForStringPair(full_name.name_space(),
+                                             full_name.name());
   return repository_->GetEntityAndDescription(key, repository, description);
 }
 
@@ -102,46 +109,46 @@ grpc::Status RepositoryRepository::GetRepositoryAndDescriptionHistory(
     const model::QualifiedName& full_name,
     model::Repository* repository,
     model::DescriptionHistory* history) const {
-  std::unique_ptr<Comparable> key(
-      new StringPairComparable(full_name.name_space(), full_name.name()));
+  EncodedKey key = EncodedKey::ForStringPair(full_name.name_space(),
+                                             full_name.name());
   return repository_->GetEntityAndDescriptionHistory(key, repository, history);
 }
 
 grpc::Status RepositoryRepository::Remove(
     const model::QualifiedName& full_name) {
-  std::unique_ptr<Comparable> key(
-      new StringPairComparable(full_name.name_space(), full_name.name()));
+  EncodedKey key = EncodedKey::ForStringPair(full_name.name_space(),
+                                             full_name.name());
   return repository_->Remove(key);
 }
 
 grpc::Status RepositoryRepository::UpdateNoDescription(
     const model::QualifiedName& full_name,
     const model::Repository& repository) {
-  std::unique_ptr<Comparable> key(
-      new StringPairComparable(full_name.name_space(), full_name.name()));
+  EncodedKey key = EncodedKey::ForStringPair(full_name.name_space(),
+                                             full_name.name());
   return repository_->UpdateNoDescription(key, repository);
 }
 
 grpc::Status RepositoryRepository::ClearDescription(
     const model::QualifiedName& full_name) {
-  std::unique_ptr<Comparable> key(
-      new StringPairComparable(full_name.name_space(), full_name.name()));
+  EncodedKey key = EncodedKey::ForStringPair(full_name.name_space(),
+                                             full_name.name());
   return repository_->ClearDescription(key);
 }
 
 grpc::Status RepositoryRepository::UpdateDescriptionOnly(
     const model::QualifiedName& full_name,
     const model::Description& description) {
-  std::unique_ptr<Comparable> key(
-      new StringPairComparable(full_name.name_space(), full_name.name()));
+  EncodedKey key = EncodedKey::ForStringPair(full_name.name_space(),
+                                             full_name.name());
   return repository_->UpdateDescriptionOnly(key, description);
 }
 
 grpc::Status RepositoryRepository::UpdateAndClearDescription(
     const model::QualifiedName& full_name,
     const model::Repository& repository) {
-  std::unique_ptr<Comparable> key(
-      new StringPairComparable(full_name.name_space(), full_name.name()));
+  EncodedKey key = EncodedKey::ForStringPair(full_name.name_space(),
+                                             full_name.name());
   return repository_->UpdateAndClearDescription(key, repository);
 }
 
@@ -149,23 +156,22 @@ grpc::Status RepositoryRepository::UpdateWithDescription(
     const model::QualifiedName& full_name,
     const model::Repository& repository,
     const model::Description& description) {
-  std::unique_ptr<Comparable> key(
-      new StringPairComparable(full_name.name_space(), full_name.name()));
+  EncodedKey key = EncodedKey::ForStringPair(full_name.name_space(),
+                                             full_name.name());
   return repository_->UpdateWithDescription(key, repository, description);
 }
 
 RepositoryRepository::PrimaryIterator
 RepositoryRepository::LowerBoundByFullName(
     const model::QualifiedName& name) const {
-  std::unique_ptr<Comparable> key(
-      new StringPairComparable(name.name_space(), name.name()));
+  EncodedKey key = EncodedKey::ForStringPair(name.name_space(), name.name());
   return repository_->LowerBound(key);
 }
 
 RepositoryRepository::SecondaryIterator
 RepositoryRepository::LowerBoundByNamespace(
     const std::string& name_space) const {
-  std::unique_ptr<Comparable> key(new StringComparable(name_space));
+  EncodedKey key = EncodedKey::ForString(name_space);
   return repository_->LowerBoundByIndex(key, 0);
 }
 
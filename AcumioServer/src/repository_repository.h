@@ -44,6 +44,8 @@ class RepositoryRepository {
   typedef mem_repository::DescribedRepository<model::Repository> _Repository;
   typedef _Repository::PrimaryIterator PrimaryIterator;
   typedef _Repository::SecondaryIterator SecondaryIterator;
+  typedef _Repository::KeyedSnapshot KeyedSnapshot;
+  typedef _Repository::Snapshot Snapshot;
 
   RepositoryRepository();
   ~RepositoryRepository();
@@ -61,9 +63,38 @@ class RepositoryRepository {
     return repository_->AddWithNoDescription(repository);
   }
 
+  // See MemRepository::BulkLoad.
+  inline grpc::Status BulkLoad(std::vector<model::DescribedRepository>* elts) {
+    return repository_->BulkLoad(elts);
+  }
+
+  // See MemRepository::Clear.
+  inline void Clear() {
+    repository_->Clear();
+  }
+
+  // See MemRepository::GetSortedSnapshots.
+  inline void GetSortedSnapshots(std::vector<KeyedSnapshot>* snapshots) const {
+    repository_->GetSortedSnapshots(snapshots);
+  }
+
+  // See MemRepository::GetSnapshots.
+  inline void GetSnapshots(std::vector<KeyedSnapshot>* snapshots) const {
+    repository_->GetSnapshots(snapshots);
+  }
+
+  // See MemRepository::SortSnapshots.
+  inline void SortSnapshots(std::vector<KeyedSnapshot>* snapshots) const {
+    repository_->SortSnapshots(snapshots);
+  }
+
   grpc::Status GetRepository(const model::QualifiedName& full_name,
                              model::Repository* elt) const;
 
+  // See DescribedRepository::GetSnapshot.
+  grpc::Status GetRepositorySnapshot(const model::QualifiedName& full_name,
+                                     Snapshot* snapshot) const;
+
   grpc::Status GetDescription(const model::QualifiedName& full_name,
                               model::Description* description) const;
 
@@ -217,12 +217,14 @@ bool RopePiece::Iterator::operator==(const BasicIterator<char>& other) const {
 
 RopePiece::RopePiece() : string_(LETTER_STRINGS[0]), prefix_(nullptr),
     suffix_(nullptr), length_(0) {}
-RopePiece::RopePiece(const char* s) : string_(s), prefix_(nullptr),
-    suffix_(nullptr), length_(std::strlen(s)) {}
+RopePiece::RopePiece(const char* s) :
+    string_(s == nullptr ? LETTER_STRINGS[0] : s), prefix_(nullptr),
+    suffix_(nullptr), length_(std::strlen(string_)) {}
 RopePiece::RopePiece(const std::string& s) : string_(s.c_str()),
     prefix_(nullptr), suffix_(nullptr), length_(s.length()) {}
 RopePiece::RopePiece(char c) : RopePiece() {
   string_ = LETTER_STRINGS[static_cast<uint8_t>(c)];
+  length_ = (c == '\0' ? 0 : 1);
 }
 // Ownership of elements of r are retained by r. Assuming lifetime of
 // r exceeds lifetime of constructed RopePiece, this should not be a problem.
@@ -255,6 +257,7 @@ const RopePiece& RopePiece::operator=(const RopePiece& r) {
   string_ = r.string_;
   prefix_ = r.prefix_;
   suffix_ = r.suffix_;
+  length_ = r.length_;
   return *this;
 }
 
@@ -284,7 +287,7 @@ char RopePiece::CharAt(uint32_t position) const {
     return '\0';
   }
 
-  return prefix_->CharAt(position - prefix_->length());
+  return suffix_->CharAt(position - prefix_->length());
 }
 
 std::string RopePiece::ToString() const {
@@ -305,6 +308,7 @@ std::string RopePiece::ToString() const {
 
   char* buffer = new char[length_ + 1];
   CopyToBuffer(buffer);
+  buffer[length_] = '\0';
   std::string ret_val(buffer);
   delete [] buffer;
   return ret_val;
@@ -371,9 +375,9 @@ int RopePiece::compare(const char* other) const {
     other_iter++;
   }
   if (self_iter == self_end) {
-    return (other_iter == '\0') ? 0 : -1;
+    return (*other_iter == '\0') ? 0 : -1;
   }
-  if (other_iter == '\0') {
+  if (*other_iter == '\0') {
     return 1;
   }
   // TODO: Double-check this. When working with UTF8 characters, how do you
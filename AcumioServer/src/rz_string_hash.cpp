@@ -8,9 +8,232 @@
 
 #include "rz_string_hash.h"
 
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ACUMIO_RZ_HASH_AVX2
+#include <immintrin.h>
+#endif
+
 namespace acumio {
 namespace util {
 
+namespace {
+// The batch kernels read their keys through one of these two views, so
+// that the same code serves both forms of HashBatch.
+class StringKeys {
+ public:
+  explicit StringKeys(const std::string* keys) : keys_(keys) {}
+  inline const char* data(size_t i) const { return keys_[i].data(); }
+  inline size_t size(size_t i) const { return keys_[i].size(); }
+  inline StringKeys From(size_t i) const { return StringKeys(keys_ + i); }
+
+ private:
+  const std::string* keys_;
+};
+
+class PointerKeys {
+ public:
+  PointerKeys(const char* const* data, const size_t* lengths) :
+      data_(data), lengths_(lengths) {}
+  inline const char* data(size_t i) const { return data_[i]; }
+  inline size_t size(size_t i) const { return lengths_[i]; }
+  inline PointerKeys From(size_t i) const {
+    return PointerKeys(data_ + i, lengths_ + i);
+  }
+
+ private:
+  const char* const* data_;
+  const size_t* lengths_;
+};
+
+// The number of independent hash chains the scalar batch interleaves.
+const size_t SCALAR_LANES = 4;
+
+template <typename Keys>
+void HashBatchScalar(const RZStringHash& hash, const Keys& keys, size_t n,
+                     uint32_t* out) {
+  size_t i = 0;
+  for (; i + SCALAR_LANES <= n; i += SCALAR_LANES) {
+    uint32_t h[SCALAR_LANES];
+    size_t common = keys.size(i);
+    for (size_t lane = 0; lane < SCALAR_LANES; lane++) {
+      h[lane] = hash.seed();
+      if (keys.size(i + lane) < common) {
+        common = keys.size(i + lane);
+      }
+    }
+    // Run all the chains together over their common length, so that the
+    // processor can overlap their dependency chains; then finish each
+    // one separately.
+    for (size_t j = 0; j < common; j++) {
+      for (size_t lane = 0; lane < SCALAR_LANES; lane++) {
+        h[lane] = hash.next_hash_value(h[lane], keys.data(i + lane)[j]);
+      }
+    }
+    for (size_t lane = 0; lane < SCALAR_LANES; lane++) {
+      const char* key = keys.data(i + lane);
+      for (size_t j = common; j < keys.size(i + lane); j++) {
+        h[lane] = hash.next_hash_value(h[lane], key[j]);
+      }
+      out[i + lane] = h[lane];
+    }
+  }
+  for (; i < n; i++) {
+    out[i] = hash(keys.data(i), keys.size(i));
+  }
+}
+
+#ifdef ACUMIO_RZ_HASH_AVX2
+const size_t AVX2_LANES = 8;
+// Each lane reads this many bytes of its key at a time.
+const size_t AVX2_BLOCK = 8;
+
+// Returns the AVX2_BLOCK bytes of data starting at offset, in the low
+// bytes of the result, zero-filled past length. Only the rare keys
+// shorter than a block take a branch that depends on offset, since the
+// other branches mispredict often when key lengths vary.
+inline uint64_t LoadBlock(const char* data, size_t length, size_t offset) {
+  uint64_t ret_val = 0;
+  if (length >= AVX2_BLOCK) {
+    // Load the last whole block starting at or before offset, and shift
+    // away the bytes before offset.
+    size_t start = offset + AVX2_BLOCK <= length ? offset :
+        length - AVX2_BLOCK;
+    memcpy(&ret_val, data + start, AVX2_BLOCK);
+    size_t skip = offset - start;
+    return skip < AVX2_BLOCK ? ret_val >> (8 * skip) : 0;
+  }
+  // Little-endian order, to match the memcpy above.
+  for (size_t k = length; k > offset; k--) {
+    ret_val = (ret_val << 8) | static_cast<uint8_t>(data[k - 1]);
+  }
+  return ret_val;
+}
+
+// Keys are hashed AVX2_LANES at a time, AVX2_BLOCK bytes per round, with
+// each group running until its longest key is done. To keep the lanes of
+// a group busy, we take the keys of each window of AVX2_WINDOW keys in
+// order of length. The windows are small enough that reordering them does
+// not cost us the cache locality of walking the keys in order.
+const size_t AVX2_WINDOW = 256;
+// Keys of this length or more all sort as equals.
+const size_t MAX_SORTED_LENGTH = 256;
+
+template <typename Keys>
+__attribute__((target("avx2")))
+void HashWindowAvx2(const RZStringHash& hash, const Keys& keys, size_t n,
+                    uint32_t* out) {
+  auto bucket = [&keys](size_t i) {
+    return keys.size(i) < MAX_SORTED_LENGTH ? keys.size(i) :
+        MAX_SORTED_LENGTH - 1;
+  };
+  // counts[b + 1] starts as the number of keys in bucket b, and becomes
+  // the position in order of the first key of bucket b + 1.
+  size_t counts[MAX_SORTED_LENGTH + 1] = {0};
+  for (size_t i = 0; i < n; i++) {
+    counts[bucket(i) + 1]++;
+  }
+  for (size_t b = 1; b <= MAX_SORTED_LENGTH; b++) {
+    counts[b] += counts[b - 1];
+  }
+  size_t order[AVX2_WINDOW];
+  for (size_t i = 0; i < n; i++) {
+    order[counts[bucket(i)]++] = i;
+  }
+
+  const __m256i left = _mm256_set1_epi32(hash.left_shift());
+  const __m256i right = _mm256_set1_epi32(hash.right_shift());
+  size_t i = 0;
+  for (; i + AVX2_LANES <= n; i += AVX2_LANES) {
+    const char* group[AVX2_LANES];
+    size_t sizes[AVX2_LANES];
+    int32_t lengths[AVX2_LANES];
+    size_t longest = 0;
+    for (size_t lane = 0; lane < AVX2_LANES; lane++) {
+      group[lane] = keys.data(order[i + lane]);
+      sizes[lane] = keys.size(order[i + lane]);
+      lengths[lane] = static_cast<int32_t>(sizes[lane]);
+      if (sizes[lane] > longest) {
+        longest = sizes[lane];
+      }
+    }
+    const __m256i length_vector =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(lengths));
+    __m256i h = _mm256_set1_epi32(static_cast<int32_t>(hash.seed()));
+    for (size_t j = 0; j < longest; j += AVX2_BLOCK) {
+      __m128i rows[AVX2_LANES];
+      for (size_t lane = 0; lane < AVX2_LANES; lane++) {
+        rows[lane] = _mm_cvtsi64_si128(static_cast<int64_t>(
+            LoadBlock(group[lane], sizes[lane], j)));
+      }
+      // Transpose the 8x8 block of bytes, so that columns[k] holds byte
+      // j + 2k of every lane in its low half, and byte j + 2k + 1 in its
+      // high half.
+      __m128i t0 = _mm_unpacklo_epi8(rows[0], rows[1]);
+      __m128i t1 = _mm_unpacklo_epi8(rows[2], rows[3]);
+      __m128i t2 = _mm_unpacklo_epi8(rows[4], rows[5]);
+      __m128i t3 = _mm_unpacklo_epi8(rows[6], rows[7]);
+      __m128i u0 = _mm_unpacklo_epi16(t0, t1);
+      __m128i u1 = _mm_unpackhi_epi16(t0, t1);
+      __m128i u2 = _mm_unpacklo_epi16(t2, t3);
+      __m128i u3 = _mm_unpackhi_epi16(t2, t3);
+      __m128i columns[AVX2_BLOCK / 2] = {
+          _mm_unpacklo_epi32(u0, u2), _mm_unpackhi_epi32(u0, u2),
+          _mm_unpacklo_epi32(u1, u3), _mm_unpackhi_epi32(u1, u3)};
+      for (size_t k = 0; k < AVX2_BLOCK; k++) {
+        __m128i column = columns[k / 2];
+        if (k % 2 == 1) {
+          column = _mm_srli_si128(column, 8);
+        }
+        // Sign-extended, as char is when next_hash_value adds it.
+        const __m256i c = _mm256_cvtepi8_epi32(column);
+        // Lanes whose key is already used up keep their old value.
+        const __m256i active = _mm256_cmpgt_epi32(
+            length_vector, _mm256_set1_epi32(static_cast<int32_t>(j + k)));
+        __m256i step = _mm256_add_epi32(
+            _mm256_add_epi32(_mm256_sllv_epi32(h, left),
+                             _mm256_srlv_epi32(h, right)), c);
+        h = _mm256_xor_si256(h, _mm256_and_si256(step, active));
+      }
+    }
+    uint32_t results[AVX2_LANES];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(results), h);
+    for (size_t lane = 0; lane < AVX2_LANES; lane++) {
+      out[order[i + lane]] = results[lane];
+    }
+  }
+  for (; i < n; i++) {
+    out[order[i]] = hash(keys.data(order[i]), keys.size(order[i]));
+  }
+}
+
+template <typename Keys>
+void HashBatchAvx2(const RZStringHash& hash, const Keys& keys, size_t n,
+                   uint32_t* out) {
+  for (size_t base = 0; base < n; base += AVX2_WINDOW) {
+    size_t count = n - base < AVX2_WINDOW ? n - base : AVX2_WINDOW;
+    HashWindowAvx2(hash, keys.From(base), count, out + base);
+  }
+}
+#endif
+
+template <typename Keys>
+struct HashBatchFunction {
+  typedef void (*Type)(const RZStringHash&, const Keys&, size_t, uint32_t*);
+};
+
+template <typename Keys>
+typename HashBatchFunction<Keys>::Type SelectHashBatch() {
+#ifdef ACUMIO_RZ_HASH_AVX2
+  if (__builtin_cpu_supports("avx2")) {
+    return &HashBatchAvx2<Keys>;
+  }
+#endif
+  return &HashBatchScalar<Keys>;
+}
+} // anonymous namespace
+
 RZStringHash::~RZStringHash() {}
 
 uint32_t RZStringHash::operator()(const std::string& s) {
@@ -21,5 +244,28 @@ uint32_t RZStringHash::operator()(const std::string& s) {
   return h;
 }
 
+uint32_t RZStringHash::operator()(const char* data, size_t length) const {
+  uint32_t h = seed_;
+  const char* end = data + length;
+  for (const char* c = data; c < end; c++) {
+    h = next_hash_value(h, *c);
+  }
+  return h;
+}
+
+void RZStringHash::HashBatch(const std::string* keys, size_t n,
+                             uint32_t* out) const {
+  static const HashBatchFunction<StringKeys>::Type hash_batch =
+      SelectHashBatch<StringKeys>();
+  hash_batch(*this, StringKeys(keys), n, out);
+}
+
+void RZStringHash::HashBatch(const char* const* data, const size_t* lengths,
+                             size_t n, uint32_t* out) const {
+  static const HashBatchFunction<PointerKeys>::Type hash_batch =
+      SelectHashBatch<PointerKeys>();
+  hash_batch(*this, PointerKeys(data, lengths), n, out);
+}
+
 } // namespace util
 } // namespace acumio
@@ -1,7 +1,7 @@
 #ifndef AcumioServer_rz_string_hash_h
 #define AcumioServer_rz_string_hash_h
 //============================================================================
-// Name        : transaction.h
+// Name        : rz_string_hash.h
 // Author      : Bill Province (bill@acumio.com)
 // Version     :
 // Copyright   : Copyright (C) 2016 Acumio
@@ -23,8 +23,17 @@
 //               compute the mod of the final result over the size of the
 //               hash-table. This is fine, but it's better to leave the
 //               hash function itself unaware of the table size.
+//
+//               Each step of the hash depends on the previous one, so a
+//               single string cannot be hashed more than a byte at a time
+//               without changing the function. HashBatch instead hashes
+//               several strings side by side: 8 per step with AVX2 where the
+//               processor has it, otherwise 4 interleaved scalar chains.
+//               Either way it produces exactly the values operator() does.
 //============================================================================
 
+#include <stddef.h>
+#include <stdint.h>
 #include <string>
 
 namespace acumio {
@@ -41,14 +50,21 @@ class RZStringHash {
   ~RZStringHash();
 
   uint32_t operator()(const std::string& s);
+  uint32_t operator()(const char* data, size_t length) const;
+
+  // Sets out[i] to the hash of keys[i], for 0 <= i < n.
+  void HashBatch(const std::string* keys, size_t n, uint32_t* out) const;
+  // The same, for keys given as the lengths[i] bytes starting at data[i].
+  void HashBatch(const char* const* data, const size_t* lengths, size_t n,
+                 uint32_t* out) const;
 
-  inline uint32_t seed() { return seed_; }
-  inline uint8_t left_shift() { return left_shift_; }
-  inline uint8_t right_shift() { return right_shift_; }
+  inline uint32_t seed() const { return seed_; }
+  inline uint8_t left_shift() const { return left_shift_; }
+  inline uint8_t right_shift() const { return right_shift_; }
   // next_hash_value =
   //    current_hash xor
   //    (left-shift(current_hash) + right-shift(current_hash) + c)
-  inline uint32_t next_hash_value(uint32_t h, char c) {
+  inline uint32_t next_hash_value(uint32_t h, char c) const {
     return h ^ ((h << left_shift_) + (h >> right_shift_) + c);
   }
 
@@ -8,71 +8,275 @@
 //============================================================================
 #include "shared_mutex.h"
 
+#include <algorithm>
+#include <climits>
+#include <functional>
+#include <thread>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 namespace acumio {
 namespace transaction {
 
-SharedMutex::SharedMutex() : state_(0) {}
+namespace {
+inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  __asm__ __volatile__("yield");
+#endif
+}
+
+#ifdef __linux__
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(int),
+              "futex word must be a 32-bit int");
+
+inline void FutexWait(std::atomic<uint32_t>* word, uint32_t expected) {
+  syscall(SYS_futex, reinterpret_cast<int*>(word), FUTEX_WAIT_PRIVATE,
+          expected, nullptr, nullptr, 0);
+}
+
+inline void FutexWakeAll(std::atomic<uint32_t>* word) {
+  syscall(SYS_futex, reinterpret_cast<int*>(word), FUTEX_WAKE_PRIVATE,
+          INT_MAX, nullptr, nullptr, 0);
+}
+#else
+inline void FutexWait(std::atomic<uint32_t>* word, uint32_t expected) {
+  std::this_thread::yield();
+}
+
+inline void FutexWakeAll(std::atomic<uint32_t>* word) {}
+#endif
+
+// A per-thread value used to choose a ReaderBiasedSharedMutex reader slot.
+inline uint32_t ThreadReaderSlot() {
+  static thread_local uint32_t slot =
+      static_cast<uint32_t>(std::hash<std::thread::id>()(
+          std::this_thread::get_id()));
+  return slot;
+}
+
+const uint32_t MAX_READER_SLOTS = 64;
+} // anonymous namespace
+
+SharedMutex::SharedMutex() : SharedMutex(false) {}
+
+SharedMutex::SharedMutex(bool reader_biased) : state_(0),
+    wake_generation_(0), writers_waiting_(0), sleepers_(0),
+    reader_biased_(reader_biased) {}
+
 SharedMutex::~SharedMutex() {}
 
 void SharedMutex::break_locks() {
+  if (reader_biased_) {
+    static_cast<ReaderBiasedSharedMutex*>(this)->reset_slots();
+  }
   state_.store(0);
+  wake_sleepers();
 }
 
-void SharedMutex::acquire() {
-  bool acquired = false;
-  int16_t current_state = state_.load();
-  while (!acquired) {
-    while (current_state < 0) {
-      current_state = state_.load();
+int32_t SharedMutex::acquire() {
+  if (reader_biased_) {
+    int32_t slot =
+        static_cast<ReaderBiasedSharedMutex*>(this)->try_acquire_biased();
+    if (slot != NO_SLOT) {
+      return slot;
     }
-    int16_t next_state = current_state + 1;
-    // If exchange fails, current_state is updated to reflect newest value.
-    acquired = state_.compare_exchange_weak(current_state, next_state);
+  }
+  uint32_t spins = 0;
+  while (true) {
+    uint32_t generation = wake_generation_.load();
+    uint32_t current_state = state_.load();
+    if ((current_state & WRITER_HELD) == 0 &&
+        writers_waiting_.load(std::memory_order_relaxed) == 0) {
+      if (state_.compare_exchange_weak(current_state, current_state + 1,
+                                       std::memory_order_acquire,
+                                       std::memory_order_relaxed)) {
+        return NO_SLOT;
+      }
+      continue;
+    }
+    // Either a writer holds the lock, or one is waiting for the current
+    // readers to drain. Both end with a wake (the last reader leaving, or
+    // the writer releasing).
+    wait(generation, &spins);
   }
 }
 
-void SharedMutex::release() {
-  bool released = false;
-  int16_t current_state = state_.load();
-  // We compare current_state to 0 to consider the case where the locks
+void SharedMutex::release(int32_t slot) {
+  if (slot != NO_SLOT) {
+    static_cast<ReaderBiasedSharedMutex*>(this)->release_biased(slot);
+    return;
+  }
+  uint32_t current_state = state_.load(std::memory_order_relaxed);
+  // We check the reader count to consider the case where the locks
   // were explicitly broken.
-  while (!released && current_state != 0) {
-    int16_t next_state = current_state - 1;
-    if (current_state < 0) {
-      next_state += 2;
-    }
+  while ((current_state & READER_MASK) != 0) {
     // If exchange fails, current_state is updated to reflect newest value.
-    released = state_.compare_exchange_weak(current_state, next_state);
+    if (state_.compare_exchange_weak(current_state, current_state - 1)) {
+      if (current_state == 1) {
+        // Last reader out: a waiting writer can now proceed.
+        wake_sleepers();
+      }
+      return;
+    }
   }
 }
 
 void SharedMutex::acquire_exclusive() {
-  bool enqueued = false;
-  int16_t current_state = state_.load();
-  while (!enqueued) {
-    while (current_state < 0) {
-      current_state = state_.load();
-     }
-    int16_t next_val = -(current_state + 1);
-    // If exchange fails, current_state is updated to reflect newest value.
-    enqueued = state_.compare_exchange_weak(current_state, next_val);
-  }
-  int16_t is_neg_one = state_.load();
-  while (is_neg_one < -1) {
-    is_neg_one = state_.load();
+  writers_waiting_.fetch_add(1);
+  uint32_t spins = 0;
+  while (true) {
+    uint32_t generation = wake_generation_.load();
+    uint32_t current_state = state_.load();
+    if (current_state == 0) {
+      // If exchange fails, current_state is updated to reflect newest value.
+      if (state_.compare_exchange_weak(current_state, WRITER_HELD,
+                                       std::memory_order_acquire,
+                                       std::memory_order_relaxed)) {
+        writers_waiting_.fetch_sub(1);
+        if (reader_biased_) {
+          static_cast<ReaderBiasedSharedMutex*>(this)->revoke_bias();
+        }
+        return;
+      }
+      continue;
+    }
+    wait(generation, &spins);
   }
 }
 
 void SharedMutex::release_exclusive() {
+  if (reader_biased_) {
+    static_cast<ReaderBiasedSharedMutex*>(this)->restore_bias();
+  }
   state_.store(0);
+  wake_sleepers();
+}
+
+void SharedMutex::wait(uint32_t observed_generation, uint32_t* spins) {
+  if (*spins < SPIN_LIMIT) {
+    (*spins)++;
+    CpuRelax();
+    return;
+  }
+  // The caller read the generation before state_, and releasers change
+  // state_ before bumping the generation, so a release the caller did not
+  // see has not bumped it yet. Registering as a sleeper before re-checking
+  // the generation (inside the futex call) pairs with releasers bumping it
+  // before reading sleepers_: either the releaser sees us and wakes us, or
+  // the futex sees the new generation and returns immediately.
+  sleepers_.fetch_add(1);
+  FutexWait(&wake_generation_, observed_generation);
+  sleepers_.fetch_sub(1);
+}
+
+void SharedMutex::wake_sleepers() {
+  wake_generation_.fetch_add(1);
+  if (sleepers_.load() != 0) {
+    FutexWakeAll(&wake_generation_);
+  }
+}
+
+ReaderBiasedSharedMutex::ReaderBiasedSharedMutex() : SharedMutex(true),
+    bias_(true), slot_mask_(0), slots_(nullptr) {
+  // Use the smallest power of two covering the hardware threads, so that
+  // slot selection is a mask.
+  uint32_t wanted = std::max(1u, std::thread::hardware_concurrency());
+  uint32_t slot_count = 1;
+  while (slot_count < wanted && slot_count < MAX_READER_SLOTS) {
+    slot_count <<= 1;
+  }
+  slot_mask_ = slot_count - 1;
+  slots_ = new ReaderSlot[slot_count];
+  for (uint32_t i = 0; i < slot_count; i++) {
+    slots_[i].count.store(0);
+  }
+}
+
+ReaderBiasedSharedMutex::~ReaderBiasedSharedMutex() {
+  delete[] slots_;
+}
+
+int32_t ReaderBiasedSharedMutex::try_acquire_biased() {
+  if (!bias_.load()) {
+    return NO_SLOT;
+  }
+  uint32_t slot = ThreadReaderSlot() & slot_mask_;
+  // Publishing our count before re-checking bias_ pairs with revoke_bias()
+  // clearing bias_ before scanning the counts: either the writer sees our
+  // count and waits for it, or we see the revocation and back out.
+  slots_[slot].count.fetch_add(1);
+  if (bias_.load()) {
+    return static_cast<int32_t>(slot);
+  }
+  if (slots_[slot].count.fetch_sub(1) == 1) {
+    // The writer revoking the bias may be parked on our count.
+    FutexWakeAll(&(slots_[slot].count));
+  }
+  return NO_SLOT;
+}
+
+void ReaderBiasedSharedMutex::release_biased(int32_t slot) {
+  ReaderSlot& reader_slot = slots_[slot];
+  uint32_t current_count = reader_slot.count.load(std::memory_order_relaxed);
+  // As with SharedMutex::release, a zero count means the locks were broken.
+  while (current_count != 0) {
+    // If exchange fails, current_count is updated to reflect newest value.
+    if (reader_slot.count.compare_exchange_weak(current_count,
+                                                current_count - 1)) {
+      // Emptying the slot before checking bias_ pairs with revoke_bias()
+      // clearing bias_ before reading the count it parks on: either we
+      // see the revocation and wake the writer, or it sees the empty slot.
+      if (current_count == 1 && !bias_.load()) {
+        FutexWakeAll(&(reader_slot.count));
+      }
+      return;
+    }
+  }
+}
+
+void ReaderBiasedSharedMutex::revoke_bias() {
+  bias_.store(false);
+  for (uint32_t i = 0; i <= slot_mask_; i++) {
+    uint32_t spins = 0;
+    uint32_t count = slots_[i].count.load();
+    while (count != 0) {
+      // Biased readers usually leave quickly, but one may hold the lock
+      // for as long as it iterates, so after the spin budget we park until
+      // the last reader to leave the slot wakes us.
+      if (spins < SPIN_LIMIT) {
+        spins++;
+        CpuRelax();
+      } else {
+        FutexWait(&(slots_[i].count), count);
+      }
+      count = slots_[i].count.load();
+    }
+  }
+}
+
+void ReaderBiasedSharedMutex::restore_bias() {
+  bias_.store(true);
+}
+
+void ReaderBiasedSharedMutex::reset_slots() {
+  for (uint32_t i = 0; i <= slot_mask_; i++) {
+    slots_[i].count.store(0);
+    FutexWakeAll(&(slots_[i].count));
+  }
+  bias_.store(true);
 }
 
 SharedLock::SharedLock(SharedMutex& mutex) : mutex_(mutex) {
-  mutex_.acquire();
+  slot_ = mutex_.acquire();
 }
 
 SharedLock::~SharedLock() {
-  mutex_.release();
+  mutex_.release(slot_);
 }
 
 ExclusiveLock::ExclusiveLock(SharedMutex& mutex) : mutex_(mutex) {
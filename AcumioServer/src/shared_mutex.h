@@ -9,8 +9,22 @@
 //               multiple concurrent SharedLocks but only a single
 //               ExclusiveLock.
 //
-//               This is performed via a spin-lock mechanism on an atomic
-//               variable.
+//               This is performed via an adaptive mechanism on a single
+//               32-bit atomic variable: a waiter first spins (with a CPU
+//               pause hint) for a short budget, and only then parks itself
+//               on a futex until a release wakes it. Once a writer is
+//               waiting, new readers are held back so that a steady stream
+//               of readers cannot starve writers.
+//
+//               For structures that are read far more often than they are
+//               written, ReaderBiasedSharedMutex can be used in place of
+//               SharedMutex (with the same SharedLock and ExclusiveLock).
+//               Its readers increment one of several per-thread counters,
+//               each on its own cache line, rather than the shared state;
+//               a writer revokes the bias and waits for those counters to
+//               drain. This makes writes more expensive, and each instance
+//               much larger, so it is meant for one-per-map guards rather
+//               than per-element ones.
 //
 //               Usage:
 //
@@ -39,31 +53,101 @@
 //============================================================================
 
 #include <atomic>
+#include <stdint.h>
 
 namespace acumio {
 namespace transaction {
 
 class SharedLock;
 class ExclusiveLock;
+class ReaderBiasedSharedMutex;
 
 class SharedMutex {
  public:
   SharedMutex();
   ~SharedMutex();
+  SharedMutex(const SharedMutex&) = delete;
+  SharedMutex& operator=(const SharedMutex&) = delete;
 
   // This is an emergency mechanism that will allow us to break locks
   // even in the event of thread-death of a thread that did not properly
   // release its lock.
   void break_locks();
 
+ protected:
+  explicit SharedMutex(bool reader_biased);
+
  private:
   friend class SharedLock;
   friend class ExclusiveLock;
-  void acquire();
-  void release();
+  friend class ReaderBiasedSharedMutex;
+  // Returned by acquire() when the shared lock is held via state_ rather
+  // than via a reader slot.
+  static const int32_t NO_SLOT = -1;
+  // The high bit of state_ marks an exclusive holder; the remaining bits
+  // count shared holders.
+  static const uint32_t WRITER_HELD = UINT32_C(0x80000000);
+  static const uint32_t READER_MASK = UINT32_C(0x7FFFFFFF);
+  // Number of pause-spins a waiter performs before parking.
+  static const uint32_t SPIN_LIMIT = 128;
+
+  // Returns the reader slot that must be passed back to release().
+  int32_t acquire();
+  void release(int32_t slot);
   void acquire_exclusive();
   void release_exclusive();
-  std::atomic<int16_t> state_;
+  // Waits (spinning first, then parking) until wake_generation_ no longer
+  // holds observed_generation. The caller must read the generation before
+  // it reads the state_ that made it decide to wait. spins tracks the spin
+  // budget used so far.
+  void wait(uint32_t observed_generation, uint32_t* spins);
+  // Bumps wake_generation_ and wakes any parked threads. Called after every
+  // change to state_ that may let a waiter proceed.
+  void wake_sleepers();
+
+  std::atomic<uint32_t> state_;
+  // Sleepers park on this rather than on state_: a waiter may be waiting
+  // for a change that leaves state_ as it found it (a reader held back by
+  // a waiting writer sees 0 both before and after that writer's turn).
+  std::atomic<uint32_t> wake_generation_;
+  // Number of exclusive acquirers that have not yet acquired. While this
+  // is non-zero, new shared acquirers wait.
+  std::atomic<uint32_t> writers_waiting_;
+  // Number of threads parked (or about to park). Only read on
+  // release, so uncontended locks never make a system call.
+  std::atomic<uint32_t> sleepers_;
+  // True only for ReaderBiasedSharedMutex; lets the lock operations
+  // dispatch without virtual calls.
+  const bool reader_biased_;
+};
+
+class ReaderBiasedSharedMutex : public SharedMutex {
+ public:
+  ReaderBiasedSharedMutex();
+  ~ReaderBiasedSharedMutex();
+
+ private:
+  friend class SharedMutex;
+  // Each slot has its own cache line, so readers on different threads do
+  // not contend.
+  struct ReaderSlot {
+    std::atomic<uint32_t> count;
+    char padding[64 - sizeof(std::atomic<uint32_t>)];
+  };
+
+  // Returns the slot acquired, or NO_SLOT if the bias is revoked and the
+  // caller must use the underlying SharedMutex.
+  int32_t try_acquire_biased();
+  void release_biased(int32_t slot);
+  // Both of these are only called while holding the underlying mutex
+  // exclusively.
+  void revoke_bias();
+  void restore_bias();
+  void reset_slots();
+
+  std::atomic<bool> bias_;
+  uint32_t slot_mask_;
+  ReaderSlot* slots_;
 };
 
 class SharedLock {
@@ -74,6 +158,7 @@ class SharedLock {
   inline SharedMutex& GetMutex() { return mutex_; }
  private:
   SharedMutex& mutex_;
+  int32_t slot_;
 };
 
 class ExclusiveLock {
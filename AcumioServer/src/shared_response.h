@@ -0,0 +1,68 @@
+#ifndef AcumioServer_shared_response_h
+#define AcumioServer_shared_response_h
+//============================================================================
+// Name        : shared_response.h
+// Author      : Bill Province (bill@acumio.com)
+// Version     :
+// Copyright   : Copyright (C) 2016 Acumio
+// Description : Fills response messages from stored element snapshots
+//               without copying them, where the response allows it.
+//
+//               A response built on a protobuf Arena (as in --async mode,
+//               where each call owns one) can point its fields at messages
+//               it does not own, so long as they outlive the arena. The
+//               stored snapshots are immutable and reference-counted, so
+//               we point the field at the snapshot's message, and have the
+//               arena hold a reference to the snapshot until it is
+//               destroyed, which is after the response has been sent. The
+//               response is then serialized straight from the snapshot.
+//
+//               A response that is not on an arena owns its fields, so
+//               there the message is copied into the field, as before.
+//============================================================================
+
+#include <google/protobuf/arena.h>
+#include <google/protobuf/repeated_field.h>
+
+namespace acumio {
+
+// Keeps snapshot alive for as long as arena.
+template <class Snapshot>
+inline void PinToArena(const Snapshot& snapshot,
+                       google::protobuf::Arena* arena) {
+  google::protobuf::Arena::Create<Snapshot>(arena, snapshot);
+}
+
+// Sets a message field of response to part, which must belong to
+// snapshot. set_shared and mutable_field are the field's
+// unsafe_arena_set_allocated_ and mutable_ accessors.
+template <class Snapshot, class Message, class Response>
+void ShareOrCopy(const Snapshot& snapshot, const Message& part,
+                 Response* response,
+                 void (Response::*set_shared)(Message*),
+                 Message* (Response::*mutable_field)()) {
+  google::protobuf::Arena* arena = response->GetArena();
+  if (arena == nullptr) {
+    (response->*mutable_field)()->CopyFrom(part);
+    return;
+  }
+  PinToArena(snapshot, arena);
+  (response->*set_shared)(const_cast<Message*>(&part));
+}
+
+// As above, appending part to a repeated message field.
+template <class Snapshot, class Message>
+void AddSharedOrCopy(const Snapshot& snapshot, const Message& part,
+                     google::protobuf::RepeatedPtrField<Message>* field) {
+  google::protobuf::Arena* arena = field->GetArena();
+  if (arena == nullptr) {
+    field->Add()->CopyFrom(part);
+    return;
+  }
+  PinToArena(snapshot, arena);
+  field->UnsafeArenaAddAllocated(const_cast<Message*>(&part));
+}
+
+} // namespace acumio
+
+#endif // AcumioServer_shared_response_h
@@ -13,15 +13,17 @@
 namespace acumio {
 namespace collection {
 
-StringAllocator::StringAllocator(uint16_t max_size) : max_size_(max_size),
-    space_used_(0), key_list_(nullptr), reference_counts_(nullptr),
-    free_key_list_() {
+const uint8_t StringAllocator::MAX_SHARED_LENGTH;
+
+StringAllocator::StringAllocator(uint16_t max_size, bool front_coded) :
+    max_size_(max_size), front_coded_(front_coded), base_(), space_used_(0),
+    key_list_(nullptr), reference_counts_(nullptr), holes_by_location_(),
+    holes_by_length_() {
   if (max_size_ > 0) {
     key_list_ = new char[max_size_];
     reference_counts_ = new uint8_t[max_size_];
+    AddHole(0, max_size_);
   }
-  FreeKey initial_free_key(0, max_size_);
-  free_key_list_.push_back(initial_free_key);
 }
 
 StringAllocator::~StringAllocator() {
@@ -32,50 +34,81 @@ StringAllocator::~StringAllocator() {
 }
 
 uint16_t StringAllocator::Add(const char* s) {
-  uint16_t space_needed = strlen(s) + 1;
-  int16_t last_free_pos = free_key_list_.size() - 1;
-  int16_t free_pos = last_free_pos;
-  uint16_t hole_length = 0;
-  while (free_pos >= 0 &&
-         (hole_length = free_key_list_[free_pos].hole_length) < space_needed) {
-    free_pos--;
-  }
-  if (free_pos < 0) {
+  uint8_t shared = 0;
+  if (front_coded_) {
+    if (base_.empty()) {
+      // Any strings stored so far share nothing with the (empty) base, and
+      // so are unaffected by our choosing it now.
+      base_ = s;
+    }
+    size_t match = BaseMatch(s);
+    shared = match < MAX_SHARED_LENGTH ? match : MAX_SHARED_LENGTH;
+    s += shared;
+  }
+  size_t space_needed = (front_coded_ ? 1 : 0) + strlen(s) + 1;
+  if (space_needed > max_size_) {
     return max_size_;
   }
-  FreeKey& updated_free = free_key_list_[free_pos];
-  uint16_t ret_val = updated_free.location;
+  // The smallest hole that fits.
+  HolesByLength::iterator best = holes_by_length_.lower_bound(
+      std::make_pair(static_cast<uint16_t>(space_needed), UINT16_C(0)));
+  if (best == holes_by_length_.end()) {
+    return max_size_;
+  }
+  uint16_t ret_val = best->second;
+  uint16_t hole_length = best->first;
+  RemoveHole(holes_by_location_.find(ret_val));
+  if (hole_length > space_needed) {
+    AddHole(ret_val + space_needed, hole_length - space_needed);
+  }
+
   uint16_t offset = ret_val;
+  if (front_coded_) {
+    key_list_[offset++] = static_cast<char>(shared + 1);
+  }
   for (const char* i = s; *i != '\0'; i++) {
     key_list_[offset++] = *i;
   }
   key_list_[offset++] = '\0';
   reference_counts_[ret_val] = 1;
-  hole_length -= space_needed;
-  if (hole_length > 0) {
-    updated_free.location = offset;
-    updated_free.hole_length = hole_length;
-    return ret_val;
-  }
-  // If we reach here, we can eliminate a hole. We will move
-  // the trailing hole to this position. Unless of course, this
-  // is the last position, in which case, we only do the size
-  // decrement.
-  if (offset < last_free_pos) {
-    updated_free = free_key_list_[last_free_pos];
-  }
-  // special case: we are completely out of space as we just filled in
-  // the last hole. Alternatively, we just allocated all of our space
-  // to a single very large string.
-  if (free_key_list_.size() == 1) {
-    updated_free.location = max_size_;
-    updated_free.hole_length = 0;
-  } else {
-    free_key_list_.pop_back();
+  space_used_ += space_needed;
+  return ret_val;
+}
+
+size_t StringAllocator::BaseMatch(const char* s) const {
+  size_t ret_val = 0;
+  while (ret_val < base_.size() && s[ret_val] == base_[ret_val]) {
+    ret_val++;
   }
   return ret_val;
 }
 
+int StringAllocator::Compare(const char* s, size_t base_match,
+                             uint16_t position) const {
+  const char* stored = key_list_ + position;
+  if (!front_coded_) {
+    return strcmp(s, stored);
+  }
+  size_t shared = static_cast<uint8_t>(stored[0]) - 1;
+  if (base_match < shared) {
+    // Both strings match the base up to base_match. There, the stored
+    // string continues to match the base, while s does not.
+    return static_cast<uint8_t>(s[base_match]) <
+        static_cast<uint8_t>(base_[base_match]) ? -1 : 1;
+  }
+  return strcmp(s + shared, stored + 1);
+}
+
+void StringAllocator::Decode(uint16_t position, std::string* s) const {
+  const char* stored = key_list_ + position;
+  if (!front_coded_) {
+    s->assign(stored);
+    return;
+  }
+  s->assign(base_, 0, static_cast<uint8_t>(stored[0]) - 1);
+  s->append(stored + 1);
+}
+
 uint8_t StringAllocator::AddReference(uint16_t position) {
   uint8_t current_val = reference_counts_[position];
   if (current_val == 0 || current_val >= MAX_REFERENCE_COUNT) {
@@ -93,39 +126,146 @@ uint8_t StringAllocator::DropReference(uint16_t position) {
   if (current_val > 0) {
     return current_val;
   }
-  // Before making a new hole, let's see if this can extend an existing
-  // hole. The extension could occur because there is a hole at some pos
-  // p with hole_length l such that p + l == position or it could occur
-  // if there is a hole at position p such that p == position +
-  // strlen(key_list_ + 1) + 1. Alternatively, the hole could occur at
-  // both ends. Interestingly, it could not happen more than once on
-  // either end. However, we will stop after finding one at either end
-  // calling the result "good enough". Technically, this could cause
-  // fragmentation, but these are expected to be used in small enough
-  // structures that this should not be a huge issue.
+  // Merge the new hole with any hole on either side of it, so that
+  // the free space does not splinter into pieces too small to use.
   uint16_t new_hole_length = strlen(key_list_ + position) + 1;
-  uint16_t next_hole_pos = position + new_hole_length;
-  for (uint16_t i = 0; i < free_key_list_.size(); i++) {
-    FreeKey& cur_free = free_key_list_[i];
-    if (cur_free.location == next_hole_pos) {
-      cur_free.location = position;
-      cur_free.hole_length += new_hole_length;
-      new_hole_length = cur_free.hole_length;
-      return 0;
+  space_used_ -= new_hole_length;
+  HolesByLocation::iterator next =
+      holes_by_location_.find(position + new_hole_length);
+  if (next != holes_by_location_.end()) {
+    new_hole_length += next->second;
+    RemoveHole(next);
+  }
+  HolesByLocation::iterator previous = holes_by_location_.lower_bound(position);
+  if (previous != holes_by_location_.begin()) {
+    previous--;
+    if (previous->first + previous->second == position) {
+      position = previous->first;
+      new_hole_length += previous->second;
+      RemoveHole(previous);
     }
-    if (cur_free.location + cur_free.hole_length == position) {
-      cur_free.hole_length = cur_free.hole_length + new_hole_length;
-      position = cur_free.location;
-      new_hole_length = cur_free.hole_length;
-      return 0;
+  }
+  AddHole(position, new_hole_length);
+  return 0;
+}
+
+void StringAllocator::Compact(std::vector<uint16_t>* relocation) {
+  if (front_coded_) {
+    CompactFrontCoded(relocation);
+    return;
+  }
+  relocation->assign(max_size_, max_size_);
+  uint16_t next = 0;
+  uint32_t position = 0;
+  HolesByLocation::const_iterator hole = holes_by_location_.begin();
+  while (position < max_size_) {
+    if (hole != holes_by_location_.end() && hole->first == position) {
+      position += hole->second;
+      hole++;
+      continue;
     }
+    uint16_t length = strlen(key_list_ + position) + 1;
+    (*relocation)[position] = next;
+    if (next != position) {
+      // The regions may overlap, but we only ever move strings down.
+      memmove(key_list_ + next, key_list_ + position, length);
+      reference_counts_[next] = reference_counts_[position];
+    }
+    next += length;
+    position += length;
+  }
+  holes_by_location_.clear();
+  holes_by_length_.clear();
+  if (next < max_size_) {
+    memset(reference_counts_ + next, 0, max_size_ - next);
+    AddHole(next, max_size_ - next);
   }
+}
 
-  // If we reach here, we could not re-use an existing hole, so we
-  // add a new one.
-  FreeKey new_hole(position, new_hole_length);
-  free_key_list_.push_back(new_hole);
-  return 0;
+void StringAllocator::CompactFrontCoded(std::vector<uint16_t>* relocation) {
+  relocation->assign(max_size_, max_size_);
+  // Decode every string first: with a new base, a string may take more or
+  // less room, so rewriting in place could overwrite one not yet read.
+  std::vector<uint16_t> positions;
+  std::vector<std::string> strings;
+  std::vector<uint8_t> counts;
+  uint32_t position = 0;
+  HolesByLocation::const_iterator hole = holes_by_location_.begin();
+  while (position < max_size_) {
+    if (hole != holes_by_location_.end() && hole->first == position) {
+      position += hole->second;
+      hole++;
+      continue;
+    }
+    positions.push_back(position);
+    strings.push_back(Decode(position));
+    counts.push_back(reference_counts_[position]);
+    position += strlen(key_list_ + position) + 1;
+  }
+
+  // The longest prefix common to all the strings is shared in full by each
+  // of them. The strings may have shared more with the current base, so we
+  // only take the new one if the strings then take no more room.
+  std::string prefix = strings.empty() ? std::string() : strings[0];
+  for (const std::string& value : strings) {
+    size_t match = 0;
+    while (match < prefix.size() && match < value.size() &&
+           prefix[match] == value[match]) {
+      match++;
+    }
+    prefix.resize(match);
+  }
+  size_t new_space = 0;
+  for (const std::string& value : strings) {
+    size_t shared = prefix.size() < MAX_SHARED_LENGTH ? prefix.size() :
+        MAX_SHARED_LENGTH;
+    new_space += 1 + value.size() - shared + 1;
+  }
+  if (new_space <= space_used_) {
+    base_ = prefix;
+  }
+
+  uint16_t next = 0;
+  for (size_t i = 0; i < strings.size(); i++) {
+    const char* value = strings[i].c_str();
+    size_t match = BaseMatch(value);
+    uint8_t shared = match < MAX_SHARED_LENGTH ? match : MAX_SHARED_LENGTH;
+    (*relocation)[positions[i]] = next;
+    reference_counts_[next] = counts[i];
+    key_list_[next] = static_cast<char>(shared + 1);
+    size_t length = strings[i].size() - shared + 1;
+    memcpy(key_list_ + next + 1, value + shared, length);
+    next += 1 + length;
+  }
+  space_used_ = next;
+  holes_by_location_.clear();
+  holes_by_length_.clear();
+  if (next < max_size_) {
+    memset(reference_counts_ + next, 0, max_size_ - next);
+    AddHole(next, max_size_ - next);
+  }
+}
+
+uint16_t StringAllocator::largest_hole() const {
+  return holes_by_length_.empty() ? 0 : holes_by_length_.rbegin()->first;
+}
+
+double StringAllocator::fragmentation() const {
+  uint16_t free = free_space();
+  if (free == 0) {
+    return 0.0;
+  }
+  return 1.0 - static_cast<double>(largest_hole()) / free;
+}
+
+void StringAllocator::AddHole(uint16_t location, uint16_t length) {
+  holes_by_location_[location] = length;
+  holes_by_length_.insert(std::make_pair(length, location));
+}
+
+void StringAllocator::RemoveHole(HolesByLocation::iterator hole) {
+  holes_by_length_.erase(std::make_pair(hole->second, hole->first));
+  holes_by_location_.erase(hole);
 }
 
 } // namespace collection
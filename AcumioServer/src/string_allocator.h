@@ -31,6 +31,23 @@
 //               returns the max_size value (Clearly, the string cannot start
 //               at max_size, so this should be seen as an error codition).
 //
+//               A front-coded allocator stores each string as a single byte
+//               giving the length (plus one) of the prefix it shares with a
+//               base string - the first non-empty string added, re-chosen
+//               on each Compact - followed by the rest of the string. Keys
+//               under one trie node tend to share much more than the trie
+//               path, so this lets more of them fit in the same space. In
+//               this mode, StringAt returns the stored form rather than the
+//               string, and callers should use Compare and Decode instead.
+//
+//               Free space is tracked as holes, indexed both by location
+//               (so that a freed string merges with the holes on either
+//               side of it) and by length (so that Add takes the smallest
+//               hole that fits). Both take O(log n) in the number of holes.
+//               Holes can still leave free space scattered in pieces too
+//               small to use; Compact moves the strings together into one
+//               block, leaving a single hole at the end.
+//
 //               There is no transaction or thread awareness in this class.
 //               As such, making modifications to it should only be done in
 //               a context where there is no possibility of multi-threaded
@@ -38,8 +55,11 @@
 //               a SharedMutex should be sufficent).
 //============================================================================
 
+#include <map>
+#include <set>
 #include <stdint.h>
 #include <string>
+#include <utility>
 #include <vector>
 
 namespace acumio {
@@ -49,10 +69,11 @@ class StringAllocator {
  public:
   const uint8_t MAX_REFERENCE_COUNT = UINT8_C(255);
 
-  StringAllocator(uint16_t max_size);
+  StringAllocator(uint16_t max_size, bool front_coded = false);
   ~StringAllocator();
 
   inline uint16_t max_size() const { return max_size_; }
+  inline bool front_coded() const { return front_coded_; }
 
   inline const char* StringAt(uint16_t position) const {
     return key_list_ + position;
@@ -64,6 +85,22 @@ class StringAllocator {
 
   inline uint16_t Add(const std::string& s) { return Add(s.c_str()); }
 
+  // The length of the prefix that s shares with the base string. Always 0
+  // unless front_coded().
+  size_t BaseMatch(const char* s) const;
+
+  // Compares s with the string at position, as strcmp would; base_match
+  // must be BaseMatch(s).
+  int Compare(const char* s, size_t base_match, uint16_t position) const;
+
+  // Sets *s to the string at position.
+  void Decode(uint16_t position, std::string* s) const;
+  inline std::string Decode(uint16_t position) const {
+    std::string ret_val;
+    Decode(position, &ret_val);
+    return ret_val;
+  }
+
   // Returns the total number of references for the string at the given
   // position. If there currently are no references at that position,
   // this operation is ignored, and we return 0. If there are currently
@@ -81,21 +118,46 @@ class StringAllocator {
     return reference_counts_[position];
   }
 
+  // Moves all strings to the start of the space, preserving their order,
+  // so that the free space forms a single hole. relocation is resized to
+  // max_size(), and for each string, (*relocation)[old_position] is set to
+  // its new position. Every holder of a position must then be updated
+  // before it is used again. If front_coded(), this also re-chooses the
+  // base, as the longest prefix common to the strings still stored, unless
+  // that would leave less free space; any BaseMatch result taken before
+  // the Compact must be recomputed.
+  void Compact(std::vector<uint16_t>* relocation);
+
+  // Statistics on the use of space.
+  inline uint16_t space_used() const { return space_used_; }
+  inline uint16_t free_space() const { return max_size_ - space_used_; }
+  inline size_t hole_count() const { return holes_by_location_.size(); }
+  uint16_t largest_hole() const;
+  // The fraction of free space lying outside the largest hole: 0 when the
+  // free space is all in one piece, approaching 1 as it is scattered.
+  double fragmentation() const;
+
  private:
-  struct FreeKey {
-    FreeKey() : FreeKey(UINT16_C(0), UINT16_C(0)) {}
-    FreeKey(const FreeKey& o)  :
-        FreeKey(o.location, o.hole_length) {}
-    FreeKey(uint16_t l, uint16_t hl) : location(l), hole_length(hl) {}
-    uint16_t location;
-    uint16_t hole_length;
-  };
+  typedef std::map<uint16_t, uint16_t> HolesByLocation;
+  // Ordered by length, then location.
+  typedef std::set<std::pair<uint16_t, uint16_t>> HolesByLength;
+
+  void CompactFrontCoded(std::vector<uint16_t>* relocation);
+  void AddHole(uint16_t location, uint16_t length);
+  void RemoveHole(HolesByLocation::iterator hole);
+
+  // The longest shared prefix we can record in a front-coded string's
+  // header byte, which must not be 0.
+  static const uint8_t MAX_SHARED_LENGTH = 254;
 
   uint16_t max_size_;
+  bool front_coded_;
+  std::string base_;
   uint16_t space_used_;
   char* key_list_;
   uint8_t* reference_counts_;
-  std::vector<FreeKey> free_key_list_;
+  HolesByLocation holes_by_location_;
+  HolesByLength holes_by_length_;
 };
 
 } // namespace collection
@@ -0,0 +1,210 @@
+//============================================================================
+// Name        : test_bulk_importer.cpp
+// Author      : Bill Province (bill@acumio.com)
+// Version     :
+// Copyright   : Copyright (C) 2016 Acumio
+// Description : A test_driver for BulkImporter.
+//============================================================================
+#include "bulk_importer.h"
+
+#include <gtest/gtest.h>
+#include <string>
+
+#include "gtest_extensions.h"
+
+namespace acumio {
+namespace {
+
+struct Catalog {
+  Catalog() :
+      referential(&namespaces, &datasets, &repositories),
+      namespace_service(&namespaces, &referential),
+      repository_service(&repositories, &referential),
+      dataset_service(&datasets, &referential),
+      importer(&referential, &namespace_service, &repository_service,
+               &dataset_service) {}
+  NamespaceRepository namespaces;
+  RepositoryRepository repositories;
+  DatasetRepository datasets;
+  ReferentialService referential;
+  NamespaceService namespace_service;
+  RepositoryService repository_service;
+  DatasetService dataset_service;
+  BulkImporter importer;
+};
+
+model::QualifiedName Name(const std::string& name_space,
+                          const std::string& name) {
+  model::QualifiedName ret_val;
+  ret_val.set_name_space(name_space);
+  ret_val.set_name(name);
+  return ret_val;
+}
+
+void AddNamespace(const std::string& parent, const std::string& name,
+                  model::server::BulkImportRequest* chunk) {
+  model::Namespace* name_space =
+      chunk->add_item()->mutable_name_space()->mutable_name_space();
+  *name_space->mutable_name() = Name(parent, name);
+  name_space->set_full_name(parent.empty() ? name : parent + "." + name);
+  name_space->set_separator(".");
+}
+
+void AddRepository(const std::string& parent, const std::string& name,
+                   model::server::BulkImportRequest* chunk) {
+  model::server::CreateRepositoryRequest* request =
+      chunk->add_item()->mutable_repository();
+  *request->mutable_repository()->mutable_name() = Name(parent, name);
+  request->mutable_repository()->set_type(model::Repository_Type_ORACLE);
+  request->set_create_or_associate_namespace(true);
+  request->set_namespace_separator(".");
+}
+
+void AddDataset(const std::string& parent, const std::string& name,
+                model::server::BulkImportRequest* chunk) {
+  model::server::CreateDatasetRequest* request =
+      chunk->add_item()->mutable_dataset();
+  *request->mutable_dataset()->mutable_physical_name() = Name(parent, name);
+  (*request->mutable_description()->mutable_description())["tag"]
+      .set_contents("table " + name);
+}
+
+TEST(BulkImporterTest, ImportsParentsFromTheChunk) {
+  Catalog catalog;
+  model::server::BulkImportRequest chunk;
+  AddNamespace("", "warehouse", &chunk);
+  AddRepository("warehouse", "oracle", &chunk);
+  for (int i = 0; i < 100; i++) {
+    AddDataset("warehouse.oracle", "table" + std::to_string(i), &chunk);
+  }
+  AddNamespace("warehouse", "staging", &chunk);
+  AddDataset("warehouse.staging", "table0", &chunk);
+  int failed_item = -1;
+  EXPECT_OK(catalog.importer.Import(chunk, &failed_item));
+  EXPECT_EQ(-1, failed_item);
+
+  EXPECT_EQ(3, catalog.namespaces.size());
+  EXPECT_EQ(1, catalog.repositories.size());
+  EXPECT_EQ(101, catalog.datasets.size());
+  model::Namespace name_space;
+  EXPECT_OK(catalog.namespaces.GetNamespace("warehouse.oracle", &name_space));
+  EXPECT_TRUE(name_space.is_repository_name());
+  model::Dataset dataset;
+  EXPECT_OK(catalog.datasets.GetDataset(Name("warehouse.oracle", "table42"),
+                                        &dataset));
+
+  // Parents may also come from what is already there.
+  chunk.Clear();
+  AddDataset("warehouse.staging", "table1", &chunk);
+  EXPECT_OK(catalog.importer.Import(chunk, &failed_item));
+  EXPECT_EQ(102, catalog.datasets.size());
+}
+
+TEST(BulkImporterTest, RejectsMissingParentsBeforeApplying) {
+  Catalog catalog;
+  model::server::BulkImportRequest chunk;
+  AddNamespace("", "warehouse", &chunk);
+  AddDataset("warehouse", "table0", &chunk);
+  // The parent only comes later in the chunk.
+  AddDataset("warehouse.later", "table1", &chunk);
+  AddNamespace("warehouse", "later", &chunk);
+  int failed_item = -1;
+  EXPECT_ERROR(catalog.importer.Import(chunk, &failed_item),
+               grpc::StatusCode::FAILED_PRECONDITION);
+  EXPECT_EQ(2, failed_item);
+  EXPECT_EQ(0, catalog.namespaces.size());
+  EXPECT_EQ(0, catalog.datasets.size());
+
+  chunk.Clear();
+  AddNamespace("", "warehouse", &chunk);
+  AddNamespace("", "warehouse", &chunk);
+  EXPECT_ERROR(catalog.importer.Import(chunk, &failed_item),
+               grpc::StatusCode::ALREADY_EXISTS);
+  EXPECT_EQ(1, failed_item);
+
+  chunk.Clear();
+  chunk.add_item();
+  EXPECT_ERROR(catalog.importer.Import(chunk, &failed_item),
+               grpc::StatusCode::INVALID_ARGUMENT);
+  EXPECT_EQ(0, failed_item);
+  EXPECT_EQ(0, catalog.namespaces.size());
+}
+
+TEST(BulkImporterTest, FailedChunkIsUndone) {
+  Catalog catalog;
+  model::server::BulkImportRequest chunk;
+  AddNamespace("", "warehouse", &chunk);
+  AddDataset("warehouse", "existing", &chunk);
+  int failed_item = -1;
+  EXPECT_OK(catalog.importer.Import(chunk, &failed_item));
+
+  // Passes the checks, but the last dataset already exists.
+  chunk.Clear();
+  AddRepository("warehouse", "oracle", &chunk);
+  AddNamespace("warehouse.oracle", "schema", &chunk);
+  AddDataset("warehouse.oracle.schema", "table0", &chunk);
+  AddDataset("warehouse", "existing", &chunk);
+  EXPECT_ERROR(catalog.importer.Import(chunk, &failed_item),
+               grpc::StatusCode::ALREADY_EXISTS);
+  EXPECT_EQ(3, failed_item);
+  EXPECT_EQ(1, catalog.namespaces.size());
+  EXPECT_EQ(0, catalog.repositories.size());
+  EXPECT_EQ(1, catalog.datasets.size());
+  model::Dataset dataset;
+  EXPECT_OK(catalog.datasets.GetDataset(Name("warehouse", "existing"),
+                                        &dataset));
+}
+
+TEST(BulkImporterTest, FailedChunkRestoresAssociatedNamespace) {
+  Catalog catalog;
+  model::server::BulkImportRequest chunk;
+  AddNamespace("", "warehouse", &chunk);
+  AddNamespace("warehouse", "oracle", &chunk);
+  AddDataset("warehouse.oracle", "existing", &chunk);
+  int failed_item = -1;
+  EXPECT_OK(catalog.importer.Import(chunk, &failed_item));
+
+  // The Repository takes over the existing Namespace, with a new
+  // separator and description, before the chunk fails.
+  chunk.Clear();
+  AddRepository("warehouse", "oracle", &chunk);
+  model::server::CreateRepositoryRequest* request =
+      chunk.mutable_item(0)->mutable_repository();
+  request->set_namespace_separator("/");
+  request->mutable_description()->set_contents("imported");
+  AddDataset("warehouse.oracle", "table0", &chunk);
+  AddDataset("warehouse.oracle", "existing", &chunk);
+  EXPECT_ERROR(catalog.importer.Import(chunk, &failed_item),
+               grpc::StatusCode::ALREADY_EXISTS);
+  EXPECT_EQ(2, failed_item);
+
+  EXPECT_EQ(0, catalog.repositories.size());
+  EXPECT_EQ(1, catalog.datasets.size());
+  model::Namespace name_space;
+  model::Description description;
+  EXPECT_OK(catalog.referential.GetNamespaceAndDescription(
+      "warehouse.oracle", &name_space, &description));
+  EXPECT_FALSE(name_space.is_repository_name());
+  EXPECT_EQ(".", name_space.separator());
+  EXPECT_EQ("", description.contents());
+
+  // A Repository item that fails itself also leaves the Namespace alone.
+  chunk.Clear();
+  AddRepository("warehouse", "oracle", &chunk);
+  AddRepository("warehouse", "oracle", &chunk);
+  EXPECT_ERROR(catalog.importer.Import(chunk, &failed_item),
+               grpc::StatusCode::ALREADY_EXISTS);
+  EXPECT_EQ(1, failed_item);
+  EXPECT_EQ(0, catalog.repositories.size());
+  EXPECT_OK(catalog.referential.GetNamespace("warehouse.oracle",
+                                             &name_space));
+  EXPECT_FALSE(name_space.is_repository_name());
+}
+
+} // anonymous namespace
+} // namespace acumio
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,361 @@
+//============================================================================
+// Name        : test_checkpoint.cpp
+// Author      : Bill Province (bill@acumio.com)
+// Version     :
+// Copyright   : Copyright (C) 2016 Acumio
+// Description : A test_driver for checkpoints.
+//============================================================================
+#include "checkpoint.h"
+
+#include <gtest/gtest.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "crc32c.h"
+#include "description.pb.h"
+#include "gtest_extensions.h"
+#include "names.pb.h"
+
+namespace acumio {
+namespace {
+
+struct Catalog {
+  Catalog() : view({&namespaces, &repositories, &datasets, &users}) {}
+  NamespaceRepository namespaces;
+  RepositoryRepository repositories;
+  DatasetRepository datasets;
+  UserRepository users;
+  CheckpointCatalog view;
+};
+
+std::string TestCheckpointPath(const std::string& name) {
+  std::string path = "/tmp/acumio_test_checkpoint_" + name;
+  remove(path.c_str());
+  return path;
+}
+
+model::QualifiedName Name(const std::string& name_space,
+                          const std::string& name) {
+  model::QualifiedName ret_val;
+  ret_val.set_name_space(name_space);
+  ret_val.set_name(name);
+  return ret_val;
+}
+
+model::Description Description(const std::string& contents) {
+  model::Description ret_val;
+  ret_val.set_contents(contents);
+  ret_val.set_editor("editor");
+  return ret_val;
+}
+
+// Enough elements to span several blocks, with some description history.
+void Populate(int count, Catalog* catalog) {
+  for (int i = 0; i < count; i++) {
+    std::string name = "name" + std::to_string(i);
+    model::Namespace name_space;
+    name_space.set_full_name(name);
+    name_space.mutable_name()->set_name(name);
+    name_space.set_separator(".");
+    ASSERT_TRUE(catalog->namespaces.AddWithDescription(
+        name_space, Description("first " + name)).ok());
+    for (int version = 0; version < i % 4; version++) {
+      EXPECT_OK(catalog->namespaces.UpdateDescriptionOnly(
+          name, Description("edit " + std::to_string(version) + " " + name)));
+    }
+
+    model::Repository repository;
+    *repository.mutable_name() = Name(name, "repo");
+    repository.set_type(model::Repository_Type_ORACLE);
+    EXPECT_OK(catalog->repositories.AddWithDescription(
+        repository, Description("repository " + name)));
+
+    model::Dataset dataset;
+    *dataset.mutable_physical_name() = Name(name, "dataset");
+    model::MultiDescription description;
+    (*description.mutable_description())["tag"] =
+        Description("dataset " + name);
+    EXPECT_OK(catalog->datasets.Add(dataset, description));
+  }
+  for (int i = 0; i < 3; i++) {
+    model::User user;
+    user.set_name("user" + std::to_string(i));
+    EXPECT_OK(catalog->users.Add(FullUser(user, "password", "salt")));
+  }
+}
+
+// Compares the serialized forms of two repositories' elements.
+template <class Repository, class Serializer>
+void ExpectSameContents(const Repository& expected, const Repository& actual,
+                        Serializer serialize) {
+  std::vector<typename Repository::KeyedSnapshot> expected_elements;
+  std::vector<typename Repository::KeyedSnapshot> actual_elements;
+  expected.GetSortedSnapshots(&expected_elements);
+  actual.GetSortedSnapshots(&actual_elements);
+  ASSERT_EQ(expected_elements.size(), actual_elements.size());
+  for (size_t i = 0; i < expected_elements.size(); i++) {
+    EXPECT_EQ(expected_elements[i].first, actual_elements[i].first);
+    EXPECT_EQ(serialize(*(expected_elements[i].second)),
+              serialize(*(actual_elements[i].second)));
+  }
+}
+
+void ExpectSameCatalog(const Catalog& expected, const Catalog& actual) {
+  ExpectSameContents(expected.namespaces, actual.namespaces,
+      [](const model::DescribedNamespace& element) {
+        return element.entity.SerializeAsString() +
+               element.description_history.SerializeAsString();
+      });
+  ExpectSameContents(expected.repositories, actual.repositories,
+      [](const model::DescribedRepository& element) {
+        return element.entity.SerializeAsString() +
+               element.description_history.SerializeAsString();
+      });
+  ExpectSameContents(expected.datasets, actual.datasets,
+      [](const model::MultiDescribed<model::Dataset>& element) {
+        model::MultiDescriptionHistory history(element.history);
+        return element.entity.SerializeAsString() +
+               std::to_string(history.history().size()) +
+               history.history().at("tag").SerializeAsString();
+      });
+  ExpectSameContents(expected.users, actual.users,
+      [](const FullUser& element) {
+        return element.user().SerializeAsString() + element.password() +
+               element.salt();
+      });
+}
+
+TEST(CheckpointTest, WriteAndRestore) {
+  std::string path = TestCheckpointPath("restore");
+  Catalog original;
+  Populate(3000, &original);
+  CheckpointView view(original.view, 1234);
+  EXPECT_EQ(3 * 3000 + 3, view.element_count());
+  EXPECT_OK(view.Write(path));
+
+  Catalog restored;
+  uint64_t log_position = 0;
+  EXPECT_OK(RestoreCheckpoint(path, restored.view, &log_position));
+  EXPECT_EQ(1234, log_position);
+  ExpectSameCatalog(original, restored);
+
+  // The restored histories read back as the originals do.
+  model::Namespace name_space;
+  model::DescriptionHistory history;
+  EXPECT_OK(restored.namespaces.GetNamespaceAndDescriptionHistory(
+      "name7", &name_space, &history));
+  ASSERT_EQ(4, history.version_size());
+  EXPECT_EQ("first name7", history.version(0).contents());
+  EXPECT_EQ("edit 1 name7", history.version(2).contents());
+  remove(path.c_str());
+}
+
+TEST(CheckpointTest, OnlyOwnerMayReadOrWrite) {
+  std::string path = TestCheckpointPath("mode");
+  std::string temp_path = path + ".tmp";
+  {
+    std::ofstream out(temp_path);
+  }
+  chmod(temp_path.c_str(), 0644);
+  Catalog original;
+  Populate(2, &original);
+  CheckpointView view(original.view, 0);
+  EXPECT_OK(view.Write(path));
+  struct stat status;
+  ASSERT_EQ(0, stat(path.c_str(), &status));
+  EXPECT_EQ(0600, status.st_mode & 0777);
+  remove(path.c_str());
+}
+
+TEST(CheckpointTest, ViewIsPointInTime) {
+  std::string path = TestCheckpointPath("point_in_time");
+  Catalog original;
+  Populate(10, &original);
+  CheckpointView view(original.view, 0);
+
+  // Changes made after the view is taken do not show up in it.
+  EXPECT_OK(original.namespaces.UpdateDescriptionOnly(
+      "name1", Description("later")));
+  EXPECT_OK(original.repositories.Remove(Name("name2", "repo")));
+  EXPECT_OK(original.users.Remove("user0"));
+  EXPECT_OK(view.Write(path));
+
+  Catalog restored;
+  uint64_t log_position = 1;
+  EXPECT_OK(RestoreCheckpoint(path, restored.view, &log_position));
+  EXPECT_EQ(0, log_position);
+  model::DescriptionHistory history;
+  model::Namespace name_space;
+  EXPECT_OK(restored.namespaces.GetNamespaceAndDescriptionHistory(
+      "name1", &name_space, &history));
+  EXPECT_EQ("edit 0 name1",
+            history.version(history.version_size() - 1).contents());
+  model::Repository repository;
+  EXPECT_OK(restored.repositories.GetRepository(Name("name2", "repo"),
+                                                &repository));
+  FullUser user;
+  EXPECT_OK(restored.users.Get("user0", &user));
+  remove(path.c_str());
+}
+
+TEST(CheckpointTest, DetectsCorruption) {
+  std::string path = TestCheckpointPath("corrupt");
+  Catalog original;
+  Populate(100, &original);
+  CheckpointView view(original.view, 0);
+  EXPECT_OK(view.Write(path));
+
+  {
+    std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+    file.seekp(100);
+    char byte = 0;
+    file.read(&byte, 1);
+    file.seekp(100);
+    file.put(byte ^ 0x01);
+  }
+  Catalog restored;
+  uint64_t log_position = 0;
+  EXPECT_ERROR(RestoreCheckpoint(path, restored.view, &log_position),
+               grpc::StatusCode::DATA_LOSS);
+
+  // A corrupt last section keeps the earlier ones from being loaded.
+  EXPECT_OK(view.Write(path));
+  {
+    std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+    // The footer offset is the first field of the 40 byte trailer.
+    file.seekg(-40, std::ios::end);
+    uint64_t footer_offset = 0;
+    for (int i = 0; i < 8; i++) {
+      footer_offset |= static_cast<uint64_t>(
+          static_cast<uint8_t>(file.get())) << (8 * i);
+    }
+    file.seekg(footer_offset - 10);
+    char byte = 0;
+    file.read(&byte, 1);
+    file.seekp(footer_offset - 10);
+    file.put(byte ^ 0x01);
+  }
+  Catalog partial;
+  EXPECT_ERROR(RestoreCheckpoint(path, partial.view, &log_position),
+               grpc::StatusCode::DATA_LOSS);
+  EXPECT_EQ(0, partial.namespaces.size());
+  EXPECT_EQ(0, partial.repositories.size());
+  EXPECT_EQ(0, partial.datasets.size());
+
+  // A cut-off file is also caught.
+  EXPECT_OK(view.Write(path));
+  {
+    std::ifstream in(path, std::ios::binary);
+    std::string contents((std::istreambuf_iterator<char>(in)),
+                         std::istreambuf_iterator<char>());
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(contents.data(), contents.size() / 2);
+  }
+  Catalog truncated;
+  EXPECT_ERROR(RestoreCheckpoint(path, truncated.view, &log_position),
+               grpc::StatusCode::DATA_LOSS);
+
+  {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out << "Not a checkpoint.";
+  }
+  Catalog other;
+  EXPECT_ERROR(RestoreCheckpoint(path, other.view, &log_position),
+               grpc::StatusCode::FAILED_PRECONDITION);
+  remove(path.c_str());
+}
+
+uint64_t ReadLittleEndian(const std::string& contents, size_t position,
+                          int bytes) {
+  uint64_t ret_val = 0;
+  for (int i = 0; i < bytes; i++) {
+    ret_val |= static_cast<uint64_t>(
+        static_cast<uint8_t>(contents[position + i])) << (8 * i);
+  }
+  return ret_val;
+}
+
+void WriteFixed32(uint32_t value, size_t position, std::string* contents) {
+  for (int i = 0; i < 4; i++) {
+    (*contents)[position + i] = static_cast<char>((value >> (8 * i)) & 0xFF);
+  }
+}
+
+// Recomputes the checksums of the last block of a checkpoint, and of its
+// footer, so that an edit to that block gets past them.
+void ResealLastBlock(std::string* contents) {
+  // The footer offset is the first field of the 40 byte trailer, and the
+  // footer checksum the fourth.
+  size_t trailer = contents->size() - 40;
+  size_t footer_offset = ReadLittleEndian(*contents, trailer, 8);
+  size_t position = footer_offset;
+  size_t last_offset = 0;
+  size_t last_size = 0;
+  size_t last_crc_position = 0;
+  while (position < trailer) {
+    uint32_t block_count = ReadLittleEndian(*contents, position + 4, 4);
+    position += 16;
+    for (uint32_t i = 0; i < block_count; i++) {
+      last_offset = ReadLittleEndian(*contents, position, 8);
+      last_size = ReadLittleEndian(*contents, position + 8, 4);
+      last_crc_position = position + 16;
+      position += 24 + ReadLittleEndian(*contents, position + 20, 4);
+    }
+  }
+  WriteFixed32(Crc32c(contents->data() + last_offset, last_size),
+               last_crc_position, contents);
+  WriteFixed32(Crc32c(contents->data() + footer_offset,
+                      trailer - footer_offset),
+               trailer + 24, contents);
+}
+
+TEST(CheckpointTest, FailedLoadLeavesAllEmpty) {
+  std::string path = TestCheckpointPath("failed_load");
+  Catalog original;
+  Populate(100, &original);
+  CheckpointView view(original.view, 0);
+  EXPECT_OK(view.Write(path));
+
+  // Rename user1 to user0 in the users section, which comes last, leaving
+  // its key alone: the checkpoint parses, but the users fail to load.
+  std::string contents;
+  {
+    std::ifstream in(path, std::ios::binary);
+    contents.assign(std::istreambuf_iterator<char>(in),
+                    std::istreambuf_iterator<char>());
+  }
+  size_t name = contents.rfind("user1");
+  ASSERT_NE(std::string::npos, name);
+  contents[name + 4] = '0';
+  ResealLastBlock(&contents);
+  {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(contents.data(), contents.size());
+  }
+
+  Catalog restored;
+  uint64_t log_position = 0;
+  EXPECT_ERROR(RestoreCheckpoint(path, restored.view, &log_position),
+               grpc::StatusCode::ALREADY_EXISTS);
+  EXPECT_EQ(0, restored.namespaces.size());
+  EXPECT_EQ(0, restored.repositories.size());
+  EXPECT_EQ(0, restored.datasets.size());
+  EXPECT_EQ(0, restored.users.size());
+
+  // What was cleared can be loaded again.
+  EXPECT_OK(view.Write(path));
+  EXPECT_OK(RestoreCheckpoint(path, restored.view, &log_position));
+  ExpectSameCatalog(original, restored);
+  remove(path.c_str());
+}
+
+} // anonymous namespace
+} // namespace acumio
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,103 @@
+//============================================================================
+// Name        : test_description_deltas.cpp
+// Author      : Bill Province (bill@acumio.com)
+// Version     :
+// Copyright   : Copyright (C) 2016 Acumio
+// Description : A test_driver for the compressed description histories.
+//============================================================================
+#include "description_deltas.h"
+
+#include <gtest/gtest.h>
+#include <string>
+#include <vector>
+
+namespace acumio {
+namespace {
+
+// Each edit rewrites a word somewhere in the middle of a long text, as a
+// wiki-style edit would.
+std::vector<std::string> EditSequence(int edits) {
+  std::vector<std::string> ret_val;
+  std::string text;
+  for (int i = 0; i < 200; i++) {
+    text.append("word").append(std::to_string(i)).append(" ");
+  }
+  for (int i = 0; i < edits; i++) {
+    size_t position = (i * 37) % (text.size() - 10);
+    text.replace(position, 4, "ed" + std::to_string(i % 100));
+    ret_val.push_back(text);
+  }
+  return ret_val;
+}
+
+TEST(DescriptionDeltasTest, RoundTrip) {
+  std::vector<std::string> texts = EditSequence(40);
+  model::DescriptionHistory stored;
+  size_t full_size = 0;
+  for (size_t i = 0; i < texts.size(); i++) {
+    model::Description* version = stored.add_version();
+    version->set_contents(texts[i]);
+    version->set_editor(std::to_string(i));
+    full_size += texts[i].size();
+    // Compressing after every edit, as the repositories do.
+    CompressHistory(&stored);
+  }
+
+  // Only the newest version and the keyframes are kept in full.
+  size_t stored_size = 0;
+  int full_versions = 0;
+  for (int i = 0; i < stored.version_size(); i++) {
+    const model::Description& version = stored.version(i);
+    stored_size += version.contents().size() + version.contents_delta().size();
+    if (version.contents_delta().empty()) {
+      full_versions++;
+    }
+  }
+  EXPECT_EQ(4, full_versions);
+  EXPECT_LT(stored_size * 5, full_size);
+  EXPECT_EQ(texts.back(), stored.version(39).contents());
+
+  model::DescriptionHistory expanded;
+  ExpandHistory(stored, &expanded);
+  ASSERT_EQ(40, expanded.version_size());
+  std::string contents;
+  for (int i = 0; i < 40; i++) {
+    EXPECT_EQ(texts[i], expanded.version(i).contents());
+    EXPECT_TRUE(expanded.version(i).contents_delta().empty());
+    EXPECT_EQ(std::to_string(i), expanded.version(i).editor());
+    ExpandContents(stored, i, &contents);
+    EXPECT_EQ(texts[i], contents);
+  }
+}
+
+TEST(DescriptionDeltasTest, BatchedAndEmptyVersions) {
+  std::vector<std::string> texts = EditSequence(20);
+  // A cleared description, then a wholly different one.
+  texts.insert(texts.begin() + 5, "");
+  texts.insert(texts.begin() + 6, "Something else entirely.");
+  model::DescriptionHistory stored;
+  for (size_t i = 0; i < texts.size(); i++) {
+    stored.add_version()->set_contents(texts[i]);
+    // Several versions may be added between compressions.
+    if (i % 3 == 2) {
+      CompressHistory(&stored);
+    }
+  }
+  CompressHistory(&stored);
+  CompressHistory(&stored);
+
+  model::DescriptionHistory expanded;
+  ExpandHistory(stored, &expanded);
+  ASSERT_EQ(static_cast<int>(texts.size()), expanded.version_size());
+  for (size_t i = 0; i < texts.size(); i++) {
+    EXPECT_EQ(texts[i], expanded.version(i).contents());
+  }
+}
+
+} // anonymous namespace
+} // namespace acumio
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
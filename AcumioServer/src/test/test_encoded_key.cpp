@@ -0,0 +1,164 @@
+//============================================================================
+// Name        : test_encoded_key.cpp
+// Author      : Bill Province (bill@acumio.com)
+// Version     :
+// Copyright   : Copyright (C) 2016 Acumio
+// Description : A test_driver for encoded_key.cpp.
+//============================================================================
+#include "encoded_key.h"
+
+#include <gtest/gtest.h>
+#include <limits>
+#include <string>
+#include <vector>
+#include "comparable.h"
+
+namespace acumio {
+
+// Verifies that for each i < j, keys[i] < keys[j].
+void ExpectAscending(const std::vector<EncodedKey>& keys) {
+  for (size_t i = 0; i < keys.size(); i++) {
+    EXPECT_EQ(keys[i], keys[i]);
+    for (size_t j = i + 1; j < keys.size(); j++) {
+      EXPECT_LT(keys[i], keys[j]) << "i: " << i << " j: " << j;
+      EXPECT_GT(keys[j], keys[i]) << "i: " << i << " j: " << j;
+    }
+  }
+}
+
+TEST(EncodedKeyTest, StringOrder) {
+  std::vector<EncodedKey> keys;
+  keys.push_back(EncodedKey::ForString(""));
+  keys.push_back(EncodedKey::ForString(std::string("\0", 1)));
+  keys.push_back(EncodedKey::ForString(std::string("\0\0", 2)));
+  keys.push_back(EncodedKey::ForString(std::string("\0a", 2)));
+  keys.push_back(EncodedKey::ForString("\x01"));
+  keys.push_back(EncodedKey::ForString("a"));
+  keys.push_back(EncodedKey::ForString(std::string("a\0", 2)));
+  keys.push_back(EncodedKey::ForString("aa"));
+  keys.push_back(EncodedKey::ForString("b"));
+  keys.push_back(EncodedKey::ForString("\xFF"));
+  ExpectAscending(keys);
+  EXPECT_EQ(EncodedKey::ForString("abc"), EncodedKey::ForString("abc"));
+}
+
+TEST(EncodedKeyTest, IntegerOrder) {
+  std::vector<EncodedKey> keys32;
+  std::vector<EncodedKey> keys64;
+  std::vector<int64_t> values = {
+      std::numeric_limits<int32_t>::min(), -65536, -256, -1, 0, 1, 255, 256,
+      std::numeric_limits<int32_t>::max()};
+  for (int64_t value : values) {
+    EncodedKey key32;
+    key32.AppendInt32(static_cast<int32_t>(value));
+    keys32.push_back(key32);
+    EncodedKey key64;
+    key64.AppendInt64(value);
+    keys64.push_back(key64);
+  }
+  EncodedKey smallest;
+  smallest.AppendInt64(std::numeric_limits<int64_t>::min());
+  keys64.insert(keys64.begin(), smallest);
+  EncodedKey largest;
+  largest.AppendInt64(std::numeric_limits<int64_t>::max());
+  keys64.push_back(largest);
+  ExpectAscending(keys32);
+  ExpectAscending(keys64);
+}
+
+TEST(EncodedKeyTest, TupleOrder) {
+  // Component by component: a shorter first string wins regardless of
+  // what follows it.
+  std::vector<EncodedKey> keys;
+  keys.push_back(EncodedKey::ForStringPair("a", "z"));
+  keys.push_back(EncodedKey::ForStringPair("aa", ""));
+  keys.push_back(EncodedKey::ForStringPair("aa", "a"));
+  keys.push_back(EncodedKey::ForStringPair("b", ""));
+  ExpectAscending(keys);
+
+  EncodedKey prefix;
+  prefix.AppendString("ns").AppendInt32(-5);
+  EncodedKey longer;
+  longer.AppendString("ns").AppendInt32(-5).AppendInt32(0);
+  EncodedKey next;
+  next.AppendString("ns").AppendInt32(2);
+  EXPECT_LT(prefix, longer);
+  EXPECT_LT(longer, next);
+}
+
+TEST(EncodedKeyTest, SpillsToHeapAndCopies) {
+  std::string long_name(3 * EncodedKey::INLINE_CAPACITY, 'x');
+  EncodedKey key = EncodedKey::ForStringPair(long_name, "suffix");
+  EXPECT_LT(EncodedKey::INLINE_CAPACITY, key.size());
+  EncodedKey copy(key);
+  EXPECT_EQ(key, copy);
+  EncodedKey moved(std::move(copy));
+  EXPECT_EQ(key, moved);
+  EXPECT_TRUE(copy.empty());
+
+  EncodedKey small = EncodedKey::ForString("small");
+  EncodedKey assigned = EncodedKey::ForString("other");
+  assigned = key;
+  EXPECT_EQ(key, assigned);
+  assigned = small;
+  EXPECT_EQ(small, assigned);
+  assigned = std::move(moved);
+  EXPECT_EQ(key, assigned);
+  EXPECT_EQ(long_name + " suffix", assigned.to_string());
+}
+
+TEST(EncodedKeyTest, ToString) {
+  EncodedKey key;
+  key.AppendString(std::string("a\0b", 3)).AppendInt32(-7).AppendInt64(
+      std::numeric_limits<int64_t>::min()).AppendUint64(42);
+  EXPECT_EQ(std::string("a\0b -7 -9223372036854775808 42", 30),
+            key.to_string());
+  EXPECT_EQ("", EncodedKey().to_string());
+}
+
+TEST(EncodedKeyTest, MatchesComparableOrder) {
+  std::vector<std::string> names = {"", "a", "aa", "ab", "b", "ba"};
+  for (const std::string& left : names) {
+    for (const std::string& right : names) {
+      StringComparable left_comparable(left);
+      StringComparable right_comparable(right);
+      int expected = left_comparable.compare_to(right_comparable);
+      int actual = left_comparable.encoded_key().compare(
+          right_comparable.encoded_key());
+      EXPECT_EQ(expected < 0, actual < 0) << left << " vs " << right;
+      EXPECT_EQ(expected == 0, actual == 0) << left << " vs " << right;
+
+      for (const std::string& suffix : names) {
+        StringPairComparable left_pair(left, suffix);
+        StringPairComparable right_pair(right, "b");
+        expected = left_pair.compare_to(right_pair);
+        actual = left_pair.encoded_key().compare(right_pair.encoded_key());
+        EXPECT_EQ(expected < 0, actual < 0);
+        EXPECT_EQ(expected == 0, actual == 0);
+        EXPECT_EQ(left_pair.to_string(), left_pair.encoded_key().to_string());
+      }
+    }
+  }
+
+  std::vector<int64_t> values = {-300, -1, 0, 7, 300};
+  for (int64_t left : values) {
+    for (int64_t right : values) {
+      Int64Comparable left_comparable(left);
+      Int64Comparable right_comparable(right);
+      EXPECT_EQ(left_comparable.compare_to(right_comparable) < 0,
+                left_comparable.encoded_key() <
+                right_comparable.encoded_key());
+      Int32Comparable left_32(static_cast<int32_t>(left));
+      Int32Comparable right_32(static_cast<int32_t>(right));
+      EXPECT_EQ(left_32.compare_to(right_32) < 0,
+                left_32.encoded_key() < right_32.encoded_key());
+    }
+  }
+}
+
+} // namespace acumio
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,164 @@
+//============================================================================
+// Name        : test_hash_index.cpp
+// Author      : Bill Province (bill@acumio.com)
+// Version     :
+// Copyright   : Copyright (C) 2016 Acumio
+// Description : A test_driver for the HashIndex template class.
+//============================================================================
+#include "hash_index.h"
+
+#include <gtest/gtest.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace acumio {
+namespace {
+
+using acumio::collection::HashIndex;
+
+EncodedKey KeyFor(int32_t i) {
+  return EncodedKey::ForStringPair("ns", std::to_string(i));
+}
+
+TEST(HashIndexTest, InsertGetErase) {
+  HashIndex<int32_t> index;
+  int32_t value = -1;
+  EXPECT_FALSE(index.Get(KeyFor(1), &value));
+  EXPECT_TRUE(index.Insert(KeyFor(1), 10));
+  EXPECT_FALSE(index.Insert(KeyFor(1), 11));
+  EXPECT_TRUE(index.Get(KeyFor(1), &value));
+  EXPECT_EQ(10, value);
+  EXPECT_EQ(1, index.size());
+
+  EXPECT_TRUE(index.Erase(KeyFor(1)));
+  EXPECT_FALSE(index.Erase(KeyFor(1)));
+  EXPECT_FALSE(index.Get(KeyFor(1), &value));
+  EXPECT_EQ(0, index.size());
+  EXPECT_TRUE(index.Insert(KeyFor(1), 12));
+  EXPECT_TRUE(index.Get(KeyFor(1), &value));
+  EXPECT_EQ(12, value);
+
+  // Keys long enough to spill out of the inline buffer work the same way.
+  EncodedKey long_key = EncodedKey::ForString(std::string(200, 'k'));
+  EXPECT_TRUE(index.Insert(long_key, 99));
+  EXPECT_TRUE(index.Get(long_key, &value));
+  EXPECT_EQ(99, value);
+}
+
+TEST(HashIndexTest, InsertBatch) {
+  HashIndex<int32_t> index(16);
+  EXPECT_TRUE(index.Insert(KeyFor(7), -7));
+  std::vector<EncodedKey> keys;
+  std::vector<int32_t> values;
+  for (int32_t i = 0; i < 500; i++) {
+    keys.push_back(KeyFor(i));
+    values.push_back(i);
+  }
+  std::vector<const EncodedKey*> key_pointers;
+  for (const EncodedKey& key : keys) {
+    key_pointers.push_back(&key);
+  }
+  // Key 7 is already present, so it keeps its old value.
+  EXPECT_EQ(499, index.InsertBatch(key_pointers.data(), values.data(),
+                                   keys.size()));
+  EXPECT_EQ(500, index.size());
+  int32_t value = 0;
+  for (int32_t i = 0; i < 500; i++) {
+    EXPECT_TRUE(index.Get(KeyFor(i), &value));
+    EXPECT_EQ(i == 7 ? -7 : i, value);
+  }
+}
+
+TEST(HashIndexTest, GrowsAndReusesTombstones) {
+  HashIndex<int32_t> index(16);
+  for (int32_t i = 0; i < 1000; i++) {
+    EXPECT_TRUE(index.Insert(KeyFor(i), i));
+  }
+  EXPECT_EQ(1000, index.size());
+  EXPECT_LE(1000 * 4 / 3, index.capacity());
+  for (int32_t i = 0; i < 1000; i += 2) {
+    EXPECT_TRUE(index.Erase(KeyFor(i)));
+  }
+  // Churn over the tombstones should not keep growing the table.
+  size_t capacity = index.capacity();
+  for (int32_t round = 0; round < 10; round++) {
+    for (int32_t i = 0; i < 1000; i += 2) {
+      EXPECT_TRUE(index.Insert(KeyFor(i), i));
+    }
+    for (int32_t i = 0; i < 1000; i += 2) {
+      EXPECT_TRUE(index.Erase(KeyFor(i)));
+    }
+  }
+  EXPECT_EQ(capacity, index.capacity());
+  for (int32_t i = 0; i < 1000; i++) {
+    int32_t value = -1;
+    EXPECT_EQ(i % 2 == 1, index.Get(KeyFor(i), &value));
+    if (i % 2 == 1) {
+      EXPECT_EQ(i, value);
+    }
+  }
+}
+
+TEST(HashIndexTest, ConcurrentReadersAndWriter) {
+  HashIndex<int32_t> index;
+  const int32_t count = 2000;
+  std::thread writer([&index]() {
+    for (int32_t i = 0; i < count; i++) {
+      index.Insert(KeyFor(i), i);
+    }
+  });
+  std::vector<std::thread> readers;
+  for (int t = 0; t < 3; t++) {
+    readers.push_back(std::thread([&index]() {
+      for (int32_t i = 0; i < count; i++) {
+        int32_t value = -1;
+        // Either not yet inserted, or inserted with the right value.
+        if (index.Get(KeyFor(i), &value)) {
+          EXPECT_EQ(i, value);
+        }
+      }
+    }));
+  }
+  writer.join();
+  for (std::thread& reader : readers) {
+    reader.join();
+  }
+  EXPECT_EQ(count, index.size());
+}
+
+TEST(HashIndexTest, ConcurrentWriters) {
+  HashIndex<int32_t> index(16);
+  const int32_t thread_count = 4;
+  const int32_t per_thread = 2000;
+  std::vector<std::thread> writers;
+  for (int32_t t = 0; t < thread_count; t++) {
+    writers.push_back(std::thread([t, &index]() {
+      for (int32_t i = t; i < thread_count * per_thread; i += thread_count) {
+        EXPECT_TRUE(index.Insert(KeyFor(i), i));
+      }
+      // Erase half of what this thread wrote.
+      for (int32_t i = t; i < thread_count * per_thread;
+           i += 2 * thread_count) {
+        EXPECT_TRUE(index.Erase(KeyFor(i)));
+      }
+    }));
+  }
+  for (std::thread& writer : writers) {
+    writer.join();
+  }
+  EXPECT_EQ(thread_count * per_thread / 2, index.size());
+  for (int32_t i = 0; i < thread_count * per_thread; i++) {
+    int32_t value = -1;
+    EXPECT_EQ(i % (2 * thread_count) >= thread_count,
+              index.Get(KeyFor(i), &value));
+  }
+}
+
+} // anonymous namespace
+} // namespace acumio
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
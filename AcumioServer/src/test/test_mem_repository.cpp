@@ -16,6 +16,7 @@
 //============================================================================
 #include "mem_repository.h"
 #include <iostream>
+#include <thread>
 #include "comparable.h"
 #include "gtest_extensions.h"
 
@@ -96,6 +97,17 @@ std::unique_ptr<_MyClassRepository> NewBasicRepository() {
   return repository;
 }
 
+std::unique_ptr<_MyClassRepository> NewHashedRepository() {
+  std::unique_ptr<_MyClassExtractor> key_extractor(new MyClassKeyExtractor());
+  std::vector<std::unique_ptr<_MyClassExtractor>> added_extractors;
+  added_extractors.push_back(std::unique_ptr<_MyClassExtractor>(
+      new MyClassSecondaryExtractor()));
+  std::unique_ptr<_MyClassRepository> repository(
+      new _MyClassRepository(std::move(key_extractor), &added_extractors,
+                             true));
+  return repository;
+}
+
 TEST(MemRepository, RepositoryConstruction) {
   std::unique_ptr<_MyClassRepository> basic_repository = NewBasicRepository();
   std::unique_ptr<_MyClassRepository> repository = NewRepository();
@@ -162,6 +174,230 @@ TEST(MemRepository, AddEltThenRemove) {
   ASSERT_EQ(repository->size(), 0);
 }
 
+TEST(MemRepository, HashPointLookups) {
+  std::unique_ptr<_MyClassRepository> repository = NewHashedRepository();
+  for (int32_t i = 0; i < 100; i++) {
+    EXPECT_OK(repository->Add(MyClass(std::to_string(i), "even", i)));
+  }
+  EXPECT_ERROR(repository->Add(MyClass("7", "odd", 7)),
+               grpc::StatusCode::ALREADY_EXISTS);
+
+  _MyClassRepository::StatusEltConstPtrPair found =
+      repository->NonMutableGet(EncodedKey::ForString("42"));
+  ASSERT_TRUE(found.first.ok());
+  EXPECT_EQ(42, found.second->value());
+
+  // Changing the main key moves the point index entry along with it.
+  EXPECT_OK(repository->Update(EncodedKey::ForString("42"),
+                               MyClass("forty-two", "even", 42)));
+  EXPECT_ERROR(repository->NonMutableGet(EncodedKey::ForString("42")).first,
+               grpc::StatusCode::NOT_FOUND);
+  found = repository->NonMutableGet(EncodedKey::ForString("forty-two"));
+  ASSERT_TRUE(found.first.ok());
+  EXPECT_EQ(42, found.second->value());
+
+  for (int32_t i = 0; i < 100; i += 2) {
+    if (i != 42) {
+      EXPECT_OK(repository->Remove(EncodedKey::ForString(std::to_string(i))));
+    }
+  }
+  EXPECT_ERROR(repository->Remove(EncodedKey::ForString("0")),
+               grpc::StatusCode::NOT_FOUND);
+  EXPECT_EQ(51, repository->size());
+  found = repository->NonMutableGet(EncodedKey::ForString("99"));
+  ASSERT_TRUE(found.first.ok());
+  EXPECT_EQ(99, found.second->value());
+
+  // The ordered index still serves range queries.
+  _MyClassRepository::PrimaryIterator it =
+      repository->LowerBound(EncodedKey::ForString("9"));
+  ASSERT_TRUE(it != repository->primary_end());
+  EXPECT_EQ("9", it->first->to_string());
+}
+
+TEST(MemRepository, ConcurrentWritersKeepIndexesInStep) {
+  std::unique_ptr<_MyClassRepository> repository = NewHashedRepository();
+  const int32_t thread_count = 4;
+  const int32_t per_thread = 300;
+  std::vector<std::thread> writers;
+  for (int32_t t = 0; t < thread_count; t++) {
+    writers.push_back(std::thread([t, &repository]() {
+      for (int32_t i = t; i < thread_count * per_thread; i += thread_count) {
+        std::string key = std::to_string(i);
+        EXPECT_OK(repository->Add(MyClass(key, "s", i)));
+        if (i % 3 == 0) {
+          EXPECT_OK(repository->Remove(EncodedKey::ForString(key)));
+        } else if (i % 3 == 1) {
+          EXPECT_OK(repository->Update(EncodedKey::ForString(key),
+                                       MyClass("r" + key, "s", i)));
+        }
+      }
+    }));
+  }
+  // Point lookups and scans run alongside the writers. Whatever they find
+  // must be the element with the key they found it under.
+  std::thread reader([&repository]() {
+    for (int32_t i = 0; i < thread_count * per_thread; i++) {
+      for (const std::string& key :
+           {std::to_string(i), "r" + std::to_string(i)}) {
+        _MyClassRepository::StatusEltConstPtrPair found =
+            repository->NonMutableGet(EncodedKey::ForString(key));
+        if (found.first.ok()) {
+          ASSERT_TRUE(found.second != nullptr);
+          EXPECT_EQ(key, found.second->key());
+        }
+      }
+    }
+  });
+  std::thread scanner([&repository]() {
+    for (int32_t i = 0; i < thread_count * per_thread; i += 50) {
+      int32_t seen = 0;
+      for (_MyClassRepository::PrimaryIterator it =
+               repository->LowerBound(EncodedKey::ForString(
+                   std::to_string(i)));
+           it != repository->primary_end() && seen < 100; ++it, ++seen) {
+        EXPECT_EQ(it->first->to_string(), it->second.key());
+      }
+    }
+  });
+  for (std::thread& writer : writers) {
+    writer.join();
+  }
+  reader.join();
+  scanner.join();
+
+  int32_t expected_size = 0;
+  for (int32_t i = 0; i < thread_count * per_thread; i++) {
+    std::string key = (i % 3 == 1 ? "r" : "") + std::to_string(i);
+    bool present = i % 3 != 0;
+    expected_size += present ? 1 : 0;
+    EXPECT_EQ(present,
+              repository->NonMutableGet(EncodedKey::ForString(key)).first.ok());
+    _MyClassRepository::PrimaryIterator it =
+        repository->LowerBound(EncodedKey::ForString(key));
+    EXPECT_EQ(present, it != repository->primary_end() &&
+                       it->first->to_string() == key);
+  }
+  EXPECT_EQ(expected_size, repository->size());
+}
+
+TEST(MemRepository, ReadsShareImmutableSnapshots) {
+  std::unique_ptr<_MyClassRepository> repository = NewRepository();
+  EXPECT_OK(repository->Add(MyClass("key", "before", 1)));
+  EncodedKey key = EncodedKey::ForString("key");
+
+  _MyClassRepository::StatusEltConstPtrPair first =
+      repository->NonMutableGet(key);
+  ASSERT_TRUE(first.first.ok());
+  // Reads share the stored element rather than copying it.
+  EXPECT_EQ(first.second.get(), repository->NonMutableGet(key).second.get());
+  {
+    _MyClassRepository::PrimaryIterator it = repository->primary_begin();
+    EXPECT_EQ(first.second.get(), &((*it).second));
+  }
+
+  // An update swaps in a new snapshot, leaving the one we hold intact.
+  EXPECT_OK(repository->Update(key, MyClass("key", "after", 2)));
+  _MyClassRepository::StatusEltConstPtrPair second =
+      repository->NonMutableGet(key);
+  ASSERT_TRUE(second.first.ok());
+  EXPECT_NE(first.second.get(), second.second.get());
+  EXPECT_EQ("before", first.second->secondary());
+  EXPECT_EQ(1, first.second->value());
+  EXPECT_EQ("after", second.second->secondary());
+  EXPECT_EQ(2, repository->primary_begin()->second.value());
+
+  // As does removal.
+  EXPECT_OK(repository->Remove(key));
+  EXPECT_EQ("after", second.second->secondary());
+  // Nothing else refers to the original snapshot any more.
+  EXPECT_EQ(1, first.second.use_count());
+}
+
+TEST(MemRepository, BulkLoad) {
+  std::unique_ptr<_MyClassRepository> repository = NewRepository();
+  std::vector<MyClass> elements;
+  // Out of main key order, to exercise the sort.
+  for (int32_t i = 999; i >= 0; i--) {
+    elements.push_back(
+        MyClass(std::to_string(i), i % 2 == 0 ? "even" : "odd", i % 10));
+  }
+  EXPECT_OK(repository->BulkLoad(&elements));
+  EXPECT_TRUE(elements.empty());
+  EXPECT_EQ(1000, repository->size());
+
+  MyClass elt("", "", 0);
+  EXPECT_OK(repository->Get(EncodedKey::ForString("123"), &elt));
+  EXPECT_EQ("odd", elt.secondary());
+  EXPECT_EQ(3, elt.value());
+  _MyClassRepository::PrimaryIterator it = repository->primary_begin();
+  EXPECT_EQ("0", it->first->to_string());
+
+  // Every secondary entry leads back to the element it was taken from.
+  int32_t odd_count = 0;
+  for (_MyClassRepository::SecondaryIterator odd =
+           repository->LowerBoundByIndex(EncodedKey::ForString("odd"), 0);
+       odd != repository->secondary_end(0); ++odd) {
+    EXPECT_EQ("odd", odd->second.secondary());
+    odd_count++;
+  }
+  EXPECT_EQ(500, odd_count);
+  _MyClassRepository::SecondaryIterator seven =
+      repository->LowerBoundByIndex(Int32Comparable(7).encoded_key(), 1);
+  ASSERT_TRUE(seven != repository->secondary_end(1));
+  EXPECT_EQ(7, seven->second.value());
+  // Equal secondary keys stay in the order the elements were given in.
+  EXPECT_EQ("997", seven->second.key());
+
+  // The loaded repository takes ordinary writes.
+  EXPECT_OK(repository->Remove(EncodedKey::ForString("123")));
+  EXPECT_OK(repository->Add(MyClass("new", "odd", 1)));
+  EXPECT_ERROR(repository->Add(MyClass("7", "odd", 7)),
+               grpc::StatusCode::ALREADY_EXISTS);
+  EXPECT_EQ(1000, repository->size());
+
+  elements.push_back(MyClass("other", "odd", 1));
+  EXPECT_ERROR(repository->BulkLoad(&elements),
+               grpc::StatusCode::FAILED_PRECONDITION);
+}
+
+TEST(MemRepository, BulkLoadBuildsPointIndex) {
+  std::unique_ptr<_MyClassRepository> repository = NewHashedRepository();
+  std::vector<MyClass> elements;
+  for (int32_t i = 0; i < 300; i++) {
+    elements.push_back(MyClass(std::to_string(i), "even", i));
+  }
+  EXPECT_OK(repository->BulkLoad(&elements));
+  for (int32_t i = 0; i < 300; i++) {
+    _MyClassRepository::StatusEltConstPtrPair found =
+        repository->NonMutableGet(EncodedKey::ForString(std::to_string(i)));
+    ASSERT_TRUE(found.first.ok());
+    EXPECT_EQ(i, found.second->value());
+  }
+  EXPECT_ERROR(repository->Add(MyClass("7", "odd", 7)),
+               grpc::StatusCode::ALREADY_EXISTS);
+}
+
+TEST(MemRepository, BulkLoadRejectsDuplicates) {
+  std::unique_ptr<_MyClassRepository> repository = NewHashedRepository();
+  std::vector<MyClass> elements;
+  elements.push_back(MyClass("a", "x", 1));
+  elements.push_back(MyClass("b", "x", 2));
+  elements.push_back(MyClass("a", "y", 3));
+  EXPECT_ERROR(repository->BulkLoad(&elements),
+               grpc::StatusCode::ALREADY_EXISTS);
+  EXPECT_EQ(0, repository->size());
+
+  elements.push_back(MyClass("a", "x", 1));
+  elements.push_back(MyClass("b", "x", 2));
+  EXPECT_OK(repository->BulkLoad(&elements));
+  EXPECT_EQ(2, repository->size());
+  _MyClassRepository::StatusEltConstPtrPair found =
+      repository->NonMutableGet(EncodedKey::ForString("b"));
+  ASSERT_TRUE(found.first.ok());
+  EXPECT_EQ(2, found.second->value());
+}
+
 } // anonymous namespace
 } // namespace acumio
 
@@ -0,0 +1,111 @@
+//============================================================================
+// Name        : test_object_allocator.cpp
+// Author      : Bill Province (bill@acumio.com)
+// Version     :
+// Copyright   : Copyright (C) 2016 Acumio
+// Description : A test_driver for our ObjectAllocator class.
+//============================================================================
+#include "object_allocator.h"
+
+#include <gtest/gtest.h>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace acumio {
+namespace collection {
+namespace {
+
+typedef ObjectAllocator<std::string> StringObjects;
+
+TEST(ObjectAllocatorTest, AddressesAreStableAcrossGrowth) {
+  StringObjects allocator(1);
+  uint32_t first = allocator.Add("first");
+  EXPECT_EQ(0, first);
+  const std::string* first_address = &allocator.ObjectAt(first);
+  // Enough to need several more chunks.
+  std::vector<uint32_t> positions;
+  for (uint32_t i = 0; i < 3 * StringObjects::CHUNK_SIZE; i++) {
+    positions.push_back(allocator.Add(std::to_string(i)));
+  }
+  EXPECT_EQ(first_address, &allocator.ObjectAt(first));
+  EXPECT_EQ("first", *first_address);
+  EXPECT_EQ(3 * StringObjects::CHUNK_SIZE + 1, allocator.size());
+  // Positions are (chunk, offset) pairs.
+  uint32_t last = positions.back();
+  EXPECT_EQ(3, last >> StringObjects::CHUNK_BITS);
+  EXPECT_EQ(0, last & (StringObjects::CHUNK_SIZE - 1));
+  EXPECT_EQ(std::to_string(3 * StringObjects::CHUNK_SIZE - 1),
+            allocator.ObjectAt(last));
+}
+
+TEST(ObjectAllocatorTest, ReferenceCountsAndReuse) {
+  StringObjects allocator;
+  uint32_t a = allocator.Add("a");
+  uint32_t b = allocator.Add("b");
+  EXPECT_EQ(2, allocator.AddReference(a));
+  EXPECT_EQ(1, allocator.DropReference(a));
+  EXPECT_EQ(0, allocator.DropReference(a));
+  EXPECT_EQ(0, allocator.ReferenceCount(a));
+  EXPECT_EQ("", allocator.ObjectAt(a));
+  // Dropped or never-allocated positions ignore further changes.
+  EXPECT_EQ(0, allocator.AddReference(a));
+  EXPECT_EQ(0, allocator.DropReference(a));
+  EXPECT_EQ(0, allocator.AddReference(allocator.ImpossiblePosition()));
+  EXPECT_EQ(1, allocator.size());
+
+  // Freed positions are reused, most recent first.
+  EXPECT_EQ(0, allocator.DropReference(b));
+  EXPECT_EQ(b, allocator.Add("c"));
+  EXPECT_EQ(a, allocator.Add("d"));
+  EXPECT_EQ("c", allocator.ObjectAt(b));
+  EXPECT_EQ(b + 1, allocator.Add("e"));
+}
+
+TEST(ObjectAllocatorTest, ConcurrentWriters) {
+  ObjectAllocator<uint64_t> allocator(1);
+  const int thread_count = 4;
+  const uint64_t rounds = 20000;
+  std::vector<std::vector<uint32_t>> kept(thread_count);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < thread_count; t++) {
+    threads.push_back(std::thread([&allocator, &kept, t, rounds]() {
+      for (uint64_t i = 0; i < rounds; i++) {
+        uint64_t value = (static_cast<uint64_t>(t) << 32) | i;
+        uint32_t position = allocator.Add(value);
+        if (i % 2 == 0) {
+          kept[t].push_back(position);
+        } else {
+          allocator.AddReference(position);
+          allocator.DropReference(position);
+          allocator.DropReference(position);
+        }
+      }
+    }));
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+
+  std::set<uint32_t> distinct;
+  for (int t = 0; t < thread_count; t++) {
+    for (size_t i = 0; i < kept[t].size(); i++) {
+      uint32_t position = kept[t][i];
+      EXPECT_TRUE(distinct.insert(position).second);
+      EXPECT_EQ((static_cast<uint64_t>(t) << 32) | (2 * i),
+                allocator.ObjectAt(position));
+      EXPECT_EQ(1, allocator.ReferenceCount(position));
+    }
+  }
+  EXPECT_EQ(thread_count * rounds / 2, allocator.size());
+}
+
+} // anonymous namespace
+} // namespace collection
+} // namespace acumio
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
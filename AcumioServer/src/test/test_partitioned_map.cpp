@@ -0,0 +1,374 @@
+//============================================================================
+// Name        : test_partitioned_map.cpp
+// Author      : Bill Province (bill@acumio.com)
+// Version     :
+// Copyright   : Copyright (C) 2016 Acumio
+// Description : A test_driver for the PartitionedMap template class.
+//============================================================================
+#include "partitioned_map.h"
+
+#include <atomic>
+#include <gtest/gtest.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace acumio {
+namespace {
+
+using acumio::collection::PartitionedMap;
+
+typedef PartitionedMap<std::string, int32_t> StringMap;
+
+std::string KeyFor(int i) {
+  // Zero-padded so that the string order matches the numeric order.
+  std::string digits = std::to_string(i);
+  return std::string(6 - digits.size(), '0') + digits;
+}
+
+std::vector<std::string> IteratedKeys(const StringMap& map) {
+  std::vector<std::string> ret_val;
+  for (StringMap::Iterator it = map.begin(); it != map.end(); ++it) {
+    ret_val.push_back(it->first);
+  }
+  return ret_val;
+}
+
+TEST(PartitionedMapTest, SplitsAndIteratesAcrossPartitions) {
+  StringMap map(false, 4);
+  std::vector<std::string> expected;
+  // Inserted in reverse, so that the splits happen at the front.
+  for (int i = 99; i >= 0; i--) {
+    EXPECT_TRUE(map.Insert(KeyFor(i), i));
+  }
+  for (int i = 0; i < 100; i++) {
+    expected.push_back(KeyFor(i));
+  }
+  EXPECT_EQ(100, map.size());
+  EXPECT_LT(1, map.partition_count());
+  EXPECT_EQ(expected, IteratedKeys(map));
+
+  EXPECT_FALSE(map.Insert(KeyFor(42), 0));
+  int32_t value = 0;
+  EXPECT_TRUE(map.Get(KeyFor(42), &value));
+  EXPECT_EQ(42, value);
+  EXPECT_FALSE(map.Get("x", &value));
+
+  StringMap::Iterator it = map.LowerBound("000041x");
+  ASSERT_NE(map.end(), it);
+  EXPECT_EQ(KeyFor(42), it->first);
+  // Walk backward over every partition boundary down to the first entry.
+  for (int i = 41; i >= 0; i--) {
+    --it;
+    EXPECT_EQ(KeyFor(i), it->first);
+  }
+  StringMap::Iterator last = map.end();
+  --last;
+  EXPECT_EQ(KeyFor(99), last->first);
+  EXPECT_EQ(map.end(), map.LowerBound("x"));
+}
+
+TEST(PartitionedMapTest, MergesAfterErase) {
+  StringMap map(false, 4);
+  for (int i = 0; i < 100; i++) {
+    map.Insert(KeyFor(i), i);
+  }
+  size_t split_count = map.partition_count();
+  for (int i = 0; i < 100; i++) {
+    if (i % 10 != 0) {
+      EXPECT_EQ(1, map.Erase(KeyFor(i)));
+    }
+  }
+  EXPECT_EQ(0, map.Erase(KeyFor(1)));
+  EXPECT_EQ(10, map.size());
+  map.Rebalance();
+  EXPECT_GT(split_count, map.partition_count());
+  std::vector<std::string> expected;
+  for (int i = 0; i < 100; i += 10) {
+    expected.push_back(KeyFor(i));
+  }
+  EXPECT_EQ(expected, IteratedKeys(map));
+
+  // A live iterator holds off neither writes nor rebalancing.
+  StringMap::Iterator it = map.begin();
+  EXPECT_EQ(1, map.Erase(KeyFor(50)));
+  EXPECT_TRUE(map.Insert(KeyFor(55), 55));
+  map.Rebalance();
+  EXPECT_EQ(KeyFor(0), it->first);
+  ++it;
+  EXPECT_EQ(KeyFor(10), it->first);
+}
+
+TEST(PartitionedMapTest, RebalancesAroundLiveIterators) {
+  StringMap map(false, 4);
+  for (int i = 0; i < 100; i++) {
+    map.Insert(KeyFor(i), i);
+  }
+  map.Rebalance();
+  size_t partition_count = map.partition_count();
+  StringMap::Iterator it = map.LowerBound(KeyFor(50));
+  // Partitions the iterator is not in still merge, moving its partition
+  // to a new index.
+  for (int i = 0; i < 40; i++) {
+    EXPECT_EQ(1, map.Erase(KeyFor(i)));
+  }
+  EXPECT_GT(partition_count, map.partition_count());
+  EXPECT_EQ(KeyFor(50), it->first);
+
+  // Its own partition is left alone while pinned, even past the bound.
+  partition_count = map.partition_count();
+  for (int i = 0; i < 20; i++) {
+    EXPECT_TRUE(map.Insert(KeyFor(50) + KeyFor(i), i));
+  }
+  EXPECT_EQ(partition_count, map.partition_count());
+  EXPECT_EQ(1, map.Erase(KeyFor(50)));
+  EXPECT_EQ(KeyFor(50), it->first);
+  std::vector<std::string> expected;
+  for (int i = 0; i < 20; i++) {
+    expected.push_back(KeyFor(50) + KeyFor(i));
+  }
+  for (int i = 51; i < 100; i++) {
+    expected.push_back(KeyFor(i));
+  }
+  StringMap::Iterator walker = it;
+  std::vector<std::string> walked;
+  for (++walker; walker != map.end(); ++walker) {
+    walked.push_back(walker->first);
+  }
+  EXPECT_EQ(expected, walked);
+
+  // Once the iterator leaves, the next write has the partition split.
+  it = map.end();
+  EXPECT_TRUE(map.Insert("x", 0));
+  EXPECT_LT(partition_count, map.partition_count());
+  expected.push_back("x");
+  for (int i = 49; i >= 40; i--) {
+    expected.insert(expected.begin(), KeyFor(i));
+  }
+  EXPECT_EQ(expected, IteratedKeys(map));
+  EXPECT_EQ(expected.size(), map.size());
+}
+
+TEST(PartitionedMapTest, DuplicateKeysStayTogether) {
+  StringMap map(true, 4);
+  for (int i = 0; i < 20; i++) {
+    map.Insert("dup", i);
+    map.Insert(KeyFor(i), i);
+  }
+  EXPECT_EQ(20, map.Count("dup"));
+  EXPECT_TRUE(map.EraseEntry("dup", 7));
+  EXPECT_FALSE(map.EraseEntry("dup", 7));
+  EXPECT_EQ(19, map.Count("dup"));
+  int32_t taken = -1;
+  EXPECT_TRUE(map.Take("dup", &taken));
+  EXPECT_EQ(0, taken);
+  EXPECT_EQ(18, map.Count("dup"));
+  EXPECT_EQ(18, map.Erase("dup"));
+  EXPECT_EQ(20, map.size());
+}
+
+TEST(PartitionedMapTest, SplitsPastLongRunsOfDuplicates) {
+  StringMap map(true, 4);
+  for (int i = 0; i < 1000; i++) {
+    map.Insert("dup", i);
+  }
+  EXPECT_EQ(1, map.partition_count());
+  // Keys after the run share its partition for a while, but are split
+  // off once it has doubled.
+  for (int i = 0; i < 2000; i++) {
+    map.Insert("e" + KeyFor(i), i);
+  }
+  EXPECT_LT(100, map.partition_count());
+  EXPECT_EQ(1000, map.Count("dup"));
+  EXPECT_EQ(3000, map.size());
+  std::vector<std::string> keys = IteratedKeys(map);
+  EXPECT_EQ("dup", keys[999]);
+  EXPECT_EQ("e000000", keys[1000]);
+  EXPECT_EQ("e001999", keys[2999]);
+}
+
+TEST(PartitionedMapTest, LeavesUnmergeablePartitionsUntilHalved) {
+  StringMap map(false, 16);
+  std::vector<std::pair<std::string, int32_t>> entries;
+  for (int i = 0; i < 48; i++) {
+    entries.push_back(std::make_pair(KeyFor(i), i));
+  }
+  EXPECT_TRUE(map.BulkLoad(&entries));
+  EXPECT_EQ(3, map.partition_count());
+  // Neither neighbour has room for what is left of the middle partition.
+  for (int i = 16; i < 29; i++) {
+    EXPECT_EQ(1, map.Erase(KeyFor(i)));
+  }
+  EXPECT_EQ(3, map.partition_count());
+  // The first partition now has room, but is not itself undersized.
+  for (int i = 0; i < 12; i++) {
+    EXPECT_EQ(1, map.Erase(KeyFor(i)));
+  }
+  EXPECT_EQ(3, map.partition_count());
+  // Down from 3 to 2 entries: not yet halved, so no Rebalance.
+  EXPECT_EQ(1, map.Erase(KeyFor(29)));
+  EXPECT_EQ(3, map.partition_count());
+  EXPECT_EQ(1, map.Erase(KeyFor(30)));
+  EXPECT_EQ(2, map.partition_count());
+  EXPECT_EQ(21, map.size());
+}
+
+TEST(PartitionedMapTest, BulkLoad) {
+  StringMap map(true, 4);
+  std::vector<std::pair<std::string, int32_t>> entries;
+  std::vector<std::string> expected;
+  for (int i = 0; i < 100; i++) {
+    entries.push_back(std::make_pair(KeyFor(i), i));
+    expected.push_back(KeyFor(i));
+    if (i == 50) {
+      // A run of equal keys longer than a partition.
+      for (int j = 0; j < 10; j++) {
+        entries.push_back(std::make_pair(KeyFor(i), j));
+        expected.push_back(KeyFor(i));
+      }
+    }
+  }
+  EXPECT_TRUE(map.BulkLoad(&entries));
+  EXPECT_TRUE(entries.empty());
+  EXPECT_EQ(110, map.size());
+  EXPECT_LT(1, map.partition_count());
+  EXPECT_EQ(expected, IteratedKeys(map));
+  EXPECT_EQ(11, map.Count(KeyFor(50)));
+  int32_t value = -1;
+  EXPECT_TRUE(map.Get(KeyFor(50), &value));
+  EXPECT_EQ(50, value);
+
+  // The loaded map takes ordinary writes.
+  EXPECT_TRUE(map.Insert("x", 0));
+  EXPECT_EQ(1, map.Erase(KeyFor(3)));
+  EXPECT_EQ(110, map.size());
+
+  entries.push_back(std::make_pair(KeyFor(0), 0));
+  EXPECT_FALSE(map.BulkLoad(&entries));
+  EXPECT_EQ(1, entries.size());
+}
+
+TEST(PartitionedMapTest, IteratorsSurviveErasingTheirEntry) {
+  StringMap map(false, 4);
+  for (int i = 0; i < 20; i++) {
+    map.Insert(KeyFor(i), i);
+  }
+  {
+    StringMap::Iterator it = map.LowerBound(KeyFor(5));
+    EXPECT_EQ(1, map.Erase(KeyFor(5)));
+    EXPECT_EQ(1, map.Erase(KeyFor(6)));
+    // The erased entry can still be read, and moved on from, but is
+    // otherwise gone.
+    EXPECT_EQ(KeyFor(5), it->first);
+    EXPECT_EQ(5, it->second);
+    int32_t value = -1;
+    EXPECT_FALSE(map.Get(KeyFor(5), &value));
+    EXPECT_EQ(0, map.Count(KeyFor(6)));
+    EXPECT_EQ(0, map.Erase(KeyFor(5)));
+    EXPECT_EQ(18, map.size());
+    ++it;
+    EXPECT_EQ(KeyFor(7), it->first);
+    --it;
+    EXPECT_EQ(KeyFor(4), it->first);
+    EXPECT_EQ(map.LowerBound(KeyFor(7)), map.LowerBound(KeyFor(5)));
+    // An erased key can be inserted again, even while its tombstone
+    // remains.
+    EXPECT_TRUE(map.Insert(KeyFor(6), 66));
+    EXPECT_FALSE(map.Insert(KeyFor(6), 67));
+    EXPECT_TRUE(map.Get(KeyFor(6), &value));
+    EXPECT_EQ(66, value);
+    // Erasing every entry of a partition leaves it to be skipped.
+    for (int i = 8; i < 16; i++) {
+      EXPECT_EQ(1, map.Erase(KeyFor(i)));
+    }
+    ++it;
+    EXPECT_EQ(KeyFor(6), it->first);
+    ++it;
+    EXPECT_EQ(KeyFor(7), it->first);
+    ++it;
+    EXPECT_EQ(KeyFor(16), it->first);
+  }
+  std::vector<std::string> expected;
+  for (int i = 0; i < 20; i++) {
+    if (i != 5 && (i < 8 || i >= 16)) {
+      expected.push_back(KeyFor(i));
+    }
+  }
+  EXPECT_EQ(expected, IteratedKeys(map));
+  map.Rebalance();
+  EXPECT_EQ(expected, IteratedKeys(map));
+  EXPECT_EQ(expected.size(), map.size());
+}
+
+TEST(PartitionedMapTest, ConcurrentEraseWhileIterating) {
+  StringMap map(false, 8);
+  const int key_count = 400;
+  for (int i = 0; i < key_count; i++) {
+    map.Insert(KeyFor(i), i);
+  }
+  std::atomic<bool> done(false);
+  std::thread writer([&map, &done]() {
+    for (int round = 0; round < 20; round++) {
+      for (int i = round % 2; i < key_count; i += 2) {
+        map.Erase(KeyFor(i));
+      }
+      for (int i = round % 2; i < key_count; i += 2) {
+        map.Insert(KeyFor(i), i);
+      }
+    }
+    done.store(true);
+  });
+  int scans = 0;
+  while (!done.load() || scans == 0) {
+    std::string previous;
+    for (StringMap::Iterator it = map.begin(); it != map.end(); ++it) {
+      EXPECT_EQ(KeyFor(it->second), it->first);
+      EXPECT_LT(previous, it->first);
+      previous = it->first;
+    }
+    scans++;
+  }
+  writer.join();
+  EXPECT_EQ(key_count, map.size());
+  EXPECT_EQ(key_count, IteratedKeys(map).size());
+  map.Rebalance();
+  EXPECT_EQ(key_count, IteratedKeys(map).size());
+}
+
+TEST(PartitionedMapTest, ConcurrentInserts) {
+  StringMap map(false, 16);
+  map.StartBackgroundRebalancer(1000000);
+  const int thread_count = 4;
+  const int inserts_per_thread = 500;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < thread_count; t++) {
+    threads.push_back(std::thread([t, &map]() {
+      for (int i = 0; i < inserts_per_thread; i++) {
+        map.Insert(KeyFor(i * thread_count + t), t);
+        // Readers run alongside the writers.
+        int32_t value;
+        map.Get(KeyFor(i), &value);
+      }
+    }));
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  map.StopBackgroundRebalancer();
+  map.Rebalance();
+  EXPECT_EQ(thread_count * inserts_per_thread, map.size());
+  std::vector<std::string> keys = IteratedKeys(map);
+  ASSERT_EQ(thread_count * inserts_per_thread, keys.size());
+  for (size_t i = 0; i < keys.size(); i++) {
+    EXPECT_EQ(KeyFor(i), keys[i]);
+  }
+  EXPECT_LT(1, map.partition_count());
+}
+
+} // anonymous namespace
+} // namespace acumio
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
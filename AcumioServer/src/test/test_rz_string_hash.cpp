@@ -0,0 +1,80 @@
+//============================================================================
+// Name        : test_rz_string_hash.cpp
+// Author      : Bill Province (bill@acumio.com)
+// Version     :
+// Copyright   : Copyright (C) 2016 Acumio
+// Description : A test_driver for rz_string_hash.cpp. For the HashBatch
+//               microbenchmark, see benchmark/rz_string_hash_benchmark.cpp.
+//============================================================================
+#include "rz_string_hash.h"
+
+#include <gtest/gtest.h>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace acumio {
+namespace util {
+namespace {
+
+std::vector<std::string> RandomKeys(size_t count, size_t min_length,
+                                    size_t max_length) {
+  std::mt19937 generator(17);
+  std::uniform_int_distribution<size_t> length(min_length, max_length);
+  std::uniform_int_distribution<int> byte(0, 255);
+  std::vector<std::string> ret_val;
+  for (size_t i = 0; i < count; i++) {
+    std::string key(length(generator), '\0');
+    for (size_t j = 0; j < key.size(); j++) {
+      key[j] = static_cast<char>(byte(generator));
+    }
+    ret_val.push_back(key);
+  }
+  return ret_val;
+}
+
+TEST(RZStringHashTest, BatchMatchesSingle) {
+  RZStringHash hash(0x5bd1e995, 5, 2);
+  // Every batch size up to a few multiples of the widest lane count, so
+  // that both the vector and the leftover paths get exercised, over keys
+  // of very different lengths (including empty and very long ones).
+  std::vector<std::string> keys = RandomKeys(37, 0, 70);
+  keys[3] = "";
+  keys[4] = std::string(1, '\xFF');
+  keys[5] = std::string(300, '\x80');
+  keys[6] = std::string(257, 'z');
+  for (size_t n = 0; n <= keys.size(); n++) {
+    std::vector<uint32_t> batch(n + 1, 0xdeadbeef);
+    hash.HashBatch(keys.data(), n, batch.data());
+    for (size_t i = 0; i < n; i++) {
+      EXPECT_EQ(hash(keys[i]), batch[i]) << "n: " << n << " i: " << i;
+      EXPECT_EQ(hash(keys[i].data(), keys[i].size()), batch[i]);
+    }
+    EXPECT_EQ(0xdeadbeef, batch[n]);
+  }
+}
+
+TEST(RZStringHashTest, PointerBatchMatchesSingle) {
+  RZStringHash hash(0x5bd1e995, 5, 2);
+  std::vector<std::string> keys = RandomKeys(300, 0, 40);
+  std::vector<const char*> data;
+  std::vector<size_t> lengths;
+  for (const std::string& key : keys) {
+    data.push_back(key.data());
+    lengths.push_back(key.size());
+  }
+  std::vector<uint32_t> batch(keys.size());
+  hash.HashBatch(data.data(), lengths.data(), keys.size(), batch.data());
+  for (size_t i = 0; i < keys.size(); i++) {
+    EXPECT_EQ(hash(keys[i]), batch[i]) << "i: " << i;
+  }
+}
+
+} // anonymous namespace
+} // namespace util
+} // namespace acumio
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
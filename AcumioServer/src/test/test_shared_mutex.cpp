@@ -0,0 +1,227 @@
+//============================================================================
+// Name        : test_shared_mutex.cpp
+// Author      : Bill Province (bill@acumio.com)
+// Version     :
+// Copyright   : Copyright (C) 2016 Acumio
+// Description : Test driver for SharedMutex, SharedLock and ExclusiveLock.
+//============================================================================
+
+#include "shared_mutex.h"
+
+#include <atomic>
+#include <chrono>
+#include <gtest/gtest.h>
+#include <thread>
+#include <time.h>
+#include <vector>
+
+namespace acumio {
+namespace transaction {
+namespace {
+
+TEST(SharedMutexTest, SharedLocksAreConcurrent) {
+  SharedMutex mutex;
+  SharedLock first(mutex);
+  std::atomic<bool> acquired(false);
+  std::thread reader([&mutex, &acquired]() {
+    SharedLock second(mutex);
+    acquired.store(true);
+  });
+  reader.join();
+  EXPECT_TRUE(acquired.load());
+}
+
+// Runs more threads than most machines have cores, so that waiters must
+// park rather than spin, and verifies that exclusive sections never overlap
+// with each other or with shared sections.
+template <typename MutexType> void CheckExclusionUnderOversubscription() {
+  MutexType mutex;
+  const uint32_t thread_count = 4 * std::thread::hardware_concurrency() + 4;
+  const uint32_t iterations = 2000;
+  std::atomic<int32_t> readers_inside(0);
+  std::atomic<int32_t> writers_inside(0);
+  std::atomic<uint32_t> violations(0);
+  uint64_t protected_count = 0;
+
+  std::vector<std::thread> threads;
+  for (uint32_t t = 0; t < thread_count; t++) {
+    threads.push_back(std::thread([&, t]() {
+      for (uint32_t i = 0; i < iterations; i++) {
+        if ((i + t) % 8 == 0) {
+          ExclusiveLock lock(mutex);
+          if (writers_inside.fetch_add(1) != 0 || readers_inside.load() != 0) {
+            violations++;
+          }
+          protected_count++;
+          writers_inside.fetch_sub(1);
+        } else {
+          SharedLock lock(mutex);
+          readers_inside.fetch_add(1);
+          if (writers_inside.load() != 0) {
+            violations++;
+          }
+          readers_inside.fetch_sub(1);
+        }
+      }
+    }));
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(0, violations.load());
+  EXPECT_EQ(thread_count * iterations / 8, protected_count);
+}
+
+// A writer must get in even while readers continuously hold the lock.
+template <typename MutexType> void CheckWriterIsNotStarved() {
+  MutexType mutex;
+  std::atomic<bool> writer_done(false);
+  std::vector<std::thread> readers;
+  for (uint32_t t = 0; t < 4; t++) {
+    readers.push_back(std::thread([&mutex, &writer_done]() {
+      while (!writer_done.load()) {
+        SharedLock lock(mutex);
+        std::this_thread::yield();
+      }
+    }));
+  }
+  std::thread writer([&mutex, &writer_done]() {
+    ExclusiveLock lock(mutex);
+    writer_done.store(true);
+  });
+  writer.join();
+  for (std::thread& reader : readers) {
+    reader.join();
+  }
+  EXPECT_TRUE(writer_done.load());
+}
+
+TEST(SharedMutexTest, ExclusionUnderOversubscription) {
+  CheckExclusionUnderOversubscription<SharedMutex>();
+}
+
+TEST(SharedMutexTest, WriterIsNotStarved) {
+  CheckWriterIsNotStarved<SharedMutex>();
+}
+
+TEST(ReaderBiasedSharedMutexTest, ExclusionUnderOversubscription) {
+  CheckExclusionUnderOversubscription<ReaderBiasedSharedMutex>();
+}
+
+TEST(ReaderBiasedSharedMutexTest, WriterIsNotStarved) {
+  CheckWriterIsNotStarved<ReaderBiasedSharedMutex>();
+}
+
+// The biased variant is usable anywhere a SharedMutex is, and recovers its
+// bias once the writer leaves.
+TEST(ReaderBiasedSharedMutexTest, UsableAsSharedMutex) {
+  ReaderBiasedSharedMutex biased;
+  SharedMutex& mutex = biased;
+  {
+    SharedLock first(mutex);
+    SharedLock second(mutex);
+  }
+  {
+    ExclusiveLock lock(mutex);
+  }
+  SharedLock after_write(mutex);
+  std::atomic<bool> acquired(false);
+  std::thread writer([&mutex, &acquired]() {
+    ExclusiveLock lock(mutex);
+    acquired.store(true);
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  EXPECT_FALSE(acquired.load());
+  mutex.break_locks();
+  writer.join();
+  EXPECT_TRUE(acquired.load());
+}
+
+// A reader that queues behind a waiting writer sees the lock free both
+// before and after that writer's turn, and must still be woken by it.
+TEST(SharedMutexTest, ReaderQueuedBehindWriterIsWoken) {
+  SharedMutex mutex;
+  for (uint32_t i = 0; i < 20; i++) {
+    SharedLock* first = new SharedLock(mutex);
+    std::thread writer([&mutex]() {
+      ExclusiveLock lock(mutex);
+    });
+    // Give the writer time to queue, then the late reader time to park.
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    std::atomic<bool> acquired(false);
+    std::thread late_reader([&mutex, &acquired]() {
+      SharedLock lock(mutex);
+      acquired.store(true);
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    delete first;
+    writer.join();
+    std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::now() + std::chrono::seconds(2);
+    while (!acquired.load() && std::chrono::steady_clock::now() < deadline) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    EXPECT_TRUE(acquired.load()) << "iteration " << i;
+    if (!acquired.load()) {
+      // Free the stuck reader so that the test can finish.
+      mutex.break_locks();
+    }
+    late_reader.join();
+  }
+}
+
+// A writer waiting out a long-held biased shared lock parks rather than
+// spinning.
+TEST(ReaderBiasedSharedMutexTest, WriterParksBehindLongReader) {
+  ReaderBiasedSharedMutex mutex;
+  SharedLock* reader = new SharedLock(mutex);
+  std::atomic<bool> acquired(false);
+  std::atomic<int64_t> writer_cpu_nanos(0);
+  std::thread writer([&mutex, &acquired, &writer_cpu_nanos]() {
+    struct timespec start;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+    {
+      ExclusiveLock lock(mutex);
+      acquired.store(true);
+    }
+    struct timespec finish;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &finish);
+    writer_cpu_nanos.store(
+        (finish.tv_sec - start.tv_sec) * INT64_C(1000000000) +
+        (finish.tv_nsec - start.tv_nsec));
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  EXPECT_FALSE(acquired.load());
+  delete reader;
+  writer.join();
+  EXPECT_TRUE(acquired.load());
+  EXPECT_GT(50000000, writer_cpu_nanos.load());
+}
+
+TEST(SharedMutexTest, BreakLocksReleasesWaiters) {
+  SharedMutex mutex;
+  SharedLock* abandoned = new SharedLock(mutex);
+  std::atomic<bool> acquired(false);
+  std::thread writer([&mutex, &acquired]() {
+    ExclusiveLock lock(mutex);
+    acquired.store(true);
+  });
+  // Give the writer time to park.
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  EXPECT_FALSE(acquired.load());
+  mutex.break_locks();
+  writer.join();
+  EXPECT_TRUE(acquired.load());
+  // The abandoned lock's release must not disturb the (now free) mutex.
+  delete abandoned;
+  ExclusiveLock lock(mutex);
+}
+
+} // anonymous namespace
+} // namespace transaction
+} // namespace acumio
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -8,10 +8,13 @@
 //               WriteTransaction.
 //============================================================================
 #include "transaction.h"
+#include <atomic>
 #include <functional>
 #include <gtest/gtest.h>
 // #include <iostream> // Remove me except when debugging. needed for std::cout.
+#include <memory>
 #include <mutex>
+#include <thread>
 #include <vector>
 
 #include "gtest_extensions.h"
@@ -385,6 +388,38 @@ TEST(TransactionTest, CompareExchangeTest) {
                                           std::memory_order_relaxed));
 }
 
+TEST(TransactionTest, SnapshotReadTransactionTest) {
+  acumio::test::TestHook<Transaction*> hook;
+  TransactionManager manager(16, one_second, 2 * one_second, &hook);
+  manager.set_snapshot_reads(true);
+  uint64_t before = acumio::time::TimerNanosSinceEpoch();
+  ReadTransaction tx(manager);
+  EXPECT_TRUE(tx.is_snapshot());
+  EXPECT_LE(before, tx.read_start_time());
+  EXPECT_OK(tx.Commit());
+  EXPECT_ERROR(tx.Commit(), grpc::StatusCode::ABORTED);
+
+  // None of the snapshot reads above should have touched the pool, so the
+  // first pooled transaction is still transaction 0.
+  uint64_t start_time;
+  Transaction* write_tx = manager.StartWriteTransaction(&start_time);
+  ASSERT_NE(write_tx, nullptr);
+  EXPECT_EQ(write_tx->id(), 0);
+  EXPECT_TRUE(manager.Release(write_tx, start_time));
+
+  // Once all of the read slots are taken, reads fall back to the pool.
+  std::vector<std::unique_ptr<ReadTransaction>> reads;
+  bool saw_pooled_read = false;
+  for (uint32_t i = 0; i < 300 && !saw_pooled_read; i++) {
+    reads.emplace_back(new ReadTransaction(manager));
+    saw_pooled_read = !reads.back()->is_snapshot();
+  }
+  EXPECT_TRUE(saw_pooled_read);
+  for (uint32_t i = 0; i < reads.size(); i++) {
+    EXPECT_OK(reads[i]->Commit());
+  }
+}
+
 TEST(TransactionTest, NoOpWriteTransactionTest) {
   acumio::test::TestHook<Transaction*> hook;
   TransactionManager manager(16, one_second, 2 * one_second, &hook);
@@ -554,10 +589,197 @@ TEST(TransactionTest, BadTimingTests) {
   EXPECT_OK(tx3.Commit());
 }
 
+TEST(TransactionTest, ConcurrentAcquireReleaseTest) {
+  acumio::test::TestHook<Transaction*> hook;
+  TransactionManager manager(4, one_second, 2 * one_second, &hook);
+  const uint32_t thread_count = 8;
+  const uint32_t iterations = 2000;
+  // One flag per possible transaction id. If the pool ever hands the same
+  // Transaction to two threads at once, the exchange below will see it.
+  std::vector<std::atomic<bool>> in_use(Transaction::NOT_A_TX);
+  for (uint32_t i = 0; i < in_use.size(); i++) {
+    in_use[i].store(false);
+  }
+  std::atomic<uint32_t> double_allocations(0);
+  std::atomic<uint32_t> failures(0);
+  std::vector<std::thread> threads;
+  for (uint32_t t = 0; t < thread_count; t++) {
+    threads.emplace_back([&]() {
+      for (uint32_t i = 0; i < iterations; i++) {
+        uint64_t start_time;
+        Transaction* tx = manager.StartReadTransaction(&start_time);
+        if (tx == nullptr) {
+          failures++;
+          continue;
+        }
+        if (in_use[tx->id()].exchange(true)) {
+          double_allocations++;
+        }
+        in_use[tx->id()].store(false);
+        if (!tx->Commit(start_time) || !manager.Release(tx, start_time)) {
+          failures++;
+        }
+      }
+    });
+  }
+  for (uint32_t t = 0; t < thread_count; t++) {
+    threads[t].join();
+  }
+  EXPECT_EQ(0, double_allocations.load());
+  EXPECT_EQ(0, failures.load());
+}
+
+TEST(TransactionTest, VersionCollectorLowWaterMarkTest) {
+  acumio::test::TestHook<Transaction*> hook;
+  TransactionManager manager(16, one_second, 2 * one_second, &hook);
+  uint64_t last_clean_time = UINT64_C(0);
+  TransactionManager::CleanerId id = manager.RegisterVersionCleaner(
+      [&last_clean_time](uint64_t clean_time) {
+        last_clean_time = clean_time;
+      });
+
+  ReadTransaction pooled_read(manager);
+  manager.set_snapshot_reads(true);
+  ReadTransaction snapshot_read(manager);
+  ASSERT_FALSE(pooled_read.is_snapshot());
+  ASSERT_TRUE(snapshot_read.is_snapshot());
+  EXPECT_EQ(1, manager.RunVersionCollectionPass(one_second));
+  EXPECT_LE(last_clean_time, pooled_read.read_start_time());
+
+  EXPECT_OK(pooled_read.Commit());
+  EXPECT_EQ(1, manager.RunVersionCollectionPass(one_second));
+  EXPECT_GT(last_clean_time, pooled_read.read_start_time());
+  EXPECT_LE(last_clean_time, snapshot_read.read_start_time());
+
+  EXPECT_OK(snapshot_read.Commit());
+  EXPECT_EQ(1, manager.RunVersionCollectionPass(one_second));
+  EXPECT_GT(last_clean_time, snapshot_read.read_start_time());
+
+  manager.UnregisterVersionCleaner(id);
+  EXPECT_EQ(0, manager.RunVersionCollectionPass(one_second));
+}
+
+TEST(TransactionTest, VersionCollectorBudgetTest) {
+  acumio::test::TestHook<Transaction*> hook;
+  TransactionManager manager(16, one_second, 2 * one_second, &hook);
+  uint32_t counts[3] = {0, 0, 0};
+  for (uint32_t i = 0; i < 3; i++) {
+    manager.RegisterVersionCleaner([&counts, i](uint64_t clean_time) {
+      counts[i]++;
+    });
+  }
+  // With no budget, each pass visits one cleaner, resuming where the
+  // previous pass left off.
+  for (uint32_t pass = 0; pass < 3; pass++) {
+    EXPECT_EQ(1, manager.RunVersionCollectionPass(0));
+  }
+  for (uint32_t i = 0; i < 3; i++) {
+    EXPECT_EQ(1, counts[i]);
+  }
+  EXPECT_EQ(3, manager.RunVersionCollectionPass(one_second));
+  for (uint32_t i = 0; i < 3; i++) {
+    EXPECT_EQ(2, counts[i]);
+  }
+}
+
+TEST(TransactionTest, VersionCollectorResumesBudgetedCleaner) {
+  acumio::test::TestHook<Transaction*> hook;
+  TransactionManager manager(16, one_second, 2 * one_second, &hook);
+  uint32_t budgeted_calls = 0;
+  uint32_t plain_calls = 0;
+  // Needs three calls to get through its data.
+  manager.RegisterBudgetedVersionCleaner(
+      [&budgeted_calls](uint64_t clean_time, uint64_t deadline_nanos) {
+        budgeted_calls++;
+        return budgeted_calls % 3 == 0;
+      });
+  manager.RegisterVersionCleaner([&plain_calls](uint64_t clean_time) {
+    plain_calls++;
+  });
+  // A cleaner that stops early ends the pass, and the next pass resumes
+  // with it, even when there is time to spare.
+  EXPECT_EQ(1, manager.RunVersionCollectionPass(one_second));
+  EXPECT_EQ(1, manager.RunVersionCollectionPass(one_second));
+  EXPECT_EQ(0, plain_calls);
+  EXPECT_EQ(2, manager.RunVersionCollectionPass(one_second));
+  EXPECT_EQ(3, budgeted_calls);
+  EXPECT_EQ(1, plain_calls);
+}
+
+TEST(TransactionTest, BackgroundVersionCollectorTest) {
+  acumio::test::TestHook<Transaction*> hook;
+  TransactionManager manager(16, one_second, 2 * one_second, &hook);
+  TxAware<uint16_t> tx_aware(0, acumio::time::TimerNanosSinceEpoch());
+  manager.RegisterCleanable(&tx_aware);
+  std::atomic<uint32_t> passes(0);
+  manager.RegisterVersionCleaner([&passes](uint64_t clean_time) {
+    passes++;
+  });
+  manager.StartVersionCollector(one_millisecond, one_millisecond);
+  for (uint32_t i = 0; i < 1000 && passes.load() < 3; i++) {
+    acumio::time::SleepNanos(one_millisecond);
+  }
+  manager.StopVersionCollector();
+  EXPECT_GE(passes.load(), 3);
+}
+
 TEST(TxAwareTest, InstantiationTest) {
   TxAware<uint16_t> tx_aware(0, acumio::time::TimerNanosSinceEpoch());
 }
 
+// Both halves are always written together, so a reader that ever sees them
+// differ has observed a torn write.
+struct TxAwarePair {
+  uint64_t first;
+  uint64_t second;
+};
+
+TEST(TxAwareTest, OptimisticReadTest) {
+  acumio::test::TestHook<Transaction*> hook;
+  TransactionManager manager(16, one_second, 2 * one_second, &hook);
+  TxAwarePair not_present = {0, 0};
+  uint64_t aware_start_time = acumio::time::TimerNanosSinceEpoch();
+  TxAware<TxAwarePair> tx_aware(not_present, aware_start_time);
+  const uint64_t write_count = 1000;
+  std::atomic<bool> done(false);
+  std::atomic<uint32_t> torn_reads(0);
+
+  std::vector<std::thread> readers;
+  for (uint32_t i = 0; i < 2; i++) {
+    readers.push_back(std::thread([&]() {
+      while (!done.load()) {
+        TxAwarePair value;
+        tx_aware.GetCopy(acumio::time::TimerNanosSinceEpoch(), &value);
+        if (value.first != value.second) {
+          torn_reads++;
+        }
+      }
+    }));
+  }
+
+  for (uint64_t i = 1; i <= write_count; i++) {
+    WriteTransaction tx(manager);
+    TxAwarePair value = {i, i};
+    tx.AddOperation(
+        [&tx_aware, value](const Transaction* t) {
+          return tx_aware.Set(value, t, t->operation_start_time());
+        },
+        [&tx_aware](const Transaction* t) { tx_aware.CompleteWrite(t); },
+        [&tx_aware](const Transaction* t) { tx_aware.Rollback(t); });
+    EXPECT_OK(tx.Commit());
+  }
+  done.store(true);
+  for (std::thread& reader : readers) {
+    reader.join();
+  }
+  EXPECT_EQ(0, torn_reads.load());
+
+  TxAwarePair value;
+  EXPECT_TRUE(tx_aware.GetCopy(acumio::time::TimerNanosSinceEpoch(), &value));
+  EXPECT_EQ(write_count, value.first);
+  EXPECT_EQ(write_count, value.second);
+}
+
 } // anonymous namespace
 } // namespace acumio
 
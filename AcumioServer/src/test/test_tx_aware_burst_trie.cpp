@@ -3,17 +3,23 @@
 // Author      : Bill Province (bill@acumio.com)
 // Version     :
 // Copyright   : Copyright (C) 2016 Acumio
-// Description : A test_driver for our TxAwareFlatMap class.
+// Description : A test_driver for our TxAwareBurstTrie class.
 //============================================================================
 #include "tx_aware_burst_trie.h"
 
 #include <gtest/gtest.h>
 // #include <iostream> // commented out except when debugging with std::cout.
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include "flat_map.h"
 #include "gtest_extensions.h"
 #include "object_allocator.h"
 #include "string_allocator.h"
+#include "test_hooks.h"
 #include "transaction.h"
 
 namespace acumio {
@@ -27,17 +33,260 @@ using acumio::collection::FlatMap;
 using acumio::collection::ObjectAllocator;
 using acumio::collection::StringAllocator;
 using acumio::collection::TxAwareBurstTrie;
+using acumio::collection::TxBasicIterator;
+using acumio::transaction::Transaction;
+using acumio::transaction::TransactionManager;
 
 uint64_t NowTime() { return acumio::time::TimerNanosSinceEpoch(); }
 
+// Adds each key, with the allocator position of its index in keys as the
+// value, in a single committed write transaction. Returns the time at which
+// the write became visible.
+uint64_t CommitAdds(TransactionManager* manager,
+                    ObjectAllocator<uint64_t>* object_allocator,
+                    TxAwareBurstTrie<uint64_t>* trie,
+                    const std::vector<std::string>& keys) {
+  uint64_t start_time;
+  Transaction* tx = manager->StartWriteTransaction(&start_time);
+  for (size_t i = 0; i < keys.size(); i++) {
+    uint32_t position = object_allocator->Add(i);
+    EXPECT_OK(trie->Add(keys[i].c_str(), position, tx, start_time));
+  }
+  EXPECT_TRUE(tx->StartWriteComplete(start_time));
+  uint64_t complete_time = tx->operation_complete_time();
+  trie->CompleteWriteOperation(tx);
+  EXPECT_TRUE(tx->Commit(start_time));
+  EXPECT_TRUE(manager->Release(tx, start_time));
+  return complete_time;
+}
+
+std::vector<std::string> IteratedKeys(const TxAwareBurstTrie<uint64_t>& trie,
+                                      uint64_t access_time) {
+  std::vector<std::string> ret_val;
+  std::unique_ptr<TxBasicIterator> it = trie.Begin(access_time);
+  std::unique_ptr<TxBasicIterator> end = trie.End(access_time);
+  for (; *it != *end; ++(*it)) {
+    ret_val.push_back((*it)->key.ToString());
+  }
+  return ret_val;
+}
+
 TEST(TxAwareBurstTrieTest, Construction) {
   TxAwareBurstTrie<uint64_t> broken;
   ObjectAllocator<uint64_t> object_allocator;
   {
     // Putting in inner-scope to properly test destruction inside of
     // the test harness.
-    TxAwareBurstTrie<uint64_t> trie();
+    // Leaves of at most 8 entries in 256 bytes of key space.
+    TxAwareBurstTrie<uint64_t> trie(&object_allocator, 256, 8);
+  }
+}
+
+TEST(TxAwareBurstTrieTest, AddAndGetAcrossBursts) {
+  acumio::test::TestHook<Transaction*> hook;
+  TransactionManager manager(16, one_second, 2 * one_second, &hook);
+  ObjectAllocator<uint64_t> object_allocator;
+  // Small leaves, so that shared prefixes burst several levels deep.
+  TxAwareBurstTrie<uint64_t> trie(&object_allocator, 64, 4);
+  std::vector<std::string> keys;
+  for (char c = 'a'; c <= 'c'; c++) {
+    for (int i = 9; i >= 0; i--) {
+      keys.push_back(std::string("pre") + c + std::to_string(i));
+    }
+  }
+  keys.push_back("");
+  keys.push_back("p");
+  uint64_t before_time = NowTime();
+  uint64_t visible_time = CommitAdds(&manager, &object_allocator, &trie, keys);
+
+  uint64_t read_time = NowTime();
+  ASSERT_LE(visible_time, read_time);
+  bool exists = false;
+  EXPECT_EQ(keys.size(), trie.Size(read_time, &exists));
+  EXPECT_TRUE(exists);
+  for (size_t i = 0; i < keys.size(); i++) {
+    uint32_t position;
+    EXPECT_OK(trie.GetValuePosition(keys[i].c_str(), &position, read_time));
+    EXPECT_EQ(i, trie.GetValue(position));
+  }
+  uint32_t position;
+  EXPECT_EQ(grpc::StatusCode::NOT_FOUND,
+            trie.GetValuePosition("pre", &position, read_time).error_code());
+  EXPECT_EQ(grpc::StatusCode::NOT_FOUND,
+            trie.GetValuePosition("q", &position, read_time).error_code());
+
+  std::vector<std::string> expected(keys);
+  std::sort(expected.begin(), expected.end());
+  EXPECT_EQ(expected, IteratedKeys(trie, read_time));
+
+  // Nothing was visible before the write started.
+  EXPECT_EQ(0, trie.Size(before_time, &exists));
+  EXPECT_FALSE(exists);
+}
+
+TEST(TxAwareBurstTrieTest, SnapshotIsolationAndRollback) {
+  acumio::test::TestHook<Transaction*> hook;
+  TransactionManager manager(16, one_second, 2 * one_second, &hook);
+  ObjectAllocator<uint64_t> object_allocator;
+  TxAwareBurstTrie<uint64_t> trie(&object_allocator, 64, 4);
+  std::vector<std::string> first = {"ab", "ac", "ad"};
+  uint64_t first_time = CommitAdds(&manager, &object_allocator, &trie, first);
+  // These burst the leaf under 'a', which must not disturb readers of the
+  // first version.
+  std::vector<std::string> second = {"ae", "af", "ag", "ah"};
+  uint64_t second_time = CommitAdds(&manager, &object_allocator, &trie,
+                                    second);
+  ASSERT_LT(first_time, second_time);
+  bool exists;
+  EXPECT_EQ(3, trie.Size(first_time, &exists));
+  EXPECT_EQ(first, IteratedKeys(trie, first_time));
+  EXPECT_EQ(7, trie.Size(second_time, &exists));
+  uint32_t position;
+  EXPECT_EQ(grpc::StatusCode::NOT_FOUND,
+            trie.GetValuePosition("ah", &position, first_time).error_code());
+  EXPECT_OK(trie.GetValuePosition("ah", &position, second_time));
+
+  // A rolled back write, including a burst, leaves no trace.
+  uint64_t start_time;
+  Transaction* tx = manager.StartWriteTransaction(&start_time);
+  const char* rolled_back[] = {"b1", "b2", "b3", "b4", "b5", "ai"};
+  for (const char* key : rolled_back) {
+    EXPECT_OK(trie.Add(key, object_allocator.Add(0), tx, start_time));
+  }
+  EXPECT_OK(trie.Remove("ab", tx, start_time));
+  EXPECT_TRUE(tx->Rollback(start_time));
+  trie.Rollback(tx);
+  EXPECT_TRUE(manager.Release(tx, start_time));
+  uint64_t read_time = NowTime();
+  EXPECT_EQ(7, trie.Size(read_time, &exists));
+  EXPECT_OK(trie.GetValuePosition("ab", &position, read_time));
+  EXPECT_EQ(grpc::StatusCode::NOT_FOUND,
+            trie.GetValuePosition("b1", &position, read_time).error_code());
+
+  // Cleaning up to the current time keeps the current version intact.
+  trie.CleanVersions(read_time);
+  EXPECT_EQ(7, trie.Size(read_time, &exists));
+}
+
+TEST(TxAwareBurstTrieTest, RemoveReplaceAndLowerBound) {
+  acumio::test::TestHook<Transaction*> hook;
+  TransactionManager manager(16, one_second, 2 * one_second, &hook);
+  ObjectAllocator<uint64_t> object_allocator;
+  TxAwareBurstTrie<uint64_t> trie(&object_allocator, 64, 4);
+  std::vector<std::string> keys = {"", "ant", "bee", "bear", "beaver",
+                                   "bison", "cat", "cow"};
+  CommitAdds(&manager, &object_allocator, &trie, keys);
+
+  uint64_t start_time;
+  Transaction* tx = manager.StartWriteTransaction(&start_time);
+  EXPECT_OK(trie.Remove("bear", tx, start_time));
+  EXPECT_OK(trie.Remove("", tx, start_time));
+  EXPECT_OK(trie.Replace("cat", object_allocator.Add(100), tx, start_time));
+  EXPECT_EQ(grpc::StatusCode::NOT_FOUND,
+            trie.Remove("dog", tx, start_time).error_code());
+  EXPECT_TRUE(tx->StartWriteComplete(start_time));
+  trie.CompleteWriteOperation(tx);
+  EXPECT_TRUE(tx->Commit(start_time));
+  EXPECT_TRUE(manager.Release(tx, start_time));
+
+  uint64_t read_time = NowTime();
+  std::vector<std::string> expected = {"ant", "beaver", "bee", "bison", "cat",
+                                       "cow"};
+  EXPECT_EQ(expected, IteratedKeys(trie, read_time));
+  uint32_t position;
+  EXPECT_OK(trie.GetValuePosition("cat", &position, read_time));
+  EXPECT_EQ(100, trie.GetValue(position));
+
+  std::unique_ptr<TxBasicIterator> end = trie.End(read_time);
+  {
+    std::unique_ptr<TxBasicIterator> it = trie.LowerBound("bea", read_time);
+    ASSERT_NE(*it, *end);
+    EXPECT_EQ("beaver", (*it)->key.ToString());
+  }
+  {
+    std::unique_ptr<TxBasicIterator> it = trie.LowerBound("bz", read_time);
+    ASSERT_NE(*it, *end);
+    EXPECT_EQ("cat", (*it)->key.ToString());
+  }
+  {
+    std::unique_ptr<TxBasicIterator> it = trie.LowerBound("d", read_time);
+    EXPECT_EQ(*it, *end);
+  }
+  {
+    std::unique_ptr<TxBasicIterator> it = trie.ReverseBegin(read_time);
+    std::vector<std::string> reversed;
+    for (; *it != *end; --(*it)) {
+      reversed.push_back((*it)->key.ToString());
+    }
+    std::vector<std::string> reverse_expected(expected.rbegin(),
+                                              expected.rend());
+    EXPECT_EQ(reverse_expected, reversed);
+  }
+}
+
+TEST(TxAwareBurstTrieTest, ConcurrentWritersAndReaders) {
+  acumio::test::TestHook<Transaction*> hook;
+  TransactionManager manager(64, one_second, 2 * one_second, &hook);
+  ObjectAllocator<uint64_t> object_allocator;
+  TxAwareBurstTrie<uint64_t> trie(&object_allocator, 256, 8);
+  std::vector<std::string> seeds;
+  for (char c = 'a'; c <= 'h'; c++) {
+    seeds.push_back(std::string(1, c));
+  }
+  CommitAdds(&manager, &object_allocator, &trie, seeds);
+
+  const int thread_count = 4;
+  const int adds_per_thread = 100;
+  std::atomic<int> committed(0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < thread_count; t++) {
+    threads.push_back(std::thread([t, &manager, &object_allocator, &trie,
+                                   &committed]() {
+      for (int i = 0; i < adds_per_thread; i++) {
+        std::string key = std::string(1, 'a' + (i % 8)) + std::to_string(t) +
+                          "-" + std::to_string(i);
+        // Retries while another writer is bursting the same leaf, giving it
+        // the chance to finish.
+        for (int attempt = 0; attempt < 1000; attempt++) {
+          uint64_t start_time;
+          Transaction* tx = manager.StartWriteTransaction(&start_time);
+          uint32_t position = object_allocator.Add(i);
+          grpc::Status result = trie.Add(key.c_str(), position, tx,
+                                         start_time);
+          object_allocator.DropReference(position);
+          if (result.ok()) {
+            EXPECT_TRUE(tx->StartWriteComplete(start_time));
+            trie.CompleteWriteOperation(tx);
+            EXPECT_TRUE(tx->Commit(start_time));
+            EXPECT_TRUE(manager.Release(tx, start_time));
+            committed++;
+            break;
+          }
+          EXPECT_EQ(grpc::StatusCode::ABORTED, result.error_code());
+          EXPECT_TRUE(tx->Rollback(start_time));
+          trie.Rollback(tx);
+          EXPECT_TRUE(manager.Release(tx, start_time));
+          std::this_thread::yield();
+        }
+        // Post-increment copies the iterator, along with its locks.
+        uint64_t read_time = NowTime();
+        std::unique_ptr<TxBasicIterator> it = trie.Begin(read_time);
+        std::unique_ptr<TxBasicIterator> end = trie.End(read_time);
+        for (int steps = 0; steps < 8 && *it != *end; steps++) {
+          (*it)++;
+        }
+      }
+    }));
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
   }
+  EXPECT_EQ(thread_count * adds_per_thread, committed.load());
+  bool exists = false;
+  EXPECT_EQ(seeds.size() + thread_count * adds_per_thread,
+            trie.Size(NowTime(), &exists));
+  EXPECT_EQ(seeds.size() + thread_count * adds_per_thread,
+            IteratedKeys(trie, NowTime()).size());
 }
 
 } // anonymous namespace
@@ -7,13 +7,17 @@
 //============================================================================
 #include "tx_aware_flat_map.h"
 
+#include <algorithm>
 #include <gtest/gtest.h>
+#include <string>
+#include <vector>
 // #include <iostream> // commented out except when debuggin with std::cout.
 
 #include "flat_map.h"
 #include "gtest_extensions.h"
 #include "object_allocator.h"
 #include "string_allocator.h"
+#include "test_hooks.h"
 #include "transaction.h"
 
 namespace acumio {
@@ -27,6 +31,8 @@ using acumio::collection::FlatMap;
 using acumio::collection::ObjectAllocator;
 using acumio::collection::StringAllocator;
 using acumio::collection::TxAwareFlatMap;
+using acumio::transaction::Transaction;
+using acumio::transaction::TransactionManager;
 
 uint64_t NowTime() { return acumio::time::TimerNanosSinceEpoch(); }
 
@@ -40,6 +46,368 @@ TEST(FlatMapTest, Construction) {
   FlatMap<uint64_t> map2(&key_allocator, &object_allocator, 14, true);
 }
 
+TEST(FlatMapTest, SearchesByPrefixThenString) {
+  StringAllocator key_allocator(8192);
+  ObjectAllocator<uint64_t> object_allocator;
+  FlatMap<uint64_t> map(&key_allocator, &object_allocator, 32, false);
+  // Keys shorter than, equal to, and longer than a prefix, many of them
+  // sharing one, plus bytes that are negative as a signed char.
+  std::vector<std::string> keys = {
+      "", "a", "abcdefg", "abcdefgh", "abcdefgha", "abcdefghb", "abcdefghbb",
+      "abcdefgi", "b", "zzzzzzzzzzzz", "\x80", "\xFF\xFF"};
+  // Insert out of order.
+  for (size_t i = 0; i < keys.size(); i++) {
+    const std::string& key = keys[(i * 5) % keys.size()];
+    uint64_t value = (i * 5) % keys.size();
+    EXPECT_NE(map.max_size(), map.Add(key.c_str(), value)) << key;
+  }
+  ASSERT_EQ(keys.size(), map.size());
+  EXPECT_EQ(map.max_size(), map.Add("abcdefghb", static_cast<uint64_t>(99)));
+  for (size_t i = 0; i < keys.size(); i++) {
+    EXPECT_EQ(keys[i], map.GetKey(i));
+    const uint64_t* value = map.Get(keys[i].c_str());
+    ASSERT_NE(nullptr, value) << keys[i];
+    EXPECT_EQ(i, *value);
+  }
+  EXPECT_EQ(nullptr, map.Get("abcdefghc"));
+  EXPECT_EQ(nullptr, map.Get("abcdefgh\x01"));
+  EXPECT_EQ(nullptr, map.Get("abc"));
+
+  bool found = true;
+  EXPECT_EQ(6, map.GetInternalPosition("abcdefghba", &found));
+  EXPECT_FALSE(found);
+  EXPECT_EQ(keys.size(), map.GetInternalPosition("\xFF\xFF\xFF", &found));
+  EXPECT_FALSE(found);
+
+  EXPECT_TRUE(map.Remove("abcdefgha"));
+  EXPECT_FALSE(map.Remove("abcdefgha"));
+  EXPECT_EQ(nullptr, map.Get("abcdefgha"));
+  ASSERT_NE(nullptr, map.Get("abcdefghb"));
+  EXPECT_EQ(5, *map.Get("abcdefghb"));
+}
+
+TEST(FlatMapTest, DuplicatesOrderByValue) {
+  StringAllocator key_allocator(8192);
+  ObjectAllocator<uint64_t> object_allocator;
+  FlatMap<uint64_t> map(&key_allocator, &object_allocator, 16, true);
+  uint32_t positions[3];
+  for (int i = 0; i < 3; i++) {
+    positions[i] = object_allocator.Add(i);
+  }
+  EXPECT_EQ(0, map.Add("duplicate key", positions[2]));
+  EXPECT_EQ(0, map.Add("duplicate key", positions[0]));
+  EXPECT_EQ(1, map.Add("duplicate key", positions[1]));
+  EXPECT_EQ(map.max_size(), map.Add("duplicate key", positions[1]));
+  EXPECT_EQ(0, map.Add("a", positions[1]));
+  for (int i = 0; i < 3; i++) {
+    EXPECT_EQ(positions[i], map.GetValuePositionByInternalPosition(i + 1));
+  }
+  for (int i = 0; i < 3; i++) {
+    object_allocator.DropReference(positions[i]);
+  }
+}
+
+TEST(FlatMapTest, FrontCodedKeys) {
+  const uint16_t key_space = 256;
+  StringAllocator plain_allocator(key_space);
+  StringAllocator front_coded_allocator(key_space, true);
+  ObjectAllocator<uint64_t> object_allocator;
+  FlatMap<uint64_t> plain(&plain_allocator, &object_allocator, 32, false);
+  FlatMap<uint64_t> map(&front_coded_allocator, &object_allocator, 32, false);
+  // The first key becomes the base; include keys that share nothing with
+  // it, that end within it, that sort on either side of it, and that share
+  // more than a single header byte can record.
+  std::string long_prefix(300, 'q');
+  std::vector<std::string> keys = {
+      "", "catalog.namespace", "catalog.namespace.table_00", "zzz",
+      long_prefix + "a", long_prefix + "b", "\xFF"};
+  for (int i = 1; i < 20; i++) {
+    keys.push_back("catalog.namespace.table_" + std::to_string(10 + i));
+  }
+  // Stored in full, the 20 table keys do not all fit.
+  for (size_t i = 0; i < keys.size(); i++) {
+    if (keys[i].compare(0, 24, "catalog.namespace.table_") == 0) {
+      plain.Add(keys[i].c_str(), static_cast<uint64_t>(i));
+    }
+  }
+  EXPECT_GT(20, plain.size());
+
+  for (size_t i = 2; i < keys.size(); i++) {
+    if (keys[i].size() < 64) {
+      EXPECT_NE(map.max_size(), map.Add(keys[i].c_str(),
+                                        static_cast<uint64_t>(i))) << keys[i];
+    }
+  }
+  // The long keys share nothing with the base, and so do not fit.
+  EXPECT_EQ(map.max_size(), map.Add(keys[4].c_str(), static_cast<uint64_t>(4)));
+  EXPECT_NE(map.max_size(), map.Add("", static_cast<uint64_t>(0)));
+  EXPECT_NE(map.max_size(), map.Add(keys[1].c_str(), static_cast<uint64_t>(1)));
+  ASSERT_EQ(keys.size() - 2, map.size());
+
+  std::vector<std::string> expected;
+  for (const std::string& key : keys) {
+    if (key.size() < 64) {
+      expected.push_back(key);
+    }
+  }
+  std::sort(expected.begin(), expected.end());
+  ASSERT_EQ(expected.size(), map.size());
+  for (uint8_t i = 0; i < map.size(); i++) {
+    FlatMap<uint64_t>::Iterator it(&map, i);
+    EXPECT_EQ(expected[i], it->key.ToString());
+    EXPECT_EQ(expected[i], map.GetKey(i));
+  }
+  for (size_t i = 0; i < keys.size(); i++) {
+    const uint64_t* value = map.Get(keys[i].c_str());
+    if (keys[i].size() < 64) {
+      ASSERT_NE(nullptr, value) << keys[i];
+      EXPECT_EQ(i, *value);
+    }
+  }
+  EXPECT_EQ(nullptr, map.Get("catalog.namespace.table_0"));
+  EXPECT_EQ(nullptr, map.Get("catalog.namespace.table_000"));
+  EXPECT_EQ(nullptr, map.Get("catalog"));
+  EXPECT_EQ(nullptr, map.Get("catalog.namespacf"));
+  EXPECT_TRUE(map.Remove(keys[2].c_str()));
+  EXPECT_EQ(nullptr, map.Get(keys[2].c_str()));
+  ASSERT_NE(nullptr, map.Get(keys[1].c_str()));
+
+  // With room to spare, the keys longer than a header can record sort and
+  // match like any other.
+  StringAllocator long_allocator(2048, true);
+  FlatMap<uint64_t> long_map(&long_allocator, &object_allocator, 8, false);
+  EXPECT_NE(long_map.max_size(),
+            long_map.Add(keys[5].c_str(), static_cast<uint64_t>(5)));
+  EXPECT_NE(long_map.max_size(),
+            long_map.Add(keys[4].c_str(), static_cast<uint64_t>(4)));
+  EXPECT_NE(long_map.max_size(),
+            long_map.Add((long_prefix + "ab").c_str(),
+                         static_cast<uint64_t>(6)));
+  EXPECT_EQ(keys[4], long_map.GetKey(0));
+  EXPECT_EQ(long_prefix + "ab", long_map.GetKey(1));
+  EXPECT_EQ(keys[5], long_map.GetKey(2));
+  ASSERT_NE(nullptr, long_map.Get(keys[4].c_str()));
+  EXPECT_EQ(4, *long_map.Get(keys[4].c_str()));
+  EXPECT_EQ(nullptr, long_map.Get(long_prefix.c_str()));
+}
+
+TEST(StringAllocatorTest, CoalescesAndCompacts) {
+  StringAllocator allocator(64);
+  std::vector<uint16_t> positions;
+  for (char c = 'a'; c < 'i'; c++) {
+    positions.push_back(allocator.Add(std::string(7, c)));
+    EXPECT_NE(allocator.max_size(), positions.back());
+  }
+  EXPECT_EQ(64, allocator.space_used());
+  EXPECT_EQ(0, allocator.hole_count());
+  EXPECT_EQ(allocator.max_size(), allocator.Add("a"));
+
+  // Neighbouring strings merge into one hole when freed, in either order.
+  EXPECT_EQ(0, allocator.DropReference(positions[2]));
+  EXPECT_EQ(0, allocator.DropReference(positions[1]));
+  EXPECT_EQ(1, allocator.hole_count());
+  EXPECT_EQ(16, allocator.largest_hole());
+  EXPECT_EQ(0.0, allocator.fragmentation());
+  positions[1] = allocator.Add(std::string(15, 'b'));
+  EXPECT_NE(allocator.max_size(), positions[1]);
+
+  // Scattered holes: the free space is there, but not in one piece.
+  EXPECT_EQ(0, allocator.DropReference(positions[4]));
+  EXPECT_EQ(0, allocator.DropReference(positions[6]));
+  EXPECT_EQ(2, allocator.hole_count());
+  EXPECT_EQ(16, allocator.free_space());
+  EXPECT_EQ(0.5, allocator.fragmentation());
+  EXPECT_EQ(allocator.max_size(), allocator.Add(std::string(15, 'z')));
+
+  EXPECT_EQ(2, allocator.AddReference(positions[7]));
+  std::vector<uint16_t> relocation;
+  allocator.Compact(&relocation);
+  EXPECT_EQ(1, allocator.hole_count());
+  EXPECT_EQ(16, allocator.largest_hole());
+  const int kept[] = {0, 1, 3, 5, 7};
+  const char fill[] = {'a', 'b', 'd', 'f', 'h'};
+  for (int i = 0; i < 5; i++) {
+    uint16_t moved = relocation[positions[kept[i]]];
+    std::string expected(kept[i] == 1 ? 15 : 7, fill[i]);
+    EXPECT_EQ(expected, allocator.StringAt(moved));
+  }
+  uint16_t last = relocation[positions[7]];
+  EXPECT_EQ(2, allocator.ReferenceCount(last));
+  EXPECT_EQ(48, last + 8);
+  EXPECT_NE(allocator.max_size(), allocator.Add(std::string(15, 'z')));
+  EXPECT_EQ(0, allocator.free_space());
+}
+
+TEST(StringAllocatorTest, CompactRechoosesFrontCodedBase) {
+  StringAllocator allocator(128, true);
+  // The first key becomes the base, but shares nothing with the others.
+  uint16_t first = allocator.Add("unrelated");
+  std::vector<std::string> keys;
+  std::vector<uint16_t> positions;
+  for (int i = 0; i < 4; i++) {
+    keys.push_back("catalog.namespace." + std::to_string(i));
+    positions.push_back(allocator.Add(keys.back()));
+    ASSERT_NE(allocator.max_size(), positions.back());
+  }
+  uint16_t used = allocator.space_used();
+  EXPECT_EQ(0, allocator.DropReference(first));
+  std::vector<uint16_t> relocation;
+  allocator.Compact(&relocation);
+  // Each key now shares the 18 byte prefix common to all of them.
+  EXPECT_EQ(18, allocator.BaseMatch("catalog.namespace.x"));
+  EXPECT_EQ(4 * 3, allocator.space_used());
+  EXPECT_GT(used, allocator.space_used());
+  for (int i = 0; i < 4; i++) {
+    positions[i] = relocation[positions[i]];
+    EXPECT_EQ(keys[i], allocator.Decode(positions[i]));
+    const char* key = keys[i].c_str();
+    EXPECT_EQ(0, allocator.Compare(key, allocator.BaseMatch(key),
+                                   positions[i]));
+  }
+  EXPECT_GT(0, allocator.Compare("catalog.a", allocator.BaseMatch("catalog.a"),
+                                 positions[0]));
+
+  // A new base that would leave less room is not taken.
+  uint16_t zzz = allocator.Add("zzz");
+  ASSERT_NE(allocator.max_size(), zzz);
+  used = allocator.space_used();
+  allocator.Compact(&relocation);
+  EXPECT_EQ(used, allocator.space_used());
+  EXPECT_EQ("zzz", allocator.Decode(relocation[zzz]));
+  EXPECT_EQ(keys[3], allocator.Decode(relocation[positions[3]]));
+}
+
+TEST(TxAwareFlatMapTest, CompactsKeySpaceUnderChurn) {
+  acumio::test::TestHook<Transaction*> hook;
+  TransactionManager manager(16, one_second, 2 * one_second, &hook);
+  ObjectAllocator<uint64_t> object_allocator;
+  uint64_t create_time = NowTime();
+  // Room for exactly ten keys. The keys share nothing with each other,
+  // so front-coding takes one extra byte per key, making each 9 bytes,
+  // except for the first, which is the base, and so takes only 2.
+  TxAwareFlatMap<uint64_t> map(&object_allocator, 83, 16, create_time);
+  std::vector<std::string> keys;
+  for (char c = 'a'; c < 'k'; c++) {
+    keys.push_back(std::string(7, c));
+    uint32_t position = object_allocator.Add(keys.size() - 1);
+    EXPECT_OK(map.Load(keys.back().c_str(), position, create_time));
+    object_allocator.DropReference(position);
+  }
+  EXPECT_EQ(83, map.key_space_used());
+
+  uint64_t start_time;
+  Transaction* tx = manager.StartWriteTransaction(&start_time);
+  const int removed[] = {2, 5, 6, 7, 8};
+  for (int i : removed) {
+    EXPECT_OK(map.Remove(keys[i].c_str(), tx, start_time));
+  }
+  EXPECT_TRUE(tx->StartWriteComplete(start_time));
+  map.CompleteWriteOperation(tx);
+  EXPECT_TRUE(tx->Commit(start_time));
+  EXPECT_TRUE(manager.Release(tx, start_time));
+  // The old version still holds the removed keys.
+  EXPECT_EQ(83, map.key_space_used());
+
+  // Once it is gone, they leave holes of 9 and 36 bytes. That is not
+  // scattered enough to compact as part of the cleaning.
+  uint64_t clean_time = NowTime();
+  map.CleanVersions(clean_time);
+  EXPECT_EQ(38, map.key_space_used());
+  EXPECT_DOUBLE_EQ(0.2, map.key_fragmentation());
+
+  // A key needing all 45 free bytes only fits by compacting.
+  std::string long_key(43, 'z');
+  tx = manager.StartWriteTransaction(&start_time);
+  uint32_t position = object_allocator.Add(99);
+  EXPECT_OK(map.Add(long_key.c_str(), position, tx, start_time));
+  object_allocator.DropReference(position);
+  EXPECT_TRUE(tx->StartWriteComplete(start_time));
+  map.CompleteWriteOperation(tx);
+  EXPECT_TRUE(tx->Commit(start_time));
+  EXPECT_TRUE(manager.Release(tx, start_time));
+  EXPECT_EQ(83, map.key_space_used());
+
+  // Both the version before the add and the one after it read correctly.
+  uint64_t read_time = NowTime();
+  for (size_t i = 0; i < keys.size(); i++) {
+    bool is_removed = (i == 2 || (i >= 5 && i <= 8));
+    uint32_t value_position;
+    for (uint64_t time : {clean_time, read_time}) {
+      grpc::Status status = map.GetValuePosition(keys[i].c_str(),
+                                                 &value_position, time);
+      if (is_removed) {
+        EXPECT_EQ(grpc::StatusCode::NOT_FOUND, status.error_code());
+      } else {
+        EXPECT_OK(status);
+        EXPECT_EQ(i, object_allocator.ObjectAt(value_position));
+      }
+    }
+  }
+  uint32_t value_position;
+  EXPECT_EQ(grpc::StatusCode::NOT_FOUND,
+            map.GetValuePosition(long_key.c_str(), &value_position,
+                                 clean_time).error_code());
+  EXPECT_OK(map.GetValuePosition(long_key.c_str(), &value_position,
+                                 read_time));
+  EXPECT_EQ(99, object_allocator.ObjectAt(value_position));
+}
+
+TEST(TxAwareFlatMapTest, ConflictsOnlyOnTheSameEntry) {
+  acumio::test::TestHook<Transaction*> hook;
+  TransactionManager manager(16, one_second, 2 * one_second, &hook);
+  ObjectAllocator<uint64_t> object_allocator;
+  TxAwareFlatMap<uint64_t> map(&object_allocator, 256, 16, NowTime());
+  uint64_t first_time;
+  Transaction* first = manager.StartWriteTransaction(&first_time);
+  uint64_t second_time;
+  Transaction* second = manager.StartWriteTransaction(&second_time);
+  uint32_t position = object_allocator.Add(1);
+  EXPECT_OK(map.Add("apple", position, first, first_time));
+  object_allocator.DropReference(position);
+  position = object_allocator.Add(2);
+  EXPECT_OK(map.Add("banana", position, second, second_time));
+  EXPECT_EQ(grpc::StatusCode::ABORTED,
+            map.Add("apple", position, second, second_time).error_code());
+  object_allocator.DropReference(position);
+
+  // Once the first write starts completing, it is visible from its
+  // complete time on, even before the map has been told of it.
+  EXPECT_TRUE(first->StartWriteComplete(first_time));
+  uint64_t complete_time = first->operation_complete_time();
+  uint32_t value_position;
+  EXPECT_OK(map.GetValuePosition("apple", &value_position, complete_time));
+  EXPECT_EQ(1, object_allocator.ObjectAt(value_position));
+  EXPECT_EQ(grpc::StatusCode::NOT_FOUND,
+            map.GetValuePosition("apple", &value_position,
+                                 complete_time - 1).error_code());
+  map.CompleteWriteOperation(first);
+  EXPECT_TRUE(first->Commit(first_time));
+  EXPECT_TRUE(manager.Release(first, first_time));
+
+  // The second write started before the first committed, but touches a
+  // different entry, so it still commits.
+  EXPECT_TRUE(second->StartWriteComplete(second_time));
+  map.CompleteWriteOperation(second);
+  EXPECT_TRUE(second->Commit(second_time));
+  EXPECT_TRUE(manager.Release(second, second_time));
+
+  uint64_t read_time = NowTime();
+  bool exists = false;
+  EXPECT_EQ(2, map.Size(read_time, &exists));
+  EXPECT_EQ(1, map.Size(complete_time, &exists));
+  EXPECT_OK(map.GetValuePosition("banana", &value_position, read_time));
+  EXPECT_EQ(2, object_allocator.ObjectAt(value_position));
+
+  // A rolled back edit leaves nothing behind.
+  uint64_t start_time;
+  Transaction* tx = manager.StartWriteTransaction(&start_time);
+  EXPECT_OK(map.Remove("apple", tx, start_time));
+  EXPECT_TRUE(tx->Rollback(start_time));
+  map.Rollback(tx);
+  EXPECT_TRUE(manager.Release(tx, start_time));
+  EXPECT_OK(map.GetValuePosition("apple", &value_position, NowTime()));
+}
+
 TEST(TxAwareFlatMapTest, Construction) {
   TxAwareFlatMap<uint64_t> broken;
   ObjectAllocator<uint64_t> object_allocator;
@@ -0,0 +1,333 @@
+//============================================================================
+// Name        : test_tx_mem_repository.cpp
+// Author      : Bill Province (bill@acumio.com)
+// Version     :
+// Copyright   : Copyright (C) 2016 Acumio
+// Description : A test_driver for the TxMemRepository template class.
+//============================================================================
+#include "tx_mem_repository.h"
+
+#include <gtest/gtest.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include "comparable.h"
+#include "gtest_extensions.h"
+#include "test_hooks.h"
+#include "time_util.h"
+#include "transaction.h"
+
+namespace acumio {
+namespace {
+
+const uint64_t one_second = acumio::time::NANOS_PER_SECOND;
+
+using acumio::transaction::Transaction;
+using acumio::transaction::TransactionManager;
+using acumio::transaction::WriteTransaction;
+
+class MyClass {
+ public:
+  MyClass() : key_(), secondary_(), value_(0) {}
+  MyClass(std::string key, std::string secondary, int32_t value) :
+      key_(key), secondary_(secondary), value_(value) {}
+  ~MyClass() {}
+  inline const std::string& key() const { return key_; }
+  inline const std::string& secondary() const { return secondary_; }
+  inline int32_t value() const { return value_; }
+
+ private:
+  std::string key_;
+  std::string secondary_;
+  int32_t value_;
+};
+
+typedef mem_repository::KeyExtractorInterface<MyClass> _MyClassExtractor;
+typedef mem_repository::TxMemRepository<MyClass> _MyClassRepository;
+
+class MyClassKeyExtractor : public _MyClassExtractor {
+ public:
+  MyClassKeyExtractor() : _MyClassExtractor() {}
+  ~MyClassKeyExtractor() {}
+  inline std::unique_ptr<Comparable> GetKey(const MyClass& element) const {
+    std::unique_ptr<Comparable> key(new StringComparable(element.key()));
+    return key;
+  }
+};
+
+class MyClassSecondaryExtractor : public _MyClassExtractor {
+ public:
+  MyClassSecondaryExtractor() : _MyClassExtractor() {}
+  ~MyClassSecondaryExtractor() {}
+
+  inline std::unique_ptr<Comparable> GetKey(const MyClass& element) const {
+    std::unique_ptr<Comparable> key(new StringComparable(element.secondary()));
+    return key;
+  }
+};
+
+uint64_t NowTime() { return acumio::time::TimerNanosSinceEpoch(); }
+
+std::unique_ptr<_MyClassRepository> NewRepository() {
+  std::unique_ptr<_MyClassExtractor> key_extractor(new MyClassKeyExtractor());
+  std::vector<std::unique_ptr<_MyClassExtractor>> added_extractors;
+  added_extractors.push_back(std::unique_ptr<_MyClassExtractor>(
+      new MyClassSecondaryExtractor()));
+  // Small leaves, so that the indexes burst.
+  std::unique_ptr<_MyClassRepository> repository(
+      new _MyClassRepository(std::move(key_extractor), &added_extractors,
+                             256, 4));
+  return repository;
+}
+
+grpc::Status CommitAdd(TransactionManager* manager,
+                       _MyClassRepository* repository, const MyClass& elt) {
+  WriteTransaction tx(*manager);
+  repository->Add(elt, &tx);
+  return tx.Commit();
+}
+
+TEST(TxMemRepository, AddGetAndRemove) {
+  acumio::test::TestHook<Transaction*> hook;
+  TransactionManager manager(16, one_second, 2 * one_second, &hook);
+  std::unique_ptr<_MyClassRepository> repository = NewRepository();
+  uint64_t before_add = NowTime();
+  EXPECT_OK(CommitAdd(&manager, repository.get(), MyClass("foo", "bar", 42)));
+  EXPECT_OK(CommitAdd(&manager, repository.get(), MyClass("bar", "bar", 10)));
+  EXPECT_OK(CommitAdd(&manager, repository.get(),
+                      MyClass("zebra", "dog", 100)));
+  uint64_t after_add = NowTime();
+  EXPECT_EQ(0, repository->size(before_add));
+  EXPECT_EQ(3, repository->size(after_add));
+
+  MyClass found;
+  EXPECT_OK(repository->Get(StringComparable("foo"), after_add, &found));
+  EXPECT_EQ(42, found.value());
+  EXPECT_EQ(grpc::StatusCode::NOT_FOUND,
+            repository->Get(StringComparable("foo"), before_add,
+                            &found).error_code());
+
+  EXPECT_EQ(grpc::StatusCode::ALREADY_EXISTS,
+            CommitAdd(&manager, repository.get(),
+                      MyClass("foo", "cat", 1)).error_code());
+  {
+    _MyClassRepository::Iterator it =
+        repository->LowerBoundByIndex(StringComparable("cat"), 0, NowTime());
+    _MyClassRepository::Iterator end = repository->secondary_end(0, NowTime());
+    ASSERT_NE(it, end);
+    // The failed add left nothing behind in the secondary index.
+    EXPECT_EQ("dog", it->secondary());
+  }
+
+  {
+    WriteTransaction tx(manager);
+    repository->Remove(StringComparable("foo"), &tx);
+    EXPECT_OK(tx.Commit());
+  }
+  uint64_t after_remove = NowTime();
+  EXPECT_EQ(2, repository->size(after_remove));
+  EXPECT_EQ(grpc::StatusCode::NOT_FOUND,
+            repository->Get(StringComparable("foo"), after_remove,
+                            &found).error_code());
+  // Readers as of an earlier time still see the removed element.
+  EXPECT_OK(repository->Get(StringComparable("foo"), after_add, &found));
+  EXPECT_EQ(42, found.value());
+
+  {
+    WriteTransaction tx(manager);
+    repository->Remove(StringComparable("foo"), &tx);
+    EXPECT_EQ(grpc::StatusCode::NOT_FOUND, tx.Commit().error_code());
+  }
+}
+
+TEST(TxMemRepository, UpdateMovesIndexEntries) {
+  acumio::test::TestHook<Transaction*> hook;
+  TransactionManager manager(16, one_second, 2 * one_second, &hook);
+  std::unique_ptr<_MyClassRepository> repository = NewRepository();
+  const char* keys[] = {"a", "b", "c", "d", "e", "f"};
+  for (const char* key : keys) {
+    EXPECT_OK(CommitAdd(&manager, repository.get(), MyClass(key, "x", 1)));
+  }
+  uint64_t before_update = NowTime();
+
+  {
+    WriteTransaction tx(manager);
+    repository->Update(StringComparable("c"), MyClass("g", "y", 2), &tx);
+    EXPECT_OK(tx.Commit());
+  }
+  uint64_t after_update = NowTime();
+
+  std::vector<std::string> primary_keys;
+  {
+    _MyClassRepository::Iterator it = repository->primary_begin(after_update);
+    _MyClassRepository::Iterator end = repository->primary_end(after_update);
+    for (; it != end; ++it) {
+      primary_keys.push_back(it->key());
+    }
+  }
+  std::vector<std::string> expected = {"a", "b", "d", "e", "f", "g"};
+  EXPECT_EQ(expected, primary_keys);
+
+  MyClass found;
+  EXPECT_OK(repository->Get(StringComparable("g"), after_update, &found));
+  EXPECT_EQ("y", found.secondary());
+  EXPECT_OK(repository->Get(StringComparable("c"), before_update, &found));
+  EXPECT_EQ("x", found.secondary());
+  {
+    _MyClassRepository::Iterator it =
+        repository->LowerBoundByIndex(StringComparable("y"), 0, after_update);
+    ASSERT_NE(it, repository->secondary_end(0, after_update));
+    EXPECT_EQ("g", it->key());
+  }
+
+  {
+    // Updating onto an existing key fails, and changes nothing.
+    WriteTransaction tx(manager);
+    repository->Update(StringComparable("a"), MyClass("b", "z", 3), &tx);
+    EXPECT_EQ(grpc::StatusCode::ALREADY_EXISTS, tx.Commit().error_code());
+  }
+  EXPECT_OK(repository->Get(StringComparable("a"), NowTime(), &found));
+  EXPECT_EQ(1, found.value());
+}
+
+TEST(TxMemRepository, CleanVersionsWithinResumes) {
+  acumio::test::TestHook<Transaction*> hook;
+  TransactionManager manager(16, one_second, 2 * one_second, &hook);
+  std::unique_ptr<_MyClassRepository> repository = NewRepository();
+  const int element_count = 300;
+  for (int i = 0; i < element_count; i++) {
+    EXPECT_OK(CommitAdd(&manager, repository.get(),
+                        MyClass("key" + std::to_string(i), "x", 1)));
+  }
+  uint64_t before_update = NowTime();
+  for (int i = 0; i < element_count; i++) {
+    std::string key = "key" + std::to_string(i);
+    WriteTransaction tx(manager);
+    repository->Update(StringComparable(key), MyClass(key, "x", 2), &tx);
+    EXPECT_OK(tx.Commit());
+  }
+  MyClass found;
+  EXPECT_OK(repository->Get(StringComparable("key7"), before_update, &found));
+  EXPECT_EQ(1, found.value());
+
+  // With no time to spare, each call cleans a little and stops.
+  uint64_t clean_time = NowTime();
+  int calls = 1;
+  while (!repository->CleanVersionsWithin(clean_time, 0)) {
+    calls++;
+    ASSERT_GT(1000, calls);
+  }
+  EXPECT_LT(2, calls);
+  for (int i = 0; i < element_count; i++) {
+    std::string key = "key" + std::to_string(i);
+    EXPECT_EQ(grpc::StatusCode::NOT_FOUND,
+              repository->Get(StringComparable(key), before_update,
+                              &found).error_code());
+    EXPECT_OK(repository->Get(StringComparable(key), clean_time, &found));
+    EXPECT_EQ(2, found.value());
+  }
+}
+
+TEST(TxMemRepository, FirstCommitterWins) {
+  acumio::test::TestHook<Transaction*> hook;
+  TransactionManager manager(16, one_second, 2 * one_second, &hook);
+  std::unique_ptr<_MyClassRepository> repository = NewRepository();
+  EXPECT_OK(CommitAdd(&manager, repository.get(), MyClass("a", "x", 1)));
+  EXPECT_OK(CommitAdd(&manager, repository.get(), MyClass("b", "x", 1)));
+
+  WriteTransaction late(manager);
+  WriteTransaction other_key(manager);
+  {
+    WriteTransaction early(manager);
+    repository->Update(StringComparable("a"), MyClass("a", "x", 2), &early);
+    EXPECT_OK(early.Commit());
+  }
+  repository->Update(StringComparable("a"), MyClass("a", "x", 3), &late);
+  EXPECT_EQ(grpc::StatusCode::ABORTED, late.Commit().error_code());
+  repository->Update(StringComparable("b"), MyClass("b", "x", 4), &other_key);
+  EXPECT_OK(other_key.Commit());
+
+  MyClass found;
+  EXPECT_OK(repository->Get(StringComparable("a"), NowTime(), &found));
+  EXPECT_EQ(2, found.value());
+  EXPECT_OK(repository->Get(StringComparable("b"), NowTime(), &found));
+  EXPECT_EQ(4, found.value());
+}
+
+TEST(TxMemRepository, WritersOfDifferentKeysInOneLeafBothCommit) {
+  acumio::test::TestHook<Transaction*> hook;
+  TransactionManager manager(16, one_second, 2 * one_second, &hook);
+  std::unique_ptr<_MyClassRepository> repository = NewRepository();
+  // Creates the leaves that the writes below share.
+  EXPECT_OK(CommitAdd(&manager, repository.get(), MyClass("aa", "x", 1)));
+
+  {
+    WriteTransaction first(manager);
+    WriteTransaction second(manager);
+    repository->Add(MyClass("ab", "x", 2), &first);
+    repository->Add(MyClass("ac", "x", 3), &second);
+    EXPECT_OK(first.Commit());
+    EXPECT_OK(second.Commit());
+  }
+  {
+    WriteTransaction first(manager);
+    WriteTransaction second(manager);
+    repository->Add(MyClass("ad", "x", 4), &first);
+    repository->Add(MyClass("ad", "x", 5), &second);
+    EXPECT_OK(first.Commit());
+    EXPECT_EQ(grpc::StatusCode::ABORTED, second.Commit().error_code());
+  }
+
+  uint64_t read_time = NowTime();
+  EXPECT_EQ(4, repository->size(read_time));
+  MyClass found;
+  EXPECT_OK(repository->Get(StringComparable("ac"), read_time, &found));
+  EXPECT_EQ(3, found.value());
+  EXPECT_OK(repository->Get(StringComparable("ad"), read_time, &found));
+  EXPECT_EQ(4, found.value());
+}
+
+TEST(TxMemRepository, ConcurrentWriters) {
+  acumio::test::TestHook<Transaction*> hook;
+  TransactionManager manager(16, one_second, 2 * one_second, &hook);
+  std::unique_ptr<_MyClassRepository> repository = NewRepository();
+  const int thread_count = 4;
+  const int adds_per_thread = 50;
+  std::atomic<int> failures(0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < thread_count; t++) {
+    threads.push_back(std::thread([t, &manager, &repository, &failures]() {
+      for (int i = 0; i < adds_per_thread; i++) {
+        MyClass elt(std::to_string(t) + "-" + std::to_string(i), "s", i);
+        grpc::Status result;
+        // Writers that create or burst the same index leaf conflict, so
+        // retry.
+        for (int attempt = 0; attempt < 1000; attempt++) {
+          result = CommitAdd(&manager, repository.get(), elt);
+          if (result.error_code() != grpc::StatusCode::ABORTED) {
+            break;
+          }
+        }
+        if (!result.ok()) {
+          failures++;
+        }
+        MyClass found;
+        repository->Get(StringComparable(elt.key()), NowTime(), &found);
+      }
+    }));
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(0, failures.load());
+  EXPECT_EQ(thread_count * adds_per_thread, repository->size(NowTime()));
+}
+
+} // anonymous namespace
+} // namespace acumio
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -68,6 +68,28 @@ TEST(UserRepository, FullUserConstruction) {
   EXPECT_NE(full_user_bill.user().name(), bill.name());
 }
 
+TEST(UserRepository, FullUserSerialization) {
+  model::User bill;
+  SetToUserBill(&bill);
+  std::string salt = (*GetSalter())();
+  std::string encrypted = (*GetEncrypter())("really_bad_password", salt);
+  FullUser full_user_bill(bill, encrypted, salt);
+  std::string serialized;
+  full_user_bill.AppendToString(&serialized);
+
+  FullUser parsed;
+  ASSERT_TRUE(parsed.ParseFromArray(serialized.data(), serialized.size()));
+  EXPECT_EQ(bill.SerializeAsString(), parsed.user().SerializeAsString());
+  EXPECT_EQ(encrypted, parsed.password());
+  EXPECT_EQ(salt, parsed.salt());
+
+  // Truncated or padded data is not a FullUser.
+  EXPECT_FALSE(parsed.ParseFromArray(serialized.data(),
+                                     serialized.size() - 1));
+  serialized.push_back('\0');
+  EXPECT_FALSE(parsed.ParseFromArray(serialized.data(), serialized.size()));
+}
+
 TEST(UserRepository, MultiUserConstruction) {
   model::User alok;
   SetToUserAlok(&alok);
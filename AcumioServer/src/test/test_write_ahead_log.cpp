@@ -0,0 +1,279 @@
+//============================================================================
+// Name        : test_write_ahead_log.cpp
+// Author      : Bill Province (bill@acumio.com)
+// Version     :
+// Copyright   : Copyright (C) 2016 Acumio
+// Description : A test_driver for WriteAheadLog, and its use from
+//               WriteTransaction.
+//============================================================================
+#include "write_ahead_log.h"
+
+#include <gtest/gtest.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest_extensions.h"
+#include "test_hooks.h"
+#include "time_util.h"
+#include "transaction.h"
+
+namespace acumio {
+namespace {
+using acumio::transaction::Transaction;
+using acumio::transaction::TransactionManager;
+using acumio::transaction::WriteAheadLog;
+using acumio::transaction::WriteTransaction;
+
+const uint64_t one_second = acumio::time::NANOS_PER_SECOND;
+
+std::string TestLogPath(const std::string& name) {
+  std::string path = "/tmp/acumio_test_wal_" + name + ".log";
+  remove(path.c_str());
+  return path;
+}
+
+std::vector<std::string> ReplayAll(const std::string& path) {
+  std::vector<std::string> ret_val;
+  uint64_t count = 0;
+  EXPECT_OK(WriteAheadLog::Replay(path,
+      [&ret_val](const std::string& record) {
+        ret_val.push_back(record);
+        return grpc::Status::OK;
+      }, &count));
+  EXPECT_EQ(ret_val.size(), count);
+  return ret_val;
+}
+
+TEST(WriteAheadLogTest, AppendAndReplay) {
+  std::string path = TestLogPath("append");
+  EXPECT_TRUE(ReplayAll(path).empty());
+  {
+    WriteAheadLog log(path, WriteAheadLog::SYNC_EACH_COMMIT, 1000);
+    EXPECT_OK(log.Open());
+    EXPECT_OK(log.Append({"one"}));
+    EXPECT_OK(log.Append({"two", std::string("th\0ree", 6)}));
+    EXPECT_OK(log.Append({""}));
+  }
+  std::vector<std::string> records = ReplayAll(path);
+  ASSERT_EQ(4, records.size());
+  EXPECT_EQ("one", records[0]);
+  EXPECT_EQ("two", records[1]);
+  EXPECT_EQ(std::string("th\0ree", 6), records[2]);
+  EXPECT_EQ("", records[3]);
+
+  // Reopening appends after what is already there.
+  uint64_t reopened_at = 0;
+  {
+    WriteAheadLog log(path, WriteAheadLog::SYNC_EACH_COMMIT, 1000);
+    EXPECT_OK(log.Open());
+    reopened_at = log.end_position();
+    EXPECT_OK(log.Append({"four"}));
+  }
+  records = ReplayAll(path);
+  ASSERT_EQ(5, records.size());
+  EXPECT_EQ("four", records[4]);
+
+  // Replay can pick up from a given position.
+  records.clear();
+  EXPECT_OK(WriteAheadLog::Replay(path, reopened_at,
+      [&records](const std::string& record) {
+        records.push_back(record);
+        return grpc::Status::OK;
+      }, nullptr));
+  ASSERT_EQ(1, records.size());
+  EXPECT_EQ("four", records[0]);
+
+  // Replay stops at the first record that apply rejects.
+  uint64_t count = 0;
+  EXPECT_ERROR(WriteAheadLog::Replay(path,
+      [](const std::string& record) {
+        return record == "two" ?
+            grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "two") :
+            grpc::Status::OK;
+      }, &count), grpc::StatusCode::INVALID_ARGUMENT);
+  EXPECT_EQ(1, count);
+  remove(path.c_str());
+}
+
+TEST(WriteAheadLogTest, TornTail) {
+  std::string path = TestLogPath("torn");
+  {
+    WriteAheadLog log(path, WriteAheadLog::SYNC_EACH_COMMIT, 1000);
+    EXPECT_OK(log.Open());
+    EXPECT_OK(log.Append({"intact", "also intact"}));
+  }
+  {
+    // A record header promising more than was written, as a crash in the
+    // middle of a write would leave.
+    std::ofstream out(path, std::ios::binary | std::ios::app);
+    out.write("\x40\0\0\0\x12\x34\x56\x78partial", 15);
+  }
+  std::vector<std::string> records = ReplayAll(path);
+  ASSERT_EQ(2, records.size());
+  EXPECT_EQ("also intact", records[1]);
+
+  {
+    WriteAheadLog log(path, WriteAheadLog::SYNC_EACH_COMMIT, 1000);
+    EXPECT_OK(log.Open());
+    EXPECT_OK(log.Append({"after"}));
+  }
+  records = ReplayAll(path);
+  ASSERT_EQ(3, records.size());
+  EXPECT_EQ("after", records[2]);
+
+  // A complete record with a bad checksum is treated the same way.
+  {
+    std::fstream out(path, std::ios::binary | std::ios::in | std::ios::out);
+    out.seekp(-1, std::ios::end);
+    out.put('X');
+  }
+  records = ReplayAll(path);
+  EXPECT_EQ(2, records.size());
+
+  // So is a torn header claiming a record far larger than the file, which
+  // must not be allocated before it is found to be torn.
+  {
+    WriteAheadLog log(path, WriteAheadLog::SYNC_EACH_COMMIT, 1000);
+    EXPECT_OK(log.Open());
+    std::ofstream out(path, std::ios::binary | std::ios::app);
+    out.write("\xF0\xFF\xFF\xFF\x12\x34\x56\x78", 8);
+  }
+  records = ReplayAll(path);
+  EXPECT_EQ(2, records.size());
+  {
+    WriteAheadLog log(path, WriteAheadLog::SYNC_EACH_COMMIT, 1000);
+    EXPECT_OK(log.Open());
+    EXPECT_OK(log.Append({"after huge"}));
+  }
+  records = ReplayAll(path);
+  ASSERT_EQ(3, records.size());
+  EXPECT_EQ("after huge", records[2]);
+
+  // Something that is not a log at all is an error, not an empty log.
+  {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out << "Not a log file.";
+  }
+  uint64_t count = 0;
+  EXPECT_ERROR(WriteAheadLog::Replay(path,
+      [](const std::string&) { return grpc::Status::OK; }, &count),
+      grpc::StatusCode::FAILED_PRECONDITION);
+  WriteAheadLog log(path, WriteAheadLog::SYNC_EACH_COMMIT, 1000);
+  EXPECT_ERROR(log.Open(), grpc::StatusCode::FAILED_PRECONDITION);
+  remove(path.c_str());
+}
+
+TEST(WriteAheadLogTest, OnlyOwnerMayReadOrWrite) {
+  std::string path = TestLogPath("mode");
+  {
+    std::ofstream out(path);
+  }
+  chmod(path.c_str(), 0644);
+  WriteAheadLog log(path, WriteAheadLog::SYNC_EACH_COMMIT, 1000);
+  EXPECT_OK(log.Open());
+  struct stat status;
+  ASSERT_EQ(0, stat(path.c_str(), &status));
+  EXPECT_EQ(0600, status.st_mode & 0777);
+  remove(path.c_str());
+}
+
+void ConcurrentAppends(WriteAheadLog::SyncPolicy policy,
+                       const std::string& name) {
+  std::string path = TestLogPath(name);
+  const int thread_count = 8;
+  const int appends_per_thread = 50;
+  {
+    WriteAheadLog log(path, policy, 200);
+    EXPECT_OK(log.Open());
+    std::vector<std::thread> threads;
+    for (int t = 0; t < thread_count; t++) {
+      threads.emplace_back([&log, t, appends_per_thread]() {
+        for (int i = 0; i < appends_per_thread; i++) {
+          std::string record = std::to_string(t) + ":" + std::to_string(i);
+          EXPECT_OK(log.Append({record, record}));
+        }
+      });
+    }
+    for (std::thread& thread : threads) {
+      thread.join();
+    }
+  }
+
+  // Each Append lands contiguously, and each thread's records keep their
+  // order.
+  std::vector<std::string> records = ReplayAll(path);
+  ASSERT_EQ(2 * thread_count * appends_per_thread, records.size());
+  std::vector<int> next(thread_count, 0);
+  for (size_t i = 0; i < records.size(); i += 2) {
+    EXPECT_EQ(records[i], records[i + 1]);
+    size_t colon = records[i].find(':');
+    int t = std::stoi(records[i].substr(0, colon));
+    EXPECT_EQ(next[t]++, std::stoi(records[i].substr(colon + 1)));
+  }
+  remove(path.c_str());
+}
+
+TEST(WriteAheadLogTest, SyncEachCommit) {
+  ConcurrentAppends(WriteAheadLog::SYNC_EACH_COMMIT, "each");
+}
+
+TEST(WriteAheadLogTest, SyncGroupCommit) {
+  ConcurrentAppends(WriteAheadLog::SYNC_GROUP_COMMIT, "group");
+}
+
+TEST(WriteAheadLogTest, SyncAsync) {
+  ConcurrentAppends(WriteAheadLog::SYNC_ASYNC, "async");
+}
+
+TEST(WriteAheadLogTest, WriteTransactionCommit) {
+  std::string path = TestLogPath("transaction");
+  WriteAheadLog log(path, WriteAheadLog::SYNC_GROUP_COMMIT, 200);
+  EXPECT_OK(log.Open());
+  acumio::test::TestHook<Transaction*> hook;
+  TransactionManager manager(16, one_second, 2 * one_second, &hook);
+  manager.set_write_ahead_log(&log);
+
+  int completions = 0;
+  auto succeed = [](const Transaction*) { return grpc::Status::OK; };
+  auto fail = [](const Transaction*) {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "fail");
+  };
+  auto complete = [&completions](const Transaction*) { completions++; };
+  auto rollback = [](const Transaction*) {};
+
+  WriteTransaction committed(manager);
+  committed.AddOperation(succeed, complete, rollback);
+  committed.AddLogRecord("first");
+  committed.AddLogRecord("second");
+  EXPECT_OK(committed.Commit());
+  EXPECT_EQ(1, completions);
+
+  // Nothing is logged for a transaction that rolls back.
+  WriteTransaction rolled_back(manager);
+  rolled_back.AddOperation(fail, complete, rollback);
+  rolled_back.AddLogRecord("never");
+  EXPECT_ERROR(rolled_back.Commit(), grpc::StatusCode::INVALID_ARGUMENT);
+
+  // Nor for one without records.
+  WriteTransaction unlogged(manager);
+  unlogged.AddOperation(succeed, complete, rollback);
+  EXPECT_OK(unlogged.Commit());
+
+  std::vector<std::string> records = ReplayAll(path);
+  ASSERT_EQ(2, records.size());
+  EXPECT_EQ("first", records[0]);
+  EXPECT_EQ("second", records[1]);
+  remove(path.c_str());
+}
+
+} // anonymous namespace
+} // namespace acumio
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,178 @@
+//============================================================================
+// Name        : test_write_coalescer.cpp
+// Author      : Bill Province (bill@acumio.com)
+// Version     :
+// Copyright   : Copyright (C) 2016 Acumio
+// Description : A test_driver for WriteCoalescer.
+//============================================================================
+#include "write_coalescer.h"
+
+#include <gtest/gtest.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "gtest_extensions.h"
+#include "test_hooks.h"
+#include "time_util.h"
+
+namespace acumio {
+namespace {
+using acumio::transaction::Transaction;
+using acumio::transaction::TransactionManager;
+using acumio::transaction::WriteCoalescer;
+using acumio::transaction::WriteTransaction;
+
+const uint64_t one_second = acumio::time::NANOS_PER_SECOND;
+
+// A mutation whose operation returns result, and which counts how many
+// times it was completed and rolled back.
+WriteCoalescer::Mutation CountingMutation(grpc::Status result,
+                                          std::atomic<int>* completed,
+                                          std::atomic<int>* rolled_back) {
+  return [result, completed, rolled_back](WriteTransaction* tx) {
+    tx->AddOperation([result](const Transaction*) { return result; },
+                     [completed](const Transaction*) { (*completed)++; },
+                     [rolled_back](const Transaction*) { (*rolled_back)++; });
+  };
+}
+
+TEST(WriteCoalescerTest, CoalescesConcurrentCommits) {
+  acumio::test::TestHook<Transaction*> hook;
+  TransactionManager manager(16, one_second, 2 * one_second, &hook);
+  WriteCoalescer coalescer(manager, 2000, 16);
+  std::atomic<int> completed(0);
+  std::atomic<int> rolled_back(0);
+  const int thread_count = 8;
+  const int commits_per_thread = 50;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < thread_count; t++) {
+    threads.emplace_back([&]() {
+      WriteCoalescer::Mutation mutation =
+          CountingMutation(grpc::Status::OK, &completed, &rolled_back);
+      for (int i = 0; i < commits_per_thread; i++) {
+        EXPECT_OK(coalescer.Commit(mutation));
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+
+  EXPECT_EQ(thread_count * commits_per_thread, completed.load());
+  EXPECT_EQ(0, rolled_back.load());
+  WriteCoalescer::Metrics metrics;
+  coalescer.GetMetrics(&metrics);
+  EXPECT_EQ(thread_count * commits_per_thread, metrics.requests);
+  EXPECT_LT(metrics.batches, metrics.requests);
+  EXPECT_LT(0, metrics.coalesced_requests);
+  EXPECT_EQ(0, metrics.fallback_batches);
+  EXPECT_LE(metrics.largest_batch, 16);
+  EXPECT_EQ(2000, metrics.window_micros);
+  EXPECT_EQ(16, metrics.max_batch_size);
+}
+
+TEST(WriteCoalescerTest, FailedBatchFallsBack) {
+  acumio::test::TestHook<Transaction*> hook;
+  TransactionManager manager(16, one_second, 2 * one_second, &hook);
+  // The window is long enough that the batch always fills.
+  WriteCoalescer coalescer(manager, 1000000, 4);
+  std::atomic<int> completed(0);
+  std::atomic<int> rolled_back(0);
+  std::vector<grpc::Status> results(4);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&, t]() {
+      grpc::Status op_result = t == 2 ?
+          grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "bad") :
+          grpc::Status::OK;
+      results[t] = coalescer.Commit(
+          CountingMutation(op_result, &completed, &rolled_back));
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+
+  for (int t = 0; t < 4; t++) {
+    if (t == 2) {
+      EXPECT_ERROR(results[t], grpc::StatusCode::INVALID_ARGUMENT);
+    } else {
+      EXPECT_OK(results[t]);
+    }
+  }
+  // Only the individual commits complete; the batch rolled back.
+  EXPECT_EQ(3, completed.load());
+  EXPECT_LT(0, rolled_back.load());
+  WriteCoalescer::Metrics metrics;
+  coalescer.GetMetrics(&metrics);
+  EXPECT_EQ(1, metrics.batches);
+  EXPECT_EQ(1, metrics.fallback_batches);
+  EXPECT_EQ(0, metrics.coalesced_requests);
+  EXPECT_EQ(4, metrics.largest_batch);
+}
+
+TEST(WriteCoalescerTest, CommitsBatchesConcurrently) {
+  acumio::test::TestHook<Transaction*> hook;
+  TransactionManager manager(16, one_second, 2 * one_second, &hook);
+  WriteCoalescer coalescer(manager, 0, 1);
+  std::atomic<bool> first_started(false);
+  std::atomic<bool> second_done(false);
+  bool first_saw_second = false;
+  // The first batch does not finish committing until the second has.
+  WriteCoalescer::Mutation slow = [&](WriteTransaction* tx) {
+    tx->AddOperation([&](const Transaction*) {
+                       first_started = true;
+                       uint64_t give_up = acumio::time::TimerNanosSinceEpoch() +
+                                          one_second / 2;
+                       while (!second_done &&
+                              acumio::time::TimerNanosSinceEpoch() < give_up) {
+                         std::this_thread::yield();
+                       }
+                       first_saw_second = second_done;
+                       return grpc::Status::OK;
+                     },
+                     [](const Transaction*) {}, [](const Transaction*) {});
+  };
+  std::thread first([&]() { EXPECT_OK(coalescer.Commit(slow)); });
+  while (!first_started) {
+    std::this_thread::yield();
+  }
+  std::atomic<int> completed(0);
+  std::atomic<int> rolled_back(0);
+  EXPECT_OK(coalescer.Commit(
+      CountingMutation(grpc::Status::OK, &completed, &rolled_back)));
+  second_done = true;
+  first.join();
+  EXPECT_TRUE(first_saw_second);
+  EXPECT_EQ(1, completed.load());
+}
+
+TEST(WriteCoalescerTest, NoWindow) {
+  acumio::test::TestHook<Transaction*> hook;
+  TransactionManager manager(16, one_second, 2 * one_second, &hook);
+  WriteCoalescer coalescer(manager, 1000, 0);
+  coalescer.set_window_micros(0);
+  std::atomic<int> completed(0);
+  std::atomic<int> rolled_back(0);
+  for (int i = 0; i < 10; i++) {
+    EXPECT_OK(coalescer.Commit(
+        CountingMutation(grpc::Status::OK, &completed, &rolled_back)));
+  }
+  EXPECT_EQ(10, completed.load());
+  WriteCoalescer::Metrics metrics;
+  coalescer.GetMetrics(&metrics);
+  EXPECT_EQ(10, metrics.batches);
+  EXPECT_EQ(0, metrics.coalesced_requests);
+  EXPECT_EQ(1, metrics.largest_batch);
+  EXPECT_EQ(0, metrics.window_micros);
+  EXPECT_EQ(1, metrics.max_batch_size);
+}
+
+} // anonymous namespace
+} // namespace acumio
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
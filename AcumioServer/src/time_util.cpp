@@ -20,12 +20,30 @@ const uint64_t END_OF_TIME = UINT64_MAX;
 
 namespace {
 typedef std::chrono::duration<uint64_t, std::nano> Nanos;
+
+// Set by ScopedWallTime; 0 when the clock is not pinned.
+thread_local uint64_t pinned_wall_nanos = UINT64_C(0);
 }
 
-void SetTimestampToNow(google::protobuf::Timestamp* ts) {
+uint64_t WallNanosSinceEpoch() {
+  if (pinned_wall_nanos != UINT64_C(0)) {
+    return pinned_wall_nanos;
+  }
   WallTime now = std::chrono::system_clock::now();
-  int64_t epoch_nanos = std::chrono::duration_cast<Nanos>(
-      now.time_since_epoch()).count();
+  return std::chrono::duration_cast<Nanos>(now.time_since_epoch()).count();
+}
+
+ScopedWallTime::ScopedWallTime(uint64_t wall_nanos) :
+    prior_wall_nanos_(pinned_wall_nanos) {
+  pinned_wall_nanos = wall_nanos;
+}
+
+ScopedWallTime::~ScopedWallTime() {
+  pinned_wall_nanos = prior_wall_nanos_;
+}
+
+void SetTimestampToNow(google::protobuf::Timestamp* ts) {
+  int64_t epoch_nanos = WallNanosSinceEpoch();
   int64_t epoch_seconds = epoch_nanos/NANOS_PER_SECOND;
   int32_t remaining_nanos = (int32_t) (epoch_nanos % NANOS_PER_SECOND);
   ts->set_seconds(epoch_seconds);
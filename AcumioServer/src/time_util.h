@@ -41,6 +41,24 @@ typedef std::chrono::time_point<_steady_clock> TimerTime;
 // and therefore, might not be a steady clock.
 void SetTimestampToNow(google::protobuf::Timestamp* ts);
 
+// Nanos since the epoch by the WallTime clock, as used by
+// SetTimestampToNow.
+uint64_t WallNanosSinceEpoch();
+
+// For as long as an instance exists, WallNanosSinceEpoch (and so
+// SetTimestampToNow) reports the given time on the thread that created it,
+// rather than reading the clock. This lets us replay logged changes with
+// the same edit times they were first made with. Other threads are not
+// affected.
+class ScopedWallTime {
+ public:
+  explicit ScopedWallTime(uint64_t wall_nanos);
+  ~ScopedWallTime();
+
+ private:
+  uint64_t prior_wall_nanos_;
+};
+
 // Returns Nanos since the epoch using a steady clock. The notion of
 // "steady" simply means that time values increase monotonically, and
 // that each tick represents the same period of time. However, drift -
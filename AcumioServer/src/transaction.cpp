@@ -7,21 +7,58 @@
 //============================================================================
 #include "transaction.h"
 
+#include <sched.h>
 #include <atomic>
 #include <cstdint> // needed for UINT64_C(x) macro.
 
 // #include <iostream> // allows std::cout. Comment out when not debugging.
-#include <mutex>
 #include <sstream>
+#include <thread>
 
 #include "time_util.h"
 
 namespace acumio {
 namespace transaction {
 
+namespace {
+// Upper bound on the number of free-list stripes. Beyond this, cores share
+// stripes.
+const uint32_t MAX_FREE_STRIPES = 64;
+
+// Bounds on the number of snapshot read slots. We aim for four slots per
+// core, which leaves room for nested reads and for more handler threads
+// than cores.
+const uint32_t MIN_READ_SLOTS = 16;
+const uint32_t MAX_READ_SLOTS = 256;
+
+// A free-stack head packs a modification tag into the upper 32 bits and
+// the id of the top Transaction into the lower 16 bits.
+inline uint64_t PackFreeHead(uint32_t tag, Transaction::Id top) {
+  return (static_cast<uint64_t>(tag) << 32) | top;
+}
+
+inline uint32_t FreeHeadTag(uint64_t head) {
+  return static_cast<uint32_t>(head >> 32);
+}
+
+inline Transaction::Id FreeHeadTop(uint64_t head) {
+  return static_cast<Transaction::Id>(head & UINT64_C(0xFFFF));
+}
+
+// A per-thread value used to choose where a thread starts probing for a
+// free read slot.
+inline uint32_t ThreadHomeSlot() {
+  static thread_local uint32_t home =
+      static_cast<uint32_t>(std::hash<std::thread::id>()(
+          std::this_thread::get_id()));
+  return home;
+}
+} // anonymous namespace
+
 Transaction::Transaction(const acumio::test::TestHook<Transaction*>* hook,
                          Id id) :
-    hook_(hook), id_(id), operation_complete_time_(UINT64_C(0)) {
+    hook_(hook), id_(id), operation_complete_time_(UINT64_C(0)),
+    next_free_(NOT_A_TX), pending_start_time_(UINT64_C(0)) {
   Transaction::AtomicInfo new_info;
   new_info.operation_start_time = UINT64_C(0);
   new_info.state = Transaction::NOT_STARTED;
@@ -143,6 +180,9 @@ bool Transaction::Reset(uint64_t expected_start_time) {
 
 bool Transaction::ResetIfOld(uint64_t youngest_reset) {
   Transaction::AtomicInfo current_info = info_.load(std::memory_order_relaxed);
+  if (current_info.state == Transaction::NOT_STARTED) {
+    return false;
+  }
   uint64_t max_op_time = (current_info.operation_start_time >
                           operation_complete_time_ ?
                           current_info.operation_start_time :
@@ -162,14 +202,29 @@ bool Transaction::ResetIfOld(uint64_t youngest_reset) {
 }
 
 ReadTransaction::ReadTransaction(TransactionManager& manager) :
-  manager_(manager), tx_(nullptr), read_start_time_(UINT64_C(0)),
-  done_(false) {
-  tx_ = manager.StartReadTransaction(&read_start_time_);
+  manager_(manager), tx_(nullptr), snapshot_slot_(-1),
+  read_start_time_(UINT64_C(0)), done_(false) {
+  if (manager.snapshot_reads()) {
+    snapshot_slot_ = manager.BeginSnapshotRead(&read_start_time_);
+  }
+  if (snapshot_slot_ < 0) {
+    tx_ = manager.StartReadTransaction(&read_start_time_);
+  }
 }
 
 grpc::Status ReadTransaction::Commit() {
   if (! done_) {
     done_ = true;
+    if (snapshot_slot_ >= 0) {
+      manager_.EndSnapshotRead(snapshot_slot_);
+      // A pooled read this old would have been reaped, and the versions
+      // it relied on are no longer guaranteed to have been kept.
+      if (read_start_time_ <= manager_.LatestReapTimeout()) {
+        return grpc::Status(grpc::StatusCode::DEADLINE_EXCEEDED,
+                            "The transaction appears to have been timed out.");
+      }
+      return grpc::Status::OK;
+    }
     if (tx_ == nullptr) {
       return grpc::Status(grpc::StatusCode::ABORTED,
           "It apparently took too long to initialize the read transaction. "
@@ -216,20 +271,24 @@ ReadTransaction::~ReadTransaction() {
   if (!done_) {
     // This really should not happen, and typically indicates a programming
     // error. TODO: Log this error and make it an alert.
-    manager_.Release(tx_, read_start_time_);
+    if (snapshot_slot_ >= 0) {
+      manager_.EndSnapshotRead(snapshot_slot_);
+    } else {
+      manager_.Release(tx_, read_start_time_);
+    }
   }
 }
 
 WriteTransaction::WriteTransaction(TransactionManager& manager) :
     manager_(manager), tx_(nullptr), write_start_time_(UINT64_C(0)), ops_(),
-    completions_(), rollbacks_(), done_(false) {
+    completions_(), rollbacks_(), log_records_(), done_(false) {
   tx_ = manager.StartWriteTransaction(&write_start_time_);
 }
 
 WriteTransaction::WriteTransaction(TransactionManager& manager,
                                    Transaction* tx) :
     manager_(manager), tx_(tx), write_start_time_(tx->operation_start_time()),
-    ops_(), completions_(), rollbacks_(), done_(false) {}
+    ops_(), completions_(), rollbacks_(), log_records_(), done_(false) {}
 
 void WriteTransaction::AddOperation(
     WriteTransaction::OpFunction op,
@@ -240,6 +299,10 @@ void WriteTransaction::AddOperation(
   rollbacks_.push_back(rollback);
 }
 
+void WriteTransaction::AddLogRecord(const std::string& record) {
+  log_records_.push_back(record);
+}
+
 WriteTransaction::~WriteTransaction() {
   if (!done_) {
     // TODO: Log an error if we reach here.
@@ -313,6 +376,11 @@ grpc::Status WriteTransaction::Commit() {
     return grpc::Status(grpc::StatusCode::ABORTED,
                         "Transaction already committed/rolled back.");
   }
+  if (tx_ == nullptr) {
+    done_ = true;
+    return grpc::Status(grpc::StatusCode::RESOURCE_EXHAUSTED,
+                        "Unable to allocate a transaction.");
+  }
   if (tx_->state() != Transaction::WRITE) {
     return grpc::Status(grpc::StatusCode::ABORTED,
                         "Transaction not in WRITE state.");
@@ -347,11 +415,33 @@ grpc::Status WriteTransaction::Commit() {
     return grpc::Status(grpc::StatusCode::ABORTED, error.str());
   }
 
+  // From here on, the transaction is committed. A write-write conflict
+  // keeps any other transaction touching the same data from getting this
+  // far until our completion functions have run, so conflicting
+  // transactions are logged in the order that they commit. We only wait
+  // for the log to be flushed after the completions, so that those
+  // transactions are not held up by the flush as well.
+  grpc::Status log_result;
+  uint64_t log_position = UINT64_C(0);
+  WriteAheadLog* log = manager_.write_ahead_log();
+  bool logged = log != nullptr && !log_records_.empty();
+  if (logged) {
+    log_result = log->Write(log_records_, &log_position);
+  }
+
   for (uint16_t i = 0; i < ops_.size(); i++) {
     completions_[i](tx_);
   }
 
   manager_.Release(tx_, write_start_time_);
+  if (logged && log_result.ok()) {
+    log_result = log->WaitDurable(log_position);
+  }
+  if (!log_result.ok()) {
+    return grpc::Status(grpc::StatusCode::DATA_LOSS,
+        "The transaction committed, but could not be logged: " +
+        log_result.error_message());
+  }
   return grpc::Status::OK;
 }
 
@@ -366,113 +456,391 @@ bool WriteTransaction::Release() {
 TransactionManager::TransactionManager(
     uint16_t pool_size, uint64_t timeout_nanos, uint64_t reap_timeout_nanos,
     const acumio::test::TestHook<Transaction*>* hook) :
-    transaction_pool_(new Transaction*[pool_size]), pool_size_(pool_size),
-    timeout_nanos_(timeout_nanos), reap_timeout_nanos_(reap_timeout_nanos),
-    hook_(hook), free_list_(), age_list_() {
+    transaction_pool_(nullptr), chunk_size_(pool_size == 0 ? 1 : pool_size),
+    chunk_count_(0), pool_size_(0), timeout_nanos_(timeout_nanos),
+    reap_timeout_nanos_(reap_timeout_nanos),
+    reap_interval_nanos_(reap_timeout_nanos / 4), hook_(hook),
+    free_stripes_(nullptr), stripe_count_(1), next_fresh_id_(0),
+    next_reap_time_(UINT64_C(0)), snapshot_reads_(false),
+    write_ahead_log_(nullptr), read_slots_(nullptr), read_slot_count_(0),
+    cleaners_(), next_cleaner_id_(0), clean_cursor_(0),
+    collector_running_(false) {
   // assert(timeout_nanos < reap_timeout_nanos)
-  for (Transaction::Id i = 0; i < pool_size_; i++) {
-    transaction_pool_[i] = new Transaction(hook, i);
+  // Valid ids are 0 .. NOT_A_TX - 1.
+  chunk_count_ = (Transaction::NOT_A_TX + chunk_size_ - 1) / chunk_size_;
+  transaction_pool_ = new std::atomic<Transaction**>[chunk_count_];
+  for (uint32_t i = 0; i < chunk_count_; i++) {
+    transaction_pool_[i].store(nullptr, std::memory_order_relaxed);
+  }
+  EnsurePoolTransaction(0);
+
+  uint32_t cores = std::thread::hardware_concurrency();
+  stripe_count_ = cores == 0 ? 1 :
+                  (cores > MAX_FREE_STRIPES ? MAX_FREE_STRIPES : cores);
+  free_stripes_ = new FreeStripe[stripe_count_];
+  for (uint32_t i = 0; i < stripe_count_; i++) {
+    free_stripes_[i].head.store(PackFreeHead(0, Transaction::NOT_A_TX),
+                                std::memory_order_relaxed);
+  }
+  reaper_busy_.clear();
+
+  read_slot_count_ = 4 * stripe_count_;
+  if (read_slot_count_ < MIN_READ_SLOTS) {
+    read_slot_count_ = MIN_READ_SLOTS;
+  } else if (read_slot_count_ > MAX_READ_SLOTS) {
+    read_slot_count_ = MAX_READ_SLOTS;
+  }
+  read_slots_ = new ReadSlot[read_slot_count_];
+  for (uint32_t i = 0; i < read_slot_count_; i++) {
+    read_slots_[i].start_time.store(UINT64_C(0), std::memory_order_relaxed);
   }
-  // The next transaction to be allocated will be transaction 0.
-  free_list_.push_back(0);
 }
 
 TransactionManager::~TransactionManager() {
-  for (uint16_t i = 0; i < pool_size_; i++) {
-    delete transaction_pool_[i];
+  StopVersionCollector();
+  for (uint32_t i = 0; i < chunk_count_; i++) {
+    Transaction** chunk = transaction_pool_[i].load(std::memory_order_relaxed);
+    if (chunk != nullptr) {
+      for (uint32_t j = 0; j < chunk_size_; j++) {
+        delete chunk[j];
+      }
+      delete[] chunk;
+    }
   }
 
   delete[] transaction_pool_;
+  delete[] free_stripes_;
+  delete[] read_slots_;
 }
 
 Transaction* TransactionManager::StartReadTransaction(uint64_t* start_time) {
   Transaction* ret_val = AcquireTransaction();
-  *start_time = acumio::time::TimerNanosSinceEpoch();
-  if (!ret_val->BeginRead(*start_time)) {
+  if (ret_val == nullptr) {
     return nullptr;
   }
-  return ret_val;
+  // See BeginSnapshotRead for why we publish a provisional time first.
+  ret_val->pending_start_time_.store(acumio::time::TimerNanosSinceEpoch());
+  *start_time = acumio::time::TimerNanosSinceEpoch();
+  bool began = ret_val->BeginRead(*start_time);
+  ret_val->pending_start_time_.store(UINT64_C(0));
+  return began ? ret_val : nullptr;
 }
 
 Transaction* TransactionManager::StartWriteTransaction(uint64_t* start_time) {
   Transaction* ret_val = AcquireTransaction();
+  if (ret_val == nullptr) {
+    return nullptr;
+  }
+  ret_val->pending_start_time_.store(acumio::time::TimerNanosSinceEpoch());
   *start_time = acumio::time::TimerNanosSinceEpoch();
-  if (!ret_val->BeginWrite(*start_time)) {
+  bool began = ret_val->BeginWrite(*start_time);
+  ret_val->pending_start_time_.store(UINT64_C(0));
+  return began ? ret_val : nullptr;
+}
+
+int32_t TransactionManager::BeginSnapshotRead(uint64_t* start_time) {
+  // We publish a provisional time before taking the actual read start time.
+  // Anyone who scans the slots for the oldest active read either sees the
+  // provisional time (which is no later than the read start time) or scanned
+  // before it was published, in which case the read start time is later
+  // than the scan.
+  uint64_t provisional_time = acumio::time::TimerNanosSinceEpoch();
+  uint32_t home = ThreadHomeSlot();
+  for (uint32_t i = 0; i < read_slot_count_; i++) {
+    uint32_t slot = (home + i) % read_slot_count_;
+    uint64_t expected = UINT64_C(0);
+    if (read_slots_[slot].start_time.compare_exchange_strong(
+            expected, provisional_time, std::memory_order_seq_cst)) {
+      *start_time = acumio::time::TimerNanosSinceEpoch();
+      return static_cast<int32_t>(slot);
+    }
+  }
+  // TODO: Increment monitor variable: every read slot was in use.
+  return -1;
+}
+
+void TransactionManager::EndSnapshotRead(int32_t slot) {
+  read_slots_[slot].start_time.store(UINT64_C(0), std::memory_order_release);
+}
+
+const Transaction* TransactionManager::get_transaction(
+    Transaction::Id transaction_id) const {
+  return PoolTransaction(transaction_id);
+}
+
+Transaction* TransactionManager::PoolTransaction(uint32_t id) const {
+  uint32_t chunk_index = id / chunk_size_;
+  if (chunk_index >= chunk_count_) {
     return nullptr;
   }
-  return ret_val;
+  Transaction** chunk =
+      transaction_pool_[chunk_index].load(std::memory_order_acquire);
+  return chunk == nullptr ? nullptr : chunk[id % chunk_size_];
 }
 
-Transaction* TransactionManager::AcquireTransaction() {
-  std::lock_guard<std::mutex> guard(state_guard_);
-  UnguardedReleaseOldTransactions();
-  Transaction::Id return_index = free_list_.back();
-  free_list_.pop_back();
-  age_list_.push_back(return_index);
-  if (free_list_.empty()) {
-    free_list_.push_back(age_list_.size());
-  }
-  if (return_index == pool_size_) {
-    // This is actually not a great position to be in: It suggests that
-    // the transaction pool was initially made too small. Notice that this
-    // is one of the reasons we use Transaction* values instead of
-    // returning a Transaction reference. If it were a Transaction reference,
-    // the reference would need to be moved when we reach here, and that's just
-    // a messy process.
-    // TODO: Alert if we reach here.
-    // TODO: Serious Alert if pool_size_ would grow to more than 32k
-    //       At that point, the next time we grow, we break.
-    pool_size_ *= 2;
-    Transaction** new_transaction_pool = new Transaction*[pool_size_];
-    for (Transaction::Id i = 0, j = return_index; i < return_index; i++, j++) {
-      // Taking advantage of pipelining.
-      new_transaction_pool[i] = transaction_pool_[i];
-      new_transaction_pool[j] = new Transaction(hook_, j);
+Transaction* TransactionManager::EnsurePoolTransaction(uint32_t id) {
+  uint32_t chunk_index = id / chunk_size_;
+  Transaction** chunk =
+      transaction_pool_[chunk_index].load(std::memory_order_acquire);
+  if (chunk == nullptr) {
+    // This is actually not a great position to be in if it happens after
+    // construction: It suggests that the transaction pool was initially
+    // made too small.
+    // TODO: Alert if we reach here for any chunk other than the first.
+    Transaction** new_chunk = new Transaction*[chunk_size_];
+    Transaction::Id first_id = chunk_index * chunk_size_;
+    for (uint32_t i = 0; i < chunk_size_; i++) {
+      new_chunk[i] = new Transaction(hook_, first_id + i);
+    }
+    if (transaction_pool_[chunk_index].compare_exchange_strong(
+            chunk, new_chunk, std::memory_order_acq_rel)) {
+      chunk = new_chunk;
+      pool_size_.fetch_add(chunk_size_, std::memory_order_relaxed);
+    } else {
+      // Another thread beat us to it; chunk now holds its allocation.
+      for (uint32_t i = 0; i < chunk_size_; i++) {
+        delete new_chunk[i];
+      }
+      delete[] new_chunk;
     }
-    delete [] transaction_pool_;
-    transaction_pool_ = new_transaction_pool;
   }
-  return transaction_pool_[return_index];
+  return chunk[id % chunk_size_];
 }
 
-bool TransactionManager::Release(Transaction* tx, uint64_t expected_op_time) {
-  std::lock_guard<std::mutex> guard(state_guard_);
-  if (!tx->Reset(expected_op_time)) {
-    return false;
+uint32_t TransactionManager::CurrentStripe() const {
+  int cpu = sched_getcpu();
+  return cpu < 0 ? 0 : static_cast<uint32_t>(cpu) % stripe_count_;
+}
+
+Transaction* TransactionManager::PopFree(FreeStripe* stripe) {
+  uint64_t head = stripe->head.load(std::memory_order_acquire);
+  while (FreeHeadTop(head) != Transaction::NOT_A_TX) {
+    Transaction* top = PoolTransaction(FreeHeadTop(head));
+    Transaction::Id next = top->next_free_.load(std::memory_order_relaxed);
+    uint64_t new_head = PackFreeHead(FreeHeadTag(head) + 1, next);
+    if (stripe->head.compare_exchange_weak(head, new_head,
+                                           std::memory_order_acq_rel,
+                                           std::memory_order_acquire)) {
+      return top;
+    }
   }
-  Transaction::Id tx_id = tx->id();
-  free_list_.push_back(tx_id);
-  for (auto it = age_list_.begin(); it < age_list_.end(); it++) {
-    if (*it == tx_id) {
-      age_list_.erase(it);
-      break;
+  return nullptr;
+}
+
+Transaction* TransactionManager::PopFree() {
+  uint32_t home = CurrentStripe();
+  for (uint32_t i = 0; i < stripe_count_; i++) {
+    Transaction* tx = PopFree(&(free_stripes_[(home + i) % stripe_count_]));
+    if (tx != nullptr) {
+      return tx;
     }
   }
+  return nullptr;
+}
+
+void TransactionManager::PushFree(Transaction* tx) {
+  FreeStripe* stripe = &(free_stripes_[CurrentStripe()]);
+  uint64_t head = stripe->head.load(std::memory_order_relaxed);
+  uint64_t new_head;
+  do {
+    tx->next_free_.store(FreeHeadTop(head), std::memory_order_relaxed);
+    new_head = PackFreeHead(FreeHeadTag(head) + 1, tx->id());
+  } while (!stripe->head.compare_exchange_weak(head, new_head,
+                                               std::memory_order_release,
+                                               std::memory_order_relaxed));
+}
+
+Transaction* TransactionManager::AcquireTransaction() {
+  MaybeReleaseOldTransactions(false);
+  Transaction* ret_val = PopFree();
+  if (ret_val != nullptr) {
+    return ret_val;
+  }
+
+  uint32_t fresh_id = next_fresh_id_.fetch_add(1, std::memory_order_acq_rel);
+  if (fresh_id >= Transaction::NOT_A_TX) {
+    // We have exhausted the id space. Our last chance is to reap.
+    // TODO: Serious Alert if we reach here.
+    next_fresh_id_.store(Transaction::NOT_A_TX, std::memory_order_relaxed);
+    MaybeReleaseOldTransactions(true);
+    return PopFree();
+  }
+  return EnsurePoolTransaction(fresh_id);
+}
+
+bool TransactionManager::Release(Transaction* tx, uint64_t expected_op_time) {
+  if (tx == nullptr || !tx->Reset(expected_op_time)) {
+    return false;
+  }
+  PushFree(tx);
   return true;
 }
 
 void TransactionManager::ReleaseOldTransactions() {
-  std::lock_guard<std::mutex> guard(state_guard_);
+  MaybeReleaseOldTransactions(true);
+}
+
+void TransactionManager::MaybeReleaseOldTransactions(bool force) {
+  if (!force && acumio::time::TimerNanosSinceEpoch() <
+                next_reap_time_.load(std::memory_order_relaxed)) {
+    return;
+  }
+  if (reaper_busy_.test_and_set(std::memory_order_acquire)) {
+    return;
+  }
   UnguardedReleaseOldTransactions();
+  next_reap_time_.store(
+      acumio::time::TimerNanosSinceEpoch() + reap_interval_nanos_,
+      std::memory_order_relaxed);
+  reaper_busy_.clear(std::memory_order_release);
 }
 
 void TransactionManager::UnguardedReleaseOldTransactions() {
-  // Caller should already have state_guard_ locked.
+  // Caller should already hold reaper_busy_.
   uint64_t reaper_time = acumio::time::LatestTimeoutTime(reap_timeout_nanos_);
-  Transaction::Id age_index = 0;
-  while (age_index < age_list_.size()) {
-    Transaction::Id tx_id = age_list_[age_index];
-    Transaction* tx_to_check = transaction_pool_[tx_id];
-    if(tx_to_check->ResetIfOld(reaper_time)) {
-      free_list_.push_back(tx_id);
-      age_index++;
-    } else {
+  uint32_t id_limit = next_fresh_id_.load(std::memory_order_acquire);
+  for (uint32_t tx_id = 0; tx_id < id_limit; tx_id++) {
+    Transaction* tx_to_check = PoolTransaction(tx_id);
+    if (tx_to_check != nullptr && tx_to_check->ResetIfOld(reaper_time)) {
+      PushFree(tx_to_check);
+    }
+  }
+}
+
+TransactionManager::CleanerId TransactionManager::RegisterVersionCleaner(
+    TransactionManager::CleanFunction clean) {
+  return RegisterBudgetedVersionCleaner(
+      [clean](uint64_t clean_time, uint64_t /* deadline_nanos */) {
+        clean(clean_time);
+        return true;
+      });
+}
+
+TransactionManager::CleanerId
+TransactionManager::RegisterBudgetedVersionCleaner(
+    TransactionManager::BudgetedCleanFunction clean) {
+  std::lock_guard<std::mutex> guard(cleaners_guard_);
+  CleanerId id = next_cleaner_id_++;
+  cleaners_.push_back(std::make_pair(id, clean));
+  return id;
+}
+
+void TransactionManager::UnregisterVersionCleaner(
+    TransactionManager::CleanerId id) {
+  std::lock_guard<std::mutex> guard(cleaners_guard_);
+  for (uint32_t i = 0; i < cleaners_.size(); i++) {
+    if (cleaners_[i].first == id) {
+      cleaners_.erase(cleaners_.begin() + i);
+      // Keep the cursor pointing at the same next cleaner.
+      if (i < clean_cursor_) {
+        clean_cursor_--;
+      }
+      return;
+    }
+  }
+}
+
+uint64_t TransactionManager::OldestActiveTime() const {
+  // The current time must be read before scanning, so that anything that
+  // starts after the scan passes it has a start time at least this late.
+  uint64_t oldest = acumio::time::TimerNanosSinceEpoch();
+  uint64_t abandoned_reads = LatestReapTimeout();
+  for (uint32_t i = 0; i < read_slot_count_; i++) {
+    uint64_t read_time = read_slots_[i].start_time.load();
+    if (read_time != UINT64_C(0) && read_time > abandoned_reads &&
+        read_time < oldest) {
+      oldest = read_time;
+    }
+  }
+
+  uint32_t id_limit = next_fresh_id_.load();
+  for (uint32_t tx_id = 0; tx_id < id_limit; tx_id++) {
+    const Transaction* tx = PoolTransaction(tx_id);
+    if (tx == nullptr) {
+      continue;
+    }
+    // The pending time must be checked before the state; see
+    // Transaction::pending_start_time_.
+    uint64_t pending_time = tx->pending_start_time_.load();
+    if (pending_time != UINT64_C(0) && pending_time < oldest) {
+      oldest = pending_time;
+    }
+    Transaction::AtomicInfo info = tx->GetAtomicInfo();
+    switch (info.state) {
+      case Transaction::READ: // Intentional fall-through.
+      case Transaction::WRITE: // Intentional fall-through.
+      case Transaction::COMPLETING_WRITE:
+        if (info.operation_start_time < oldest) {
+          oldest = info.operation_start_time;
+        }
+        break;
+      default:
+        break;
+    }
+  }
+  return oldest;
+}
+
+uint32_t TransactionManager::RunVersionCollectionPass(uint64_t budget_nanos) {
+  // Reaping first means that pooled Transactions abandoned for longer than
+  // the reap timeout no longer hold back the low-water mark.
+  ReleaseOldTransactions();
+  uint64_t clean_time = OldestActiveTime();
+  uint64_t deadline = acumio::time::TimerNanosSinceEpoch() + budget_nanos;
+
+  std::lock_guard<std::mutex> guard(cleaners_guard_);
+  uint32_t cleaner_count = cleaners_.size();
+  uint32_t cleaned = 0;
+  while (cleaned < cleaner_count) {
+    if (clean_cursor_ >= cleaner_count) {
+      clean_cursor_ = 0;
+    }
+    bool finished = cleaners_[clean_cursor_].second(clean_time, deadline);
+    cleaned++;
+    if (!finished) {
+      // Out of time; the next pass starts with the rest of this cleaner.
       break;
     }
+    clean_cursor_++;
+    if (acumio::time::TimerNanosSinceEpoch() >= deadline) {
+      break;
+    }
+  }
+  return cleaned;
+}
+
+void TransactionManager::StartVersionCollector(uint64_t interval_nanos,
+                                               uint64_t budget_nanos) {
+  std::lock_guard<std::mutex> guard(collector_guard_);
+  if (collector_running_) {
+    return;
+  }
+  collector_running_ = true;
+  collector_ = std::thread([this, interval_nanos, budget_nanos]() {
+    std::unique_lock<std::mutex> lock(collector_guard_);
+    while (collector_running_) {
+      collector_wakeup_.wait_for(lock,
+                                 std::chrono::nanoseconds(interval_nanos));
+      if (!collector_running_) {
+        break;
+      }
+      lock.unlock();
+      RunVersionCollectionPass(budget_nanos);
+      lock.lock();
+    }
+  });
+}
+
+void TransactionManager::StopVersionCollector() {
+  {
+    std::lock_guard<std::mutex> guard(collector_guard_);
+    if (!collector_running_) {
+      return;
+    }
+    collector_running_ = false;
   }
-  auto begin_it = age_list_.begin();
-  auto end_it = begin_it + age_index;
-  age_list_.erase(begin_it, end_it);
+  collector_wakeup_.notify_all();
+  collector_.join();
 }
 
 } // namespace transaction
@@ -48,6 +48,16 @@
 //               forget about the transaction and return it to the
 //               TransactionManager.
 //
+//               Since reads never leave edits behind that other threads
+//               need to resolve through get_transaction, a TransactionManager
+//               may instead be configured for "snapshot reads" (see
+//               TransactionManager::set_snapshot_reads). In that mode, a
+//               ReadTransaction is nothing more than a read start time that
+//               is published in one of the manager's read slots for as long
+//               as the read is active - so that the manager knows which
+//               versions of the data must be kept - and it does not occupy
+//               a Transaction from the pool at all.
+//
 //               Our transaction model is as follows:
 //
 //               Premise 1:
@@ -225,11 +235,16 @@
 
 #include <grpc++/support/status.h>
 #include <atomic>
+#include <condition_variable>
 #include <cstdint>
+#include <functional>
 #include <mutex>
+#include <thread>
+#include <utility>
 #include <vector>
 #include "test_hooks.h"
 #include "time_util.h"
+#include "write_ahead_log.h"
 
 namespace acumio {
 namespace transaction {
@@ -352,6 +367,9 @@ class Transaction {
   bool Reset(uint64_t expected_start_time);
   // Reset if operation_time_ <= youngest_reset. Returns true if we actually
   // performed the Reset.
+  // Transactions in the NOT_STARTED state are never considered old, since
+  // they are either on a free list or have just been handed out and are
+  // about to begin.
   bool ResetIfOld(uint64_t youngest_reset);
   bool BeginRead(uint64_t read_start_time);
   bool BeginWrite(uint64_t write_start_time);
@@ -365,6 +383,14 @@ class Transaction {
   // structs will not work with more than 128 bits.
   volatile uint64_t operation_complete_time_;
   std::atomic<AtomicInfo> info_;
+  // Link to the next Transaction on the TransactionManager free stack that
+  // currently holds this Transaction. Only meaningful while free.
+  std::atomic<Id> next_free_;
+  // While a read or write is being started, this holds a time no later
+  // than the operation start time that is about to be set. This lets the
+  // version collector see a Transaction that has taken its start time but
+  // not yet transitioned out of NOT_STARTED. 0 otherwise.
+  std::atomic<uint64_t> pending_start_time_;
 };
 
 // Use this to hold sets of Transaction* values. When comparing two
@@ -392,9 +418,14 @@ class ReadTransaction {
 
   inline uint64_t read_start_time() { return read_start_time_; }
 
+  // True if this read is a snapshot read, i.e., it holds a read slot
+  // instead of a pooled Transaction.
+  inline bool is_snapshot() const { return snapshot_slot_ >= 0; }
+
  private:
   TransactionManager& manager_;
   Transaction* tx_;
+  int32_t snapshot_slot_;
   uint64_t read_start_time_;
   bool done_;
 };
@@ -416,6 +447,15 @@ class WriteTransaction {
   void AddOperation(OpFunction op,
                     CompletionFunction completion,
                     RollbackFunction rollback);
+
+  // Adds a record describing this transaction's changes to the manager's
+  // WriteAheadLog (if it has one). The records are written at Commit, once
+  // the transaction can no longer roll back, and before the completion
+  // functions run; Commit then waits for them to be durable, as the log's
+  // SyncPolicy dictates, before returning. If the log cannot be written,
+  // the changes are still committed in memory, but Commit returns
+  // DATA_LOSS, since they may not survive a restart.
+  void AddLogRecord(const std::string& record);
   grpc::Status Commit();
   bool Release();
 
@@ -432,6 +472,7 @@ class WriteTransaction {
   std::vector<OpFunction> ops_;
   std::vector<CompletionFunction> completions_;
   std::vector<RollbackFunction> rollbacks_;
+  std::vector<std::string> log_records_;
   bool done_;
 };
 
@@ -459,6 +500,86 @@ class TransactionManager {
   Transaction* StartReadTransaction(uint64_t* start_time);
   Transaction* StartWriteTransaction(uint64_t* start_time);
 
+  // Starts a snapshot read: claims a read slot, publishes the read in it,
+  // and sets start_time to the read start time. Returns the slot, to be
+  // handed back to EndSnapshotRead, or -1 if every slot is in use. This
+  // never touches the Transaction pool.
+  int32_t BeginSnapshotRead(uint64_t* start_time);
+  void EndSnapshotRead(int32_t slot);
+
+  // When true, ReadTransactions use BeginSnapshotRead, falling back to a
+  // pooled Transaction only if no read slot is free. Defaults to false.
+  inline bool snapshot_reads() const { return snapshot_reads_; }
+  inline void set_snapshot_reads(bool snapshot_reads) {
+    snapshot_reads_ = snapshot_reads;
+  }
+
+  // The log that WriteTransactions write their records to at Commit. Not
+  // owned; null (the default) if changes are not logged.
+  inline WriteAheadLog* write_ahead_log() const { return write_ahead_log_; }
+  inline void set_write_ahead_log(WriteAheadLog* log) {
+    write_ahead_log_ = log;
+  }
+
+  // Version garbage collection.
+  //
+  // Transaction-aware data (see TxAware and TxManagedMap) keeps historical
+  // versions for the benefit of reads that started before a change. Those
+  // versions may be discarded once no active read or write could still
+  // need them; they are discarded by invoking CleanVersions(clean_time)
+  // with a clean_time no later than the start of any active operation.
+  // Data that wants to be collected registers a CleanFunction here.
+  typedef std::function<void(uint64_t clean_time)> CleanFunction;
+  typedef uint64_t CleanerId;
+
+  // The CleanFunction may be invoked from the collector thread at any time
+  // until UnregisterVersionCleaner returns, and is never invoked
+  // concurrently with itself.
+  CleanerId RegisterVersionCleaner(CleanFunction clean);
+
+  // As above, for data that can stop partway through cleaning when a pass
+  // runs out of time. The function is also handed the time (see
+  // TimerNanosSinceEpoch) by which the pass should end, and returns true
+  // once it has been through all of its data, or false if it stopped
+  // early, in which case the next pass resumes with it. It should make
+  // some progress before stopping, however little time is left.
+  typedef std::function<bool(uint64_t clean_time, uint64_t deadline_nanos)>
+      BudgetedCleanFunction;
+  CleanerId RegisterBudgetedVersionCleaner(BudgetedCleanFunction clean);
+
+  // Convenience for anything with a CleanVersions(uint64_t) method, such as
+  // TxAware<EltType> or TxManagedMap<EltType>. The cleanable is not owned,
+  // and must be unregistered before it is destroyed.
+  template <class Cleanable>
+  CleanerId RegisterCleanable(Cleanable* cleanable) {
+    return RegisterVersionCleaner(
+        std::bind(&Cleanable::CleanVersions, cleanable,
+                  std::placeholders::_1));
+  }
+
+  void UnregisterVersionCleaner(CleanerId id);
+
+  // Returns the low-water mark: a time no later than the start of any
+  // active Transaction or snapshot read. Snapshot reads older than the reap
+  // timeout are ignored, since they will fail on Commit anyway. If nothing
+  // is active, this is the current time.
+  uint64_t OldestActiveTime() const;
+
+  // Performs one collection pass: reaps old Transactions, computes the
+  // low-water mark and then invokes registered cleaners in round-robin
+  // order, picking up where the last pass stopped, until either every
+  // cleaner has been visited or budget_nanos have elapsed. At least one
+  // cleaner is visited per pass; a BudgetedCleanFunction that runs out of
+  // time ends the pass. Returns the number of cleaners invoked.
+  uint32_t RunVersionCollectionPass(uint64_t budget_nanos);
+
+  // Starts a background thread performing a collection pass every
+  // interval_nanos, each limited to budget_nanos. Does nothing if the
+  // collector is already running. The collector is stopped by
+  // StopVersionCollector or by destruction of the TransactionManager.
+  void StartVersionCollector(uint64_t interval_nanos, uint64_t budget_nanos);
+  void StopVersionCollector();
+
   // When performing edits for in-flight transactions, we might identify
   // the transaction in the edit contents by the transaction_id. This
   // method allows us to find the current state of the provided transaction.
@@ -471,7 +592,13 @@ class TransactionManager {
   // expected to take care of this.
   const Transaction* get_transaction(Transaction::Id transaction_id) const;
 
-  inline uint16_t get_pool_size() const { return pool_size_; }
+  // Number of Transactions allocated so far. The pool grows beyond its
+  // initial size (in chunks of the initial size) when more Transactions are
+  // concurrently in use than were initially allocated.
+  inline uint16_t get_pool_size() const {
+    uint32_t size = pool_size_.load(std::memory_order_relaxed);
+    return size > UINT16_MAX ? UINT16_MAX : size;
+  }
   inline uint64_t get_timeout_nanos() const { return timeout_nanos_; }
   inline uint64_t get_reap_timeout_nanos() const {
     return reap_timeout_nanos_;
@@ -490,47 +617,109 @@ class TransactionManager {
 
   // Looks at all active transactions and forces them to be released back
   // to the pending state if their age is greater than reap_timeout_nanos.
+  // If another thread is already reaping, this returns without waiting.
   void ReleaseOldTransactions();
 
  private:
+  // Head of a lock-free (Treiber) stack of free Transaction ids, linked
+  // through Transaction::next_free_. The head packs a 32-bit modification
+  // tag above the 16-bit id of the top Transaction, so that a pop cannot
+  // succeed against a head that was popped and pushed back in the meantime
+  // (the ABA problem). The padding keeps each stripe on its own cache line,
+  // since each core normally touches only its own stripe.
+  struct FreeStripe {
+    std::atomic<uint64_t> head;
+    char padding[64 - sizeof(std::atomic<uint64_t>)];
+  };
+
+  // Holds the (provisional) start time of an active snapshot read, or 0 if
+  // the slot is free. Like the FreeStripes, each slot has its own cache line.
+  struct ReadSlot {
+    std::atomic<uint64_t> start_time;
+    char padding[64 - sizeof(std::atomic<uint64_t>)];
+  };
+
   // Provides a free transaction to the caller - used either for
   // StartReadTransaction or StartWriteTransaction - so that we can
-  // decide which transaction to provide.
+  // decide which transaction to provide. Returns nullptr only if we have
+  // exhausted the Transaction::Id space.
   Transaction* AcquireTransaction();
 
-  // This operation is assumed to be invoked when we already have the
-  // state_guard_ mutex locked. We invoke it this way so that we can
-  // efficiently share code. It is otherwise the same as
-  // ReleaseOldTransactions().
+  // Pops a free Transaction, trying the stripe for the current core first
+  // and then stealing from the other stripes. Returns nullptr if all
+  // stripes are empty.
+  Transaction* PopFree();
+  Transaction* PopFree(FreeStripe* stripe);
+  void PushFree(Transaction* tx);
+  uint32_t CurrentStripe() const;
+
+  // Returns the Transaction with the given id, or nullptr if the chunk
+  // holding it has not been allocated.
+  Transaction* PoolTransaction(uint32_t id) const;
+  // Makes sure that the chunk holding the given id is allocated. Any number
+  // of threads may race to do this; exactly one allocation wins.
+  Transaction* EnsurePoolTransaction(uint32_t id);
+
+  // Runs a reaper pass if no other thread is running one. If force is false,
+  // the pass is also skipped unless reap_interval_nanos_ have passed since
+  // the last one.
+  void MaybeReleaseOldTransactions(bool force);
+
+  // This operation is assumed to be invoked when we already hold the
+  // reaper_busy_ flag, so that only one thread sweeps at a time. It is
+  // otherwise the same as ReleaseOldTransactions(). Every allocated
+  // Transaction that is in use and older than the reap timeout is reset and
+  // pushed back on to a free stack. The Transaction::Reset compare-exchange
+  // decides the race between the reaper and a late Release, so a
+  // Transaction is only ever returned to the free stacks once.
   void UnguardedReleaseOldTransactions();
 
-  // TODO: Replace this with home-made exclusive mutex class.
-  std::mutex state_guard_;
-  Transaction** transaction_pool_;
-  uint16_t pool_size_;
+  // The pool is a directory of chunks, each holding chunk_size_
+  // Transactions. Chunks are allocated on demand and never moved or freed
+  // before destruction, so a Transaction* remains valid for the life of the
+  // TransactionManager and lookups never need a lock.
+  std::atomic<Transaction**>* transaction_pool_;
+  uint32_t chunk_size_;
+  uint32_t chunk_count_;
+  std::atomic<uint32_t> pool_size_;
   uint64_t timeout_nanos_;
   uint64_t reap_timeout_nanos_;
+  uint64_t reap_interval_nanos_;
   const acumio::test::TestHook<Transaction*> * hook_;
 
-  // We use the free_list to determine which will be the next Transaction
-  // to allocate. At initialization, this will be 0. When we allocate a
-  // Transaction, we pop the transaction_id from the free_list_, and
-  // use that. If the free_list_ becomes empty by this process, we push
-  // onto the free_list_ the size of the age_list_. When we release a
-  // Transaction, we remove that transaction from the age_list (this is
-  // a linear search - so we expect the number of pending transactions
-  // to be small so that linear searches are most effective), and add that
-  // value to the free_list.
-  //
-  // At any one point, we maintain this invariant:
-  // forall(Integer i: 0 <= i < free_list_.size() + age_list_.size()
-  //        implies i in free_list_ or i in age_list_)
-  // A bit less formally: If your free_list_ has 17 elements and your
-  // age_list has 13 elements, then you should expect to see all of the
-  // values 0,1,2, ... 29 scattered between the age_list_ and the
-  // free_list_.
-  std::vector<Transaction::Id> free_list_;
-  std::vector<Transaction::Id> age_list_;
+  // Transactions are handed out first from the free stacks. Only when all
+  // of the free stacks are empty do we take the next never-used id from
+  // next_fresh_id_. As a result, every id below next_fresh_id_ refers to
+  // a Transaction that is either free or in use, and ids are allocated
+  // densely from 0.
+  FreeStripe* free_stripes_;
+  uint32_t stripe_count_;
+  std::atomic<uint32_t> next_fresh_id_;
+
+  std::atomic_flag reaper_busy_;
+  std::atomic<uint64_t> next_reap_time_;
+
+  // See set_snapshot_reads.
+  bool snapshot_reads_;
+  // Not owned; see set_write_ahead_log.
+  WriteAheadLog* write_ahead_log_;
+  // Each thread starts probing for a free slot at its own home position, so
+  // in the common case a thread always reuses the same uncontended slot.
+  ReadSlot* read_slots_;
+  uint32_t read_slot_count_;
+
+  // Registration is rare compared to collection, so a simple mutex suffices.
+  // The mutex is held while a cleaner runs, which is what makes it safe to
+  // destroy a cleanable right after unregistering it.
+  std::mutex cleaners_guard_;
+  std::vector<std::pair<CleanerId, BudgetedCleanFunction>> cleaners_;
+  CleanerId next_cleaner_id_;
+  uint32_t clean_cursor_;
+
+  std::mutex collector_guard_;
+  std::condition_variable collector_wakeup_;
+  std::thread collector_;
+  bool collector_running_;
 };
 
 } // namespace transaction
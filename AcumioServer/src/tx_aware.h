@@ -7,9 +7,27 @@
 // Copyright   : Copyright (C) 2016 Acumio
 // Description : Provides templated transaction-aware access to a versioned
 //               data structure.
+//
+//               Reads of the current value do not write to any shared
+//               state: every change to the current or edit state happens
+//               between two increments of a sequence counter (a
+//               "seqlock"), so a reader copies the times and edit state it
+//               needs and simply retries if the counter moved underneath
+//               it. Get and GetLatest decide which value to return this
+//               way, and return a reference to it, which is only valid
+//               until the next modification; an owner that reads through
+//               them (such as TxAwareFlatMap) keeps its own writers out
+//               for as long as it uses the result. GetCopy must also copy
+//               the value within the read, which is only safe for
+//               trivially copyable element types; for others (such as the
+//               elements of TxMemRepository) it takes the SharedLock.
 //============================================================================
 
 #include <stdint.h> // needed for UINT16_C
+#include <atomic>
+#include <cstring>
+#include <functional>
+#include <type_traits>
 #include <vector>
 #include "shared_mutex.h"
 #include "time_util.h"
@@ -56,48 +74,135 @@ class TxAware {
       current_value_times_(0, aware_start_time),
       not_present_value_(not_present_value), edit_value_(not_present_value_),
       edit_state_time_(NOT_EDITING, acumio::time::END_OF_TIME),
-      edit_tx_(nullptr), versions_start_(0),
+      edit_tx_(nullptr), sequence_(0), versions_start_(0),
       versions_next_(0), historical_versions_() {}
   ~TxAware() {}
 
   bool IsLatestVersionAtTime(uint64_t access_time) const {
-    SharedLock read_lock(guard_);
-    return current_value_times_.create <= access_time &&
-           edit_state_time_.state == NOT_EDITING;
+    TimeBoundary current_times;
+    EditStateTime edit_state_time;
+    const Transaction* edit_tx;
+    ReadState(&current_times, &edit_state_time, &edit_tx);
+    return current_times.create <= access_time &&
+           edit_state_time.state == NOT_EDITING;
   }
 
+  // The result refers to internal storage, and so is only valid until the
+  // next modification of this TxAware.
   const EltType& Get(uint64_t access_time, bool* exists_at_time) const {
-    // This extra level of scoping brackets is here to establish scope for
-    // the SharedLock on the guard_.
-    {
-      SharedLock read_lock(guard_);
-      if (current_value_times_.create <= access_time) {
-        if (edit_state_time_.state != NOT_EDITING &&
-            edit_state_time_.time <= access_time) {
-          // In this case, we should potentially use the value that is the edit
-          // value, but only if the transaction is in the COMPLETING_WRITE
-          // state, and the edit_state.time matches the transaction's start
-          // time AND if the access time is later than the transaction's
-          // operation_complete_time().
-          if (edit_tx_->operation_complete_time() < access_time) {
-            Transaction::AtomicInfo tx_info = edit_tx_->GetAtomicInfo();
-            if (edit_state_time_.time == tx_info.operation_start_time &&
-                tx_info.state == Transaction::COMPLETING_WRITE) {
-              *exists_at_time = (edit_state_time_.state == SETTING);
-              return edit_value_;
-            }
-          }
-        }
-        *exists_at_time = (access_time < current_value_times_.remove);
-        return (*exists_at_time ? current_value_ : not_present_value_);
-      }
-    } // End: Extra scoping for mutex.
+    TimeBoundary current_times;
+    EditStateTime edit_state_time;
+    const Transaction* edit_tx;
+    ReadState(&current_times, &edit_state_time, &edit_tx);
+    switch (ResolveAccess(current_times, edit_state_time, edit_tx,
+                          access_time)) {
+      case USE_EDIT_VALUE:
+        *exists_at_time = (edit_state_time.state == SETTING);
+        return edit_value_;
+      case USE_CURRENT_VALUE:
+        *exists_at_time = true;
+        return current_value_;
+      case NOT_PRESENT:
+        *exists_at_time = false;
+        return not_present_value_;
+      case SEARCH_HISTORY:
+        break;
+    }
     return VersionSearch(access_time, exists_at_time);
   }
 
+  // Prepares an edit by tx at edit_time and provides the value that edit
+  // should be based upon: tx's own pending edit if it already has one, or
+  // else the current value. This is what lets one transaction make several
+  // successive edits to the same element. *exists is set to false if the
+  // base value is absent (in which case *value is the not-present value).
+  // The pointer refers to internal storage, and is only valid until the
+  // next modification of this TxAware; callers are expected to follow up
+  // with Set or Remove using the same tx and edit_time.
+  grpc::Status GetForEdit(const Transaction* tx, uint64_t edit_time,
+                          const EltType** value, bool* exists) {
+    ExclusiveLock guard(guard_);
+    SequenceWriteGuard sequence_guard(sequence_);
+    Transaction::AtomicInfo current_tx_info = tx->GetAtomicInfo();
+    if (current_tx_info.operation_start_time != edit_time) {
+      return grpc::Status(grpc::StatusCode::DEADLINE_EXCEEDED,
+        "The transaction timed out before completion.");
+    }
+    grpc::Status ret_val = VerifyNoConflictingEdits(tx, edit_time);
+    if (!ret_val.ok()) {
+      return ret_val;
+    }
+    if (edit_tx_ == tx && edit_state_time_.state != NOT_EDITING) {
+      *exists = (edit_state_time_.state == SETTING);
+      *value = &edit_value_;
+    } else if (current_value_times_.remove == acumio::time::END_OF_TIME) {
+      *exists = true;
+      *value = &current_value_;
+    } else {
+      *exists = false;
+      *value = &not_present_value_;
+    }
+    return grpc::Status::OK;
+  }
+
+  // Replaces the current value outright, as though it had been committed
+  // at create_time, without recording any history. Only valid while this
+  // TxAware is not yet visible to other threads, e.g., while loading a
+  // freshly created structure.
+  void InitializeValue(const EltType& value, uint64_t create_time) {
+    ExclusiveLock guard(guard_);
+    SequenceWriteGuard sequence_guard(sequence_);
+    current_value_ = value;
+    current_value_times_.create = create_time;
+    current_value_times_.remove = acumio::time::END_OF_TIME;
+  }
+
+  // Makes value the current value as of create_time, keeping the prior
+  // value in the history. This bypasses the edit state altogether, for
+  // owners that track their own pending edits and only hand over the
+  // result once it has committed (see TxAwareFlatMap). Versions must be
+  // published in time order, so a create_time earlier than that of the
+  // current value is moved up to it.
+  void Publish(const EltType& value, uint64_t create_time) {
+    ExclusiveLock guard(guard_);
+    SequenceWriteGuard sequence_guard(sequence_);
+    if (create_time < current_value_times_.create) {
+      create_time = current_value_times_.create;
+    }
+    PushCurrentToHistory(create_time);
+    current_value_ = value;
+    current_value_times_.create = create_time;
+    current_value_times_.remove = acumio::time::END_OF_TIME;
+  }
+
+  // The most recently committed value, ignoring any pending edit. As with
+  // Get, the result refers to internal storage, and so is only valid until
+  // the next modification of this TxAware.
+  const EltType& GetLatest(bool* exists) const {
+    TimeBoundary current_times;
+    EditStateTime edit_state_time;
+    const Transaction* edit_tx;
+    ReadState(&current_times, &edit_state_time, &edit_tx);
+    *exists = (current_times.remove == acumio::time::END_OF_TIME);
+    return *exists ? current_value_ : not_present_value_;
+  }
+
+  // Copies the value as of access_time into value, returning true if the
+  // value exists at that time (otherwise, value is set to the not-present
+  // value). Unlike the Get above, the result does not refer to internal
+  // storage, which is what allows the optimistic read for trivially
+  // copyable element types.
+  bool GetCopy(uint64_t access_time, EltType* value) const {
+    return CopyAtTime(
+        access_time, value,
+        std::integral_constant<bool,
+                               std::is_trivially_copyable<EltType>::value>());
+  }
+
   grpc::Status Set(const EltType& e, const Transaction* tx,
                    uint64_t edit_time) {
     ExclusiveLock guard(guard_);
+    SequenceWriteGuard sequence_guard(sequence_);
     Transaction::AtomicInfo current_tx_info = tx->GetAtomicInfo();
     if (current_tx_info.operation_start_time != edit_time) {
       return grpc::Status(grpc::StatusCode::DEADLINE_EXCEEDED,
@@ -118,8 +223,9 @@ class TxAware {
     return grpc::Status::OK;
   }
 
-  grpc::Status Remove(Transaction* tx, uint64_t edit_time) {
+  grpc::Status Remove(const Transaction* tx, uint64_t edit_time) {
     ExclusiveLock guard(guard_);
+    SequenceWriteGuard sequence_guard(sequence_);
     Transaction::AtomicInfo current_tx_info = tx->GetAtomicInfo();
     if (current_tx_info.operation_start_time != edit_time) {
       return grpc::Status(grpc::StatusCode::DEADLINE_EXCEEDED,
@@ -136,15 +242,18 @@ class TxAware {
     edit_value_ = not_present_value_;
     edit_state_time_.state = REMOVING;
     edit_state_time_.time = edit_time;
+    return grpc::Status::OK;
   }
 
   void CompleteWrite(const Transaction* tx) {
     ExclusiveLock guard(guard_);
+    SequenceWriteGuard sequence_guard(sequence_);
     CompleteWriteWithGuard(tx);
   }
 
   void Rollback(const Transaction* tx) {
     ExclusiveLock guard(guard_);
+    SequenceWriteGuard sequence_guard(sequence_);
     if (tx != edit_tx_) {
       return;
     }
@@ -154,13 +263,15 @@ class TxAware {
   // Removes versions if their time-span does not cover clean_time, and if
   // their time-span comes before clean_time. i.e.:
   // remove if version.times.remove <= clean_time.
+  // Removed versions are reset to the not-present value, so that they
+  // release anything they hold.
   void CleanVersions(uint64_t clean_time) {
     ExclusiveLock guard(versions_guard_);
     uint16_t version_count = historical_versions_.size();
     if (versions_start_ > versions_next_) {
       while (versions_start_ < version_count &&
              historical_versions_[versions_start_].times.remove <= clean_time) {
-        versions_start_++;
+        historical_versions_[versions_start_++].value = not_present_value_;
       }
       if (versions_start_ == version_count) {
         versions_start_ = 0;
@@ -168,11 +279,177 @@ class TxAware {
     }
     while (versions_next_ != versions_start_ &&
            historical_versions_[versions_start_].times.remove <= clean_time) {
-      versions_start_++;
+      historical_versions_[versions_start_++].value = not_present_value_;
+    }
+  }
+
+  // Applies rewrite to every value held: the current value, any pending
+  // edit, and all of the history. The rewrite must not change what a value
+  // means; this is for relocating storage the values refer to, such as
+  // keys in an allocator that has been compacted.
+  void RewriteValues(const std::function<void(EltType*)>& rewrite) {
+    ExclusiveLock guard(guard_);
+    SequenceWriteGuard sequence_guard(sequence_);
+    ExclusiveLock versions_lock(versions_guard_);
+    rewrite(&current_value_);
+    rewrite(&edit_value_);
+    for (Version& version : historical_versions_) {
+      rewrite(&version.value);
     }
   }
 
  private:
+  // Number of times an optimistic read retries before falling back to the
+  // SharedLock. Retries only happen while a writer is modifying this very
+  // element, so this is rarely reached.
+  static const uint32_t MAX_OPTIMISTIC_RETRIES = 64;
+
+  enum AccessResolution {
+    USE_EDIT_VALUE,
+    USE_CURRENT_VALUE,
+    NOT_PRESENT,
+    SEARCH_HISTORY
+  };
+
+  // Marks the sequence counter odd for the lifetime of the guard. Must only
+  // be constructed while guard_ is held exclusively, so there is never more
+  // than one of these active per TxAware.
+  class SequenceWriteGuard {
+   public:
+    SequenceWriteGuard(std::atomic<uint32_t>& sequence) :
+        sequence_(sequence),
+        start_(sequence.load(std::memory_order_relaxed)) {
+      sequence_.store(start_ + 1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+    }
+    ~SequenceWriteGuard() {
+      sequence_.store(start_ + 2, std::memory_order_release);
+    }
+   private:
+    std::atomic<uint32_t>& sequence_;
+    uint32_t start_;
+  };
+
+  // Decides where the value as of access_time is to be found, given a
+  // consistent view of the current and edit state.
+  static AccessResolution ResolveAccess(const TimeBoundary& current_times,
+                                        const EditStateTime& edit_state_time,
+                                        const Transaction* edit_tx,
+                                        uint64_t access_time) {
+    if (current_times.create > access_time) {
+      return SEARCH_HISTORY;
+    }
+    if (edit_state_time.state != NOT_EDITING &&
+        edit_state_time.time <= access_time) {
+      // In this case, we should potentially use the value that is the edit
+      // value, but only if the transaction is in the COMPLETING_WRITE
+      // state, and the edit_state.time matches the transaction's start
+      // time AND if the access time is later than the transaction's
+      // operation_complete_time().
+      if (edit_tx->operation_complete_time() < access_time) {
+        Transaction::AtomicInfo tx_info = edit_tx->GetAtomicInfo();
+        if (edit_state_time.time == tx_info.operation_start_time &&
+            tx_info.state == Transaction::COMPLETING_WRITE) {
+          return USE_EDIT_VALUE;
+        }
+      }
+    }
+    return access_time < current_times.remove ? USE_CURRENT_VALUE :
+                                                NOT_PRESENT;
+  }
+
+  // Copies the current times and edit state, retrying while a writer is
+  // changing them, and only taking guard_ if writers keep doing so.
+  void ReadState(TimeBoundary* current_times, EditStateTime* edit_state_time,
+                 const Transaction** edit_tx) const {
+    for (uint32_t attempt = 0; attempt < MAX_OPTIMISTIC_RETRIES; attempt++) {
+      uint32_t start = sequence_.load(std::memory_order_acquire);
+      if ((start & 1) != 0) {
+        continue;
+      }
+      *current_times = current_value_times_;
+      *edit_state_time = edit_state_time_;
+      *edit_tx = edit_tx_;
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (sequence_.load(std::memory_order_relaxed) == start) {
+        return;
+      }
+    }
+    SharedLock read_lock(guard_);
+    *current_times = current_value_times_;
+    *edit_state_time = edit_state_time_;
+    *edit_tx = edit_tx_;
+  }
+
+  // Optimistic read for trivially copyable element types.
+  bool CopyAtTime(uint64_t access_time, EltType* value,
+                  std::true_type trivially_copyable) const {
+    for (uint32_t attempt = 0; attempt < MAX_OPTIMISTIC_RETRIES; attempt++) {
+      uint32_t start = sequence_.load(std::memory_order_acquire);
+      if ((start & 1) != 0) {
+        continue;
+      }
+      TimeBoundary current_times(current_value_times_.create,
+                                 current_value_times_.remove);
+      EditStateTime edit_state_time(edit_state_time_.state,
+                                    edit_state_time_.time);
+      const Transaction* edit_tx = edit_tx_;
+      EltType current_value;
+      EltType edit_value;
+      std::memcpy(&current_value, &current_value_, sizeof(EltType));
+      std::memcpy(&edit_value, &edit_value_, sizeof(EltType));
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (sequence_.load(std::memory_order_relaxed) != start) {
+        continue;
+      }
+      // We now have a consistent copy of the state.
+      switch (ResolveAccess(current_times, edit_state_time, edit_tx,
+                            access_time)) {
+        case USE_EDIT_VALUE:
+          *value = edit_value;
+          return edit_state_time.state == SETTING;
+        case USE_CURRENT_VALUE:
+          *value = current_value;
+          return true;
+        case NOT_PRESENT:
+          *value = not_present_value_;
+          return false;
+        case SEARCH_HISTORY:
+          return CopyFromHistory(access_time, value);
+      }
+    }
+    return CopyAtTime(access_time, value, std::false_type());
+  }
+
+  bool CopyAtTime(uint64_t access_time, EltType* value,
+                  std::false_type trivially_copyable) const {
+    {
+      SharedLock read_lock(guard_);
+      switch (ResolveAccess(current_value_times_, edit_state_time_, edit_tx_,
+                            access_time)) {
+        case USE_EDIT_VALUE:
+          *value = edit_value_;
+          return edit_state_time_.state == SETTING;
+        case USE_CURRENT_VALUE:
+          *value = current_value_;
+          return true;
+        case NOT_PRESENT:
+          *value = not_present_value_;
+          return false;
+        case SEARCH_HISTORY:
+          break;
+      }
+    }
+    return CopyFromHistory(access_time, value);
+  }
+
+  bool CopyFromHistory(uint64_t access_time, EltType* value) const {
+    SharedLock read_lock(versions_guard_);
+    bool exists_at_time;
+    *value = VersionSearchWithGuard(access_time, &exists_at_time);
+    return exists_at_time;
+  }
+
   // Assumes you already have guard_ locked.
   void CompleteWriteWithGuard(const Transaction* tx) {
     if (edit_tx_ != tx) {
@@ -187,26 +464,35 @@ class TxAware {
       return;
     }
 
-    if (current_value_times_.remove == acumio::time::END_OF_TIME) {
-      ExclusiveLock versions_lock(versions_guard_);
-      IncreaseVersionsBufferIfNeeded();
-      Version& next_version = historical_versions_[versions_next_];
-      next_version.value = current_value_;
-      next_version.times.create = current_value_times_.create;
-      next_version.times.remove = edit_state_time_.time;
-      versions_next_++;
-      if (versions_next_ == historical_versions_.size()) {
-        versions_next_ = 0;
-      }
-    }
-    // If current_value_times_.remove != END_OF_TIME, there is no reason
-    // to push a value onto the history stack since the gap in time will
-    // indicate a lack of value at that time.
-
+    PushCurrentToHistory(edit_state_time_.time);
     current_value_ = edit_value_;
     current_value_times_.create = edit_state_time_.time;
     current_value_times_.remove = (edit_state_time_.state == REMOVING ?
         edit_state_time_.time : acumio::time::END_OF_TIME);
+    // The edit is now the current value. Leaving the edit state in place
+    // would make every later edit look like a conflict.
+    ClearEditState();
+  }
+
+  // Assumes you have locked guard_. Records the current value as having
+  // lasted until remove_time.
+  void PushCurrentToHistory(uint64_t remove_time) {
+    // If current_value_times_.remove != END_OF_TIME, there is no reason
+    // to push a value onto the history stack since the gap in time will
+    // indicate a lack of value at that time.
+    if (current_value_times_.remove != acumio::time::END_OF_TIME) {
+      return;
+    }
+    ExclusiveLock versions_lock(versions_guard_);
+    IncreaseVersionsBufferIfNeeded();
+    Version& next_version = historical_versions_[versions_next_];
+    next_version.value = current_value_;
+    next_version.times.create = current_value_times_.create;
+    next_version.times.remove = remove_time;
+    versions_next_++;
+    if (versions_next_ == historical_versions_.size()) {
+      versions_next_ = 0;
+    }
   }
 
   // Assumes you have locked guard_.
@@ -219,7 +505,7 @@ class TxAware {
 
   // Assumes you have locked versions.
   uint16_t VersionCount() const {
-    if (versions_start_ < versions_next_) {
+    if (versions_start_ <= versions_next_) {
       return versions_next_ - versions_start_;
     }
     return historical_versions_.size() + versions_next_ - versions_start_;
@@ -246,14 +532,20 @@ class TxAware {
       for (uint16_t i = 0; i < versions_next_; i++) {
         historical_versions_.push_back(historical_versions_[i]);
       }
+      // The originals are now unused; release what they hold.
+      for (uint16_t i = 0; i < old_size; i++) {
+        historical_versions_[i].value = not_present_value_;
+      }
       versions_start_ = old_size;
       versions_next_ = 0;
     }
     else {
-      // This is the simple case.
+      // This is the simple case. We add one more than the version count so
+      // that, even starting from an empty buffer, the queue never fills up
+      // (a full queue would be indistinguishable from an empty one).
       TimeBoundary empty_boundary(0, 0);
       Version empty_version(not_present_value_, empty_boundary);
-      for (uint16_t i = 0; i < version_count_plus_one; i++) {
+      for (uint16_t i = 0; i <= version_count_plus_one; i++) {
         historical_versions_.push_back(empty_version);
       }
     }
@@ -264,99 +556,50 @@ class TxAware {
     // The access time pre-dates the current value create time.
     // Time to look at prior history.
     SharedLock read_lock(versions_guard_);
-    if (versions_start_ == versions_next_) {
-      *exists_at_time = false;
-      return not_present_value_;
-    }
+    return VersionSearchWithGuard(access_time, exists_at_time);
+  }
 
-    // We want to binary search the history queue, but we want to make
-    // the logic for doing so simple. This is of course complicated by
-    // the fact that we are using a circle queue. We are going to potentially
-    // check 4 boundary values:
-    //     1) The earliest value (at versions_start_),
-    //     2) the latest value (at versions_next_ - 1 if
-    //        versions_next_ != 0, otherwise, at
-    //        historical_versions_.size() - 1),
-    // And then, if versions_next_ != 0 and versions_next_ < versions_start_,
-    //     3) The version at the last position in the vector
-    //     4) The version at the 0th position in the vector.
-    // By checking at the beginning and ending vector positions, our binary
-    // search will require fewer edge cases.
-    const Version& early_bound = historical_versions_[versions_start_];
-    if (early_bound.times.create < access_time) {
-      *exists_at_time = false;
-      return not_present_value_;
-    }
-    if (early_bound.times.remove > access_time) {
-      *exists_at_time = true;
-      return early_bound.value;
+  // Assumes you have versions_guard_ locked (shared or exclusive).
+  const EltType& VersionSearchWithGuard(
+      uint64_t access_time, bool* exists_at_time) const {
+    // The history is a circular queue ordered by time, starting at
+    // versions_start_. We binary search on the logical position (0 being
+    // the oldest version) for the first version created after access_time;
+    // the version before that is the only one that might cover access_time.
+    uint16_t count = VersionCount();
+    uint16_t low = 0;
+    uint16_t high = count;
+    while (low < high) {
+      uint16_t mid = low + (high - low) / 2;
+      if (HistoricalVersion(mid).times.create <= access_time) {
+        low = mid + 1;
+      } else {
+        high = mid;
+      }
     }
-    // We have now established that the earliest version comes before
-    // our access time. Next, we check our latest version.
-    const Version& late_bound = historical_versions_[versions_next_];
-    if (late_bound.times.remove >= access_time) {
+    if (low == 0) {
       *exists_at_time = false;
       return not_present_value_;
     }
-    if (late_bound.times.create >= access_time) {
+    const Version& candidate = HistoricalVersion(low - 1);
+    if (access_time < candidate.times.remove) {
       *exists_at_time = true;
-      return late_bound.value;
-    }
-    uint16_t early_position = versions_start_;
-    uint16_t late_position = versions_next_;
-    // We have now established early and late bounds, but we need to
-    // handle the case of spanning across the end of the versions vector.
-    if (versions_next_ < versions_start_) {
-      uint16_t end_pos = historical_versions_.size() - 1;
-      const Version& vector_end = historical_versions_[end_pos];
-      if (vector_end.times.create <= access_time) {
-        if (access_time < vector_end.times.remove) {
-          *exists_at_time = true;
-          return vector_end.value;
-        }
-        //vector_end.times.remove <= access_time
-        const Version& vector_start = historical_versions_[0];
-        if (access_time < vector_start.times.remove) {
-          // vector_end.times.remove <= access_time < vector_start.times.remove
-          // so either we match on historical_versions_[0] or there is no
-          // match.
-          if (vector_start.times.create <= access_time) {
-            *exists_at_time = true;
-            return vector_start.value;
-          }
-          *exists_at_time = false;
-          return not_present_value_;
-        }
-        // vector_start.times.remove <= access_time
-        early_position = 0;
-      }
-      else {
-        late_position = end_pos;
-      }
-    }
-
-    // Finally, we binary search the versions between early_position
-    // and late_version. We maintain at each point that:
-    // historical_versions_[early_position].remove <= access_time
-    // < historical_versions_[late_position].create
-    while (late_position > early_position + 1) {
-      uint16_t mid_position = (late_position + early_position)/2;
-      const Version& mid_reference = historical_versions_[mid_position];
-      if (mid_reference.times.create > access_time) {
-        late_position = mid_position;
-      }
-      else if (access_time < mid_reference.times.remove){
-        *exists_at_time = true;
-        return mid_reference.value;
-      }
-      else {
-        early_position = mid_position;
-      }
+      return candidate.value;
     }
     *exists_at_time = false;
     return not_present_value_;
   }
 
+  // Assumes you have versions_guard_ locked. logical_position 0 is the
+  // oldest version.
+  inline const Version& HistoricalVersion(uint16_t logical_position) const {
+    uint32_t position = versions_start_ + logical_position;
+    if (position >= historical_versions_.size()) {
+      position -= historical_versions_.size();
+    }
+    return historical_versions_[position];
+  }
+
   grpc::Status VerifyNoConflictingEdits(const Transaction* tx,
                                         uint64_t edit_time) {
     if (edit_tx_ != nullptr) {
@@ -375,6 +618,11 @@ class TxAware {
             // has been timed out and repurposed. We simply clear the current
             // edit state (i.e., rolling back the change), and continue.
             ClearEditState();
+          } else if (edit_tx_info.operation_start_time !=
+                     edit_state_time_.time) {
+            // Same Transaction, but the edit is left over from an earlier
+            // (timed out) use of it.
+            ClearEditState();
           }
           // re-entering edit of same value with the same transaction.
           // While this might not be common behavior, it is perfectly valid in
@@ -412,6 +660,9 @@ class TxAware {
   EltType edit_value_;
   EditStateTime edit_state_time_;
   const Transaction* edit_tx_;
+  // Odd while a writer holding guard_ is modifying the current or edit
+  // state; see SequenceWriteGuard.
+  std::atomic<uint32_t> sequence_;
   uint16_t versions_start_;
   uint16_t versions_next_;
   std::vector<Version> historical_versions_;
@@ -32,6 +32,7 @@ namespace acumio {
 namespace collection {
 
 using acumio::transaction::ExclusiveLock;
+using acumio::transaction::ReaderBiasedSharedMutex;
 using acumio::transaction::SharedLock;
 using acumio::transaction::SharedMutex;
 using acumio::transaction::Transaction;
@@ -42,82 +43,103 @@ using acumio::transaction::TxPointerLess;
 template <typename EltType>
 class TxAwareBurstTrie : public TxManagedMap<EltType> {
  public:
-  TxAwareBurstTrie() {}
+  typedef UnadaptedTxManagedMap::EntryVisitor EntryVisitor;
+
+  // object_allocator is owned externally, and shared with the maps of the
+  // trie. Each leaf of the trie is a TxAwareFlatMap holding at most
+  // max_leaf_size entries whose keys fit in max_leaf_key_space bytes; a
+  // leaf that would outgrow either limit is burst into a TxAwareTrieNode.
+  TxAwareBurstTrie(ObjectAllocator<EltType>* object_allocator,
+                   uint16_t max_leaf_key_space, uint8_t max_leaf_size,
+                   bool allow_duplicates = false) :
+      TxManagedMap<EltType>(object_allocator, allow_duplicates),
+      max_leaf_key_space_(max_leaf_key_space),
+      max_leaf_size_(max_leaf_size),
+      leaf_factory_(object_allocator, max_leaf_key_space, max_leaf_size,
+                    allow_duplicates),
+      node_factory_(&leaf_factory_, object_allocator, allow_duplicates),
+      guard_(),
+      root_(&leaf_factory_, &node_factory_, object_allocator,
+            allow_duplicates, &guard_) {}
+
+  TxAwareBurstTrie() : TxAwareBurstTrie<EltType>(nullptr, 0, 0, false) {}
   ~TxAwareBurstTrie() {}
 
   grpc::Status GetValuePosition(const char* key, uint32_t* value,
                                 uint64_t access_time) const {
-    // TODO: STUB!
-    return grpc::Status::OK;
+    return root_.GetValuePosition(key, value, access_time);
   }
 
   uint32_t Size(uint64_t access_time, bool* exists_at_time) const {
-    // TODO: STUB!
-    return 0;
+    return root_.Size(access_time, exists_at_time);
   }
 
   grpc::Status Add(const char* key, uint32_t value, const Transaction* tx,
                    uint64_t tx_time) {
-    // TODO: STUB!
-    return grpc::Status::OK;
+    return root_.Add(key, value, tx, tx_time);
   }
 
   grpc::Status Remove(const char* key, const Transaction* tx,
                       uint64_t tx_time) {
-    // TODO: STUB!
-    return grpc::Status::OK;
+    return root_.Remove(key, tx, tx_time);
   }
 
   grpc::Status Remove(const char* key, uint32_t value, const Transaction* tx,
                       uint64_t tx_time) {
-    // TODO: STUB!
-    return grpc::Status::OK;
+    return root_.Remove(key, value, tx, tx_time);
   }
 
   grpc::Status Replace(const char* key, uint32_t value, const Transaction* tx,
                        uint64_t tx_time) {
-    // TODO: STUB!
-    return grpc::Status::OK;
+    return root_.Replace(key, value, tx, tx_time);
+  }
+
+  grpc::Status Load(const char* key, uint32_t value, uint64_t create_time) {
+    return root_.Load(key, value, create_time);
+  }
+
+  grpc::Status VisitForEdit(const Transaction* tx, uint64_t tx_time,
+                            const EntryVisitor& visitor) const {
+    return root_.VisitForEdit(tx, tx_time, visitor);
   }
 
   std::unique_ptr<TxBasicIterator> Begin(uint64_t access_time) const {
-    // TODO: STUB!
-    return std::unique_ptr<TxBasicIterator>(nullptr);
+    return root_.Begin(access_time);
   }
 
   std::unique_ptr<TxBasicIterator> ReverseBegin(uint64_t access_time) const {
-    // TODO: STUB!
-    return std::unique_ptr<TxBasicIterator>(nullptr);
+    return root_.ReverseBegin(access_time);
   }
 
   std::unique_ptr<TxBasicIterator> End(uint64_t access_time) const {
-    // TODO: STUB!
-    return std::unique_ptr<TxBasicIterator>(nullptr);
+    return root_.End(access_time);
   }
 
   std::unique_ptr<TxBasicIterator> LowerBound(const char* key,
                                               uint64_t access_time) const {
-    // TODO: STUB!
-    return std::unique_ptr<TxBasicIterator>(nullptr);
+    return root_.LowerBound(key, access_time);
   }
 
-  virtual void CleanVersions(uint64_t clean_time) {
-    // TODO: STUB!
+  void CleanVersions(uint64_t clean_time) {
+    root_.CleanVersions(clean_time);
   }
 
-  virtual void CompleteWriteOperation(const Transaction* tx) {
-    // TODO: STUB!
+  void CompleteWriteOperation(const Transaction* tx) {
+    root_.CompleteWriteOperation(tx);
   }
 
-  virtual void Rollback(const Transaction* tx) {
-    // TODO: STUB!
+  void Rollback(const Transaction* tx) {
+    root_.Rollback(tx);
   }
 
  private:
-  uint64_t cleanup_nanos_;
-  uint64_t max_leaf_key_space_;
+  uint16_t max_leaf_key_space_;
   uint8_t max_leaf_size_;
-  mutable SharedMutex guard_;
+  // The factories must outlive root_, so they are declared before it.
+  TxAwareFlatMapFactory<EltType> leaf_factory_;
+  TxAwareTrieNodeFactory<EltType> node_factory_;
+  // One guard per trie, taken by every reader, so it is reader-biased.
+  mutable ReaderBiasedSharedMutex guard_;
   TxAwareTrieNode<EltType> root_;
 };
 
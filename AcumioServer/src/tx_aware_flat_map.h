@@ -27,6 +27,13 @@
 //               the modifying transaction or the point-in-time in which
 //               to conduct a read operation.
 //
+//               Edits are held per transaction, entry by entry, until the
+//               transaction completes its write, and only then folded
+//               into a new version. So a transaction only conflicts with
+//               another editing the same entry, or with a write to that
+//               entry committed after it started; not merely for sharing
+//               a map.
+//
 //               Whether or not duplicate keys are allowed is defined by
 //               the constructor parameter "allow_duplicates". However, this
 //               only defines duplication with respect to keys. So, if
@@ -37,12 +44,14 @@
 //============================================================================
 
 //#include <atomic>
+#include <algorithm>
 #include <functional>
 #include <grpc++/support/status.h>
 #include <iterator>
 #include <memory>
 #include <mutex>
 #include <string>
+#include <utility>
 #include <vector>
 #include "flat_map.h"
 #include "iterators.h"
@@ -71,6 +80,7 @@ class TxAwareFlatMap : public TxManagedMap<EltType> {
   // using the syntax this->allow_duplicates() instead, but this will be
   // equally if not more confusing.
   using UnadaptedTxManagedMap::allow_duplicates;
+  typedef UnadaptedTxManagedMap::EntryVisitor EntryVisitor;
 
   typedef typename FlatMap<EltType>::Iterator _InnerIter;
 
@@ -86,6 +96,10 @@ class TxAwareFlatMap : public TxManagedMap<EltType> {
   // current and historical versions.
   // TODO: Verify best numbers experimentally.
   //
+  // Keys are front-coded against the first key added (see StringAllocator),
+  // since keys below a trie node tend to share long prefixes; this lets
+  // more of them fit in max_key_space before the map must burst.
+  //
   // The allow_duplicates parameter determines if duplicate keys are accepted
   // or rejected. Having said that, having a duplicate of both key and value is
   // *never* allowed.
@@ -95,10 +109,14 @@ class TxAwareFlatMap : public TxManagedMap<EltType> {
       TxManagedMap<EltType>(object_allocator, allow_duplicates),
       max_space_(max_key_space),
       max_size_(max_size),
-      key_allocator_(new StringAllocator(max_key_space)),
-      elements_(nullptr) {
-    FlatMap<EltType> not_present_value;
-    elements_ = new VersionArray(not_present_value, create_time);
+      key_allocator_(new StringAllocator(max_key_space, true)),
+      elements_(nullptr), pending_() {
+    // The "not present" version is a real (empty) FlatMap rather than a
+    // default-constructed one, so that the first edit can build upon it
+    // like any other version.
+    FlatMap<EltType> empty_map(key_allocator_.get(), object_allocator,
+                               max_size, allow_duplicates);
+    elements_ = new VersionArray(empty_map, create_time);
   }
 
   // A FlatMap in this form is not actually usable. However, we have this
@@ -106,86 +124,22 @@ class TxAwareFlatMap : public TxManagedMap<EltType> {
   TxAwareFlatMap() : TxAwareFlatMap(nullptr, 0, 0, 0, false) {}
 
   ~TxAwareFlatMap() {
+    // The versions and pending edits refer to keys in key_allocator_, so
+    // they must go first.
+    for (PendingEdit& pending : pending_) {
+      ReleasePending(&pending);
+    }
     delete elements_;
   }
 
   grpc::Status Add(const char* key, uint32_t value_position,
                    const Transaction* tx, uint64_t tx_time) {
-    acumio::transaction::ExclusiveLock guard(guard_);
-    grpc::Status check = VerifyTxEditTime(tx, tx_time);
-    if (!check.ok()) {
-      return check;
-    }
-    bool exists_at_time = false;
-    const FlatMap<EltType>& current_array =
-        elements_->Get(tx_time, &exists_at_time);
-    if (exists_at_time && current_array.size() == max_size_) {
-      // TODO: Migrate this to using an enum code that allows us to detect
-      //       that this is a likely condition where we should burst.
-      return grpc::Status(grpc::StatusCode::OUT_OF_RANGE,
-                          "FlatMap has reached max size.");
-    }
-
-    bool exists_key = false;
-    uint8_t new_elt_pos = (
-        allow_duplicates() ?
-        current_array.GetInternalPosition(key, value_position, &exists_key) :
-        current_array.GetInternalPosition(key, &exists_key));
-    if (exists_key) {
-      return grpc::Status(grpc::StatusCode::ALREADY_EXISTS,
-                          "There is already an entry with the given key.");
-    }
-
-    uint16_t key_pos = key_allocator_->Add(key);
-    if (key_pos == max_size_) {
-      // TODO: Migrate this to using an enum code that allows us to detect
-      //       that this is a likely condition where we should burst.
-      return grpc::Status(grpc::StatusCode::OUT_OF_RANGE,
-                          "FlatMap has reached max key space.");
-    }
-
-    FlatMap<EltType> new_version(current_array, key_pos, value_position,
-                                 new_elt_pos);
-    // The key_allocator_->Add(key) and the use of the above constructor
-    // would double-count the addition of the key. For this reason, we
-    // drop one of the references.
-    key_allocator_->DropReference(key_pos);
-    grpc::Status result = elements_->Set(new_version, tx, tx_time);
-    if (!result.ok()) {
-      key_allocator_->DropReference(key_pos);
-    }
-    return result;
+    return EditEntry(ADD_ENTRY, key, value_position, tx, tx_time);
   }
- 
+
   grpc::Status Replace(const char* key, uint32_t value, const Transaction* tx,
                        uint64_t tx_time) {
-    acumio::transaction::ExclusiveLock guard(guard_);
-    grpc::Status check = VerifyTxEditTime(tx, tx_time);
-    if (!check.ok()) {
-      return check;
-    }
-    bool exists_at_time = false;
-    const FlatMap<EltType>& current_array =
-        elements_->Get(tx_time, &exists_at_time);
-    if (!exists_at_time) {
-      return grpc::Status(grpc::StatusCode::NOT_FOUND,
-                          "Could not find key to replace.");
-    }
-
-    bool exists_key = false;
-    uint8_t new_elt_pos = (allow_duplicates() ?
-                           current_array.GetInternalPosition(key, value,
-                                                             &exists_key) :
-                           current_array.GetInternalPosition(key, &exists_key));
-    if (!exists_key) {
-      return grpc::Status(grpc::StatusCode::NOT_FOUND,
-                          "Could not find key to replace.");
-    }
-
-    FlatMap<EltType> update_array(current_array);
-    update_array.PutUsingArrayPosition(new_elt_pos, value);
-
-    return elements_->Set(update_array, tx, tx_time);
+    return EditEntry(REPLACE_ENTRY, key, value, tx, tx_time);
   }
 
   grpc::Status Remove(const char* key, const Transaction* tx,
@@ -195,28 +149,7 @@ class TxAwareFlatMap : public TxManagedMap<EltType> {
           grpc::StatusCode::FAILED_PRECONDITION,
           "This method is not valid if duplicate keys are allowed.");
     }
-    acumio::transaction::ExclusiveLock guard(guard_);
-    grpc::Status check = VerifyTxEditTime(tx, tx_time);
-    if (!check.ok()) {
-      return check;
-    }
-    bool exists_at_time = false;
-    const FlatMap<EltType>& current_array =
-        elements_->Get(tx_time, &exists_at_time);
-    if (!exists_at_time) {
-      return grpc::Status(grpc::StatusCode::NOT_FOUND,
-                          "Could not find key to remove.");
-    }
-
-    bool exists_key = false;
-    uint8_t del_elt_pos = current_array.GetInternalPosition(key, &exists_key);
-    if (!exists_key) {
-      return grpc::Status(grpc::StatusCode::NOT_FOUND,
-                          "Could not find key to remove.");
-    }
-
-    FlatMap<EltType> new_version(current_array, del_elt_pos);
-    return elements_->Set(new_version, tx, tx_time);
+    return EditEntry(REMOVE_ENTRY, key, UINT32_C(0), tx, tx_time);
   }
 
   grpc::Status Remove(const char* key, uint32_t value, const Transaction* tx,
@@ -224,36 +157,65 @@ class TxAwareFlatMap : public TxManagedMap<EltType> {
     if (!(allow_duplicates())) {
       return Remove(key, tx, tx_time);
     }
+    return EditEntry(REMOVE_ENTRY, key, value, tx, tx_time);
+  }
+
+  grpc::Status Load(const char* key, uint32_t value_position,
+                    uint64_t create_time) {
     acumio::transaction::ExclusiveLock guard(guard_);
-    grpc::Status check = VerifyTxEditTime(tx, tx_time);
-    if (!check.ok()) {
-      return check;
-    }
     bool exists_at_time = false;
-    const FlatMap<EltType>& current_array =
-        elements_->Get(tx_time, &exists_at_time);
-    if (!exists_at_time) {
-      return grpc::Status(grpc::StatusCode::NOT_FOUND,
-                          "Could not find key to remove.");
+    FlatMap<EltType> loaded(elements_->Get(create_time, &exists_at_time));
+    if (loaded.size() == max_size_) {
+      return grpc::Status(grpc::StatusCode::OUT_OF_RANGE,
+                          "FlatMap has reached max size.");
     }
-
     bool exists_key = false;
-    uint8_t del_elt_pos = current_array.GetInternalPosition(key, value,
-                                                            &exists_key);
-    if (!exists_key) {
-      return grpc::Status(grpc::StatusCode::NOT_FOUND,
-                          "Could not find key to remove.");
+    FindEntry(loaded, key, value_position, &exists_key);
+    if (exists_key) {
+      return grpc::Status(grpc::StatusCode::ALREADY_EXISTS,
+                          "There is already an entry with the given key.");
     }
+    if (loaded.Add(key, value_position) == loaded.max_size()) {
+      return grpc::Status(grpc::StatusCode::OUT_OF_RANGE,
+                          "FlatMap has reached max key space.");
+    }
+    elements_->InitializeValue(loaded, create_time);
+    return grpc::Status::OK;
+  }
 
-    FlatMap<EltType> new_version(current_array, del_elt_pos);
-    return elements_->Set(new_version, tx, tx_time);
+  // With a transaction, visits the entries as that transaction would see
+  // them: everything committed so far, plus its own pending edits.
+  grpc::Status VisitForEdit(const Transaction* tx, uint64_t tx_time,
+                            const EntryVisitor& visitor) const {
+    SharedLock guard(guard_);
+    std::vector<Entry> entries;
+    if (tx == nullptr) {
+      CollectEntriesAtTime(tx_time, &entries);
+    } else {
+      if (tx->GetAtomicInfo().operation_start_time != tx_time) {
+        return grpc::Status(grpc::StatusCode::DEADLINE_EXCEEDED,
+          "The transaction timed out before completion.");
+      }
+      bool exists = false;
+      CollectEntries(elements_->GetLatest(&exists), &entries);
+      for (const PendingEdit& pending : pending_) {
+        if (pending.tx == tx && pending.tx_time == tx_time) {
+          ApplyToEntries(pending, &entries);
+        }
+      }
+    }
+    for (const Entry& entry : entries) {
+      visitor(entry.first.c_str(), entry.second);
+    }
+    return grpc::Status::OK;
   }
 
   grpc::Status GetValuePosition(const char* key, uint32_t* value,
                                 uint64_t access_time) const {
     acumio::transaction::SharedLock guard(guard_);
     bool found = false;
-    const FlatMap<EltType>& array = elements_->Get(access_time, &found);
+    std::shared_ptr<const View> view;
+    const FlatMap<EltType>& array = VersionAtTime(access_time, &found, &view);
     if (!found) {
       return grpc::Status(grpc::StatusCode::NOT_FOUND,
                           "Could not find key.");
@@ -263,75 +225,97 @@ class TxAwareFlatMap : public TxManagedMap<EltType> {
       return grpc::Status(grpc::StatusCode::NOT_FOUND,
                           "Could not find key.");
     }
-    
+
     return grpc::Status::OK;
   }
 
+  // Besides discarding old versions, this compacts the key space once
+  // enough of it has been scattered by the keys those versions released.
   virtual void CleanVersions(uint64_t clean_time) {
     acumio::transaction::ExclusiveLock guard(guard_);
+    ResolvePending();
     elements_->CleanVersions(clean_time);
+    if (key_allocator_->fragmentation() > MAX_KEY_FRAGMENTATION) {
+      CompactKeys();
+    }
   }
 
+  // Publishes the edits of tx, along with those of any other transaction
+  // that has started completing its write.
   void CompleteWriteOperation(const Transaction* tx) {
     acumio::transaction::ExclusiveLock guard(guard_);
-    elements_->CompleteWrite(tx);
+    ResolvePending();
   }
 
   void Rollback(const Transaction* tx) {
     acumio::transaction::ExclusiveLock guard(guard_);
-    elements_->Rollback(tx);
+    for (auto it = pending_.begin(); it != pending_.end(); ++it) {
+      if (it->tx == tx) {
+        ReleasePending(&(*it));
+        pending_.erase(it);
+        return;
+      }
+    }
   }
 
+  // The iterators below are positioned under a SharedLock which is then
+  // handed to the returned iterator, so the map cannot change underneath
+  // an iterator for as long as it lives. Do not hold one across a write
+  // to this map from the same thread.
   std::unique_ptr<TxBasicIterator> LowerBound(const char* key,
                                               uint64_t access_time) const {
-    acumio::transaction::SharedLock guard(guard_);
+    SharedLock* lock = new SharedLock(guard_);
     bool exists = false;
-    const FlatMap<EltType>& reference = elements_->Get(access_time, &exists);
-    uint8_t key_pos = exists ? reference.GetInternalPosition(key, &exists)
-                             : reference.size();
-    std::shared_ptr<TxBasicIterator> delegate_ret_val(
-        new _InnerIter(&reference, key_pos));
-    std::unique_ptr<TxBasicIterator> ret_val(
-        new TxManagedIterator(delegate_ret_val, &guard_));
-    return ret_val;
+    std::shared_ptr<const View> view;
+    const FlatMap<EltType>& reference = VersionAtTime(access_time, &exists,
+                                                      &view);
+    uint8_t key_pos = reference.GetInternalPosition(key, &exists);
+    return MakeIterator(reference, view, key_pos, lock);
   }
 
   std::unique_ptr<TxBasicIterator> Begin(uint64_t access_time) const {
-    acumio::transaction::SharedLock guard(guard_);
+    SharedLock* lock = new SharedLock(guard_);
     bool exists = false;
-    const FlatMap<EltType>& reference = elements_->Get(access_time, &exists);
-    std::shared_ptr<TxBasicIterator> delegate_ret_val(
-        new _InnerIter(&reference, 0));
-    std::unique_ptr<TxBasicIterator> ret_val(
-        new TxManagedIterator(delegate_ret_val, &guard_));
-    return ret_val;
+    std::shared_ptr<const View> view;
+    const FlatMap<EltType>& reference = VersionAtTime(access_time, &exists,
+                                                      &view);
+    return MakeIterator(reference, view, 0, lock);
   }
 
   std::unique_ptr<TxBasicIterator> ReverseBegin(uint64_t access_time) const {
-    acumio::transaction::SharedLock guard(guard_);
+    SharedLock* lock = new SharedLock(guard_);
     bool exists = false;
-    const FlatMap<EltType>& reference = elements_->Get(access_time, &exists);
-    std::shared_ptr<TxBasicIterator> delegate_ret_val(
-        new _InnerIter(&reference,
-                       reference.size() == 0 ? 0 : reference.size() - 1));
-    std::unique_ptr<TxBasicIterator> ret_val(
-        new TxManagedIterator(delegate_ret_val, &guard_));
-    return ret_val;
+    std::shared_ptr<const View> view;
+    const FlatMap<EltType>& reference = VersionAtTime(access_time, &exists,
+                                                      &view);
+    return MakeIterator(reference, view,
+                        reference.size() == 0 ? 0 : reference.size() - 1,
+                        lock);
   }
 
+  // The end iterator holds no lock, and refers to no version: it compares
+  // equal to any iterator from this map that has run off either end. This
+  // means it never touches guard_, so it is safe to create while holding
+  // an iterator from the same map.
   std::unique_ptr<TxBasicIterator> End(uint64_t access_time) const {
-    acumio::transaction::SharedLock guard(guard_);
-    bool exists = false;
-    const FlatMap<EltType>& reference = elements_->Get(access_time, &exists);
-    std::shared_ptr<TxBasicIterator> delegate_ret_val(
-        new _InnerIter(&reference, reference.size()));
-    std::unique_ptr<TxBasicIterator> ret_val(
-        new TxManagedIterator(delegate_ret_val, &guard_));
-    return ret_val;
+    return std::unique_ptr<TxBasicIterator>(
+        new Iterator(this, nullptr, std::shared_ptr<const View>(), 0,
+                     nullptr));
   }
 
   inline uint16_t max_space() const { return max_space_; }
 
+  // Key space statistics; see StringAllocator.
+  inline uint16_t key_space_used() const {
+    acumio::transaction::SharedLock guard(guard_);
+    return key_allocator_->space_used();
+  }
+
+  inline double key_fragmentation() const {
+    acumio::transaction::SharedLock guard(guard_);
+    return key_allocator_->fragmentation();
+  }
+
   // Returns the size of map at the time indicated, and assuming the map
   // has a recorded version at that time, exists_at_time is set to true.
   // If there are no versions available at the indicated time, this returns
@@ -340,25 +324,514 @@ class TxAwareFlatMap : public TxManagedMap<EltType> {
   // in reality, the value will be limited to a uint8_t.
   uint32_t Size(uint64_t access_time, bool* exists_at_time) const {
     acumio::transaction::SharedLock guard(guard_);
-    const FlatMap<EltType>& reference = elements_->Get(access_time,
-                                                       exists_at_time);
+    std::shared_ptr<const View> view;
+    const FlatMap<EltType>& reference = VersionAtTime(access_time,
+                                                      exists_at_time, &view);
     return reference.size();
   }
 
  private:
-  grpc::Status VerifyTxEditTime(const Transaction* tx, uint64_t tx_time) {
-    if (tx_time != tx->operation_start_time()) {
+  typedef TxAware<FlatMap<EltType>> VersionArray;
+  typedef std::pair<std::string, uint32_t> Entry;
+
+  enum EntryOp {
+    ADD_ENTRY,
+    REPLACE_ENTRY,
+    REMOVE_ENTRY
+  };
+
+  // One transaction's edit to a single entry. An entry is identified by its
+  // key, or by its key and value if duplicate keys are allowed. While
+  // present, the edit holds a reference to key_pos in key_allocator_ and to
+  // value in the object allocator, so that publishing it cannot fail.
+  struct EntryEdit {
+    std::string key;
+    uint32_t value;
+    bool present;
+    uint16_t key_pos;
+  };
+
+  // The edits a transaction has made, but not yet published. Keeping these
+  // per transaction, rather than as a single pending version of the whole
+  // map, is what lets transactions editing different entries proceed
+  // side by side; they only conflict on the same entry.
+  struct PendingEdit {
+    const Transaction* tx;
+    uint64_t tx_time;
+    std::vector<EntryEdit> entries;
+  };
+
+  // A version that has never been published: the one a reader sees while
+  // some transaction is completing its write. It has its own key space,
+  // since key_allocator_ may only be modified under the exclusive guard.
+  struct View {
+    View(uint16_t key_space, ObjectAllocator<EltType>* object_allocator,
+         bool allow_duplicates) :
+        keys(key_space), map(&keys, object_allocator, UINT8_MAX,
+                             allow_duplicates) {}
+    StringAllocator keys;
+    FlatMap<EltType> map;
+  };
+
+  // Iterates over a FlatMap, keeping the View it belongs to (if any) alive.
+  class Iterator : public TxBasicIterator {
+   public:
+    Iterator(const TxAwareFlatMap* container, const FlatMap<EltType>* map,
+             std::shared_ptr<const View> view, uint8_t position,
+             SharedLock* held_lock) :
+        TxBasicIterator(held_lock), container_(container), map_(map),
+        view_(view), position_(position) {}
+
+    Iterator(const Iterator& other) :
+        TxBasicIterator(static_cast<const TxBasicIterator&>(other)),
+        container_(other.container_), map_(other.map_), view_(other.view_),
+        position_(other.position_) {}
+
+    ~Iterator() {}
+
+    TxBasicIterator* Clone() const { return new Iterator(*this); }
+
+    TxBasicIterator& operator++() {
+      if (!AtEnd()) {
+        position_++;
+      }
+      return *this;
+    }
+
+    TxBasicIterator& operator--() {
+      if (map_ != nullptr) {
+        position_ = (position_ == 0 ? map_->size() : position_ - 1);
+      }
+      return *this;
+    }
+
+    TxBasicIterator& operator++(int) {
+      saved_tmp_.reset(new Iterator(*this));
+      ++(*this);
+      return *saved_tmp_;
+    }
+
+    TxBasicIterator& operator--(int) {
+      saved_tmp_.reset(new Iterator(*this));
+      --(*this);
+      return *saved_tmp_;
+    }
+
+    bool operator==(const TxBasicIterator& other) const {
+      const Iterator* other_iter = dynamic_cast<const Iterator*>(&other);
+      if (other_iter == nullptr || container_ != other_iter->container_) {
+        return false;
+      }
+      if (AtEnd() || other_iter->AtEnd()) {
+        return AtEnd() && other_iter->AtEnd();
+      }
+      return map_ == other_iter->map_ && position_ == other_iter->position_;
+    }
+
+    const MapIterElement& operator*() const { return *(operator->()); }
+
+    const MapIterElement* operator->() const {
+      const char* key = nullptr;
+      uint32_t value = 0;
+      if (!AtEnd()) {
+        saved_key_ = map_->GetKey(position_);
+        key = saved_key_.c_str();
+        value = map_->GetValuePositionByInternalPosition(position_);
+      }
+      saved_val_.reset(new MapIterElement(key, value));
+      return saved_val_.get();
+    }
+
+   private:
+    inline bool AtEnd() const {
+      return map_ == nullptr || position_ >= map_->size();
+    }
+
+    const TxAwareFlatMap* container_;
+    const FlatMap<EltType>* map_;
+    std::shared_ptr<const View> view_;
+    uint8_t position_;
+    std::unique_ptr<Iterator> saved_tmp_;
+    // Backs the key of saved_val_.
+    mutable std::string saved_key_;
+    mutable std::unique_ptr<MapIterElement> saved_val_;
+  };
+
+  // CleanVersions compacts the key space when more than this fraction of
+  // the free space lies outside the largest hole.
+  static constexpr double MAX_KEY_FRAGMENTATION = 0.25;
+
+  // The common structure of Add, Replace and Remove: records op on the
+  // entry for key (and value, if duplicates are allowed) as a pending edit
+  // by tx.
+  grpc::Status EditEntry(EntryOp op, const char* key, uint32_t value,
+                         const Transaction* tx, uint64_t tx_time) {
+    acumio::transaction::ExclusiveLock guard(guard_);
+    Transaction::AtomicInfo current_tx_info = tx->GetAtomicInfo();
+    if (current_tx_info.operation_start_time != tx_time) {
       return grpc::Status(grpc::StatusCode::DEADLINE_EXCEEDED,
-                          "Transaction timed out.");
+        "The transaction timed out before completion.");
     }
-    if (!elements_->IsLatestVersionAtTime(tx_time)) {
-      return grpc::Status(grpc::StatusCode::ABORTED,
-                          "Concurrent edit conflict.");
+    // Note that this may publish or discard the edits of other
+    // transactions, depending on how far along they are.
+    ResolvePending();
+
+    PendingEdit* own = nullptr;
+    for (PendingEdit& pending : pending_) {
+      if (pending.tx == tx) {
+        own = &pending;
+      } else if (FindEdit(&pending, key, value) != nullptr) {
+        return grpc::Status(grpc::StatusCode::ABORTED,
+                            "concurrency exception.");
+      }
+    }
+
+    bool exists = false;
+    const FlatMap<EltType>& latest = elements_->GetLatest(&exists);
+    uint8_t latest_pos = FindEntry(latest, key, value, &exists);
+    if (ChangedSince(latest, key, value, tx_time)) {
+      return grpc::Status(grpc::StatusCode::ABORTED, "concurrency exception.");
+    }
+    EntryEdit* own_edit = (own == nullptr ? nullptr :
+                           FindEdit(own, key, value));
+    bool exists_for_tx = (own_edit == nullptr ? exists : own_edit->present);
+
+    uint16_t key_pos = key_allocator_->max_size();
+    switch (op) {
+      case ADD_ENTRY:
+        if (exists_for_tx) {
+          return grpc::Status(grpc::StatusCode::ALREADY_EXISTS,
+                              "There is already an entry with the given key.");
+        }
+        if (SizeIfAllPublished(latest, tx) >= max_size_) {
+          // TODO: Migrate this to using an enum code that allows us to
+          //       detect that this is a likely condition where we should
+          //       burst.
+          return grpc::Status(grpc::StatusCode::OUT_OF_RANGE,
+                              "FlatMap has reached max size.");
+        }
+        key_pos = ReserveKey(key);
+        if (key_pos == key_allocator_->max_size()) {
+          // TODO: Migrate this to using an enum code that allows us to
+          //       detect that this is a likely condition where we should
+          //       burst.
+          return grpc::Status(grpc::StatusCode::OUT_OF_RANGE,
+                              "FlatMap has reached max key space.");
+        }
+        break;
+      case REPLACE_ENTRY:
+        if (!exists_for_tx) {
+          return grpc::Status(grpc::StatusCode::NOT_FOUND,
+                              "Could not find key to replace.");
+        }
+        key_pos = (own_edit != nullptr ? own_edit->key_pos :
+                                         latest.GetIntKey(latest_pos));
+        key_allocator_->AddReference(key_pos);
+        break;
+      case REMOVE_ENTRY:
+        if (!exists_for_tx) {
+          return grpc::Status(grpc::StatusCode::NOT_FOUND,
+                              "Could not find key to remove.");
+        }
+        break;
+    }
+
+    if (own == nullptr) {
+      pending_.push_back(PendingEdit());
+      own = &(pending_.back());
+      own->tx = tx;
+      own->tx_time = tx_time;
+    }
+    if (own_edit == nullptr) {
+      own->entries.push_back(EntryEdit());
+      own_edit = &(own->entries.back());
+      own_edit->key = key;
+      own_edit->present = false;
+    } else {
+      ReleaseEdit(own_edit);
+    }
+    own_edit->value = value;
+    own_edit->present = (op != REMOVE_ENTRY);
+    own_edit->key_pos = key_pos;
+    if (own_edit->present) {
+      this->object_allocator_->AddReference(value);
     }
     return grpc::Status::OK;
   }
 
-  typedef TxAware<FlatMap<EltType>> VersionArray;
+  // Assumes you have guard_ locked exclusively. True if the entry for key
+  // (and value) was changed by a write published after tx_time.
+  bool ChangedSince(const FlatMap<EltType>& latest, const char* key,
+                    uint32_t value, uint64_t tx_time) const {
+    if (elements_->IsLatestVersionAtTime(tx_time)) {
+      return false;
+    }
+    bool exists_then = false;
+    const FlatMap<EltType>& then = elements_->Get(tx_time, &exists_then);
+    uint8_t then_pos = FindEntry(then, key, value, &exists_then);
+    bool exists_now = false;
+    uint8_t now_pos = FindEntry(latest, key, value, &exists_now);
+    if (exists_then != exists_now) {
+      return true;
+    }
+    return exists_now &&
+           then.GetValuePositionByInternalPosition(then_pos) !=
+           latest.GetValuePositionByInternalPosition(now_pos);
+  }
+
+  // Assumes you have guard_ locked exclusively. The size the map would have
+  // if every pending addition were published, less the entries that tx
+  // itself removes (those cannot be published without its additions).
+  uint32_t SizeIfAllPublished(const FlatMap<EltType>& latest,
+                              const Transaction* tx) const {
+    uint32_t ret_val = latest.size();
+    for (const PendingEdit& pending : pending_) {
+      for (const EntryEdit& edit : pending.entries) {
+        bool exists = false;
+        FindEntry(latest, edit.key.c_str(), edit.value, &exists);
+        if (edit.present && !exists) {
+          ret_val++;
+        } else if (!edit.present && exists && pending.tx == tx) {
+          ret_val--;
+        }
+      }
+    }
+    return ret_val;
+  }
+
+  // Assumes you have guard_ locked exclusively. Returns a position for key
+  // in key_allocator_ holding a new reference, or key_allocator_->max_size()
+  // if there is no room for it.
+  uint16_t ReserveKey(const char* key) {
+    bool exists = false;
+    const FlatMap<EltType>& latest = elements_->GetLatest(&exists);
+    uint16_t key_pos = latest.GetKeyPosition(key, &exists);
+    if (exists) {
+      key_allocator_->AddReference(key_pos);
+      return key_pos;
+    }
+    for (const PendingEdit& pending : pending_) {
+      for (const EntryEdit& edit : pending.entries) {
+        if (edit.present && edit.key == key) {
+          key_allocator_->AddReference(edit.key_pos);
+          return edit.key_pos;
+        }
+      }
+    }
+    key_pos = key_allocator_->Add(key);
+    if (key_pos == key_allocator_->max_size() &&
+        key_allocator_->hole_count() > 1) {
+      // The space may be there, just not in one piece. Compaction updates
+      // every version and pending edit in place.
+      CompactKeys();
+      key_pos = key_allocator_->Add(key);
+    }
+    return key_pos;
+  }
+
+  // Assumes you have guard_ locked exclusively. Publishes the edits of
+  // every transaction that has started completing its write, in the order
+  // they completed, and discards those of transactions that have been
+  // rolled back or have timed out. Edits of transactions still writing
+  // are kept.
+  void ResolvePending() {
+    std::vector<std::pair<uint64_t, size_t>> completing;
+    std::vector<bool> keep(pending_.size(), false);
+    for (size_t i = 0; i < pending_.size(); i++) {
+      const PendingEdit& pending = pending_[i];
+      Transaction::AtomicInfo info;
+      uint64_t complete_time;
+      pending.tx->GetAtomicInfo(&info, &complete_time);
+      if (info.operation_start_time != pending.tx_time) {
+        continue;
+      }
+      if (info.state == Transaction::WRITE) {
+        keep[i] = true;
+      } else if (info.state == Transaction::COMPLETING_WRITE) {
+        // The complete time is set just after the state changes, so it
+        // may not be there yet; it cannot be earlier than the start.
+        completing.push_back(
+            std::make_pair(std::max(complete_time, pending.tx_time), i));
+      }
+    }
+    bool all_kept = std::find(keep.begin(), keep.end(), false) == keep.end();
+    if (completing.empty() && all_kept) {
+      return;
+    }
+
+    std::sort(completing.begin(), completing.end());
+    for (const std::pair<uint64_t, size_t>& next : completing) {
+      bool exists = false;
+      FlatMap<EltType> published(elements_->GetLatest(&exists));
+      for (const EntryEdit& edit : pending_[next.second].entries) {
+        bool exists_key = false;
+        uint8_t pos = FindEntry(published, edit.key.c_str(), edit.value,
+                                &exists_key);
+        if (exists_key) {
+          published = FlatMap<EltType>(published, pos);
+        }
+        if (edit.present) {
+          published.Add(edit.key_pos, edit.value);
+        }
+      }
+      elements_->Publish(published, next.first);
+    }
+
+    std::vector<PendingEdit> kept;
+    for (size_t i = 0; i < pending_.size(); i++) {
+      if (keep[i]) {
+        kept.push_back(std::move(pending_[i]));
+      } else {
+        ReleasePending(&(pending_[i]));
+      }
+    }
+    pending_.swap(kept);
+  }
+
+  // Assumes you have guard_ locked. The edit in pending for the entry
+  // with key (and value), or nullptr if there is none.
+  EntryEdit* FindEdit(const PendingEdit* pending, const char* key,
+                      uint32_t value) const {
+    PendingEdit* modifiable = const_cast<PendingEdit*>(pending);
+    for (EntryEdit& edit : modifiable->entries) {
+      if (edit.key == key && (!allow_duplicates() || edit.value == value)) {
+        return &edit;
+      }
+    }
+    return nullptr;
+  }
+
+  inline uint8_t FindEntry(const FlatMap<EltType>& map, const char* key,
+                           uint32_t value, bool* exists) const {
+    return (allow_duplicates() ?
+            map.GetInternalPosition(key, value, exists) :
+            map.GetInternalPosition(key, exists));
+  }
+
+  // Assumes you have guard_ locked exclusively.
+  void ReleaseEdit(EntryEdit* edit) {
+    if (edit->present) {
+      key_allocator_->DropReference(edit->key_pos);
+      this->object_allocator_->DropReference(edit->value);
+      edit->present = false;
+    }
+  }
+
+  void ReleasePending(PendingEdit* pending) {
+    for (EntryEdit& edit : pending->entries) {
+      ReleaseEdit(&edit);
+    }
+  }
+
+  // Assumes you have guard_ locked (shared or exclusive). Provides the
+  // version as of access_time. This is normally a committed version, but
+  // if some transaction completing its write should be visible at
+  // access_time, this builds the version that includes its edits into
+  // *view, and refers to that instead.
+  const FlatMap<EltType>& VersionAtTime(
+      uint64_t access_time, bool* exists_at_time,
+      std::shared_ptr<const View>* view) const {
+    std::vector<std::pair<uint64_t, const PendingEdit*>> visible;
+    VisibleEdits(access_time, &visible);
+    const FlatMap<EltType>& committed = elements_->Get(access_time,
+                                                       exists_at_time);
+    if (visible.empty()) {
+      return committed;
+    }
+    std::vector<Entry> entries;
+    CollectEntries(committed, &entries);
+    for (const std::pair<uint64_t, const PendingEdit*>& next : visible) {
+      ApplyToEntries(*(next.second), &entries);
+    }
+    size_t key_space = 1;
+    for (const Entry& entry : entries) {
+      key_space += entry.first.size() + 1;
+    }
+    View* built = new View(std::min<size_t>(key_space, UINT16_MAX),
+                           this->object_allocator_, allow_duplicates());
+    view->reset(built);
+    for (const Entry& entry : entries) {
+      built->map.Add(entry.first.c_str(), entry.second);
+    }
+    *exists_at_time = true;
+    return built->map;
+  }
+
+  // Assumes you have guard_ locked. Collects the pending edits visible at
+  // access_time, in the order they are to be applied.
+  void VisibleEdits(
+      uint64_t access_time,
+      std::vector<std::pair<uint64_t, const PendingEdit*>>* visible) const {
+    for (const PendingEdit& pending : pending_) {
+      Transaction::AtomicInfo info;
+      uint64_t complete_time;
+      pending.tx->GetAtomicInfo(&info, &complete_time);
+      if (info.state == Transaction::COMPLETING_WRITE &&
+          info.operation_start_time == pending.tx_time &&
+          complete_time != 0 && complete_time <= access_time) {
+        visible->push_back(std::make_pair(complete_time, &pending));
+      }
+    }
+    std::sort(visible->begin(), visible->end());
+  }
+
+  void CollectEntriesAtTime(uint64_t access_time,
+                            std::vector<Entry>* entries) const {
+    bool exists = false;
+    std::shared_ptr<const View> view;
+    CollectEntries(VersionAtTime(access_time, &exists, &view), entries);
+  }
+
+  static void CollectEntries(const FlatMap<EltType>& map,
+                             std::vector<Entry>* entries) {
+    for (uint8_t i = 0; i < map.size(); i++) {
+      entries->push_back(
+          Entry(map.GetKey(i), map.GetValuePositionByInternalPosition(i)));
+    }
+  }
+
+  // Applies the edits in pending to entries, which are kept in key order.
+  void ApplyToEntries(const PendingEdit& pending,
+                      std::vector<Entry>* entries) const {
+    for (const EntryEdit& edit : pending.entries) {
+      for (auto it = entries->begin(); it != entries->end(); ++it) {
+        if (it->first == edit.key &&
+            (!allow_duplicates() || it->second == edit.value)) {
+          entries->erase(it);
+          break;
+        }
+      }
+      if (edit.present) {
+        Entry added(edit.key, edit.value);
+        entries->insert(std::lower_bound(entries->begin(), entries->end(),
+                                         added),
+                        added);
+      }
+    }
+  }
+
+  // Assumes you have guard_ locked exclusively.
+  void CompactKeys() {
+    std::vector<uint16_t> relocation;
+    key_allocator_->Compact(&relocation);
+    elements_->RewriteValues([&relocation](FlatMap<EltType>* version) {
+      version->RelocateKeys(relocation);
+    });
+    for (PendingEdit& pending : pending_) {
+      for (EntryEdit& edit : pending.entries) {
+        if (edit.present) {
+          edit.key_pos = relocation[edit.key_pos];
+        }
+      }
+    }
+  }
+
+  std::unique_ptr<TxBasicIterator> MakeIterator(
+      const FlatMap<EltType>& reference, std::shared_ptr<const View> view,
+      uint8_t position, SharedLock* held_lock) const {
+    return std::unique_ptr<TxBasicIterator>(
+        new Iterator(this, &reference, view, position, held_lock));
+  }
 
   uint16_t max_space_;
   uint8_t max_size_;
@@ -366,11 +839,47 @@ class TxAwareFlatMap : public TxManagedMap<EltType> {
   // Note that we don't version our keys directly. If a node changes a key,
   // we will simply refer to both the old and new versions.
   std::unique_ptr<StringAllocator> key_allocator_;
-  ObjectAllocator<EltType>* object_allocator_;
 
+  // Only ever changed by publishing a committed edit, so it holds no
+  // pending edit of its own; those are in pending_.
   VersionArray* elements_;
+  std::vector<PendingEdit> pending_;
 }; // end class TxAwareFlatMap
 
+// Creates TxAwareFlatMap leaves for a TxAwareBurstTrie.
+template <typename EltType>
+class TxAwareFlatMapFactory : public TxManagedMapFactory<EltType> {
+ public:
+  TxAwareFlatMapFactory(ObjectAllocator<EltType>* object_allocator,
+                        uint16_t max_key_space, uint8_t max_size,
+                        bool allow_duplicates = false) :
+      TxManagedMapFactory<EltType>(object_allocator, allow_duplicates),
+      max_key_space_(max_key_space), max_size_(max_size) {}
+  ~TxAwareFlatMapFactory() {}
+
+  TxManagedMap<EltType>* CreateNew(uint64_t create_time) {
+    return new TxAwareFlatMap<EltType>(this->object_allocator_,
+                                       max_key_space_, max_size_, create_time,
+                                       this->allow_duplicates_);
+  }
+
+  grpc::Status CreateCopy(const TxManagedMap<EltType>& other,
+                          const Transaction* tx, uint64_t create_time,
+                          TxManagedMap<EltType>** copy) {
+    std::unique_ptr<TxManagedMap<EltType>> created(CreateNew(create_time));
+    grpc::Status result = this->LoadFrom(other, tx, create_time,
+                                         created.get());
+    if (result.ok()) {
+      *copy = created.release();
+    }
+    return result;
+  }
+
+ private:
+  uint16_t max_key_space_;
+  uint8_t max_size_;
+};
+
 } // namespace collection
 } // namespace acumio
 #endif // AcumioServer_tx_aware_flat_map_h
@@ -11,15 +11,26 @@
 //               Cache-conscious Trie-based Data Structure for Strings"
 //               (Nikolas Askitis, Ranjan Sinha).
 //
+//               Each node has one child map per leading byte of the key;
+//               the child holds the remainder of the key. The empty key
+//               is held at index 0 (its remainder is again the empty key),
+//               which is also why a child at index 0 is never burst.
+//
 //               See tx_aware_burst_trie.h for more details.
 //============================================================================
 
 #include <grpc++/support/status.h>
+#include <atomic>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <vector>
 #include "flat_set.h"
 #include "object_allocator.h"
 #include "shared_mutex.h"
+#include "time_util.h"
+#include "tx_aware.h"
 #include "tx_managed_map.h"
 
 namespace acumio {
@@ -33,95 +44,32 @@ using acumio::transaction::WriteTransaction;
 using acumio::transaction::TxAware;
 using acumio::transaction::TxPointerLess;
 
-template <typename EltType>
-class TxManagedMapFactory {
- public:
-  TxManagedMapFactory(ObjectAllocator<EltType>* object_allocator,
-                      bool allow_duplicates = false) :
-      object_allocator_(object_allocator),
-      allow_duplicates_(allow_duplicates) {}
-  TxManagedMapFactory() :  TxManagedMapFactory(nullptr, false) {}
-  ~TxManagedMapFactory() {}
-
-  // Caller must assume ownership of generated object.
-  virtual TxManagedMap<EltType>* CreateNew(uint64_t create_time) = 0;
-  // Caller must assume ownership of generated object.
-  virtual TxManagedMap<EltType>* CreateCopy(TxManagedMap<EltType>* other,
-                                            uint64_t create_time) = 0;
-
- private:
-  ObjectAllocator<EltType>* object_allocator_;
-  bool allow_duplicates_;
-};
-
 template <typename EltType>
 class TxAwareTrieNode : public TxManagedMap<EltType> {
  public:
+  typedef UnadaptedTxManagedMap::EntryVisitor EntryVisitor;
 
   friend class Iterator;
   typedef FlatSet<uint8_t>::const_iterator FlatIterator;
 
+  // Iterators hold a SharedLock on the node (and on the child map they are
+  // currently visiting) for their lifetime. Copies of an iterator - which
+  // includes post-increment and post-decrement - share those locks.
   class Iterator : public TxBasicIterator {
    public:
+    friend class TxAwareTrieNode;
+
     // While these constructors are public for use in the TxAwareTrieNode,
     // they really should only be available within the TxAwareTrieNode.
-    // Public access should be via the TxAwareTrieNode::begin(),
-    // TxAwareTrieNode::end(), and TxAwareTrieNdoe::LowerBound(const char*)
+    // Public access should be via the TxAwareTrieNode::Begin(),
+    // TxAwareTrieNode::End(), and TxAwareTrieNode::LowerBound(const char*)
     // methods.
     //
-    // precondition: The index_delegate and child_delegate should come from
-    //               the provided container. The operation is undefined if
-    //               either index_delegate or child_delegate are related
-    //               to different structures other than the container.
-    //
-    // precondition:
-    //    Assuming the container is not null then:
-    //        (index_delegate.get() == nullptr ||
-    //         index_delegate.get() == container.populated_.end())
-    //        iff
-    //        (child_delegate.get() == nullptr)
-    //
-    // In other words, it makes no sense to use a child_delegate that refers
-    // to an actual "something" if the index_delegate is either nullptr or
-    // pointing to the end of the iterator.
-    //
-    // precondition:
-    //    Assuming the container is not null and child_delegate is not null
-    //    then:
-    //        *child_delegate != container->IndexedEnd(**index_delegate,
-    //                                                 access_time);
-    // In other words, if you pass in a child_delegate, it should always
-    // be a dereferencable value. A nullptr is okay however, assuming that
-    // you really are at the very end of iteration over all index values.
-    Iterator(const TxAwareTrieNode* container,
-             std::unique_ptr<FlatIterator> index_delegate,
-             std::unique_ptr<TxBasicIterator> child_delegate,
-             uint64_t access_time,
-             SharedMutex* guard) :
-        TxBasicIterator(guard),
-        container_(container), index_delegate_(std::move(index_delegate)),
-        child_delegate_(std::move(child_delegate)), access_time_(access_time),
-        index_end_(nullptr), index_(0), child_end_(nullptr),
-        saved_tmp_(nullptr), empty_val_() {
-      // See precondition.
-      if (container != nullptr) {
-        index_end_.reset(new FlatIterator(container->populated_.end()));
-        if (index_delegate_.get() == nullptr) {
-          index_delegate_.reset(
-              new FlatIterator(container->populated_.end()));
-        } else if (*index_delegate_ != *index_end_) {
-          // assert: child_delegate.get() != nullptr.
-          index_ = **index_delegate_;
-          child_end_ = container->IndexedEndIterator(index_, access_time_);
-        }
-      }
-    }
-
-    // Same as above constructor but with index_delegate and child_delegate
-    // specified as nullptr.
-    Iterator(const TxAwareTrieNode* container,
-             uint64_t access_time, SharedMutex* guard) :
-        TxBasicIterator(guard),
+    // Creates an iterator positioned at the end. If held_lock is not null,
+    // the iterator takes ownership of it (see BasicIterator).
+    Iterator(const TxAwareTrieNode* container, uint64_t access_time,
+             SharedLock* held_lock) :
+        TxBasicIterator(held_lock),
         container_(container), index_delegate_(nullptr),
         child_delegate_(nullptr), access_time_(access_time),
         index_end_(nullptr), index_(0), child_end_(nullptr),
@@ -133,7 +81,7 @@ class TxAwareTrieNode : public TxManagedMap<EltType> {
     }
 
     Iterator(const Iterator& other) :
-        TxBasicIterator(other.guard()),
+        TxBasicIterator(static_cast<const TxBasicIterator&>(other)),
         container_(other.container_), index_delegate_(nullptr),
         child_delegate_(nullptr), access_time_(other.access_time_),
         index_end_(nullptr), index_(other.index_), child_end_(nullptr),
@@ -162,31 +110,11 @@ class TxAwareTrieNode : public TxManagedMap<EltType> {
         return *this;
       }
 
-      (*child_delegate_)++;
-      while ((child_delegate_.get() == nullptr ||
-              *child_delegate_ == *child_end_) &&
-             *index_delegate_ != *index_end_) {
-        (*index_delegate_)++;
-        if (*index_delegate_ != *index_end_) {
-          index_ = **index_delegate_;
-          std::unique_ptr<TxBasicIterator> new_child =
-              container_->IndexedBeginIterator(index_, access_time_);
-          if (new_child.get() == nullptr) {
-            child_delegate_.reset(nullptr);
-          } else {
-            child_delegate_.reset(new_child.release());
-            std::unique_ptr<TxBasicIterator> new_child_end =
-                container_->IndexedEndIterator(index_, access_time_);
-            child_end_.reset(new_child_end.release());
-          }
-        }
-      }
-
-      if (*index_delegate_ == *index_end_) {
-        child_delegate_.reset(nullptr);
-        child_end_.reset(nullptr);
+      ++(*child_delegate_);
+      if (*child_delegate_ == *child_end_) {
+        ++(*index_delegate_);
+        SettleForward();
       }
-
       return *this;
     }
 
@@ -195,31 +123,13 @@ class TxAwareTrieNode : public TxManagedMap<EltType> {
         return *this;
       }
 
-      (*child_delegate_)--;
-      while ((child_delegate_.get() == nullptr ||
-              *child_delegate_ == *child_end_) &&
-             *index_delegate_ != *index_end_) {
-        (*index_delegate_)--;
-        if (*index_delegate_ != *index_end_) {
-          index_ = **index_delegate_;
-          std::unique_ptr<TxBasicIterator> new_child =
-              container_->IndexedReverseBeginIterator(index_, access_time_);
-          if (new_child.get() == nullptr) {
-            child_delegate_.reset(nullptr);
-          } else {
-            child_delegate_.reset(new_child.release());
-            std::unique_ptr<TxBasicIterator> new_child_end =
-                container_->IndexedEndIterator(index_, access_time_);
-            child_end_.reset(new_child_end.release());
-          }
-        }
-      }
-
-      if (*index_delegate_ == *index_end_) {
-        child_delegate_.reset(nullptr);
-        child_end_.reset(nullptr);
+      // Decrementing past the first element of a child map moves that
+      // child iterator to its end.
+      --(*child_delegate_);
+      if (*child_delegate_ == *child_end_) {
+        --(*index_delegate_);
+        SettleBackward();
       }
-
       return *this;
     }
 
@@ -249,7 +159,8 @@ class TxAwareTrieNode : public TxManagedMap<EltType> {
         return other_iter->child_delegate_.get() == nullptr;
       }
 
-      if (index_ != other_iter->index_) {
+      if (other_iter->child_delegate_.get() == nullptr ||
+          index_ != other_iter->index_) {
         return false;
       }
 
@@ -263,10 +174,7 @@ class TxAwareTrieNode : public TxManagedMap<EltType> {
 
     const MapIterElement& operator*() const {
       if (child_delegate_.get() != nullptr) {
-        const MapIterElement& child_elt = **child_delegate_;
-        RopePiece elt_key(new RopePiece(static_cast<char>(index_)),
-                          new RopePiece(child_elt.key));
-        saved_val_.reset(new MapIterElement(elt_key, child_elt.value));
+        saved_val_.reset(new MapIterElement(ComposeElement()));
         return *saved_val_;
       }
       return empty_val_;
@@ -274,16 +182,73 @@ class TxAwareTrieNode : public TxManagedMap<EltType> {
 
     const MapIterElement* operator->() const {
       if (child_delegate_.get() != nullptr) {
-        const MapIterElement& child_elt = **child_delegate_;
-        RopePiece elt_key(new RopePiece(static_cast<char>(index_)),
-                          new RopePiece(child_elt.key));
-        saved_val_.reset(new MapIterElement(elt_key, child_elt.value));
+        saved_val_.reset(new MapIterElement(ComposeElement()));
         return saved_val_.get();
       }
       return &empty_val_;
     }
 
    private:
+    // Starting with the index under index_delegate_, moves forward to the
+    // first index with a non-empty child, positioning child_delegate_ at the
+    // start of that child. Ends up at the end if there is no such index.
+    void SettleForward() {
+      child_delegate_.reset(nullptr);
+      child_end_.reset(nullptr);
+      while (*index_delegate_ != *index_end_) {
+        if (TrySettle(**index_delegate_,
+                      container_->IndexedBeginIterator(**index_delegate_,
+                                                       access_time_))) {
+          return;
+        }
+        ++(*index_delegate_);
+      }
+    }
+
+    // As SettleForward, but moving backward and positioning child_delegate_
+    // at the last element of the child.
+    void SettleBackward() {
+      child_delegate_.reset(nullptr);
+      child_end_.reset(nullptr);
+      while (*index_delegate_ != *index_end_) {
+        if (TrySettle(**index_delegate_,
+                      container_->IndexedReverseBeginIterator(
+                          **index_delegate_, access_time_))) {
+          return;
+        }
+        --(*index_delegate_);
+      }
+    }
+
+    // Takes child as the position within the child map at index, unless
+    // that child map is absent or empty. Returns true if taken.
+    bool TrySettle(uint8_t index, std::unique_ptr<TxBasicIterator> child) {
+      if (child.get() == nullptr) {
+        return false;
+      }
+      // child is created first, so its lock keeps the end position valid.
+      std::unique_ptr<TxBasicIterator> child_end =
+          container_->IndexedEndIterator(index, access_time_);
+      if (*child == *child_end) {
+        return false;
+      }
+      index_ = index;
+      child_delegate_ = std::move(child);
+      child_end_ = std::move(child_end);
+      return true;
+    }
+
+    MapIterElement ComposeElement() const {
+      const MapIterElement& child_elt = **child_delegate_;
+      if (index_ == 0) {
+        // The empty key: there is no leading character to restore.
+        return child_elt;
+      }
+      RopePiece elt_key(new RopePiece(static_cast<char>(index_)),
+                        new RopePiece(child_elt.key));
+      return MapIterElement(elt_key, child_elt.value);
+    }
+
     const TxAwareTrieNode* container_;
     std::unique_ptr<FlatIterator> index_delegate_;
     std::unique_ptr<TxBasicIterator> child_delegate_;
@@ -296,12 +261,25 @@ class TxAwareTrieNode : public TxManagedMap<EltType> {
     MapIterElement empty_val_;
   };
 
+  // Neither factory is owned by the node. The intermediate_factory is used
+  // when a leaf child must burst, and should create TxAwareTrieNodes.
   TxAwareTrieNode(TxManagedMapFactory<EltType>* leaf_factory,
                   TxManagedMapFactory<EltType>* intermediate_factory,
                   ObjectAllocator<EltType>* object_allocator,
                   bool allow_duplicates = false) :
+      TxAwareTrieNode<EltType>(leaf_factory, intermediate_factory,
+                               object_allocator, allow_duplicates, nullptr) {}
+
+  // As above, but guarding the node with an externally owned guard rather
+  // than its own, e.g., so that the root of a TxAwareBurstTrie can use a
+  // ReaderBiasedSharedMutex.
+  TxAwareTrieNode(TxManagedMapFactory<EltType>* leaf_factory,
+                  TxManagedMapFactory<EltType>* intermediate_factory,
+                  ObjectAllocator<EltType>* object_allocator,
+                  bool allow_duplicates, SharedMutex* guard) :
       TxManagedMap<EltType>(object_allocator, allow_duplicates),
-      guard_(),
+      own_guard_(),
+      guard_(guard == nullptr ? &own_guard_ : guard),
       leaf_factory_(leaf_factory),
       intermediate_factory_(intermediate_factory),
       populated_(256),
@@ -324,7 +302,7 @@ class TxAwareTrieNode : public TxManagedMap<EltType> {
     }
 
     uint8_t index = IndexFromKey(key);
-    SharedLock read_lock(guard_);
+    SharedLock read_lock(*guard_);
 
     const TxManagedMap<EltType>* map = MapVersionAtTime(index, access_time);
     if (map == nullptr) {
@@ -332,29 +310,21 @@ class TxAwareTrieNode : public TxManagedMap<EltType> {
                           "Could not find key at given time.");
     }
 
-    return map->GetValuePosition(key + 1, value, access_time);
+    return map->GetValuePosition(ChildKey(key), value, access_time);
   }
 
+  // exists_at_time is set to true if any child map exists at access_time.
   uint32_t Size(uint64_t access_time, bool* exists_at_time) const {
-    FlatIterator begin = populated_.begin();
-    FlatIterator end = populated_.end();
-    FlatIterator it = begin;
+    SharedLock read_lock(*guard_);
     uint32_t ret_val = 0;
     *exists_at_time = false;
-    for (; it != end && !(*exists_at_time); it++) {
-      uint8_t index = *it;
-      const TxManagedMap<EltType>* map = MapVersionAtTime(index, access_time);
-      if (map != nullptr) {
-        ret_val += map->Size(access_time, exists_at_time);
-      }
-    }
-
-    for (; it != end; it++) {
-      uint8_t index = *it;
-      bool unused = false;
-      const TxManagedMap<EltType>* map = MapVersionAtTime(index, access_time);
+    FlatIterator end = populated_.end();
+    for (FlatIterator it = populated_.begin(); it != end; ++it) {
+      const TxManagedMap<EltType>* map = MapVersionAtTime(*it, access_time);
       if (map != nullptr) {
-        ret_val += map->Size(access_time, &unused);
+        bool child_exists = false;
+        ret_val += map->Size(access_time, &child_exists);
+        *exists_at_time = *exists_at_time || child_exists;
       }
     }
 
@@ -363,607 +333,248 @@ class TxAwareTrieNode : public TxManagedMap<EltType> {
 
   grpc::Status Add(const char* key, uint32_t value, const Transaction* tx,
                    uint64_t tx_time) {
-    if (key == nullptr || key[0] == '\0') {
-      return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
-                          "key must not be null and have length > 0.");
-    }
-
-    uint8_t index = IndexFromKey(key);
-
-    acumio::transaction::ExclusiveLock lock(guard_);
-    // First, we verify Transaction info.
-    Transaction::AtomicInfo current_tx_info = tx->GetAtomicInfo();
-    if (current_tx_info.operation_start_time != tx_time) {
-      return grpc::Status(grpc::StatusCode::DEADLINE_EXCEEDED,
-        "The transaction timed out before completion.");
-    }
-
-    EditInfo& edit_info = edits_[index];
-    MapVersion& current_version = current_values_[index];
-    grpc::Status ret_val = VerifyNoConflictingEdits(tx, edit_info,
-                                                    current_version, tx_time);
-
-    if (!ret_val.ok()) {
-      return ret_val;
-    }
-
-    // assert: edit_info.state == NOT_EDITING ||
-    //         edit_info.state == PASS_THROUGH
-    // The other two cases would have generated an error during
-    // VerifyNoConflictingEdits.
-    if (edit_info.state == PASS_THROUGH) {
-      ret_val = current_version.value->Add(key + 1, value, tx, tx_time);
-      if (ret_val.ok()) {
-        edit_info.edit_transactions.insert(tx);
-        return grpc::Status::OK;
-      }
-
-      // TODO: Migrate Error Codes of content to detect when a possible
-      //       burst condition is a likely valid response. Using
-      //       grpc's Status code is a bit limiting. We are checking two
-      //       things here: first that we have a possible "burst" condition
-      //       according to our current value and second, that we are in
-      //       a configuration where our current value is a leaf-level
-      //       map and our historical value is empty. Only in this case
-      //       can we burst.
-      if (ret_val.error_code() != grpc::StatusCode::OUT_OF_RANGE ||
-          historical_values_[index].value != nullptr) {
-        return ret_val;
-      }
-
-      // If we have reached here, we should burst the current value
-      // and create a new edit version with the burst value. However,
-      // if we have more pending transactions on the current value,
-      // we should just return a concurrency exception.
-      // Notice that when we initially check for a possible conflict with an
-      // existing transaction, we might not have noticed this condition,
-      // because we only noticed the need to burst the node after we did
-      // the initial conflict-check. It's the need to burst the node that
-      // causes us to require that there are not conflicting transactions.
-      if (edit_info.edit_transactions.size() != 0) {
-        return grpc::Status(grpc::StatusCode::ABORTED,
-                            "concurrency exception.");
-      }
-
-      return BurstAndAdd(key + 1, value, edit_info, current_version, tx,
-                         tx_time);
-    }
-
-    // assert: edit_info.state == NOT_EDITING.
-    if (current_version.value == nullptr) {
-      // assert: current_version.times.create == 0,
-      //         current_version.times.remove == end_of_time,
-      //         historical_version.times.create == 0,
-      //         historical_version.times.remove == 0,
-      //         edit_info.edit_transactions.size() == 0
-      edit_info.edit_value = leaf_factory_->CreateNew(tx_time);
-      ret_val = edit_info.edit_value->Add(key + 1, value, tx, tx_time);
-      if (!ret_val.ok()) {
-        delete edit_info.edit_value;
-        edit_info.edit_value = nullptr;
-        return ret_val;
-      }
-      edit_info.state = CREATING;
-      edit_info.time = tx_time;
-      edit_info.edit_transactions.insert(tx);
-      return grpc::Status::OK;
-    }
-
-    // assert: edit_info.state == NOT_EDITING and
-    //         current_version.value != nullptr
-    ret_val = current_version.value->Add(key + 1, value, tx, tx_time);
-
-    if (ret_val.ok()) {
-      edit_info.state = PASS_THROUGH;
-      edit_info.time = tx_time;
-      edit_info.edit_transactions.insert(tx);
-      return grpc::Status::OK;
-    }
-
-    if (ret_val.error_code() != grpc::StatusCode::OUT_OF_RANGE ||
-        historical_values_[index].value != nullptr) {
-      return ret_val;
-    }
-
-    // Here, we know that historical_values_[index].value was a nullptr,
-    // and we got an OUT_OF_RANGE error from trying to add the new element.
-    // This is exactly the condition needed to burst the current
-    // version.
-    return BurstAndAdd(key + 1, value, edit_info, current_version, tx, tx_time);
+    return EditChild(key, tx, tx_time, true,
+        [value, tx, tx_time](TxManagedMap<EltType>* map,
+                             const char* child_key) {
+          return map->Add(child_key, value, tx, tx_time);
+        });
   }
 
-  // TODO: Consider unifying both Remove methods and the Replace method using
-  //       callback functions. All three methods have identical structure
-  //       except for calling either Remove/Replace or BurstAndRemove/Replace
-  //       internally.
   grpc::Status Remove(const char* key, const Transaction* tx,
                       uint64_t tx_time) {
-    if (key == nullptr || key[0] == '\0') {
-      return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
-                          "key must not be null and have length > 0.");
-    }
-
-    uint8_t index = IndexFromKey(key);
-
-    acumio::transaction::ExclusiveLock lock(guard_);
-    // First, we verify Transaction info.
-    Transaction::AtomicInfo current_tx_info = tx->GetAtomicInfo();
-    if (current_tx_info.operation_start_time != tx_time) {
-      return grpc::Status(grpc::StatusCode::DEADLINE_EXCEEDED,
-        "The transaction timed out before completion.");
-    }
-
-    EditInfo& edit_info = edits_[index];
-    MapVersion& current_version = current_values_[index];
-    grpc::Status ret_val = VerifyNoConflictingEdits(tx, edit_info,
-                                                    current_version, tx_time);
-
-    if (!ret_val.ok()) {
-      return ret_val;
-    }
-
-    // assert: edit_info.state == NOT_EDITING ||
-    //         edit_info.state == PASS_THROUGH
-    // The other two cases would have generated an error during
-    // VerifyNoConflictingEdits.
-    if (edit_info.state == PASS_THROUGH) {
-      ret_val = current_version.value->Remove(key + 1, tx, tx_time);
-      if (ret_val.ok()) {
-        edit_info.edit_transactions.insert(tx);
-        return grpc::Status::OK;
-      }
-
-      // TODO: Migrate Error Codes of content to detect when a possible
-      //       burst condition is a likely valid response. Using
-      //       grpc's Status code is a bit limiting. We are checking two
-      //       things here: first that we have a possible "burst" condition
-      //       according to our current value and second, that we are in
-      //       a configuration where our current value is a leaf-level
-      //       map and our historical value is empty. Only in this case
-      //       can we burst.
-      // Note: Yes, we can end up in a burst condition even when removing
-      //       a value, because we cause a new version to be generated.
-      if (ret_val.error_code() != grpc::StatusCode::OUT_OF_RANGE ||
-          historical_values_[index].value != nullptr) {
-        return ret_val;
-      }
-
-      // If we have reached here, we should burst the current value
-      // and create a new edit version with the burst value. However,
-      // if we have more pending transactions on the current value,
-      // we should just return a concurrency exception.
-      // Notice that when we initially check for a possible conflict with an
-      // existing transaction, we might not have noticed this condition,
-      // because we only noticed the need to burst the node after we did
-      // the initial conflict-check. It's the need to burst the node that
-      // causes us to require that there are not conflicting transactions.
-      if (edit_info.edit_transactions.size() != 0) {
-        return grpc::Status(grpc::StatusCode::ABORTED,
-                            "concurrency exception.");
-      }
-
-      return BurstAndRemove(key + 1, edit_info, current_version, tx, tx_time);
-    }
-
-    // assert: edit_info.state == NOT_EDITING.
-    if (current_version.value == nullptr) {
-      return grpc::Status(grpc::StatusCode::NOT_FOUND,
-                          "unable to find key to remove.");
-    }
-
-    // assert: edit_info.state == NOT_EDITING and
-    //         current_version.value != nullptr
-    ret_val = current_version.value->Remove(key + 1, tx, tx_time);
-
-    if (ret_val.ok()) {
-      edit_info.state = PASS_THROUGH;
-      edit_info.time = tx_time;
-      edit_info.edit_transactions.insert(tx);
-      return grpc::Status::OK;
-    }
-
-    if (ret_val.error_code() != grpc::StatusCode::OUT_OF_RANGE ||
-        historical_values_[index].value != nullptr) {
-      return ret_val;
-    }
-
-    // Here, we know that historical_values_[index].value was a nullptr,
-    // and we got an OUT_OF_RANGE error from trying to add the new element.
-    // This is exactly the condition needed to burst the current
-    // version.
-    return BurstAndRemove(key + 1, edit_info, current_version, tx, tx_time);
+    return EditChild(key, tx, tx_time, false,
+        [tx, tx_time](TxManagedMap<EltType>* map, const char* child_key) {
+          return map->Remove(child_key, tx, tx_time);
+        });
   }
 
   grpc::Status Remove(const char* key, uint32_t value, const Transaction* tx,
                       uint64_t tx_time) {
+    return EditChild(key, tx, tx_time, false,
+        [value, tx, tx_time](TxManagedMap<EltType>* map,
+                             const char* child_key) {
+          return map->Remove(child_key, value, tx, tx_time);
+        });
+  }
+
+  grpc::Status Replace(const char* key, uint32_t value, const Transaction* tx,
+                       uint64_t tx_time) {
+    return EditChild(key, tx, tx_time, false,
+        [value, tx, tx_time](TxManagedMap<EltType>* map,
+                             const char* child_key) {
+          return map->Replace(child_key, value, tx, tx_time);
+        });
+  }
+
+  grpc::Status Load(const char* key, uint32_t value, uint64_t create_time) {
     if (key == nullptr) {
       return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
                           "key must not be null.");
     }
 
     uint8_t index = IndexFromKey(key);
-
-    acumio::transaction::ExclusiveLock lock(guard_);
-    // First, we verify Transaction info.
-    Transaction::AtomicInfo current_tx_info = tx->GetAtomicInfo();
-    if (current_tx_info.operation_start_time != tx_time) {
-      return grpc::Status(grpc::StatusCode::DEADLINE_EXCEEDED,
-        "The transaction timed out before completion.");
-    }
-
-    EditInfo& edit_info = edits_[index];
-    MapVersion& current_version = current_values_[index];
-    grpc::Status ret_val = VerifyNoConflictingEdits(tx, edit_info,
-                                                    current_version, tx_time);
-
-    if (!ret_val.ok()) {
-      return ret_val;
-    }
-
-    // assert: edit_info.state == NOT_EDITING ||
-    //         edit_info.state == PASS_THROUGH
-    // The other two cases would have generated an error during
-    // VerifyNoConflictingEdits.
-    if (edit_info.state == PASS_THROUGH) {
-      ret_val = current_version.value->Remove(key + 1, value, tx, tx_time);
-      if (ret_val.ok()) {
-        edit_info.edit_transactions.insert(tx);
-        return grpc::Status::OK;
-      }
-
-      // TODO: Migrate Error Codes of content to detect when a possible
-      //       burst condition is a likely valid response. Using
-      //       grpc's Status code is a bit limiting. We are checking two
-      //       things here: first that we have a possible "burst" condition
-      //       according to our current value and second, that we are in
-      //       a configuration where our current value is a leaf-level
-      //       map and our historical value is empty. Only in this case
-      //       can we burst.
-      // Note: Yes, we can end up in a burst condition even when removing
-      //       a value, because we cause a new version to be generated.
-      if (ret_val.error_code() != grpc::StatusCode::OUT_OF_RANGE ||
-          historical_values_[index].value != nullptr) {
-        return ret_val;
-      }
-
-      // If we have reached here, we should burst the current value
-      // and create a new edit version with the burst value. However,
-      // if we have more pending transactions on the current value,
-      // we should just return a concurrency exception.
-      // Notice that when we initially check for a possible conflict with an
-      // existing transaction, we might not have noticed this condition,
-      // because we only noticed the need to burst the node after we did
-      // the initial conflict-check. It's the need to burst the node that
-      // causes us to require that there are not conflicting transactions.
-      if (edit_info.edit_transactions.size() != 0) {
-        return grpc::Status(grpc::StatusCode::ABORTED,
-                            "concurrency exception.");
+    const char* child_key = ChildKey(key);
+    {
+      // Loading into an existing child leaves this node unchanged, so that
+      // only needs a SharedLock.
+      SharedLock read_lock(*guard_);
+      const MapVersion& current_version = current_values_[index];
+      if (current_version.value != nullptr) {
+        grpc::Status ret_val = current_version.value->Load(child_key, value,
+                                                           create_time);
+        if (!IsBurstCondition(ret_val, index, current_version.leaf)) {
+          return ret_val;
+        }
       }
-
-      return BurstAndRemove(key + 1, value, edit_info, current_version, tx,
-                            tx_time);
     }
 
-    // assert: edit_info.state == NOT_EDITING.
+    acumio::transaction::ExclusiveLock lock(*guard_);
+    MapVersion& current_version = current_values_[index];
     if (current_version.value == nullptr) {
-      return grpc::Status(grpc::StatusCode::NOT_FOUND,
-                          "unable to find key to remove.");
-    }
-
-    // assert: edit_info.state == NOT_EDITING and
-    //         current_version.value != nullptr
-    ret_val = current_version.value->Remove(key + 1, value, tx, tx_time);
-
-    if (ret_val.ok()) {
-      edit_info.state = PASS_THROUGH;
-      edit_info.time = tx_time;
-      edit_info.edit_transactions.insert(tx);
-      return grpc::Status::OK;
+      current_version.value = leaf_factory_->CreateNew(create_time);
+      current_version.leaf = true;
+      current_version.times.create = create_time;
+      current_version.times.remove = acumio::time::END_OF_TIME;
+      populated_.insert(index);
     }
 
-    if (ret_val.error_code() != grpc::StatusCode::OUT_OF_RANGE ||
-        historical_values_[index].value != nullptr) {
+    grpc::Status ret_val = current_version.value->Load(child_key, value,
+                                                       create_time);
+    if (!IsBurstCondition(ret_val, index, current_version.leaf)) {
       return ret_val;
     }
 
-    // Here, we know that historical_values_[index].value was a nullptr,
-    // and we got an OUT_OF_RANGE error from trying to add the new element.
-    // This is exactly the condition needed to burst the current
-    // version.
-    return BurstAndRemove(key + 1, value, edit_info, current_version, tx,
-                          tx_time);
-  }
-
-  grpc::Status Replace(const char* key, uint32_t value, const Transaction* tx,
-                       uint64_t tx_time) {
-    if (key == nullptr || key[0] == '\0') {
-      return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
-                          "key must not be null and have length > 0.");
-    }
-
-    uint8_t index = IndexFromKey(key);
-
-    acumio::transaction::ExclusiveLock lock(guard_);
-    // First, we verify Transaction info.
-    Transaction::AtomicInfo current_tx_info = tx->GetAtomicInfo();
-    if (current_tx_info.operation_start_time != tx_time) {
-      return grpc::Status(grpc::StatusCode::DEADLINE_EXCEEDED,
-        "The transaction timed out before completion.");
-    }
-
-    EditInfo& edit_info = edits_[index];
-    MapVersion& current_version = current_values_[index];
-    grpc::Status ret_val = VerifyNoConflictingEdits(tx, edit_info,
-                                                    current_version, tx_time);
-
+    TxManagedMap<EltType>* burst = nullptr;
+    ret_val = intermediate_factory_->CreateCopy(*current_version.value,
+                                                nullptr, create_time, &burst);
     if (!ret_val.ok()) {
       return ret_val;
     }
+    delete current_version.value;
+    current_version.value = burst;
+    current_version.leaf = false;
+    return burst->Load(child_key, value, create_time);
+  }
 
-    // assert: edit_info.state == NOT_EDITING ||
-    //         edit_info.state == PASS_THROUGH
-    // The other two cases would have generated an error during
-    // VerifyNoConflictingEdits.
-    if (edit_info.state == PASS_THROUGH) {
-      ret_val = current_version.value->Replace(key + 1, value, tx, tx_time);
-      if (ret_val.ok()) {
-        edit_info.edit_transactions.insert(tx);
-        return grpc::Status::OK;
+  grpc::Status VisitForEdit(const Transaction* tx, uint64_t tx_time,
+                            const EntryVisitor& visitor) const {
+    SharedLock read_lock(*guard_);
+    FlatIterator end = populated_.end();
+    for (FlatIterator it = populated_.begin(); it != end; ++it) {
+      uint8_t index = *it;
+      const TxManagedMap<EltType>* map = MapVersionForEdit(index, tx, tx_time);
+      if (map == nullptr) {
+        continue;
       }
-
-      // TODO: Migrate Error Codes of content to detect when a possible
-      //       burst condition is a likely valid response. Using
-      //       grpc's Status code is a bit limiting. We are checking two
-      //       things here: first that we have a possible "burst" condition
-      //       according to our current value and second, that we are in
-      //       a configuration where our current value is a leaf-level
-      //       map and our historical value is empty. Only in this case
-      //       can we burst.
-      // Note: Yes, we can end up in a burst condition even when replacing
-      //       a value, because we cause a new version to be generated.
-      if (ret_val.error_code() != grpc::StatusCode::OUT_OF_RANGE ||
-          historical_values_[index].value != nullptr) {
-        return ret_val;
+      std::string prefix;
+      if (index != 0) {
+        prefix.push_back(static_cast<char>(index));
       }
-
-      // If we have reached here, we should burst the current value
-      // and create a new edit version with the burst value. However,
-      // if we have more pending transactions on the current value,
-      // we should just return a concurrency exception.
-      // Notice that when we initially check for a possible conflict with an
-      // existing transaction, we might not have noticed this condition,
-      // because we only noticed the need to burst the node after we did
-      // the initial conflict-check. It's the need to burst the node that
-      // causes us to require that there are not conflicting transactions.
-      if (edit_info.edit_transactions.size() != 0) {
-        return grpc::Status(grpc::StatusCode::ABORTED,
-                            "concurrency exception.");
+      grpc::Status result = map->VisitForEdit(tx, tx_time,
+          [&prefix, &visitor](const char* child_key, uint32_t value) {
+            visitor((prefix + child_key).c_str(), value);
+          });
+      if (!result.ok()) {
+        return result;
       }
-
-      return BurstAndReplace(key + 1, value, edit_info, current_version, tx,
-                             tx_time);
-    }
-
-    // assert: edit_info.state == NOT_EDITING.
-    if (current_version.value == nullptr) {
-      return grpc::Status(grpc::StatusCode::NOT_FOUND,
-                          "unable to find key to remove.");
-    }
-
-    // assert: edit_info.state == NOT_EDITING and
-    //         current_version.value != nullptr
-    ret_val = current_version.value->Replace(key + 1, value, tx, tx_time);
-
-    if (ret_val.ok()) {
-      edit_info.state = PASS_THROUGH;
-      edit_info.time = tx_time;
-      edit_info.edit_transactions.insert(tx);
-      return grpc::Status::OK;
     }
-
-    if (ret_val.error_code() != grpc::StatusCode::OUT_OF_RANGE ||
-        historical_values_[index].value != nullptr) {
-      return ret_val;
-    }
-
-    // Here, we know that historical_values_[index].value was a nullptr,
-    // and we got an OUT_OF_RANGE error from trying to add the new element.
-    // This is exactly the condition needed to burst the current
-    // version.
-    return BurstAndReplace(key + 1, value, edit_info, current_version, tx,
-                           tx_time);
+    return grpc::Status::OK;
   }
 
   std::unique_ptr<TxBasicIterator> Begin(uint64_t access_time) const {
-    acumio::transaction::SharedLock lock(guard_);
-
-    std::unique_ptr<FlatIterator> index_iter(
-        new FlatIterator(populated_.begin()));
-    std::unique_ptr<TxBasicIterator> child_iter(nullptr);
-    if (*index_iter == populated_.end()) {
-      return std::unique_ptr<TxBasicIterator>(
-          new Iterator(this, std::move(index_iter), std::move(child_iter),
-                       access_time, &guard_));
-    }
-
-    child_iter = IndexedBeginIterator(**index_iter, access_time);
-    std::unique_ptr<TxBasicIterator> child_end =
-        IndexedEndIterator(**index_iter, access_time);
-    while ((child_iter.get() == nullptr || *child_iter == *child_end)) {
-      index_iter->operator++();
-        if (*index_iter == populated_.end()) {
-        child_iter.reset(nullptr);
-        return std::unique_ptr<TxBasicIterator>(
-            new Iterator(this, std::move(index_iter), std::move(child_iter),
-                         access_time, &guard_));
-      }
-      std::unique_ptr<TxBasicIterator> new_child =
-          IndexedBeginIterator(**index_iter, access_time);
-      child_iter.reset(new_child.release());
-      std::unique_ptr<TxBasicIterator> new_end =
-          IndexedEndIterator(**index_iter, access_time);
-      child_end.reset(new_end.release());
-    }
-
-    return std::unique_ptr<TxBasicIterator>(
-        new Iterator(this, std::move(index_iter), std::move(child_iter),
-                     access_time, &guard_));
+    std::unique_ptr<Iterator> ret_val(
+        new Iterator(this, access_time, new SharedLock(*guard_)));
+    ret_val->index_delegate_.reset(new FlatIterator(populated_.begin()));
+    ret_val->SettleForward();
+    return std::unique_ptr<TxBasicIterator>(ret_val.release());
   }
 
   std::unique_ptr<TxBasicIterator> ReverseBegin(uint64_t access_time) const {
-    acumio::transaction::SharedLock lock(guard_);
-
-    std::unique_ptr<FlatIterator> index_iter(
-        new FlatIterator(populated_.rbegin()));
-    std::unique_ptr<TxBasicIterator> child_iter(nullptr);
-    if (*index_iter == populated_.end()) {
-      return std::unique_ptr<TxBasicIterator>(
-          new Iterator(this, std::move(index_iter), std::move(child_iter),
-                       access_time, &guard_));
-    }
-
-    child_iter = IndexedReverseBeginIterator(**index_iter, access_time);
-    std::unique_ptr<TxBasicIterator> child_end =
-        IndexedEndIterator(**index_iter, access_time);
-    while ((child_iter.get() == nullptr || *child_iter == *child_end)) {
-      index_iter->operator--();
-        if (*index_iter == populated_.end()) {
-        child_iter.reset(nullptr);
-        return std::unique_ptr<TxBasicIterator>(
-            new Iterator(this, std::move(index_iter), std::move(child_iter),
-                         access_time, &guard_));
-      }
-      std::unique_ptr<TxBasicIterator> new_child =
-          IndexedReverseBeginIterator(**index_iter, access_time);
-      child_iter.reset(new_child.release());
-      std::unique_ptr<TxBasicIterator> new_end =
-          IndexedEndIterator(**index_iter, access_time);
-      child_end.reset(new_end.release());
-    }
-
-    return std::unique_ptr<TxBasicIterator>(
-        new Iterator(this, std::move(index_iter), std::move(child_iter),
-                     access_time, &guard_));
+    std::unique_ptr<Iterator> ret_val(
+        new Iterator(this, access_time, new SharedLock(*guard_)));
+    ret_val->index_delegate_.reset(new FlatIterator(populated_.rbegin()));
+    ret_val->SettleBackward();
+    return std::unique_ptr<TxBasicIterator>(ret_val.release());
   }
 
+  // The end iterator holds no lock; it is only meaningful for comparison.
   std::unique_ptr<TxBasicIterator> End(uint64_t access_time) const {
     return std::unique_ptr<TxBasicIterator>(
-        new Iterator(this, access_time, &guard_));
+        new Iterator(this, access_time, nullptr));
   }
 
-  // Returns a unique_ptr to a nullptr if key == nullptr or if key == "".
-  // Empty strings cannot be stored in a TxAwareTrieNode.
+  // Returns an iterator to the first entry whose key is not less than key,
+  // or End(access_time) if there is none (or key is null).
   std::unique_ptr<TxBasicIterator> LowerBound(const char* key,
                                               uint64_t access_time) const {
-    if (key == nullptr || key[0] == '\0') {
-      return std::unique_ptr<TxBasicIterator>(nullptr);
+    if (key == nullptr) {
+      return End(access_time);
     }
 
-    acumio::transaction::SharedLock lock(guard_);
-
+    std::unique_ptr<Iterator> ret_val(
+        new Iterator(this, access_time, new SharedLock(*guard_)));
     uint8_t original_index = IndexFromKey(key);
-    std::unique_ptr<FlatIterator> index_iter(
+    ret_val->index_delegate_.reset(
         new FlatIterator(populated_.lower_bound(original_index)));
-    FlatIterator end_index_iter = populated_.end();
-    if (*index_iter == end_index_iter) {
-      return std::unique_ptr<TxBasicIterator>(
-          new Iterator(this, access_time, &guard_));
-    }
-
-    std::unique_ptr<TxBasicIterator> child_iter(nullptr);
-    std::unique_ptr<TxBasicIterator> child_end_iter(nullptr);
-    if (**index_iter == original_index) {
-      child_iter = (IndexedLowerBoundIterator(key, access_time));
-      if (child_iter.get() != nullptr) {
-        child_end_iter = IndexedEndIterator(original_index, access_time);
-        if (*child_iter != *child_end_iter) {
-          return std::unique_ptr<TxBasicIterator>(
-              new Iterator(this, std::move(index_iter), std::move(child_iter),
-                           access_time, &guard_));
-        }
-      }
-      (*index_iter)++;
-    }
-
-    // If we reached here, our returned iterator's key will not match the
-    // key of the first character of the requested lower bound key.
-    while (*index_iter != end_index_iter) {
-      child_iter.reset(
-          IndexedBeginIterator(**index_iter, access_time).release());
-      if (child_iter.get() != nullptr) {
-        child_end_iter.reset(
-            IndexedEndIterator(**index_iter, access_time).release());
-        if (*child_iter != *child_end_iter) {
-          return std::unique_ptr<TxBasicIterator>(
-              new Iterator(this, std::move(index_iter), std::move(child_iter),
-                           access_time, &guard_));
-        }
+    if (*(ret_val->index_delegate_) != populated_.end() &&
+        **(ret_val->index_delegate_) == original_index) {
+      if (ret_val->TrySettle(original_index,
+                             IndexedLowerBoundIterator(key, access_time))) {
+        return std::unique_ptr<TxBasicIterator>(ret_val.release());
       }
-      (*index_iter)++;
+      // Everything under original_index is less than key.
+      ++(*(ret_val->index_delegate_));
     }
 
-    return std::unique_ptr<TxBasicIterator>(
-        new Iterator(this, access_time, &guard_));
+    ret_val->SettleForward();
+    return std::unique_ptr<TxBasicIterator>(ret_val.release());
   }
 
-  // Removes versions if their time-span does not cover clean_time, and if
-  // their time-span comes before clean_time. i.e.:
-  // remove if version.times.remove <= clean_time.
-  // Skip elements if the time-span in question is currently being edited.
+  // Removes historical child maps once they only cover times before
+  // clean_time (i.e., remove <= clean_time), and has each remaining child
+  // clean its own versions in the same way.
   void CleanVersions(uint64_t clean_time) {
-    acumio::transaction::ExclusiveLock lock(guard_);
-
-    FlatSet<uint8_t>::iterator begin = populated_.begin();
-    FlatSet<uint8_t>::iterator it = begin;
-
-    while (it != populated_.end()) {
-      uint8_t index = *it;
-      EditInfo& edit_info = edits_[index];
-      if (edit_info.time <= clean_time && edit_info.time != UINT64_C(0)) {
-        // Just skip it if we find something being edited at a time
-        // overlapping our access_time.
-        it++;
-        continue;
-      }
-
-      MapVersion& current_info = current_values_[index];
-      MapVersion& historical_info = historical_values_[index];
-      bool current_map_cleared = false;
-      if (current_info.times.remove < clean_time) {
-        delete current_info.value;
-        current_info.value = nullptr;
-        current_info.times.create = UINT64_C(0);
-        current_info.times.remove = UINT64_C(0);
-        current_map_cleared = true;
+    {
+      // The children clean themselves under their own guards, so unless
+      // there is a historical child to discard, this node is unchanged.
+      SharedLock read_lock(*guard_);
+      bool discards = false;
+      FlatSet<uint8_t>::iterator end = populated_.end();
+      for (FlatSet<uint8_t>::iterator it = populated_.begin(); it != end;
+           ++it) {
+        const MapVersion& historical_info = historical_values_[*it];
+        if (historical_info.value != nullptr &&
+            historical_info.times.remove <= clean_time) {
+          discards = true;
+          break;
+        }
       }
-      else if (current_info.times.create <= clean_time) {
-        current_info.value->CleanVersions(clean_time);
+      if (!discards) {
+        for (FlatSet<uint8_t>::iterator it = populated_.begin(); it != end;
+             ++it) {
+          if (historical_values_[*it].value != nullptr) {
+            historical_values_[*it].value->CleanVersions(clean_time);
+          }
+          if (current_values_[*it].value != nullptr) {
+            current_values_[*it].value->CleanVersions(clean_time);
+          }
+        }
+        return;
       }
+    }
 
-      if (historical_info.times.remove <= clean_time) {
-        delete historical_info.value;
-        historical_info.value = nullptr;
-        historical_info.times.create = UINT64_C(0);
-        historical_info.times.remove = current_info.times.create;
-        if (current_map_cleared) {
-          populated_.erase(index);
+    acumio::transaction::ExclusiveLock lock(*guard_);
+    FlatSet<uint8_t>::iterator end = populated_.end();
+    for (FlatSet<uint8_t>::iterator it = populated_.begin(); it != end; ++it) {
+      uint8_t index = *it;
+      MapVersion& historical_info = historical_values_[index];
+      if (historical_info.value != nullptr) {
+        if (historical_info.times.remove <= clean_time) {
+          delete historical_info.value;
+          historical_info.value = nullptr;
+          historical_info.leaf = false;
         } else {
-          it++;
+          historical_info.value->CleanVersions(clean_time);
         }
-      } else if (historical_info.times.create <= clean_time) {
+      }
+
+      MapVersion& current_info = current_values_[index];
+      if (current_info.value != nullptr) {
         current_info.value->CleanVersions(clean_time);
-        it++;
       }
     }
   }
 
   void CompleteWriteOperation(const Transaction* tx) {
-    acumio::transaction::ExclusiveLock lock(guard_);
+    if (tx->GetAtomicInfo().state != Transaction::COMPLETING_WRITE) {
+      return;
+    }
+    {
+      SharedLock read_lock(*guard_);
+      std::vector<TxManagedMap<EltType>*> children;
+      if (TakePassThroughEdits(tx, &children)) {
+        for (TxManagedMap<EltType>* child : children) {
+          child->CompleteWriteOperation(tx);
+        }
+        return;
+      }
+    }
+    acumio::transaction::ExclusiveLock lock(*guard_);
     CompleteWriteOperationWithGuard(tx);
   }
 
   void Rollback(const Transaction* tx) {
-    acumio::transaction::ExclusiveLock lock(guard_);
+    {
+      SharedLock read_lock(*guard_);
+      std::vector<TxManagedMap<EltType>*> children;
+      if (TakePassThroughEdits(tx, &children)) {
+        for (TxManagedMap<EltType>* child : children) {
+          child->Rollback(tx);
+        }
+        return;
+      }
+    }
+    acumio::transaction::ExclusiveLock lock(*guard_);
     RollbackWithGuard(tx);
   }
 
@@ -984,30 +595,39 @@ class TxAwareTrieNode : public TxManagedMap<EltType> {
 
   struct EditInfo {
     EditInfo() : state(NOT_EDITING), time(UINT64_C(0)), edit_value(nullptr),
-        edit_transactions() {}
-    EditInfo(const EditInfo& o) : state(o.state), time(o.time),
-        edit_value(o.edit_value), edit_transactions(o.edit_transactions) {}
+        leaf(false), edit_transactions() {}
+    EditInfo(const EditInfo& o) = delete;
     ~EditInfo() { delete edit_value; }
 
-    EditState state;
+    // Atomic, since writers passing through to a child change it between
+    // NOT_EDITING and PASS_THROUGH under a SharedLock, while readers check
+    // it for CREATING or BURSTING.
+    std::atomic<EditState> state;
     uint64_t time;
+    // Only populated while CREATING or BURSTING. Until the edit completes,
+    // this map is visible to no other thread (readers only see it while the
+    // owning transaction is completing its write).
     TxManagedMap<EltType>* edit_value;
+    // True if edit_value is a leaf-level map.
+    bool leaf;
     FlatSet<const Transaction*, TxPointerLess> edit_transactions;
   };
 
   struct MapVersion {
-    MapVersion(TxManagedMap<EltType>* v,
-               const typename TxAware<EltType>::TimeBoundary& t) :
-      value(v), times(t) {}
-    MapVersion() : value(nullptr), times(UINT64_C(0), UINT64_C(0)) {}
-    MapVersion(const MapVersion& other) : value(other.value),
-        times(other.times) {}
+    MapVersion() : value(nullptr), leaf(false),
+        times(UINT64_C(0), UINT64_C(0)) {}
+    MapVersion(const MapVersion& other) = delete;
     ~MapVersion() { delete value; }
 
     TxManagedMap<EltType>* value;
+    // True if value is a leaf-level map, and so may be burst.
+    bool leaf;
     typename TxAware<EltType>::TimeBoundary times;
   };
 
+  typedef std::function<grpc::Status(TxManagedMap<EltType>* map,
+                                     const char* child_key)> ChildEdit;
+
   typedef std::multimap<Transaction::Id, uint8_t>::iterator TxEditsIterator;
 
   /************************* Private methods ****************************/
@@ -1035,6 +655,32 @@ class TxAwareTrieNode : public TxManagedMap<EltType> {
     return ret_val;
   }
 
+  // Removes all of tx's entries from tx_edits_map_, collecting the indices
+  // they refer to.
+  void TakeTxEdits(const Transaction* tx, FlatSet<uint8_t>* indices) {
+    std::pair<TxEditsIterator, TxEditsIterator> range = TxEditsRange(tx);
+    for (TxEditsIterator it = range.first; it != range.second; ++it) {
+      indices->insert(it->second);
+    }
+    tx_edits_map_.erase(range.first, range.second);
+  }
+
+  void EraseTxEdit(uint8_t index, const Transaction* tx) {
+    std::pair<TxEditsIterator, TxEditsIterator> range = TxEditsRange(tx);
+    for (TxEditsIterator it = range.first; it != range.second; ++it) {
+      if (it->second == index) {
+        tx_edits_map_.erase(it);
+        return;
+      }
+    }
+  }
+
+  void RecordEdit(uint8_t index, const Transaction* tx) {
+    if (edits_[index].edit_transactions.insert(tx).second) {
+      tx_edits_map_.insert(std::make_pair(tx->id(), index));
+    }
+  }
+
   inline uint8_t IndexFromKey(const char* key) const {
     // fwiw, static_cast and implicit cast are the same. The idea here is
     // just to signal intent: we really do mean to treat the char as an
@@ -1042,220 +688,455 @@ class TxAwareTrieNode : public TxManagedMap<EltType> {
     return static_cast<uint8_t>(key[0]);
   }
 
-  void CompleteWriteOperationWithGuard(const Transaction* tx) {
-    std::pair<TxEditsIterator, TxEditsIterator> range = TxEditsRange(tx);
+  // The portion of key held by the child map. The empty key stays empty.
+  inline const char* ChildKey(const char* key) const {
+    return key[0] == '\0' ? key : key + 1;
+  }
 
-    for (TxEditsIterator it = range.first; it != range.second; ++it) {
-      uint8_t index = it->second;
-      EditInfo& edit_info = edits_[index];
-      edit_info.edit_transactions.erase(tx);
-      switch (edit_info.state) {
-        case NOT_EDITING:
-          break;
-        case PASS_THROUGH:
-          (current_values_[index]).value->CompleteWriteOperation(tx);
-          break;
-        case CREATING:
-          // We are relying on state transition information here that says
-          // that whenever we do this assignment, the history information
-          // will be nullptr, and prior to that, is also a nullptr, so
-          // we don't need to update it.
-          historical_values_[index].times.remove = edit_info.time;
-          current_values_[index].times.create = edit_info.time;
-          current_values_[index].times.remove = acumio::time::END_OF_TIME;
-          current_values_[index].value = edit_info.edit_value;
-          edit_info.edit_value = nullptr;
-          edit_info.time = UINT64_C(0);
-          edit_info.state = NOT_EDITING;
-          // edit_transactions should already be empty.
-          populated_.insert(index);
-          break;
-        case BURSTING:
-          historical_values_[index].value = current_values_[index].value;
-          historical_values_[index].times.create =
-              current_values_[index].times.create;
-          historical_values_[index].times.remove = edit_info.time;
-          current_values_[index].value = edit_info.edit_value;
-          current_values_[index].times.create = edit_info.time;
-          current_values_[index].times.remove = acumio::time::END_OF_TIME;
-          edit_info.edit_value = nullptr;
-          edit_info.state = NOT_EDITING;
-          edit_info.time = UINT64_C(0);
-          // edit_transactions should already be empty.
-          // populated_ should already contain the index.
-          break;
-        default:
-          // TODO: Log a fatal error here. This should never happen, and
-          //       indicates that we failed to update this case-statement
-          //       to handle a new enum value. Either that or edit_info.state
-          //       has been corrupted to an illegal value.
-          return;
+  // A child reporting OUT_OF_RANGE has run out of room. We can only do
+  // something about that if it is a leaf, and not at index 0 (every key
+  // there is empty, so bursting would not spread them out).
+  inline bool IsBurstCondition(const grpc::Status& result, uint8_t index,
+                               bool leaf) const {
+    return result.error_code() == grpc::StatusCode::OUT_OF_RANGE &&
+           leaf && index != 0;
+  }
+
+  // Applies edit, on behalf of tx, to the child map for key. This is the
+  // common structure of Add, Remove and Replace. If there is no child map
+  // and creates_child is true, a new leaf is created for the edit.
+  grpc::Status EditChild(const char* key, const Transaction* tx,
+                         uint64_t tx_time, bool creates_child,
+                         const ChildEdit& edit) {
+    if (key == nullptr) {
+      return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                          "key must not be null.");
+    }
+
+    uint8_t index = IndexFromKey(key);
+    const char* child_key = ChildKey(key);
+
+    {
+      SharedLock read_lock(*guard_);
+      bool handled = false;
+      grpc::Status ret_val = TryPassThrough(index, child_key, tx, tx_time,
+                                            edit, &handled);
+      if (handled) {
+        return ret_val;
       }
     }
-  }
 
-  void RollbackWithGuard(const Transaction* tx) {
-    std::pair<TxEditsIterator, TxEditsIterator> range = TxEditsRange(tx);
+    // The edit changes this node (or needs to clean up after others that
+    // would), so it needs the ExclusiveLock.
+    acumio::transaction::ExclusiveLock lock(*guard_);
+    // First, we verify Transaction info.
+    Transaction::AtomicInfo current_tx_info = tx->GetAtomicInfo();
+    if (current_tx_info.operation_start_time != tx_time) {
+      return grpc::Status(grpc::StatusCode::DEADLINE_EXCEEDED,
+        "The transaction timed out before completion.");
+    }
 
-    for (TxEditsIterator it = range.first; it != range.second; ++it) {
-      uint8_t index = it->second;
-      EditInfo& edit_info = edits_[index];
-      // This will be a no-op if the tx is not present.
-      edit_info.edit_transactions.erase(tx);
-      if (edit_info.state != NOT_EDITING) {
-        if (edit_info.state == PASS_THROUGH) {
-          (current_values_[index]).value->Rollback(tx);
-        }
+    EditInfo& edit_info = edits_[index];
+    MapVersion& current_version = current_values_[index];
+    grpc::Status ret_val = VerifyNoConflictingEdits(index, tx, tx_time);
+    if (!ret_val.ok()) {
+      return ret_val;
+    }
 
-        if (edit_info.edit_transactions.size() == 0) {
-          edit_info.state = NOT_EDITING;
-          edit_info.time = UINT64_C(0);
-          delete edit_info.edit_value;
-          edit_info.edit_value = nullptr;
-        }
+    if (edit_info.state == CREATING || edit_info.state == BURSTING) {
+      // VerifyNoConflictingEdits guarantees that tx owns this edit, so
+      // we simply keep editing the replacement map.
+      ret_val = edit(edit_info.edit_value, child_key);
+      if (!IsBurstCondition(ret_val, index, edit_info.leaf)) {
+        return ret_val;
+      }
+      TxManagedMap<EltType>* burst = nullptr;
+      ret_val = BurstCopy(*edit_info.edit_value, tx, tx_time, child_key, edit,
+                          &burst);
+      if (ret_val.ok()) {
+        delete edit_info.edit_value;
+        edit_info.edit_value = burst;
+        edit_info.leaf = false;
       }
+      return ret_val;
     }
-  }
 
-  grpc::Status VerifyNoConflictingEdits(const Transaction* tx,
-      EditInfo& edit_info, MapVersion& current_version, uint64_t tx_time) {
-    FlatSet<const Transaction*, TxPointerLess>& edit_transactions =
-        edit_info.edit_transactions;
-    // Counter-intuitively, we do not increment the iterator in this loop.
-    // The reason is that the rollback and completion operations each
-    // decrease the size of the list. Instead, we will increment inside the
-    // loop for those cases that need it.
-    auto it = edit_transactions.begin();
-    while (it != edit_transactions.end()) {
-      const Transaction* current_tx = *it;
-      Transaction::AtomicInfo current_state_time = current_tx->GetAtomicInfo();
-      Transaction::State tx_state = current_state_time.state;
-      switch(tx_state) {
-        case Transaction::NOT_STARTED: // Intentional fall-through to next case.
-        case Transaction::READ:
-          // If we reach this condition, we have a re-purposed transaction
-          // that was not properly rolled back previously. Push the rollback
-          // operation forward.
-          RollbackWithGuard(current_tx);
-          break;
-        case Transaction::WRITE:
-          if (edit_info.state == CREATING || edit_info.state == BURSTING) {
-            if (current_tx->id() != tx->id()) {
-              if (current_state_time.operation_start_time  == edit_info.time) {
-                return grpc::Status(grpc::StatusCode::ABORTED,
-                                    "concurrency exception.");
-              } else {
-                RollbackWithGuard(current_tx);
-              }
-            }
-          } else if (edit_info.state == NOT_EDITING) {
-            RollbackWithGuard(current_tx);
-          } else {
-            // assert: edit_info.state == PASS_THROUGH. Skip past this
-            // transaction and continue looking at others.
-            it++;
-          }
-          break;
-        case Transaction::COMPLETING_WRITE:
-          CompleteWriteOperationWithGuard(current_tx);
-          break;
-        case Transaction::COMMITTED:
-          // If we reach here, we have probably encountered the cruft of a
-          // previously timed-out transaction where the transaction has since
-          // then been re-purposed and then committed.
-          RollbackWithGuard(current_tx);
-          break;
-        case Transaction::ROLLED_BACK:
-          RollbackWithGuard(current_tx);
-          break;
-        default:
-          return grpc::Status(grpc::StatusCode::INTERNAL,
-                              "Coding issue. Did not fix switch.");
+    // assert: edit_info.state == NOT_EDITING ||
+    //         edit_info.state == PASS_THROUGH
+    if (current_version.value == nullptr) {
+      if (!creates_child) {
+        return grpc::Status(grpc::StatusCode::NOT_FOUND,
+                            "unable to find key.");
+      }
+      // assert: edit_info.state == NOT_EDITING
+      TxManagedMap<EltType>* created = leaf_factory_->CreateNew(tx_time);
+      ret_val = edit(created, child_key);
+      if (!ret_val.ok()) {
+        delete created;
+        return ret_val;
+      }
+      StartReplacement(index, CREATING, created, true, tx, tx_time);
+      return grpc::Status::OK;
+    }
+
+    ret_val = edit(current_version.value, child_key);
+    if (ret_val.ok()) {
+      if (edit_info.state == NOT_EDITING) {
+        edit_info.state = PASS_THROUGH;
+        edit_info.time = tx_time;
       }
+      RecordEdit(index, tx);
+      return grpc::Status::OK;
     }
 
-    if (tx_time < current_version.times.create ||
-        (current_version.times.remove != acumio::time::END_OF_TIME &&
-         tx_time < current_version.times.remove)) {
-      return grpc::Status(grpc::StatusCode::ABORTED, "concurrency exception.");
+    if (!IsBurstCondition(ret_val, index, current_version.leaf)) {
+      return ret_val;
     }
 
-    return grpc::Status::OK;
-  }
+    // If we have reached here, we should burst the current value
+    // and create a new edit version with the burst value. However,
+    // if other transactions have pending edits on the current value,
+    // we should just return a concurrency exception: the burst copy
+    // would not carry their edits.
+    // Notice that when we initially check for a possible conflict with an
+    // existing transaction, we might not have noticed this condition,
+    // because we only noticed the need to burst the node after we did
+    // the initial conflict-check. It's the need to burst the node that
+    // causes us to require that there are not conflicting transactions.
+    FlatSet<const Transaction*, TxPointerLess>& editors =
+        edit_info.edit_transactions;
+    if (editors.size() > 1 || (editors.size() == 1 && editors.count(tx) == 0)) {
+      return grpc::Status(grpc::StatusCode::ABORTED,
+                          "concurrency exception.");
+    }
 
-  grpc::Status BurstAndAdd(const char* key, uint32_t value, EditInfo& edit_info,
-      MapVersion& current_version, const Transaction* tx, uint64_t tx_time) {
-    edit_info.edit_value =
-        intermediate_factory_->CreateCopy(current_version.value,
-                                          tx_time);
-    grpc::Status ret_val = edit_info.edit_value->Add(key, value, tx, tx_time);
+    TxManagedMap<EltType>* burst = nullptr;
+    ret_val = BurstCopy(*current_version.value, tx, tx_time, child_key, edit,
+                        &burst);
     if (!ret_val.ok()) {
-      delete edit_info.edit_value;
-      edit_info.edit_value = nullptr;
       return ret_val;
     }
-
-    edit_info.edit_transactions.insert(tx);
-    edit_info.state = BURSTING;
-    edit_info.time = tx_time;
+    if (editors.erase(tx) != 0) {
+      // tx's earlier edits to the leaf were carried into the burst copy,
+      // so the leaf goes into history without them.
+      current_version.value->Rollback(tx);
+    }
+    StartReplacement(index, BURSTING, burst, false, tx, tx_time);
     return grpc::Status::OK;
   }
 
-  grpc::Status BurstAndRemove(const char* key, EditInfo& edit_info,
-      MapVersion& current_version, const Transaction* tx, uint64_t tx_time) {
-    edit_info.edit_value =
-        intermediate_factory_->CreateCopy(current_version.value,
-                                          tx_time);
-    grpc::Status ret_val = edit_info.edit_value->Remove(key, tx, tx_time);
-    if (!ret_val.ok()) {
-      delete edit_info.edit_value;
-      edit_info.edit_value = nullptr;
+  // Assumes you hold a SharedLock on guard_. The common case of an edit:
+  // passing it through to an existing child map, which arbitrates any
+  // conflicts with other transactions passing through. This only changes
+  // the edit bookkeeping, under edits_guard_, so any number of writers can
+  // do it at once. Sets *handled to false, without changing anything, if
+  // the edit needs the ExclusiveLock instead: to create or burst the child,
+  // or to push along the edits of other transactions.
+  grpc::Status TryPassThrough(uint8_t index, const char* child_key,
+                              const Transaction* tx, uint64_t tx_time,
+                              const ChildEdit& edit, bool* handled) {
+    *handled = false;
+    const MapVersion& current_version = current_values_[index];
+    {
+      std::lock_guard<std::mutex> edits_lock(edits_guard_);
+      EditInfo& edit_info = edits_[index];
+      if (current_version.value == nullptr ||
+          (edit_info.state != NOT_EDITING &&
+           edit_info.state != PASS_THROUGH)) {
+        return grpc::Status::OK;
+      }
+      for (const Transaction* editor : edit_info.edit_transactions) {
+        if (editor->id() != tx->id() &&
+            editor->GetAtomicInfo().state != Transaction::WRITE) {
+          return grpc::Status::OK;
+        }
+      }
+      *handled = true;
+      if (tx->GetAtomicInfo().operation_start_time != tx_time) {
+        return grpc::Status(grpc::StatusCode::DEADLINE_EXCEEDED,
+          "The transaction timed out before completion.");
+      }
+      if (tx_time < current_version.times.create) {
+        return grpc::Status(grpc::StatusCode::ABORTED,
+                            "concurrency exception.");
+      }
+    }
+
+    grpc::Status ret_val = edit(current_version.value, child_key);
+    if (IsBurstCondition(ret_val, index, current_version.leaf)) {
+      *handled = false;
       return ret_val;
     }
+    if (ret_val.ok()) {
+      std::lock_guard<std::mutex> edits_lock(edits_guard_);
+      EditInfo& edit_info = edits_[index];
+      if (edit_info.state == NOT_EDITING) {
+        edit_info.state = PASS_THROUGH;
+        edit_info.time = tx_time;
+      }
+      RecordEdit(index, tx);
+    }
+    return ret_val;
+  }
 
-    edit_info.edit_transactions.insert(tx);
-    edit_info.state = BURSTING;
-    edit_info.time = tx_time;
-    return grpc::Status::OK;
+  // Assumes you hold a SharedLock on guard_. If every edit by tx in this
+  // node passes through to a child, forgets them all, collecting the
+  // children into *children so that the caller can complete or roll back
+  // tx in each, and returns true. Otherwise, changes nothing and returns
+  // false.
+  bool TakePassThroughEdits(const Transaction* tx,
+                            std::vector<TxManagedMap<EltType>*>* children) {
+    std::lock_guard<std::mutex> edits_lock(edits_guard_);
+    std::pair<TxEditsIterator, TxEditsIterator> range = TxEditsRange(tx);
+    for (TxEditsIterator it = range.first; it != range.second; ++it) {
+      EditState state = edits_[it->second].state;
+      if (state != NOT_EDITING && state != PASS_THROUGH) {
+        return false;
+      }
+    }
+    for (TxEditsIterator it = range.first; it != range.second; ++it) {
+      uint8_t index = it->second;
+      EditInfo& edit_info = edits_[index];
+      if (edit_info.edit_transactions.erase(tx) == 0 ||
+          edit_info.state != PASS_THROUGH) {
+        continue;
+      }
+      children->push_back(current_values_[index].value);
+      if (edit_info.edit_transactions.size() == 0) {
+        edit_info.state = NOT_EDITING;
+        edit_info.time = UINT64_C(0);
+      }
+    }
+    tx_edits_map_.erase(range.first, range.second);
+    return true;
   }
 
-  grpc::Status BurstAndRemove(const char* key, uint32_t value,
-      EditInfo& edit_info, MapVersion& current_version, const Transaction* tx,
-      uint64_t tx_time) {
-    edit_info.edit_value =
-        intermediate_factory_->CreateCopy(current_version.value,
-                                          tx_time);
-    grpc::Status ret_val = edit_info.edit_value->Remove(key, value, tx,
-                                                        tx_time);
+  // Creates an intermediate node holding the entries of leaf (as tx sees
+  // them), and applies edit to it.
+  grpc::Status BurstCopy(const TxManagedMap<EltType>& leaf,
+                         const Transaction* tx, uint64_t tx_time,
+                         const char* child_key, const ChildEdit& edit,
+                         TxManagedMap<EltType>** burst) {
+    TxManagedMap<EltType>* copy = nullptr;
+    grpc::Status ret_val = intermediate_factory_->CreateCopy(leaf, tx, tx_time,
+                                                             &copy);
     if (!ret_val.ok()) {
-      delete edit_info.edit_value;
-      edit_info.edit_value = nullptr;
       return ret_val;
     }
+    ret_val = edit(copy, child_key);
+    if (!ret_val.ok()) {
+      delete copy;
+      return ret_val;
+    }
+    *burst = copy;
+    return grpc::Status::OK;
+  }
 
-    edit_info.edit_transactions.insert(tx);
-    edit_info.state = BURSTING;
+  void StartReplacement(uint8_t index, EditState state,
+                        TxManagedMap<EltType>* replacement, bool leaf,
+                        const Transaction* tx, uint64_t tx_time) {
+    EditInfo& edit_info = edits_[index];
+    edit_info.state = state;
     edit_info.time = tx_time;
-    return grpc::Status::OK;
+    edit_info.edit_value = replacement;
+    edit_info.leaf = leaf;
+    RecordEdit(index, tx);
+    // Readers need to find the index once the edit becomes visible, which
+    // happens as soon as tx starts completing its write.
+    populated_.insert(index);
   }
 
-  grpc::Status BurstAndReplace(const char* key, uint32_t value,
-      EditInfo& edit_info, MapVersion& current_version, const Transaction* tx,
-      uint64_t tx_time) {
-    edit_info.edit_value =
-        intermediate_factory_->CreateCopy(current_version.value,
-                                          tx_time);
-    grpc::Status ret_val = edit_info.edit_value->Replace(key, value, tx,
-                                                         tx_time);
-    if (!ret_val.ok()) {
-      delete edit_info.edit_value;
-      edit_info.edit_value = nullptr;
-      return ret_val;
+  void CompleteWriteOperationWithGuard(const Transaction* tx) {
+    if (tx->GetAtomicInfo().state != Transaction::COMPLETING_WRITE) {
+      return;
+    }
+    FlatSet<uint8_t> indices(4);
+    TakeTxEdits(tx, &indices);
+    FlatSet<uint8_t>::iterator end = indices.end();
+    for (FlatSet<uint8_t>::iterator it = indices.begin(); it != end; ++it) {
+      CompleteIndex(*it, tx);
+    }
+  }
+
+  void RollbackWithGuard(const Transaction* tx) {
+    FlatSet<uint8_t> indices(4);
+    TakeTxEdits(tx, &indices);
+    FlatSet<uint8_t>::iterator end = indices.end();
+    for (FlatSet<uint8_t>::iterator it = indices.begin(); it != end; ++it) {
+      RollbackIndex(*it, tx);
+    }
+  }
+
+  // Assumes tx is COMPLETING_WRITE.
+  void CompleteIndex(uint8_t index, const Transaction* tx) {
+    EditInfo& edit_info = edits_[index];
+    if (edit_info.edit_transactions.erase(tx) == 0) {
+      return;
+    }
+    EraseTxEdit(index, tx);
+    MapVersion& current_version = current_values_[index];
+    switch (edit_info.state) {
+      case NOT_EDITING:
+        break;
+      case PASS_THROUGH:
+        current_version.value->CompleteWriteOperation(tx);
+        if (edit_info.edit_transactions.size() == 0) {
+          edit_info.state = NOT_EDITING;
+          edit_info.time = UINT64_C(0);
+        }
+        break;
+      case CREATING: // Intentional fall-through to next case.
+      case BURSTING: {
+        if (tx->operation_start_time() != edit_info.time) {
+          // Left over from an earlier use of this Transaction.
+          DiscardReplacement(index);
+          break;
+        }
+        edit_info.edit_value->CompleteWriteOperation(tx);
+        if (edit_info.state == BURSTING) {
+          // When bursting, the current value is a leaf, and leaves never
+          // have a history, so there is nothing to lose here.
+          MapVersion& historical_version = historical_values_[index];
+          delete historical_version.value;
+          historical_version.value = current_version.value;
+          historical_version.leaf = current_version.leaf;
+          historical_version.times.create = current_version.times.create;
+          historical_version.times.remove = edit_info.time;
+        }
+        current_version.value = edit_info.edit_value;
+        current_version.leaf = edit_info.leaf;
+        current_version.times.create = edit_info.time;
+        current_version.times.remove = acumio::time::END_OF_TIME;
+        edit_info.edit_value = nullptr;
+        edit_info.leaf = false;
+        edit_info.state = NOT_EDITING;
+        edit_info.time = UINT64_C(0);
+        break;
+      }
+      default:
+        // TODO: Log a fatal error here. This should never happen, and
+        //       indicates that we failed to update this case-statement
+        //       to handle a new enum value. Either that or edit_info.state
+        //       has been corrupted to an illegal value.
+        return;
+    }
+  }
+
+  void RollbackIndex(uint8_t index, const Transaction* tx) {
+    EditInfo& edit_info = edits_[index];
+    if (edit_info.edit_transactions.erase(tx) == 0) {
+      return;
+    }
+    EraseTxEdit(index, tx);
+    switch (edit_info.state) {
+      case NOT_EDITING:
+        break;
+      case PASS_THROUGH:
+        current_values_[index].value->Rollback(tx);
+        if (edit_info.edit_transactions.size() == 0) {
+          edit_info.state = NOT_EDITING;
+          edit_info.time = UINT64_C(0);
+        }
+        break;
+      case CREATING: // Intentional fall-through to next case.
+      case BURSTING:
+        DiscardReplacement(index);
+        break;
+      default:
+        return;
+    }
+  }
+
+  void DiscardReplacement(uint8_t index) {
+    EditInfo& edit_info = edits_[index];
+    delete edit_info.edit_value;
+    edit_info.edit_value = nullptr;
+    edit_info.leaf = false;
+    edit_info.state = NOT_EDITING;
+    edit_info.time = UINT64_C(0);
+    if (current_values_[index].value == nullptr &&
+        historical_values_[index].value == nullptr) {
+      populated_.erase(index);
+    }
+  }
+
+  // Resolves the pending edits of other transactions at index, so that tx
+  // may edit it: edits of finished or abandoned transactions are pushed to
+  // completion or rolled back, while a live transaction that is replacing
+  // the child map is a conflict. Pending PASS_THROUGH edits are left for
+  // the child map to arbitrate.
+  grpc::Status VerifyNoConflictingEdits(uint8_t index, const Transaction* tx,
+                                        uint64_t tx_time) {
+    EditInfo& edit_info = edits_[index];
+    FlatSet<const Transaction*, TxPointerLess>& edit_transactions =
+        edit_info.edit_transactions;
+    // Rollback and completion each remove a transaction from the set, which
+    // invalidates our iterator; after each, we start over from the beginning.
+    bool restart = true;
+    while (restart) {
+      restart = false;
+      FlatSet<const Transaction*, TxPointerLess>::iterator end =
+          edit_transactions.end();
+      for (FlatSet<const Transaction*, TxPointerLess>::iterator it =
+               edit_transactions.begin(); it != end; ++it) {
+        const Transaction* current_tx = *it;
+        bool replacing = (edit_info.state == CREATING ||
+                          edit_info.state == BURSTING);
+        if (current_tx->id() == tx->id()) {
+          if (replacing && edit_info.time != tx_time) {
+            // Left over from an earlier use of this Transaction.
+            RollbackIndex(index, current_tx);
+            restart = true;
+            break;
+          }
+          continue;
+        }
+
+        Transaction::AtomicInfo current_state_time =
+            current_tx->GetAtomicInfo();
+        switch(current_state_time.state) {
+          case Transaction::WRITE:
+            if (!replacing) {
+              // assert: edit_info.state == PASS_THROUGH. Skip past this
+              // transaction and continue looking at others.
+              continue;
+            }
+            if (current_state_time.operation_start_time == edit_info.time) {
+              return grpc::Status(grpc::StatusCode::ABORTED,
+                                  "concurrency exception.");
+            }
+            // The Transaction was timed out and re-purposed.
+            RollbackIndex(index, current_tx);
+            break;
+          case Transaction::COMPLETING_WRITE:
+            CompleteWriteOperationWithGuard(current_tx);
+            // In case the completion did not cover this index (as when the
+            // edit is left over from an earlier use of the Transaction).
+            CompleteIndex(index, current_tx);
+            break;
+          case Transaction::NOT_STARTED: // Intentional fall-through.
+          case Transaction::READ:        // Intentional fall-through.
+          case Transaction::COMMITTED:   // Intentional fall-through.
+          case Transaction::ROLLED_BACK:
+            // If we reach this condition, we have the cruft of a transaction
+            // that was not properly completed or rolled back here (e.g., it
+            // timed out and has since been re-purposed). Push the rollback
+            // operation forward.
+            RollbackIndex(index, current_tx);
+            break;
+          default:
+            return grpc::Status(grpc::StatusCode::INTERNAL,
+                                "Coding issue. Did not fix switch.");
+        }
+        restart = true;
+        break;
+      }
+    }
+
+    if (tx_time < current_values_[index].times.create) {
+      return grpc::Status(grpc::StatusCode::ABORTED, "concurrency exception.");
     }
 
-    edit_info.edit_transactions.insert(tx);
-    edit_info.state = BURSTING;
-    edit_info.time = tx_time;
     return grpc::Status::OK;
   }
 
@@ -1265,7 +1146,8 @@ class TxAwareTrieNode : public TxManagedMap<EltType> {
     const EditInfo& edit_info = edits_[index];
 
     if ((edit_info.state == CREATING || edit_info.state == BURSTING) &&
-        (edit_info.time <= access_time && edit_info.time != UINT64_C(0))) {
+        edit_info.time <= access_time &&
+        edit_info.edit_transactions.size() != 0) {
       const Transaction* tx = *(edit_info.edit_transactions.begin());
       Transaction::AtomicInfo tx_info;
       uint64_t tx_complete_time;
@@ -1279,16 +1161,14 @@ class TxAwareTrieNode : public TxManagedMap<EltType> {
     }
 
     const MapVersion& current_info = current_values_[index];
-    if (current_info.times.create <= access_time) {
-      if (current_info.times.remove <= access_time) {
-        return nullptr;
-      }
-
+    if (current_info.value != nullptr &&
+        current_info.times.create <= access_time) {
       return current_info.value;
     }
 
     const MapVersion& historical_info = historical_values_[index];
-    if (historical_info.times.create > access_time ||
+    if (historical_info.value == nullptr ||
+        historical_info.times.create > access_time ||
         historical_info.times.remove <= access_time) {
       return nullptr;
     }
@@ -1296,6 +1176,21 @@ class TxAwareTrieNode : public TxManagedMap<EltType> {
     return historical_info.value;
   }
 
+  // Assumes you already have a read-lock. The map tx should see when
+  // editing at tx_time: its own replacement map if it has one.
+  const TxManagedMap<EltType>* MapVersionForEdit(uint8_t index,
+                                                 const Transaction* tx,
+                                                 uint64_t tx_time) const {
+    const EditInfo& edit_info = edits_[index];
+    if (tx != nullptr &&
+        (edit_info.state == CREATING || edit_info.state == BURSTING) &&
+        edit_info.time == tx_time &&
+        edit_info.edit_transactions.count(tx) != 0) {
+      return edit_info.edit_value;
+    }
+    return MapVersionAtTime(index, tx_time);
+  }
+
   // Assumes you already have a read-lock.
   std::unique_ptr<TxBasicIterator>
   IndexedBeginIterator(uint8_t index, uint64_t access_time) const {
@@ -1312,7 +1207,7 @@ class TxAwareTrieNode : public TxManagedMap<EltType> {
   IndexedReverseBeginIterator(uint8_t index, uint64_t access_time) const {
     const TxManagedMap<EltType>* map = MapVersionAtTime(index, access_time);
     if (map == nullptr) {
-      return map->Begin(access_time);
+      return std::unique_ptr<TxBasicIterator>(nullptr);
     }
 
     return map->ReverseBegin(access_time);
@@ -1338,34 +1233,43 @@ class TxAwareTrieNode : public TxManagedMap<EltType> {
       return std::unique_ptr<TxBasicIterator>(nullptr);
     }
 
-    return map->LowerBound(key + 1, access_time);
+    return map->LowerBound(ChildKey(key), access_time);
   }
 
   // ****************  Primary Private Attributes *********************** //
-  mutable SharedMutex guard_;
+  SharedMutex own_guard_;
+  // Either &own_guard_ or the guard provided at construction.
+  SharedMutex* guard_;
 
   TxManagedMapFactory<EltType>* leaf_factory_;
   TxManagedMapFactory<EltType>* intermediate_factory_;
 
   // For each index, there will only be a single historical_value at most.
   // Possible configurations:
-  //   1. current value is nullptr with date-range [0,end-of-time)
-  //      history value is nullptr with date-range [0,0)
+  //   1. current value is nullptr
+  //      history value is nullptr
   //   2. current value is leaf-level with date-range [t1,end-of-time)
-  //      history value is nullptr with date-range [0,t1)
+  //      history value is nullptr
   //   3. current value is intermediate with date-range [t2,end-of-time)
   //      history value is leaf-level with date-range [t1,t2)
+  //   4. current value is intermediate with date-range [t2,end-of-time)
+  //      history value is nullptr (after CleanVersions).
   MapVersion current_values_[256];
   MapVersion historical_values_[256];
 
-  // This reflects the union of current_values_ and historical_values_.
-  // The point of this set is to speed up the process of iterating over
-  // all values. If x is an element of populated_ then either
-  // current_values_[x] is populated with a map or historical_values[x]
-  // is populated with a map.
+  // This reflects the union of current_values_ and historical_values_,
+  // plus any index with a map being created. The point of this set is to
+  // speed up the process of iterating over all values. If x is an element
+  // of populated_ then either current_values_[x] is populated with a map,
+  // historical_values[x] is populated with a map, or edits_[x] is creating
+  // one.
   FlatSet<uint8_t> populated_;
 
   // **************** Edit Private Attributes ************************* //
+  // Writers holding only a SharedLock on guard_ (see TryPassThrough) take
+  // this to change edits_ and tx_edits_map_. Anyone holding the
+  // ExclusiveLock on guard_ can change them without it.
+  std::mutex edits_guard_;
   // When CompleteWriteOperation or Rollback gets invoked, we need to be
   // able to efficiently locate all edits related to the operation. The
   // tx_edits_map_ will enable that. When reading data, we need to see which
@@ -1374,6 +1278,40 @@ class TxAwareTrieNode : public TxManagedMap<EltType> {
   EditInfo edits_[256];
 };
 
+// Creates the intermediate TxAwareTrieNodes of a TxAwareBurstTrie; the
+// leaves beneath them come from leaf_factory, which is not owned.
+template <typename EltType>
+class TxAwareTrieNodeFactory : public TxManagedMapFactory<EltType> {
+ public:
+  TxAwareTrieNodeFactory(TxManagedMapFactory<EltType>* leaf_factory,
+                         ObjectAllocator<EltType>* object_allocator,
+                         bool allow_duplicates = false) :
+      TxManagedMapFactory<EltType>(object_allocator, allow_duplicates),
+      leaf_factory_(leaf_factory) {}
+  ~TxAwareTrieNodeFactory() {}
+
+  TxManagedMap<EltType>* CreateNew(uint64_t create_time) {
+    return new TxAwareTrieNode<EltType>(leaf_factory_, this,
+                                        this->object_allocator_,
+                                        this->allow_duplicates_);
+  }
+
+  grpc::Status CreateCopy(const TxManagedMap<EltType>& other,
+                          const Transaction* tx, uint64_t create_time,
+                          TxManagedMap<EltType>** copy) {
+    std::unique_ptr<TxManagedMap<EltType>> created(CreateNew(create_time));
+    grpc::Status result = this->LoadFrom(other, tx, create_time,
+                                         created.get());
+    if (result.ok()) {
+      *copy = created.release();
+    }
+    return result;
+  }
+
+ private:
+  TxManagedMapFactory<EltType>* leaf_factory_;
+};
+
 } // namespace collection
 } // acumio
 
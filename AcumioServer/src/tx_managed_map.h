@@ -10,6 +10,7 @@
 //============================================================================
 
 #include <grpc++/support/status.h>
+#include <functional>
 #include <memory>
 #include <string>
 
@@ -42,6 +43,8 @@ typedef DelegatingIterator<MapIterElement> TxManagedIterator;
 
 class UnadaptedTxManagedMap {
  public:
+  typedef std::function<void(const char* key, uint32_t value)> EntryVisitor;
+
   UnadaptedTxManagedMap(bool allow_duplicates);
 
   // Same as UnadaptedTxManagedMap(false);
@@ -119,6 +122,21 @@ class UnadaptedTxManagedMap {
   virtual void CompleteWriteOperation(const Transaction* tx) = 0;
   virtual void Rollback(const Transaction* tx) = 0;
 
+  // Adds an entry that is already committed as of create_time, bypassing
+  // the transactional edit state. This is only valid for a map that is not
+  // yet visible to any other thread: we use it to populate the copy made
+  // when bursting a node, and for bulk loading.
+  virtual grpc::Status Load(const char* key, uint32_t value,
+                            uint64_t create_time) = 0;
+
+  // Visits every entry in key order as tx sees the map at tx_time: that is,
+  // the state as of tx_time plus any edits tx itself has made but not yet
+  // committed. A null tx visits just the state as of tx_time. Bursting uses
+  // this, since the bursting transaction may already have edited the map
+  // being burst.
+  virtual grpc::Status VisitForEdit(const Transaction* tx, uint64_t tx_time,
+                                    const EntryVisitor& visitor) const = 0;
+
   // This takes care of the operation of registering the triple:
   // AddCallback, CompleteWriteCallback, and RollbackCallback with
   // the Transaction.
@@ -179,7 +197,7 @@ class TxManagedMap : public UnadaptedTxManagedMap {
     uint32_t value_position;
     grpc::Status ret_val = GetValuePosition(key, &value_position, access_time);
     if (ret_val.ok()) {
-      *value = object_allocator_->ObjectAt(value_position);
+      *value = object_allocator_->CopyObjectAt(value_position);
     }
     return ret_val;
   }
@@ -203,7 +221,7 @@ class TxManagedMap : public UnadaptedTxManagedMap {
     uint32_t value_position;
     grpc::Status ret_val = GetValuePosition(key, &value_position, access_time);
     if (ret_val.ok()) {
-      *value = &(object_allocator_->ObjectAt(value_position));
+      *value = &(object_allocator_->ModifiableObjectAt(value_position));
     }
     return ret_val;
   }
@@ -214,6 +232,48 @@ class TxManagedMap : public UnadaptedTxManagedMap {
   ObjectAllocator<EltType>* object_allocator_;
 };
 
+// Creates the maps that make up a composite TxManagedMap, such as the
+// leaves and intermediate nodes of a TxAwareBurstTrie.
+template <typename EltType>
+class TxManagedMapFactory {
+ public:
+  TxManagedMapFactory(ObjectAllocator<EltType>* object_allocator,
+                      bool allow_duplicates = false) :
+      object_allocator_(object_allocator),
+      allow_duplicates_(allow_duplicates) {}
+  TxManagedMapFactory() :  TxManagedMapFactory(nullptr, false) {}
+  virtual ~TxManagedMapFactory() {}
+
+  // Caller must assume ownership of generated object.
+  virtual TxManagedMap<EltType>* CreateNew(uint64_t create_time) = 0;
+
+  // Creates a map holding the entries of other as tx sees them at
+  // create_time (see VisitForEdit), loaded as though committed at
+  // create_time. On success, the caller must assume ownership of *copy.
+  virtual grpc::Status CreateCopy(const TxManagedMap<EltType>& other,
+                                  const Transaction* tx, uint64_t create_time,
+                                  TxManagedMap<EltType>** copy) = 0;
+
+ protected:
+  // Loads the entries of other, as tx sees them at create_time, into
+  // target. Used to implement CreateCopy.
+  static grpc::Status LoadFrom(const TxManagedMap<EltType>& other,
+                               const Transaction* tx, uint64_t create_time,
+                               TxManagedMap<EltType>* target) {
+    grpc::Status load_result;
+    grpc::Status visit_result = other.VisitForEdit(tx, create_time,
+        [target, create_time, &load_result](const char* key, uint32_t value) {
+          if (load_result.ok()) {
+            load_result = target->Load(key, value, create_time);
+          }
+        });
+    return visit_result.ok() ? load_result : visit_result;
+  }
+
+  ObjectAllocator<EltType>* object_allocator_;
+  bool allow_duplicates_;
+};
+
 } // namespace collection
 } // namespace acumio
 
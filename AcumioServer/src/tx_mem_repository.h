@@ -0,0 +1,543 @@
+#ifndef AcumioServer_tx_mem_repository_h
+#define AcumioServer_tx_mem_repository_h
+//============================================================================
+// Name        : tx_mem_repository.h
+// Author      : Bill Province (bill@acumio.com)
+// Version     :
+// Copyright   : Copyright (C) 2016 Acumio
+// Description : Provides templated multi-threaded access to an in-memory
+//               repository, using the same KeyExtractorInterface and
+//               ElementMutatorInterface as the MemRepository.
+//
+//               Unlike the MemRepository, this is threadsafe. Each element
+//               lives in a TxAware "slot," and the primary and secondary
+//               indexes are TxAwareBurstTries mapping keys to slot
+//               positions. Writes are registered with a WriteTransaction
+//               and only happen when it commits; reads are performed as of
+//               a given time, and so see a consistent snapshot without
+//               blocking writers. Two writers only conflict when they
+//               edit the same element or the same key of an index, in
+//               which case the later one fails with ABORTED. (An index
+//               leaf that has to be created or burst is the exception:
+//               only one writer at a time can do that to a given leaf.)
+//
+//               Keys are taken from Comparable::compare_string(), so the
+//               iteration order is the order of those strings. Since the
+//               indexes hold C-strings, compare strings must not contain
+//               '\0'. A secondary index entry is keyed by the secondary
+//               compare string, then SECONDARY_KEY_SEPARATOR, then the
+//               primary compare string, so secondary compare strings must
+//               not contain the separator either.
+//
+//               EltType must have a no-arg constructor.
+//============================================================================
+
+#include <memory>
+#include <sstream>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <grpc++/support/status.h>
+#include "comparable.h"
+#include "mem_repository.h"
+#include "object_allocator.h"
+#include "time_util.h"
+#include "transaction.h"
+#include "tx_aware.h"
+#include "tx_aware_burst_trie.h"
+#include "tx_managed_map.h"
+
+namespace acumio {
+
+namespace mem_repository {
+
+using acumio::collection::ObjectAllocator;
+using acumio::collection::TxAwareBurstTrie;
+using acumio::collection::TxBasicIterator;
+using acumio::transaction::Transaction;
+using acumio::transaction::TxAware;
+using acumio::transaction::WriteTransaction;
+
+template <class EltType>
+class TxMemRepository {
+ public:
+  typedef KeyExtractorInterface<EltType> Extractor;
+  typedef ElementMutatorInterface<EltType> Mutator;
+  typedef TxAware<EltType> Slot;
+  typedef std::shared_ptr<Slot> SlotPointer;
+  typedef TxAwareBurstTrie<SlotPointer> Index;
+
+  static const char SECONDARY_KEY_SEPARATOR = '\x01';
+  static const uint16_t DEFAULT_LEAF_KEY_SPACE = UINT16_C(2048);
+  static const uint8_t DEFAULT_LEAF_SIZE = UINT8_C(32);
+  // How many slots CleanVersionsWithin cleans between checks of the time.
+  static const uint32_t CLEAN_CHECK_INTERVAL = UINT32_C(64);
+
+  // Iterates over an index as of a fixed access time. Like the index
+  // iterators it wraps, this holds a read-lock on the index for its
+  // lifetime, so it must be destroyed before the same thread commits a
+  // write to this repository.
+  class Iterator {
+   public:
+    Iterator(const TxMemRepository* repository,
+             std::unique_ptr<TxBasicIterator> delegate,
+             uint64_t access_time) :
+        repository_(repository), delegate_(std::move(delegate)),
+        access_time_(access_time), element_() {}
+    Iterator(Iterator&& other) :
+        repository_(other.repository_), delegate_(std::move(other.delegate_)),
+        access_time_(other.access_time_), element_() {}
+    ~Iterator() {}
+
+    inline Iterator& operator++() {
+      ++(*delegate_);
+      return *this;
+    }
+
+    inline Iterator& operator--() {
+      --(*delegate_);
+      return *this;
+    }
+
+    inline bool operator==(const Iterator& other) const {
+      return *delegate_ == *(other.delegate_);
+    }
+
+    inline bool operator!=(const Iterator& other) const {
+      return *delegate_ != *(other.delegate_);
+    }
+
+    // The index key: for a secondary index, this includes the separator and
+    // primary key suffix.
+    inline std::string key() const { return (*delegate_)->key.ToString(); }
+
+    const EltType& operator*() const {
+      repository_->ElementAt((*delegate_)->value, access_time_, &element_);
+      return element_;
+    }
+
+    const EltType* operator->() const {
+      repository_->ElementAt((*delegate_)->value, access_time_, &element_);
+      return &element_;
+    }
+
+   private:
+    const TxMemRepository* repository_;
+    std::unique_ptr<TxBasicIterator> delegate_;
+    uint64_t access_time_;
+    mutable EltType element_;
+  };
+
+  // The extractors vector is *not* made const, because we perform a move
+  // operation on the contents of the vector, thereby passing ownership
+  // to the repository. Each index is a TxAwareBurstTrie whose leaves hold
+  // at most max_leaf_size entries in max_leaf_key_space bytes of keys.
+  TxMemRepository(std::unique_ptr<Extractor> main_extractor,
+                  std::vector<std::unique_ptr<Extractor>>* extractors,
+                  uint16_t max_leaf_key_space = DEFAULT_LEAF_KEY_SPACE,
+                  uint8_t max_leaf_size = DEFAULT_LEAF_SIZE) :
+      main_extractor_(std::move(main_extractor)), extractors_(), slots_(),
+      main_index_(&slots_, max_leaf_key_space, max_leaf_size), indices_(),
+      clean_phase_(0), clean_resume_key_() {
+    for (uint16_t i = 0; i < extractors->size(); i++) {
+      extractors_.push_back(std::move(extractors->at(i)));
+      indices_.push_back(std::unique_ptr<Index>(
+          new Index(&slots_, max_leaf_key_space, max_leaf_size)));
+    }
+  }
+
+  ~TxMemRepository() {}
+
+  inline uint16_t added_index_count() const {return indices_.size();}
+
+  inline const Extractor& main_extractor() const { return *main_extractor_; }
+  inline const Extractor& ith_extractor(int i) const {
+    return *(extractors_[i]);
+  }
+
+  inline uint32_t size(uint64_t access_time) const {
+    bool exists = false;
+    return main_index_.Size(access_time, &exists);
+  }
+
+  // The write operations below only register the operation with tx. The
+  // operation itself happens during tx->Commit(), which reports any
+  // failure, such as ALREADY_EXISTS or NOT_FOUND, or ABORTED if another
+  // transaction has a pending edit to the same element. Operations find
+  // elements by their committed keys as of the transaction's start, but
+  // build upon the edits earlier operations of the same transaction made to
+  // those elements. (So, e.g., one transaction cannot both Add an element
+  // and then Update it.)
+  void Add(const EltType& e, WriteTransaction* tx) {
+    std::shared_ptr<OpState> state(new OpState());
+    tx->AddOperation(
+        [this, e, state](const Transaction* t) { return DoAdd(e, t, state); },
+        [this, state](const Transaction* t) { CompleteOp(t, state); },
+        [this, state](const Transaction* t) { RollbackOp(t, state); });
+  }
+
+  void Remove(const Comparable& key, WriteTransaction* tx) {
+    std::shared_ptr<OpState> state(new OpState());
+    std::string key_string = key.compare_string();
+    tx->AddOperation(
+        [this, key_string, state](const Transaction* t) {
+          return DoRemove(key_string, t, state);
+        },
+        [this, state](const Transaction* t) { CompleteOp(t, state); },
+        [this, state](const Transaction* t) { RollbackOp(t, state); });
+  }
+
+  void Update(const Comparable& key, const EltType& new_value,
+              WriteTransaction* tx) {
+    ApplyMutation(key, std::shared_ptr<Mutator>(
+                      new ReplacementMutator<EltType>(new_value)), tx);
+  }
+
+  // The mutation may change the primary key, so long as the new key is not
+  // already in use.
+  void ApplyMutation(const Comparable& key, std::shared_ptr<Mutator> mutator,
+                     WriteTransaction* tx) {
+    std::shared_ptr<OpState> state(new OpState());
+    std::string key_string = key.compare_string();
+    tx->AddOperation(
+        [this, key_string, mutator, state](const Transaction* t) {
+          return DoMutate(key_string, mutator.get(), t, state);
+        },
+        [this, state](const Transaction* t) { CompleteOp(t, state); },
+        [this, state](const Transaction* t) { RollbackOp(t, state); });
+  }
+
+  grpc::Status Get(const Comparable& key, uint64_t access_time,
+                   EltType* elt) const {
+    uint32_t position;
+    grpc::Status result = main_index_.GetValuePosition(
+        key.compare_string().c_str(), &position, access_time);
+    if (result.ok() && !ElementAt(position, access_time, elt)) {
+      result = grpc::Status(grpc::StatusCode::NOT_FOUND, "");
+    }
+    if (!result.ok()) {
+      return NotFound(key.compare_string());
+    }
+    return grpc::Status::OK;
+  }
+
+  Iterator LowerBound(const Comparable& key, uint64_t access_time) const {
+    return Iterator(this, main_index_.LowerBound(key.compare_string().c_str(),
+                                                 access_time),
+                    access_time);
+  }
+
+  Iterator LowerBoundByIndex(const Comparable& key, int index_number,
+                             uint64_t access_time) const {
+    return Iterator(this, indices_[index_number]->LowerBound(
+                              key.compare_string().c_str(), access_time),
+                    access_time);
+  }
+
+  Iterator primary_begin(uint64_t access_time) const {
+    return Iterator(this, main_index_.Begin(access_time), access_time);
+  }
+
+  Iterator primary_end(uint64_t access_time) const {
+    return Iterator(this, main_index_.End(access_time), access_time);
+  }
+
+  Iterator secondary_begin(int index_number, uint64_t access_time) const {
+    return Iterator(this, indices_[index_number]->Begin(access_time),
+                    access_time);
+  }
+
+  Iterator secondary_end(int index_number, uint64_t access_time) const {
+    return Iterator(this, indices_[index_number]->End(access_time),
+                    access_time);
+  }
+
+  // Drops versions no longer visible at clean_time. This may be registered
+  // with TransactionManager::RegisterCleanable.
+  void CleanVersions(uint64_t clean_time) {
+    clean_phase_ = 0;
+    clean_resume_key_.clear();
+    CleanVersionsWithin(clean_time, acumio::time::END_OF_TIME);
+  }
+
+  // As CleanVersions, but stops once deadline_nanos (see
+  // TimerNanosSinceEpoch) has passed, returning false; the next call picks
+  // up where this one stopped. Returns true once everything has been
+  // cleaned. This may be registered with
+  // TransactionManager::RegisterBudgetedVersionCleaner.
+  bool CleanVersionsWithin(uint64_t clean_time, uint64_t deadline_nanos) {
+    if (clean_phase_ == 0) {
+      // Only elements present at clean_time can have versions that ended
+      // by then; those removed earlier go once the indexes let go of them.
+      // Scoped so that the iterators release their read-locks before we
+      // clean the indexes themselves.
+      std::unique_ptr<TxBasicIterator> it = clean_resume_key_.empty() ?
+          main_index_.Begin(clean_time) :
+          main_index_.LowerBound(clean_resume_key_.c_str(), clean_time);
+      std::unique_ptr<TxBasicIterator> end = main_index_.End(clean_time);
+      for (uint32_t cleaned = 1; *it != *end; ++(*it), cleaned++) {
+        slots_.CopyObjectAt((*it)->value)->CleanVersions(clean_time);
+        if (cleaned % CLEAN_CHECK_INTERVAL == 0 &&
+            acumio::time::TimerNanosSinceEpoch() >= deadline_nanos) {
+          ++(*it);
+          if (*it == *end) {
+            break;
+          }
+          clean_resume_key_ = (*it)->key.ToString();
+          return false;
+        }
+      }
+      clean_resume_key_.clear();
+      clean_phase_ = 1;
+      if (acumio::time::TimerNanosSinceEpoch() >= deadline_nanos) {
+        return false;
+      }
+    }
+    // Phase 1 cleans the main index, and phase i + 2 secondary index i.
+    while (clean_phase_ <= indices_.size()) {
+      if (clean_phase_ == 1) {
+        main_index_.CleanVersions(clean_time);
+      } else {
+        indices_[clean_phase_ - 2]->CleanVersions(clean_time);
+      }
+      clean_phase_++;
+      if (clean_phase_ <= indices_.size() &&
+          acumio::time::TimerNanosSinceEpoch() >= deadline_nanos) {
+        return false;
+      }
+    }
+    clean_phase_ = 0;
+    return true;
+  }
+
+ private:
+  // What an operation needs to remember between its OpFunction and its
+  // CompletionFunction or RollbackFunction.
+  struct OpState {
+    OpState() : slot(), slot_position(UINT32_C(0)), created_slot(false),
+        removed_slot(false) {}
+    SlotPointer slot;
+    uint32_t slot_position;
+    // The slot was allocated by this operation, and so the repository's
+    // reference to it must be dropped if the operation is rolled back.
+    bool created_slot;
+    // The element was removed, and so the repository's reference to it
+    // must be dropped when the operation completes.
+    bool removed_slot;
+  };
+
+  grpc::Status DoAdd(const EltType& e, const Transaction* tx,
+                     const std::shared_ptr<OpState>& state) {
+    uint64_t tx_time = tx->operation_start_time();
+    std::string key = main_extractor_->GetKey(e)->compare_string();
+    // The slot starts out with a reference held by the repository itself,
+    // for as long as the element is in the repository. The indexes add
+    // references of their own for as long as any version refers to it.
+    state->slot.reset(new Slot(EltType(), tx_time));
+    state->slot_position = slots_.Add(state->slot);
+    state->created_slot = true;
+
+    grpc::Status result = state->slot->Set(e, tx, tx_time);
+    if (result.ok()) {
+      result = main_index_.Add(key.c_str(), state->slot_position, tx,
+                               tx_time);
+      if (result.error_code() == grpc::StatusCode::ALREADY_EXISTS) {
+        std::stringstream error;
+        error << "Cannot add duplicate element with key: (\"" << key
+              << "\")";
+        result = grpc::Status(grpc::StatusCode::ALREADY_EXISTS, error.str());
+      }
+    }
+    for (uint16_t i = 0; result.ok() && i < indices_.size(); i++) {
+      result = indices_[i]->Add(SecondaryKey(i, e, key).c_str(),
+                                state->slot_position, tx, tx_time);
+    }
+
+    if (!result.ok()) {
+      RollbackOp(tx, state);
+    }
+    return result;
+  }
+
+  grpc::Status DoRemove(const std::string& key, const Transaction* tx,
+                        const std::shared_ptr<OpState>& state) {
+    uint64_t tx_time = tx->operation_start_time();
+    const EltType* current = nullptr;
+    grpc::Status result = LookupForEdit(key, tx, state, &current);
+    if (!result.ok()) {
+      return result;
+    }
+
+    std::vector<std::string> secondary_keys;
+    for (uint16_t i = 0; i < indices_.size(); i++) {
+      secondary_keys.push_back(SecondaryKey(i, *current, key));
+    }
+    result = state->slot->Remove(tx, tx_time);
+    if (result.ok()) {
+      result = main_index_.Remove(key.c_str(), tx, tx_time);
+    }
+    for (uint16_t i = 0; result.ok() && i < indices_.size(); i++) {
+      result = indices_[i]->Remove(secondary_keys[i].c_str(), tx, tx_time);
+    }
+
+    if (!result.ok()) {
+      RollbackOp(tx, state);
+      return result;
+    }
+    state->removed_slot = true;
+    return grpc::Status::OK;
+  }
+
+  grpc::Status DoMutate(const std::string& key, Mutator* mutator,
+                        const Transaction* tx,
+                        const std::shared_ptr<OpState>& state) {
+    uint64_t tx_time = tx->operation_start_time();
+    const EltType* current = nullptr;
+    grpc::Status result = LookupForEdit(key, tx, state, &current);
+    if (!result.ok()) {
+      return result;
+    }
+
+    std::vector<std::string> prior_secondary_keys;
+    for (uint16_t i = 0; i < indices_.size(); i++) {
+      prior_secondary_keys.push_back(SecondaryKey(i, *current, key));
+    }
+    EltType updated(*current);
+    result = mutator->Mutate(&updated);
+    if (!result.ok()) {
+      return result;
+    }
+    std::string updated_key =
+        main_extractor_->GetKey(updated)->compare_string();
+
+    result = state->slot->Set(updated, tx, tx_time);
+    if (result.ok() && updated_key != key) {
+      result = main_index_.Remove(key.c_str(), tx, tx_time);
+      if (result.ok()) {
+        result = main_index_.Add(updated_key.c_str(), state->slot_position,
+                                 tx, tx_time);
+      }
+      if (result.error_code() == grpc::StatusCode::ALREADY_EXISTS) {
+        std::stringstream error;
+        error << "There is already an element with the key "
+              << updated_key << ".";
+        result = grpc::Status(grpc::StatusCode::ALREADY_EXISTS, error.str());
+      }
+    }
+    for (uint16_t i = 0; result.ok() && i < indices_.size(); i++) {
+      std::string secondary_key = SecondaryKey(i, updated, updated_key);
+      if (secondary_key == prior_secondary_keys[i]) {
+        continue;
+      }
+      result = indices_[i]->Remove(prior_secondary_keys[i].c_str(), tx,
+                                   tx_time);
+      if (result.ok()) {
+        result = indices_[i]->Add(secondary_key.c_str(), state->slot_position,
+                                  tx, tx_time);
+      }
+    }
+
+    if (!result.ok()) {
+      RollbackOp(tx, state);
+    }
+    return result;
+  }
+
+  // Finds the slot for key, and the value tx should base its edit upon.
+  grpc::Status LookupForEdit(const std::string& key, const Transaction* tx,
+                             const std::shared_ptr<OpState>& state,
+                             const EltType** current) {
+    uint64_t tx_time = tx->operation_start_time();
+    grpc::Status result = main_index_.GetValuePosition(
+        key.c_str(), &(state->slot_position), tx_time);
+    if (!result.ok()) {
+      return NotFound(key);
+    }
+    state->slot = slots_.CopyObjectAt(state->slot_position);
+    bool exists = false;
+    result = state->slot->GetForEdit(tx, tx_time, current, &exists);
+    if (!result.ok()) {
+      return result;
+    }
+    if (!exists) {
+      return NotFound(key);
+    }
+    return grpc::Status::OK;
+  }
+
+  // Both CompleteOp and RollbackOp are applied to everything the
+  // transaction may have touched, and may run more than once for the same
+  // transaction (once per operation); the underlying CompleteWrite and
+  // Rollback methods ignore transactions they know nothing of.
+  void CompleteOp(const Transaction* tx,
+                  const std::shared_ptr<OpState>& state) {
+    if (state->slot.get() != nullptr) {
+      state->slot->CompleteWrite(tx);
+    }
+    main_index_.CompleteWriteOperation(tx);
+    for (uint16_t i = 0; i < indices_.size(); i++) {
+      indices_[i]->CompleteWriteOperation(tx);
+    }
+    // The repository's reference now lasts until the element is removed.
+    state->created_slot = false;
+    if (state->removed_slot) {
+      state->removed_slot = false;
+      slots_.DropReference(state->slot_position);
+    }
+  }
+
+  void RollbackOp(const Transaction* tx,
+                  const std::shared_ptr<OpState>& state) {
+    if (state->slot.get() != nullptr) {
+      state->slot->Rollback(tx);
+    }
+    main_index_.Rollback(tx);
+    for (uint16_t i = 0; i < indices_.size(); i++) {
+      indices_[i]->Rollback(tx);
+    }
+    state->removed_slot = false;
+    if (state->created_slot) {
+      state->created_slot = false;
+      slots_.DropReference(state->slot_position);
+    }
+  }
+
+  std::string SecondaryKey(uint16_t index_number, const EltType& e,
+                           const std::string& primary_key) const {
+    std::string ret_val =
+        extractors_[index_number]->GetKey(e)->compare_string();
+    ret_val.append(1, SECONDARY_KEY_SEPARATOR);
+    ret_val.append(primary_key);
+    return ret_val;
+  }
+
+  // Returns false if the element did not exist at access_time.
+  bool ElementAt(uint32_t position, uint64_t access_time,
+                 EltType* elt) const {
+    return slots_.CopyObjectAt(position)->GetCopy(access_time, elt);
+  }
+
+  static grpc::Status NotFound(const std::string& key) {
+    std::stringstream error;
+    error << "Unable to find element with key: (\"" << key << "\")";
+    return grpc::Status(grpc::StatusCode::NOT_FOUND, error.str());
+  }
+
+  std::unique_ptr<Extractor> main_extractor_;
+  std::vector<std::unique_ptr<Extractor>> extractors_;
+  // Declared before the indexes, which drop their references to slots
+  // when destroyed.
+  ObjectAllocator<SlotPointer> slots_;
+  Index main_index_;
+  std::vector<std::unique_ptr<Index>> indices_;
+  // Where CleanVersionsWithin stopped: 0 while cleaning the slots, from
+  // clean_resume_key_ on (or from the start, if empty), and then one phase
+  // per index. Cleaning is never run concurrently with itself.
+  uint32_t clean_phase_;
+  std::string clean_resume_key_;
+};
+
+} // namespace mem_repository
+} // namespace acumio
+
+#endif // AcumioServer_tx_mem_repository_h
@@ -35,17 +35,73 @@ class ContactEmailExtractor : public _UserExtractor {
   }
 };
 
+void AppendField(const char* data, size_t size, std::string* out) {
+  for (int i = 0; i < 4; i++) {
+    out->push_back(static_cast<char>((size >> (8 * i)) & 0xFF));
+  }
+  out->append(data, size);
+}
+
+// Reads a field written by AppendField from the front of [*next, end).
+bool ReadField(const char** next, const char* end, const char** data,
+               uint32_t* size) {
+  if (end - *next < 4) {
+    return false;
+  }
+  *size = 0;
+  for (int i = 0; i < 4; i++) {
+    *size |=
+        static_cast<uint32_t>(static_cast<uint8_t>((*next)[i])) << (8 * i);
+  }
+  *next += 4;
+  if (static_cast<size_t>(end - *next) < *size) {
+    return false;
+  }
+  *data = *next;
+  *next += *size;
+  return true;
+}
+
 } // anonymous namespace
 
 FullUser::~FullUser() {}
 
+void FullUser::AppendToString(std::string* out) const {
+  std::string user;
+  user_.SerializeToString(&user);
+  AppendField(user.data(), user.size(), out);
+  AppendField(password_.data(), password_.size(), out);
+  AppendField(salt_.data(), salt_.size(), out);
+}
+
+bool FullUser::ParseFromArray(const char* data, int size) {
+  const char* next = data;
+  const char* end = data + size;
+  const char* field;
+  uint32_t field_size;
+  if (!ReadField(&next, end, &field, &field_size) ||
+      !user_.ParseFromArray(field, field_size)) {
+    return false;
+  }
+  if (!ReadField(&next, end, &field, &field_size)) {
+    return false;
+  }
+  password_.assign(field, field_size);
+  if (!ReadField(&next, end, &field, &field_size)) {
+    return false;
+  }
+  salt_.assign(field, field_size);
+  return next == end;
+}
+
 UserRepository::UserRepository() : repository_(nullptr) {
   std::unique_ptr<_UserExtractor> main_extractor(new NameExtractor());
   std::unique_ptr<_UserExtractor> email_extractor(new ContactEmailExtractor());
   std::vector<std::unique_ptr<_UserExtractor>> additional_extractors;
   additional_extractors.push_back(std::move(email_extractor));
   repository_.reset(new _UserRepository(std::move(main_extractor),
-                                        &additional_extractors));
+                                        &additional_extractors,
+                                        true));
 }
 
 UserRepository::~UserRepository() {}
@@ -31,6 +31,12 @@ class FullUser {
   inline std::string* mutable_password() { return &password_; }
   inline std::string* mutable_salt() { return &salt_; }
 
+  // Serializes the user, along with its encrypted password and salt, in
+  // the manner of a protobuf message. Used for write-ahead log records.
+  void AppendToString(std::string* out) const;
+  // Reverses AppendToString. Returns false if data is not a FullUser.
+  bool ParseFromArray(const char* data, int size);
+
  private:
   model::User user_;
   std::string password_;
@@ -43,6 +49,7 @@ class UserRepository {
   typedef mem_repository::MemRepository<FullUser> _UserRepository;
   typedef _UserRepository::PrimaryIterator PrimaryIterator;
   typedef _UserRepository::SecondaryIterator SecondaryIterator;
+  typedef _UserRepository::KeyedSnapshot KeyedSnapshot;
 
   UserRepository();
   ~UserRepository();
@@ -50,34 +57,57 @@ class UserRepository {
   inline grpc::Status Add(const FullUser& user) {
     return repository_->Add(user);
   }
+  // See MemRepository::BulkLoad.
+  inline grpc::Status BulkLoad(std::vector<FullUser>* users) {
+    return repository_->BulkLoad(users);
+  }
+  // See MemRepository::Clear.
+  inline void Clear() {
+    repository_->Clear();
+  }
   inline grpc::Status Remove(const std::string& name) {
-    std::unique_ptr<Comparable> key(new StringComparable(name));
+    EncodedKey key = EncodedKey::ForString(name);
     return repository_->Remove(key);
   }
   inline grpc::Status Update(const std::string& name,
                              const FullUser& user) {
-    std::unique_ptr<Comparable> key(new StringComparable(name));
+    EncodedKey key = EncodedKey::ForString(name);
     return  repository_->Update(key, user);
   }
 
   inline grpc::Status Get(const std::string& name, FullUser* elt) {
-    std::unique_ptr<Comparable> key(new StringComparable(name));
+    EncodedKey key = EncodedKey::ForString(name);
     // TODO: Translate NOT_FOUND results to present better error message.
     return repository_->Get(key, elt);
   }
 
   inline int32_t size() const { return repository_->size(); }
 
+  // See MemRepository::GetSortedSnapshots.
+  inline void GetSortedSnapshots(std::vector<KeyedSnapshot>* snapshots) const {
+    repository_->GetSortedSnapshots(snapshots);
+  }
+
+  // See MemRepository::GetSnapshots.
+  inline void GetSnapshots(std::vector<KeyedSnapshot>* snapshots) const {
+    repository_->GetSnapshots(snapshots);
+  }
+
+  // See MemRepository::SortSnapshots.
+  inline void SortSnapshots(std::vector<KeyedSnapshot>* snapshots) const {
+    repository_->SortSnapshots(snapshots);
+  }
+
   PrimaryIterator LowerBoundByName(const std::string& name) {
-    std::unique_ptr<Comparable> key(new StringComparable(name));
+    EncodedKey key = EncodedKey::ForString(name);
     return repository_->LowerBound(key);
   }
 /*
   Re-enable this when we start want to support search more effectively.
 
   SecondaryIterator LowerBoundByEmail(const std::string& email) const {
-    std::unique_ptr<Comparable> key(new StringComparable(email));
-    return repository_->LowerBoundByIndex(string_key, 0);
+    EncodedKey key = EncodedKey::ForString(email);
+    return repository_->LowerBoundByIndex(key, 0);
   }
 */
  private:
@@ -0,0 +1,305 @@
+//============================================================================
+// Name        : write_ahead_log.cpp
+// Author      : Bill Province (bill@acumio.com)
+// Version     :
+// Copyright   : Copyright (C) 2016 Acumio
+// Description : Implementation of WriteAheadLog.
+//============================================================================
+#include "write_ahead_log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+
+#include "crc32c.h"
+
+namespace acumio {
+namespace transaction {
+
+namespace {
+// Names the format version; bump the digit if the framing ever changes.
+const char LOG_HEADER[] = "ACUMWAL1";
+const size_t LOG_HEADER_SIZE = sizeof(LOG_HEADER) - 1;
+const size_t FRAME_SIZE = 8;
+
+void AppendFixed32(uint32_t value, std::string* out) {
+  for (int i = 0; i < 4; i++) {
+    out->push_back(static_cast<char>((value >> (8 * i)) & 0xFF));
+  }
+}
+
+uint32_t ReadFixed32(const char* in) {
+  uint32_t ret_val = 0;
+  for (int i = 0; i < 4; i++) {
+    ret_val |= static_cast<uint32_t>(static_cast<uint8_t>(in[i])) << (8 * i);
+  }
+  return ret_val;
+}
+
+grpc::Status IoError(const std::string& what, const std::string& path,
+                     int error_number) {
+  std::stringstream error;
+  error << "Unable to " << what << " write-ahead log (\"" << path
+        << "\"): " << strerror(error_number);
+  return grpc::Status(grpc::StatusCode::INTERNAL, error.str());
+}
+
+// Reads the log at path, handing each intact record that ends after
+// start_position to apply. Sets *valid_end to the offset just past the last
+// intact record.
+grpc::Status ScanLog(const std::string& path, uint64_t start_position,
+                     const WriteAheadLog::RecordFunction& apply,
+                     uint64_t* valid_end, uint64_t* record_count) {
+  *valid_end = 0;
+  *record_count = 0;
+  std::ifstream in(path, std::ios::in | std::ios::binary);
+  if (!in.is_open()) {
+    return grpc::Status::OK;
+  }
+  char header[LOG_HEADER_SIZE];
+  in.read(header, LOG_HEADER_SIZE);
+  if (in.gcount() == 0) {
+    return grpc::Status::OK;
+  }
+  if (static_cast<size_t>(in.gcount()) != LOG_HEADER_SIZE ||
+      memcmp(header, LOG_HEADER, LOG_HEADER_SIZE) != 0) {
+    std::stringstream error;
+    error << "The file (\"" << path
+          << "\") is not a write-ahead log, or has an unsupported version.";
+    return grpc::Status(grpc::StatusCode::FAILED_PRECONDITION, error.str());
+  }
+  *valid_end = LOG_HEADER_SIZE;
+  in.seekg(0, std::ios::end);
+  uint64_t file_size = static_cast<uint64_t>(in.tellg());
+  in.seekg(LOG_HEADER_SIZE, std::ios::beg);
+
+  char frame[FRAME_SIZE];
+  std::string record;
+  while (true) {
+    in.read(frame, FRAME_SIZE);
+    if (static_cast<size_t>(in.gcount()) != FRAME_SIZE) {
+      break;
+    }
+    uint32_t length = ReadFixed32(frame);
+    // A torn frame may claim any length at all, so check it against what
+    // is left of the file before allocating room for it.
+    if (length > file_size - *valid_end - FRAME_SIZE) {
+      break;
+    }
+    record.resize(length);
+    in.read(&(record[0]), length);
+    if (static_cast<uint32_t>(in.gcount()) != length ||
+        Crc32c(record) != ReadFixed32(frame + 4)) {
+      // A torn write from a crash. Everything before it is intact.
+      break;
+    }
+    *valid_end += FRAME_SIZE + length;
+    if (*valid_end > start_position) {
+      grpc::Status result = apply(record);
+      if (!result.ok()) {
+        return result;
+      }
+      (*record_count)++;
+    }
+  }
+  return grpc::Status::OK;
+}
+
+grpc::Status WriteFully(int fd, const std::string& data) {
+  size_t done = 0;
+  while (done < data.size()) {
+    ssize_t result = ::write(fd, data.data() + done, data.size() - done);
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return grpc::Status(grpc::StatusCode::INTERNAL, strerror(errno));
+    }
+    done += result;
+  }
+  return grpc::Status::OK;
+}
+} // anonymous namespace
+
+WriteAheadLog::WriteAheadLog(const std::string& path, SyncPolicy policy,
+                             uint64_t group_commit_micros) :
+    path_(path), policy_(policy), group_commit_micros_(group_commit_micros),
+    fd_(-1), written_(0), synced_(0), flushing_(false),
+    failure_(grpc::Status::OK), stopping_(false) {}
+
+WriteAheadLog::~WriteAheadLog() {
+  {
+    std::lock_guard<std::mutex> lock(guard_);
+    stopping_ = true;
+  }
+  stop_requested_.notify_all();
+  if (flusher_.joinable()) {
+    flusher_.join();
+  }
+  if (fd_ >= 0) {
+    std::unique_lock<std::mutex> lock(guard_);
+    while (flushing_) {
+      flushed_.wait(lock);
+    }
+    if (written_ > synced_ && failure_.ok()) {
+      FlushLocked(&lock);
+    }
+    ::close(fd_);
+  }
+}
+
+grpc::Status WriteAheadLog::Replay(const std::string& path,
+                                   const RecordFunction& apply,
+                                   uint64_t* record_count) {
+  return Replay(path, UINT64_C(0), apply, record_count);
+}
+
+grpc::Status WriteAheadLog::Replay(const std::string& path,
+                                   uint64_t start_position,
+                                   const RecordFunction& apply,
+                                   uint64_t* record_count) {
+  uint64_t valid_end = 0;
+  uint64_t count = 0;
+  grpc::Status result = ScanLog(path, start_position, apply, &valid_end,
+                                &count);
+  if (record_count != nullptr) {
+    *record_count = count;
+  }
+  return result;
+}
+
+grpc::Status WriteAheadLog::Open() {
+  uint64_t valid_end = 0;
+  uint64_t count = 0;
+  grpc::Status scan = ScanLog(
+      path_, UINT64_MAX,
+      [](const std::string&) { return grpc::Status::OK; },
+      &valid_end, &count);
+  if (!scan.ok()) {
+    return scan;
+  }
+
+  // The log holds user records, so only the server's user may read it. A
+  // log left by an older server may have been created readable by others.
+  fd_ = ::open(path_.c_str(), O_RDWR | O_CREAT, 0600);
+  if (fd_ < 0) {
+    return IoError("open", path_, errno);
+  }
+  if (::fchmod(fd_, 0600) != 0) {
+    return IoError("restrict access to", path_, errno);
+  }
+  if (valid_end == 0) {
+    if (::ftruncate(fd_, 0) != 0 ||
+        !WriteFully(fd_, std::string(LOG_HEADER, LOG_HEADER_SIZE)).ok() ||
+        ::fsync(fd_) != 0) {
+      return IoError("initialize", path_, errno);
+    }
+    valid_end = LOG_HEADER_SIZE;
+  } else if (::ftruncate(fd_, valid_end) != 0) {
+    return IoError("truncate the torn end of", path_, errno);
+  }
+  if (::lseek(fd_, valid_end, SEEK_SET) < 0) {
+    return IoError("seek to the end of", path_, errno);
+  }
+
+  written_ = valid_end;
+  synced_ = valid_end;
+  if (policy_ != SYNC_EACH_COMMIT) {
+    flusher_ = std::thread(&WriteAheadLog::RunFlusher, this);
+  }
+  return grpc::Status::OK;
+}
+
+grpc::Status WriteAheadLog::Write(const std::vector<std::string>& records,
+                                  uint64_t* position) {
+  std::string buffer;
+  for (const std::string& record : records) {
+    AppendFixed32(record.size(), &buffer);
+    AppendFixed32(Crc32c(record), &buffer);
+    buffer.append(record);
+  }
+
+  std::lock_guard<std::mutex> lock(guard_);
+  if (!failure_.ok()) {
+    return failure_;
+  }
+  grpc::Status result = WriteFully(fd_, buffer);
+  if (!result.ok()) {
+    return FailLocked("write to");
+  }
+  written_ += buffer.size();
+  *position = written_;
+  return grpc::Status::OK;
+}
+
+grpc::Status WriteAheadLog::WaitDurable(uint64_t position) {
+  std::unique_lock<std::mutex> lock(guard_);
+  if (policy_ == SYNC_ASYNC) {
+    return failure_;
+  }
+  while (synced_ < position && failure_.ok()) {
+    if (policy_ == SYNC_EACH_COMMIT && !flushing_) {
+      FlushLocked(&lock);
+    } else {
+      flushed_.wait(lock);
+    }
+  }
+  return synced_ >= position ? grpc::Status::OK : failure_;
+}
+
+uint64_t WriteAheadLog::end_position() {
+  std::lock_guard<std::mutex> lock(guard_);
+  return written_;
+}
+
+grpc::Status WriteAheadLog::Append(const std::vector<std::string>& records) {
+  uint64_t position = 0;
+  grpc::Status result = Write(records, &position);
+  if (!result.ok()) {
+    return result;
+  }
+  return WaitDurable(position);
+}
+
+void WriteAheadLog::FlushLocked(std::unique_lock<std::mutex>* lock) {
+  flushing_ = true;
+  uint64_t target = written_;
+  lock->unlock();
+  int result = ::fdatasync(fd_);
+  int error_number = errno;
+  lock->lock();
+  flushing_ = false;
+  if (result != 0) {
+    errno = error_number;
+    FailLocked("flush");
+  } else if (target > synced_) {
+    synced_ = target;
+  }
+  flushed_.notify_all();
+}
+
+void WriteAheadLog::RunFlusher() {
+  std::unique_lock<std::mutex> lock(guard_);
+  while (!stopping_) {
+    stop_requested_.wait_for(
+        lock, std::chrono::microseconds(group_commit_micros_));
+    if (!stopping_ && written_ > synced_ && !flushing_ && failure_.ok()) {
+      FlushLocked(&lock);
+    }
+  }
+}
+
+grpc::Status WriteAheadLog::FailLocked(const std::string& what) {
+  if (failure_.ok()) {
+    failure_ = IoError(what, path_, errno);
+  }
+  return failure_;
+}
+
+} // namespace transaction
+} // namespace acumio
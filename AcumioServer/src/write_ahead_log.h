@@ -0,0 +1,138 @@
+#ifndef AcumioServer_write_ahead_log_h
+#define AcumioServer_write_ahead_log_h
+//============================================================================
+// Name        : write_ahead_log.h
+// Author      : Bill Province (bill@acumio.com)
+// Version     :
+// Copyright   : Copyright (C) 2016 Acumio
+// Description : An append-only, checksummed log of committed changes. On
+//               restart, the log is replayed to rebuild the in-memory
+//               state.
+//
+//               The file starts with a short header naming the format
+//               version, followed by records, each framed as:
+//                   4 bytes: payload length (little-endian)
+//                   4 bytes: CRC-32C of the payload (little-endian)
+//                   payload
+//               A crash can leave a partially written record at the end of
+//               the file. Replay stops at the first record that is cut off
+//               or fails its checksum, and Open truncates the file there
+//               before appending anything further.
+//
+//               Writing a record and making it durable are separate steps,
+//               so that the order of records can be fixed while holding
+//               whatever lock orders the changes they describe, without
+//               holding that lock for the duration of a disk flush. How a
+//               writer waits for durability depends on the SyncPolicy:
+//                 SYNC_EACH_COMMIT: WaitDurable returns only once the
+//                     records are flushed. A writer that finds a flush
+//                     already in progress waits for it and then, if need be,
+//                     flushes on behalf of everyone who wrote since, so
+//                     concurrent commits share flushes.
+//                 SYNC_GROUP_COMMIT: A background thread flushes every
+//                     group_commit_micros. WaitDurable returns once the
+//                     flush covering the records completes.
+//                 SYNC_ASYNC: The background thread flushes as above, but
+//                     WaitDurable does not wait for it. A crash can lose
+//                     the last group_commit_micros of acknowledged changes.
+//
+//               Once a write or flush fails, the log refuses all further
+//               records: we can no longer say which changes are durable.
+//============================================================================
+
+#include <grpc++/support/status.h>
+#include <stdint.h>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace acumio {
+namespace transaction {
+
+class WriteAheadLog {
+ public:
+  enum SyncPolicy {
+    SYNC_EACH_COMMIT,
+    SYNC_GROUP_COMMIT,
+    SYNC_ASYNC
+  };
+
+  typedef std::function<grpc::Status(const std::string& record)>
+      RecordFunction;
+
+  WriteAheadLog(const std::string& path, SyncPolicy policy,
+                uint64_t group_commit_micros);
+  // Flushes anything not yet flushed.
+  ~WriteAheadLog();
+
+  // Hands each intact record in the log at path to apply, in order,
+  // stopping early if apply fails. A missing file is treated as an empty
+  // log. If record_count is not null, it is set to the number of records
+  // applied.
+  static grpc::Status Replay(const std::string& path,
+                             const RecordFunction& apply,
+                             uint64_t* record_count);
+
+  // As above, but skipping the records that end at or before
+  // start_position, a value previously returned by end_position. Used to
+  // replay just the changes made after a checkpoint was taken.
+  static grpc::Status Replay(const std::string& path,
+                             uint64_t start_position,
+                             const RecordFunction& apply,
+                             uint64_t* record_count);
+
+  // Opens the log for appending, creating it if need be, and discarding
+  // any torn record at its end. Must be called before Write.
+  grpc::Status Open();
+
+  // Appends the records to the log, in order and contiguously, and sets
+  // *position to the end of the last of them, to be handed to
+  // WaitDurable. The records are not necessarily durable yet.
+  grpc::Status Write(const std::vector<std::string>& records,
+                     uint64_t* position);
+
+  // Waits, as the SyncPolicy dictates, for everything up to position to be
+  // flushed.
+  grpc::Status WaitDurable(uint64_t position);
+
+  // The position just past the last record written so far.
+  uint64_t end_position();
+
+  // Write followed by WaitDurable.
+  grpc::Status Append(const std::vector<std::string>& records);
+
+  inline SyncPolicy policy() const { return policy_; }
+  inline const std::string& path() const { return path_; }
+
+ private:
+  // Flushes everything written so far. The caller must hold the lock, and
+  // no other flush may be in progress; the lock is released during the
+  // flush itself.
+  void FlushLocked(std::unique_lock<std::mutex>* lock);
+  void RunFlusher();
+  grpc::Status FailLocked(const std::string& what);
+
+  std::string path_;
+  SyncPolicy policy_;
+  uint64_t group_commit_micros_;
+  int fd_;
+
+  // Guards everything below.
+  std::mutex guard_;
+  std::condition_variable flushed_;
+  std::condition_variable stop_requested_;
+  uint64_t written_;
+  uint64_t synced_;
+  bool flushing_;
+  grpc::Status failure_;
+  bool stopping_;
+  std::thread flusher_;
+};
+
+} // namespace transaction
+} // namespace acumio
+
+#endif // AcumioServer_write_ahead_log_h
@@ -0,0 +1,135 @@
+//============================================================================
+// Name        : write_coalescer.cpp
+// Author      : Bill Province (bill@acumio.com)
+// Version     :
+// Copyright   : Copyright (C) 2016 Acumio
+// Description : Implementation of WriteCoalescer.
+//============================================================================
+#include "write_coalescer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+namespace acumio {
+namespace transaction {
+
+WriteCoalescer::WriteCoalescer(TransactionManager& manager,
+                               uint64_t window_micros,
+                               uint32_t max_batch_size) :
+    manager_(manager), pending_(), gathering_(false),
+    window_micros_(window_micros),
+    max_batch_size_(std::max(UINT32_C(1), max_batch_size)), metrics_() {}
+
+WriteCoalescer::~WriteCoalescer() {}
+
+grpc::Status WriteCoalescer::Commit(const Mutation& mutation) {
+  Request request(mutation);
+  std::unique_lock<std::mutex> lock(guard_);
+  metrics_.requests++;
+  pending_.push_back(&request);
+  if (pending_.size() >= max_batch_size_) {
+    batch_full_.notify_one();
+  }
+  while (!request.done) {
+    if (request.taken || gathering_) {
+      batch_done_.wait(lock);
+    } else {
+      // Our request may not make it into this batch, if more than
+      // max_batch_size were already waiting; in that case, we lead another
+      // batch once this one has been taken, unless someone else does.
+      gathering_ = true;
+      LeadBatch(&lock);
+    }
+  }
+  bool commit_alone = request.commit_alone;
+  lock.unlock();
+  if (commit_alone) {
+    return CommitAlone(mutation);
+  }
+  return request.status;
+}
+
+void WriteCoalescer::LeadBatch(std::unique_lock<std::mutex>* lock) {
+  if (window_micros_ > 0) {
+    batch_full_.wait_for(*lock, std::chrono::microseconds(window_micros_),
+                         [this]() {
+                           return pending_.size() >= max_batch_size_;
+                         });
+  }
+  size_t batch_size = std::min(pending_.size(),
+                               static_cast<size_t>(max_batch_size_));
+  std::vector<Request*> batch(pending_.begin(),
+                              pending_.begin() + batch_size);
+  pending_.erase(pending_.begin(), pending_.begin() + batch_size);
+  for (Request* request : batch) {
+    request->taken = true;
+  }
+  // Let the next batch start gathering while this one commits.
+  gathering_ = false;
+  if (!pending_.empty()) {
+    batch_done_.notify_all();
+  }
+  lock->unlock();
+
+  grpc::Status batch_result;
+  if (batch.size() == 1) {
+    batch_result = CommitAlone(batch[0]->mutation);
+    batch[0]->status = batch_result;
+  } else {
+    WriteTransaction tx(manager_);
+    for (Request* request : batch) {
+      request->mutation(&tx);
+    }
+    batch_result = tx.Commit();
+  }
+
+  lock->lock();
+  metrics_.batches++;
+  metrics_.largest_batch = std::max(metrics_.largest_batch,
+                                    static_cast<uint64_t>(batch.size()));
+  if (batch.size() > 1) {
+    if (batch_result.ok()) {
+      metrics_.coalesced_requests += batch.size();
+    } else {
+      metrics_.fallback_batches++;
+    }
+  }
+  for (Request* request : batch) {
+    if (batch.size() > 1) {
+      // The batch was rolled back; each caller sees whether its own
+      // mutation was responsible.
+      request->commit_alone = !batch_result.ok();
+      request->status = batch_result;
+    }
+    request->done = true;
+  }
+  batch_done_.notify_all();
+}
+
+grpc::Status WriteCoalescer::CommitAlone(const Mutation& mutation) {
+  WriteTransaction tx(manager_);
+  mutation(&tx);
+  return tx.Commit();
+}
+
+void WriteCoalescer::set_window_micros(uint64_t window_micros) {
+  std::lock_guard<std::mutex> lock(guard_);
+  window_micros_ = window_micros;
+}
+
+void WriteCoalescer::set_max_batch_size(uint32_t max_batch_size) {
+  std::lock_guard<std::mutex> lock(guard_);
+  max_batch_size_ = std::max(UINT32_C(1), max_batch_size);
+  batch_full_.notify_one();
+}
+
+void WriteCoalescer::GetMetrics(Metrics* metrics) {
+  std::lock_guard<std::mutex> lock(guard_);
+  *metrics = metrics_;
+  metrics->window_micros = window_micros_;
+  metrics->max_batch_size = max_batch_size_;
+}
+
+} // namespace transaction
+} // namespace acumio
@@ -0,0 +1,124 @@
+#ifndef AcumioServer_write_coalescer_h
+#define AcumioServer_write_coalescer_h
+//============================================================================
+// Name        : write_coalescer.h
+// Author      : Bill Province (bill@acumio.com)
+// Version     :
+// Copyright   : Copyright (C) 2016 Acumio
+// Description : Commits small, independent mutations from many threads
+//               together. Each WriteTransaction takes a Transaction from the
+//               pool and goes through the full commit lifecycle, which for
+//               a stream of tiny updates (say, a crawler updating one
+//               description per call) costs far more than the updates
+//               themselves.
+//
+//               Instead of building its own WriteTransaction, a caller hands
+//               Commit a Mutation that registers its operations (and log
+//               records) with a WriteTransaction it is given. The first
+//               caller to arrive while no batch is being gathered becomes
+//               its leader: it waits up to window_micros for others to
+//               arrive (or until max_batch_size mutations are waiting),
+//               applies all of them to a single WriteTransaction, and
+//               commits it. Once the leader has taken its batch, the next
+//               caller to arrive starts gathering another, so one batch
+//               fills while the one before it commits. If a commit
+//               succeeds, every mutation in the batch succeeded. If it
+//               fails - whether because two mutations conflict, one of them
+//               is invalid, or the batch ran out of time - the batch has
+//               been rolled back, and each caller in it commits its own
+//               mutation in its own WriteTransaction instead, on its own
+//               thread, so that it gets the status its own mutation would
+//               have had. A Mutation may therefore be applied more than
+//               once, and should do nothing but register operations with
+//               the transaction it is given.
+//
+//               A window of 0 only coalesces mutations that are already
+//               waiting when a batch starts, so it adds no latency.
+//============================================================================
+
+#include <grpc++/support/status.h>
+#include <stdint.h>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+
+#include "transaction.h"
+
+namespace acumio {
+namespace transaction {
+
+class WriteCoalescer {
+ public:
+  typedef std::function<void(WriteTransaction* tx)> Mutation;
+
+  struct Metrics {
+    // Calls to Commit so far.
+    uint64_t requests;
+    // Batches committed, or attempted, as a single WriteTransaction.
+    uint64_t batches;
+    // Requests that committed as part of a batch of more than one.
+    uint64_t coalesced_requests;
+    // Batches that failed and were committed one mutation at a time.
+    uint64_t fallback_batches;
+    uint64_t largest_batch;
+    // The current tuning.
+    uint64_t window_micros;
+    uint32_t max_batch_size;
+  };
+
+  WriteCoalescer(TransactionManager& manager, uint64_t window_micros,
+                 uint32_t max_batch_size);
+  ~WriteCoalescer();
+
+  // Applies mutation to a WriteTransaction, commits it along with whichever
+  // other mutations are coalesced with it, and returns the status of the
+  // commit for this mutation.
+  grpc::Status Commit(const Mutation& mutation);
+
+  // Tuning may be changed at any time; it applies to the next batch.
+  void set_window_micros(uint64_t window_micros);
+  // A max_batch_size of 0 is treated as 1.
+  void set_max_batch_size(uint32_t max_batch_size);
+  void GetMetrics(Metrics* metrics);
+
+ private:
+  struct Request {
+    explicit Request(const Mutation& m) :
+        mutation(m), status(), taken(false), done(false),
+        commit_alone(false) {}
+    const Mutation& mutation;
+    grpc::Status status;
+    // Set once a leader has taken the request into its batch.
+    bool taken;
+    // Set once that batch has committed or failed.
+    bool done;
+    // Set if the batch failed, so that the caller must commit the mutation
+    // itself.
+    bool commit_alone;
+  };
+
+  // Gathers and commits one batch. The caller holds the lock, and the lock
+  // is released once the batch has been taken, while it commits.
+  void LeadBatch(std::unique_lock<std::mutex>* lock);
+  grpc::Status CommitAlone(const Mutation& mutation);
+
+  TransactionManager& manager_;
+
+  // Guards everything below.
+  std::mutex guard_;
+  std::condition_variable batch_full_;
+  std::condition_variable batch_done_;
+  std::deque<Request*> pending_;
+  // Whether a leader is gathering a batch. Batches that have been taken
+  // commit concurrently with this.
+  bool gathering_;
+  uint64_t window_micros_;
+  uint32_t max_batch_size_;
+  Metrics metrics_;
+};
+
+} // namespace transaction
+} // namespace acumio
+
+#endif // AcumioServer_write_coalescer_h